@@ -26,17 +26,104 @@ LOCAL_MODULE := audio.primary.$(TARGET_BOARD_PLATFORM)
 
 LOCAL_MODULE_RELATIVE_PATH := hw
 
-LOCAL_SRC_FILES := audio_hw.c
+LOCAL_SRC_FILES := \
+    audio_hw.c \
+    audio_capture.c \
+    audio_mixer.c \
+    audio_path.c \
+    audio_src.c \
+    audio_dsp.c \
+    audio_hdmi.c \
+    audio_iec61937.c \
+    audio_latency.c
 
-LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioroute
+LOCAL_ARM_NEON := true
+
+LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libexpat
 
 LOCAL_CFLAGS := -Wno-unused-parameter
 
+# the mmap stream interface of hardware/audio.h came with android 8.0
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -ge 26 && echo true),true)
+LOCAL_CFLAGS += -DFFHAL_MMAP
+endif
+
 LOCAL_C_INCLUDES += \
     external/tinyalsa/include \
-    system/media/audio_utils/include \
-    system/media/audio_effects/include \
-    system/media/audio_route/include
+    external/expat/lib \
+    system/media/audio_effects/include
 
 include $(BUILD_SHARED_LIBRARY)
 
+# the same hal on simulated cards (audio_sim.h), for boards without the codec and for measuring
+# the pipeline without hardware. audio_sim.c stands in for libtinyalsa
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio.primary.sim
+
+LOCAL_MODULE_RELATIVE_PATH := hw
+
+LOCAL_SRC_FILES := \
+    audio_hw.c \
+    audio_capture.c \
+    audio_mixer.c \
+    audio_path.c \
+    audio_src.c \
+    audio_dsp.c \
+    audio_hdmi.c \
+    audio_iec61937.c \
+    audio_latency.c \
+    audio_sim.c
+
+LOCAL_ARM_NEON := true
+
+LOCAL_SHARED_LIBRARIES := liblog libcutils libexpat
+
+LOCAL_CFLAGS := -Wno-unused-parameter
+
+# the mmap stream interface of hardware/audio.h came with android 8.0
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -ge 26 && echo true),true)
+LOCAL_CFLAGS += -DFFHAL_MMAP
+endif
+
+LOCAL_C_INCLUDES += \
+    external/tinyalsa/include \
+    external/expat/lib \
+    system/media/audio_effects/include
+
+include $(BUILD_SHARED_LIBRARY)
+
+# audio_bench.c, the hal on the simulated cards driven like audioflinger drives it, with pass or
+# fail checks of latency, blocking, xruns and cpu wakeups. runs on the build host:
+#   audio_bench [-t seconds] [-l load threads] [-j jitter us] [-c control write us] [-x max xruns] mode [case]
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_bench
+
+LOCAL_SRC_FILES := \
+    audio_bench.c \
+    audio_hw.c \
+    audio_capture.c \
+    audio_mixer.c \
+    audio_path.c \
+    audio_src.c \
+    audio_dsp.c \
+    audio_hdmi.c \
+    audio_iec61937.c \
+    audio_latency.c \
+    audio_sim.c
+
+LOCAL_CFLAGS := -Wno-unused-parameter
+LOCAL_CFLAGS += -DAUDIO_PATH_XML='"$(abspath $(LOCAL_PATH))/a64_paths.xml"' -DAUDIO_PATH_BIN='"/tmp/audio_bench_paths.bin"'
+
+LOCAL_C_INCLUDES += \
+    hardware/libhardware/include \
+    external/tinyalsa/include \
+    external/expat/lib \
+    system/media/audio_effects/include
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog libexpat
+
+LOCAL_LDLIBS := -lm -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,826 @@
+#define LOG_TAG "audio_bench"
+
+// 包含头文件
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <hardware/audio.h>
+#include "audio_dsp.h"
+#include "audio_latency.h"
+#include "audio_sim.h"
+#include "audio_src.h"
+
+/* host harness of the hal on the simulated cards (audio_sim.h). every mode drives the hal through
+ * the audio_hw_device interface as audioflinger does, prints one line per case and ends with
+ * PASS or FAIL, the exit code is the number of failed cases. the load generator and the wakeup
+ * jitter of the sim are set with -l and -j, so a case can be checked on an idle and a loaded cpu.
+ * the jitter delays the blocking pcm_read and pcm_write of the sim, the mixer and mmap writers
+ * time their own sleeps and only compete with the load threads. -c makes every mixer control write
+ * of the sim take as long as on a codec behind i2c.
+ *   audio_bench [-t seconds] [-l load threads] [-j jitter us] [-c control write us] [-x max xruns] mode [case]
+ */
+
+// 内部常量定义
+#define BENCH_TONE_HZ      1000
+#define BENCH_TONE_LEVEL   8192
+#define BENCH_CHURN_CYCLES 20
+#define BENCH_SRC_TONE_HZ  997   // not a divisor of any rate, so the tone walks over every phase
+#define BENCH_SRC_LEVEL    0.5   // -6dBFS
+#define BENCH_SRC_THDN_DB  -85.0 // 16bit quantization of input and output alone gives about -89dB at this level
+#define BENCH_VOL_ERR_DB   0.01  // control and software gain together against the stream volume
+#define BENCH_VOL_FRAMES   1024
+#define BENCH_CVT_SAMPLES  4096
+#define BENCH_CVT_ROUNDS   1000
+#define BENCH_FAST_LAT_MS  9     // a fast output through the mixer, the 2 x 192 frames of its own pcm before
+#define BENCH_LAT_TOL_MS   1.0   // the codec part against the loopback delay of the sim
+#define BENCH_LAT_SUM_MS   0.05  // the parts against the total, they are printed with two decimals
+#define BENCH_LAT_PEAK     0.8   // the marker has to stand out well above ALAT_THRESHOLD, even under load
+
+// 内部类型定义
+typedef struct {
+    const char          *name;
+    audio_output_flags_t flags;
+    audio_devices_t      devices;
+    uint32_t             rate;
+    double               max_wakeups; // mixer passes per second allowed while it plays alone, 0 for any
+} BENCH_OUTPUT;
+
+typedef struct {
+    int64_t  max_ns;     // longest single call
+    int64_t  sum_ns;
+    uint32_t calls;
+} BENCH_CALLS;
+
+typedef struct {
+    struct audio_stream_out *out;
+    uint32_t     rate;
+    volatile int run;
+    BENCH_CALLS  calls;
+} BENCH_WRITER;
+
+typedef struct {
+    struct audio_stream_in *in;
+    uint32_t     rate;
+    volatile int run;
+} BENCH_READER;
+
+typedef struct {
+    int inrate;
+    int outrate;
+} BENCH_SRC_RATES;
+
+typedef struct {
+    const char *name;
+    int       (*run)(struct audio_hw_device *dev);
+    const char *help;
+} BENCH_MODE;
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+static int      g_seconds   = 3;
+static uint32_t g_max_xruns = 0;
+static const char *g_case   = NULL; // only the case of this name, all when NULL
+
+// every output flavour the policy file opens, each one a different path through the hal
+static const BENCH_OUTPUT g_outputs[] = {
+    { "mixer", AUDIO_OUTPUT_FLAG_PRIMARY    , AUDIO_DEVICE_OUT_SPEAKER    , 48000, 0 },
+    { "fast" , AUDIO_OUTPUT_FLAG_FAST       , AUDIO_DEVICE_OUT_SPEAKER    , 48000, 0 },
+    { "deep" , AUDIO_OUTPUT_FLAG_DEEP_BUFFER, AUDIO_DEVICE_OUT_SPEAKER    , 48000, 6 },
+    { "src"  , AUDIO_OUTPUT_FLAG_PRIMARY    , AUDIO_DEVICE_OUT_SPEAKER    , 44100, 0 },
+    { "hdmi" , AUDIO_OUTPUT_FLAG_DIRECT     , AUDIO_DEVICE_OUT_AUX_DIGITAL, 48000, 0 },
+};
+
+// what the hal resamples, from the common content rates to the 48kHz mixer, to a codec stuck at
+// 44.1kHz, and back for capture
+static const BENCH_SRC_RATES g_src_rates[] = {
+    { 44100, 48000 }, { 8000, 48000 }, { 16000, 48000 }, { 96000, 48000 }, { 192000, 48000 }, { 48000, 44100 }, { 44100, 16000 },
+};
+
+// 内部函数实现
+static int64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void calls_add(BENCH_CALLS *c, int64_t ns)
+{
+    if (ns > c->max_ns) c->max_ns = ns;
+    c->sum_ns += ns;
+    c->calls++;
+}
+
+static double calls_avg_ms(const BENCH_CALLS *c)
+{
+    return c->calls ? c->sum_ns / 1e6 / c->calls : 0;
+}
+
+static void fill_tone(int16_t *buf, int frames, int channels, uint32_t rate, uint64_t *phase)
+{
+    int i, c;
+    for (i=0; i<frames; i++, (*phase)++) {
+        int16_t s = (int16_t)(BENCH_TONE_LEVEL * sin(2 * M_PI * BENCH_TONE_HZ * (double)(*phase % rate) / rate));
+        for (c=0; c<channels; c++) *buf++ = s;
+    }
+}
+
+// xruns and failed pcm calls the stream counted, out of its dump
+static void stream_counters(const struct audio_stream *stream, uint32_t *xruns, uint32_t *errors)
+{
+    char  text[4096], *p;
+    FILE *fp = tmpfile();
+    *xruns = *errors = 0;
+    if (!fp) return;
+    stream->dump(stream, fileno(fp));
+    rewind(fp);
+    text[fread(text, 1, sizeof(text) - 1, fp)] = '\0';
+    fclose(fp);
+    for (p = text; (p = strchr(p, '\n')); p++) {
+        if (sscanf(p + 1, " %u xruns, %u errors", xruns, errors) == 2) break;
+    }
+}
+
+// sum of the counters named key in the device dump, " wakeups" of the mixer, " underruns" of its tracks
+static uint32_t dump_sum(struct audio_hw_device *dev, const char *key)
+{
+    char     text[16384], *p, *q;
+    uint32_t sum = 0;
+    FILE    *fp = tmpfile();
+    if (!fp) return 0;
+    dev->dump(dev, fileno(fp));
+    rewind(fp);
+    text[fread(text, 1, sizeof(text) - 1, fp)] = '\0';
+    fclose(fp);
+    for (p = text; (p = strstr(p, key)); p++) {
+        for (q = p; q > text && q[-1] >= '0' && q[-1] <= '9'; q--);
+        if (q < p) sum += strtoul(q, NULL, 10);
+    }
+    return sum;
+}
+
+static int case_wanted(const char *name)
+{
+    return !g_case || strcmp(g_case, name) == 0;
+}
+
+static int report(const char *name, int pass, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static int report(const char *name, int pass, const char *fmt, ...)
+{
+    va_list ap;
+    printf("%-10s ", name);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(" %s\n", pass ? "PASS" : "FAIL");
+    fflush(stdout);
+    return pass ? 0 : 1;
+}
+
+static int open_output(struct audio_hw_device *dev, const BENCH_OUTPUT *o, struct audio_stream_out **out)
+{
+    struct audio_config config;
+    char   kvpairs[32];
+    int    ret;
+    memset(&config, 0, sizeof(config));
+    config.sample_rate  = o->rate;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format       = AUDIO_FORMAT_PCM_16_BIT;
+    ret = dev->open_output_stream(dev, 0, o->devices, o->flags, &config, out, NULL);
+    if (ret != 0) return ret;
+    snprintf(kvpairs, sizeof(kvpairs), "routing=%d", o->devices);
+    (*out)->common.set_parameters(&(*out)->common, kvpairs);
+    return 0;
+}
+
+/* one output flavour: open to first write returned, every write call of g_seconds of tone, the
+ * position against what was written, then write and standby cycles for the resume path. passes
+ * with no failed pcm call, at most g_max_xruns xruns, no write blocking longer than two buffers,
+ * a position that kept up with the writes within the buffer and, for a fast output, a latency
+ * within BENCH_FAST_LAT_MS
+ */
+static int bench_output(struct audio_hw_device *dev, const BENCH_OUTPUT *o)
+{
+    struct audio_stream_out *out;
+    BENCH_CALLS calls = { 0 };
+    struct timespec ts;
+    uint64_t phase = 0, written = 0, played = 0;
+    uint32_t xruns, errors, latency_ms, sim_xruns, wakeups;
+    int64_t  t0, t1, open_ns, churn_ns, limit_ns, steady_ns;
+    double   wakeups_s;
+    int16_t *buf;
+    size_t   bytes;
+    int      frames, i, pass;
+
+    t0  = bench_now();
+    if (open_output(dev, o, &out) != 0) return report(o->name, 0, "open failed");
+    bytes  = out->common.get_buffer_size(&out->common);
+    frames = bytes / 4;
+    buf    = malloc(bytes);
+    sim_xruns = asim_get_xruns();
+
+    fill_tone(buf, frames, 2, o->rate, &phase);
+    out->write(out, buf, bytes);
+    written += frames;
+    open_ns  = bench_now() - t0;
+
+    latency_ms = out->get_latency(out);
+    limit_ns   = 2 * (int64_t)latency_ms * 1000000 + 5000000;
+    wakeups    = dump_sum(dev, " wakeups");
+    steady_ns  = bench_now();
+    while (written < (uint64_t)g_seconds * o->rate) {
+        fill_tone(buf, frames, 2, o->rate, &phase);
+        t1 = bench_now();
+        out->write(out, buf, bytes);
+        calls_add(&calls, bench_now() - t1);
+        written += frames;
+    }
+    out->get_presentation_position(out, &played, &ts);
+    wakeups_s = (dump_sum(dev, " wakeups") - wakeups) * 1e9 / (bench_now() - steady_ns);
+
+    t1 = bench_now();
+    for (i=0; i<BENCH_CHURN_CYCLES; i++) {
+        fill_tone(buf, frames, 2, o->rate, &phase);
+        out->write(out, buf, bytes);
+        out->common.standby(&out->common);
+    }
+    churn_ns = bench_now() - t1;
+
+    stream_counters(&out->common, &xruns, &errors);
+    // standby cycles stop the pcm on purpose, the sim counts xruns of every pcm so only the steady part is judged
+    pass = errors == 0 && xruns <= g_max_xruns && calls.max_ns <= limit_ns
+        && played + (uint64_t)latency_ms * o->rate / 1000 + frames >= written
+        && (o->max_wakeups == 0 || wakeups_s <= o->max_wakeups)
+        && (!(o->flags & AUDIO_OUTPUT_FLAG_FAST) || latency_ms <= BENCH_FAST_LAT_MS);
+    report(o->name, pass, "open %6.2fms, write avg %6.2fms max %6.2fms (limit %lld), latency %ums, behind %lld frames, "
+        "%5.1f mixer wakeups/s, %4.0f churn/s, %u xruns (sim %u), %u errors", open_ns / 1e6, calls_avg_ms(&calls),
+        calls.max_ns / 1e6, (long long)(limit_ns / 1000000), latency_ms, (long long)(written - played), wakeups_s,
+        BENCH_CHURN_CYCLES * 1e9 / churn_ns, xruns, asim_get_xruns() - sim_xruns, errors);
+    dev->close_output_stream(dev, out);
+    free(buf);
+    return pass ? 0 : 1;
+}
+
+// capture of the codec mic, reads as audiorecord does and checks nothing got lost
+static int bench_input(struct audio_hw_device *dev, uint32_t rate, audio_channel_mask_t mask, const char *name)
+{
+    struct audio_stream_in *in;
+    struct audio_config config;
+    BENCH_CALLS calls = { 0 };
+    uint32_t xruns, errors, lost = 0;
+    uint64_t got = 0;
+    int64_t  t0, open_ns, limit_ns;
+    void    *buf;
+    size_t   bytes;
+    int      pass;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate  = rate;
+    config.channel_mask = mask;
+    config.format       = AUDIO_FORMAT_PCM_16_BIT;
+    t0 = bench_now();
+    if (dev->open_input_stream(dev, 0, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in, AUDIO_INPUT_FLAG_NONE, NULL, AUDIO_SOURCE_MIC) != 0) {
+        return report(name, 0, "open failed");
+    }
+    bytes = in->common.get_buffer_size(&in->common);
+    buf   = malloc(bytes);
+    in->read(in, buf, bytes);
+    open_ns  = bench_now() - t0;
+    limit_ns = 2 * (int64_t)bytes * 1000000000LL / audio_stream_in_frame_size(in) / rate + 5000000;
+    in->get_input_frames_lost(in);
+
+    while (got < (uint64_t)g_seconds * rate) {
+        int64_t t1 = bench_now();
+        in->read(in, buf, bytes);
+        calls_add(&calls, bench_now() - t1);
+        got  += bytes / audio_stream_in_frame_size(in);
+        lost += in->get_input_frames_lost(in);
+    }
+    stream_counters(&in->common, &xruns, &errors);
+    pass = errors == 0 && xruns <= g_max_xruns && lost == 0 && calls.max_ns <= limit_ns;
+    report(name, pass, "open %6.2fms, read avg %6.2fms max %6.2fms (limit %lld), %u frames lost, %u xruns, %u errors",
+        open_ns / 1e6, calls_avg_ms(&calls), calls.max_ns / 1e6, (long long)(limit_ns / 1000000), lost, xruns, errors);
+    dev->close_input_stream(dev, in);
+    free(buf);
+    return pass ? 0 : 1;
+}
+
+// plays tone until told to stop, timing every write
+static void* writer_proc(void *param)
+{
+    BENCH_WRITER *w     = (BENCH_WRITER*)param;
+    size_t        bytes = w->out->common.get_buffer_size(&w->out->common);
+    int16_t      *buf   = malloc(bytes);
+    uint64_t      phase = 0;
+
+    while (buf && w->run) {
+        int64_t t0;
+        fill_tone(buf, bytes / 4, 2, w->rate, &phase);
+        t0 = bench_now();
+        w->out->write(w->out, buf, bytes);
+        calls_add(&w->calls, bench_now() - t0);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void* reader_proc(void *param)
+{
+    BENCH_READER *r     = (BENCH_READER*)param;
+    size_t        bytes = r->in->common.get_buffer_size(&r->in->common);
+    int16_t      *buf   = malloc(bytes);
+    while (buf && r->run) r->in->read(r->in, buf, bytes);
+    free(buf);
+    return NULL;
+}
+
+static double param_ms(const char *str, const char *key)
+{
+    const char *p = strstr(str, key);
+    return p && p[strlen(key)] == '=' ? strtod(p + strlen(key) + 1, NULL) : -1;
+}
+
+// one latency_test=start as a client runs it, the result is what get_parameters returns
+static int bench_latency(struct audio_hw_device *dev, const char *name, int loop_ms)
+{
+    double total, hal, kernel, codec, in, peak;
+    char  *str = NULL;
+    int    i;
+
+    asim_set_loopback(loop_ms);
+    usleep(200 * 1000); // the loop is full of the new delay
+    if (dev->set_parameters(dev, "latency_test=start") != 0) return report(name, 0, "start refused");
+    for (i=0; i<(ALAT_TIMEOUT_MS + 1000) / 50; i++) {
+        usleep(50 * 1000);
+        free(str);
+        str = dev->get_parameters(dev, "latency_test");
+        if (!strstr(str, "running")) break;
+    }
+    total  = param_ms(str, "latency_total_ms");
+    hal    = param_ms(str, "latency_out_hal_ms");
+    kernel = param_ms(str, "latency_out_kernel_ms");
+    codec  = param_ms(str, "latency_codec_ms");
+    in     = param_ms(str, "latency_in_ms");
+    peak   = param_ms(str, "latency_peak");
+    i      = strstr(str, "=done") != NULL;
+    free(str);
+    if (!i) return report(name, 0, "loop %dms, no result", loop_ms);
+    // the parts are rounded to 0.01ms each
+    return report(name, fabs(codec - loop_ms) <= BENCH_LAT_TOL_MS && fabs(hal + kernel + codec + in - total) <= BENCH_LAT_SUM_MS && peak >= BENCH_LAT_PEAK,
+        "loop %2dms: total %6.2fms = out hal %5.2f + out kernel %5.2f + codec %5.2f + in %5.2f, peak %.2f",
+        loop_ms, total, hal, kernel, codec, in, peak);
+}
+
+/* round trip measurement on the loopback of the sim: a stream plays and a capture stream reads
+ * while latency_test runs, at two loop delays. the hal does not know the delay, so the codec part
+ * it reports has to come out as the loop within BENCH_LAT_TOL_MS, and the parts have to add up */
+static int mode_latency(struct audio_hw_device *dev)
+{
+    static const BENCH_OUTPUT OUTPUTS[] = {
+        { "normal", AUDIO_OUTPUT_FLAG_PRIMARY, AUDIO_DEVICE_OUT_SPEAKER, 44100, 0 },
+        { "fast"  , AUDIO_OUTPUT_FLAG_FAST   , AUDIO_DEVICE_OUT_SPEAKER, 48000, 0 },
+    };
+    static const uint32_t IN_RATES[] = { 44100, 16000 };
+    static const int      LOOPS   [] = { 20, 50 };
+    struct audio_config config;
+    BENCH_WRITER w;
+    BENCH_READER r;
+    pthread_t    wt, rt;
+    char         name[32];
+    int          failed = 0, i, j;
+
+    for (i=0; i<2; i++) {
+        if (!case_wanted(OUTPUTS[i].name)) continue;
+        memset(&w, 0, sizeof(w));
+        memset(&r, 0, sizeof(r));
+        memset(&config, 0, sizeof(config));
+        config.sample_rate  = IN_RATES[i];
+        config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+        config.format       = AUDIO_FORMAT_PCM_16_BIT;
+        if (open_output(dev, &OUTPUTS[i], &w.out) != 0) {
+            failed += report(OUTPUTS[i].name, 0, "open failed");
+            continue;
+        }
+        if (dev->open_input_stream(dev, 0, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &r.in, AUDIO_INPUT_FLAG_NONE, NULL, AUDIO_SOURCE_MIC) != 0) {
+            dev->close_output_stream(dev, w.out);
+            failed += report(OUTPUTS[i].name, 0, "open input failed");
+            continue;
+        }
+        w.rate = OUTPUTS[i].rate;
+        w.run  = r.run = 1;
+        pthread_create(&wt, NULL, writer_proc, &w);
+        pthread_create(&rt, NULL, reader_proc, &r);
+        usleep(300 * 1000);
+        for (j=0; j<(int)(sizeof(LOOPS) / sizeof(LOOPS[0])); j++) {
+            snprintf(name, sizeof(name), "%s-%d", OUTPUTS[i].name, LOOPS[j]);
+            failed += bench_latency(dev, name, LOOPS[j]);
+        }
+        w.run = r.run = 0;
+        pthread_join(wt, NULL);
+        pthread_join(rt, NULL);
+        r.in->common.standby(&r.in->common);
+        w.out->common.standby(&w.out->common);
+        dev->close_input_stream(dev, r.in);
+        dev->close_output_stream(dev, w.out);
+    }
+    asim_set_loopback(0);
+    return failed;
+}
+
+/* routing hammer: a normal and a fast stream play while the control thread switches their
+ * routing between speaker, headphone and both as the policy does, starts and stops a capture
+ * stream (which applies the mic path under the device lock), changes volume and reads positions,
+ * parameters and the dump as fast as it can. the writers own their active streams, so no control
+ * call may stall them: passes with no underrun of the mixer tracks, no xrun of any pcm and no
+ * write blocking longer than two buffers. run it with -c for the control writes to take time
+ */
+static int mode_routing(struct audio_hw_device *dev)
+{
+    static const audio_devices_t ROUTES[] = {
+        AUDIO_DEVICE_OUT_SPEAKER, AUDIO_DEVICE_OUT_WIRED_HEADPHONE,
+        AUDIO_DEVICE_OUT_SPEAKER | AUDIO_DEVICE_OUT_WIRED_HEADPHONE,
+    };
+    static const BENCH_OUTPUT OUTPUTS[] = {
+        { "normal", AUDIO_OUTPUT_FLAG_PRIMARY, AUDIO_DEVICE_OUT_SPEAKER, 44100, 0 },
+        { "fast"  , AUDIO_OUTPUT_FLAG_FAST   , AUDIO_DEVICE_OUT_SPEAKER, 44100, 0 },
+    };
+    BENCH_WRITER writers[2];
+    pthread_t    threads[2];
+    struct audio_stream_in *in;
+    struct audio_config     config;
+    int16_t      capture[441];
+    BENCH_CALLS  control = { 0 };
+    uint32_t     xruns, underruns, changes = 0;
+    int64_t      end, limit_ns[2];
+    int          failed = 0, i;
+
+    memset(writers, 0, sizeof(writers));
+    for (i=0; i<2; i++) {
+        if (open_output(dev, &OUTPUTS[i], &writers[i].out) != 0) return report("routing", 0, "open failed");
+        writers[i].rate = OUTPUTS[i].rate;
+        writers[i].run  = 1;
+        limit_ns[i]     = 2 * (int64_t)writers[i].out->get_latency(writers[i].out) * 1000000 + 5000000;
+    }
+    memset(&config, 0, sizeof(config));
+    config.sample_rate  = 44100;
+    config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    config.format       = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_input_stream(dev, 0, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in, AUDIO_INPUT_FLAG_NONE, NULL, AUDIO_SOURCE_MIC) != 0) {
+        return report("routing", 0, "open input failed");
+    }
+    for (i=0; i<2; i++) pthread_create(&threads[i], NULL, writer_proc, &writers[i]);
+    usleep(300 * 1000); // both tracks started
+    xruns     = asim_get_xruns();
+    underruns = dump_sum(dev, " underruns");
+
+    for (end = bench_now() + g_seconds * 1000000000LL; bench_now() < end; changes++) {
+        struct timespec ts;
+        uint64_t frames;
+        char     kvpairs[32], *str;
+        int64_t  t0 = bench_now();
+        FILE    *fp;
+        snprintf(kvpairs, sizeof(kvpairs), "routing=%d", ROUTES[changes % 3]);
+        for (i=0; i<2; i++) {
+            struct audio_stream_out *out = writers[i].out;
+            out->common.set_parameters(&out->common, kvpairs);
+            out->set_volume(out, (changes % 7) / 7.0f, 1.0f);
+            out->get_presentation_position(out, &frames, &ts);
+        }
+        in->read(in, capture, sizeof(capture));
+        in->common.standby(&in->common);
+        str = dev->get_parameters(dev, "screen_state");
+        free(str);
+        fp = tmpfile();
+        if (fp) {
+            dev->dump(dev, fileno(fp));
+            fclose(fp);
+        }
+        calls_add(&control, bench_now() - t0);
+    }
+    xruns     = asim_get_xruns() - xruns;
+    underruns = dump_sum(dev, " underruns") - underruns;
+
+    dev->close_input_stream(dev, in);
+    for (i=0; i<2; i++) {
+        writers[i].run = 0;
+        pthread_join(threads[i], NULL);
+        failed += report(OUTPUTS[i].name, writers[i].calls.max_ns <= limit_ns[i], "write avg %6.2fms max %6.2fms (limit %lld)",
+            calls_avg_ms(&writers[i].calls), writers[i].calls.max_ns / 1e6, (long long)(limit_ns[i] / 1000000));
+        dev->close_output_stream(dev, writers[i].out);
+    }
+    failed += report("routing", underruns == 0 && xruns <= g_max_xruns, "%u changes, control avg %6.3fms max %6.2fms, "
+        "%u track underruns, %u xruns", changes, calls_avg_ms(&control), control.max_ns / 1e6, underruns, xruns);
+    return failed;
+}
+
+// thd+n of a sine against the best fitting sine of the same frequency, the residual is every
+// harmonic, alias and noise the converter added. n is large, so the 3x3 normal equations are solved
+// by cramer's rule in double without trouble
+static double thdn_db(const int16_t *buf, int frames, int channels, double w)
+{
+    double m[3][3] = {{0}}, v[3] = {0}, x[3], det, res = 0, sig = 0;
+    int    i, j, k;
+    for (i=0; i<frames; i++) {
+        double b[3] = { sin(w * i), cos(w * i), 1 }, y = buf[i * channels];
+        for (j=0; j<3; j++) {
+            for (k=0; k<3; k++) m[j][k] += b[j] * b[k];
+            v[j] += b[j] * y;
+        }
+    }
+    #define DET3(a) ((a)[0][0] * ((a)[1][1] * (a)[2][2] - (a)[1][2] * (a)[2][1]) \
+                   - (a)[0][1] * ((a)[1][0] * (a)[2][2] - (a)[1][2] * (a)[2][0]) \
+                   + (a)[0][2] * ((a)[1][0] * (a)[2][1] - (a)[1][1] * (a)[2][0]))
+    det = DET3(m);
+    for (j=0; j<3; j++) {
+        double t[3][3];
+        memcpy(t, m, sizeof(t));
+        for (k=0; k<3; k++) t[k][j] = v[k];
+        x[j] = DET3(t) / det;
+    }
+    #undef DET3
+    for (i=0; i<frames; i++) {
+        double fit = x[0] * sin(w * i) + x[1] * cos(w * i) + x[2];
+        double r   = buf[i * channels] - fit;
+        res += r * r;
+        sig += (fit - x[2]) * (fit - x[2]);
+    }
+    return 10 * log10(res / sig);
+}
+
+// converter cost per output frame and its thd+n, stereo in and out as the hal runs it for playback
+static int bench_src(int inrate, int outrate)
+{
+    int16_t  in[ASRC_BLOCK * 2], *out, *all;
+    void    *src   = asrc_init(inrate, outrate, 2, 2);
+    int64_t  total = (int64_t)inrate * g_seconds, done = 0, outframes = 0, ns = 0, t;
+    uint64_t phase = 0;
+    int      cap, keep = outrate, skip = ASRC_BLOCK, n, i;
+    double   thdn;
+    char     name[32];
+
+    snprintf(name, sizeof(name), "%dk>%dk", inrate / 1000, outrate / 1000);
+    if (!src) return report(name, 0, "asrc_init failed");
+    cap = asrc_max_out(src, ASRC_BLOCK);
+    out = (int16_t*)malloc(cap * 2 * sizeof(int16_t));
+    all = (int16_t*)malloc((keep + cap) * 2 * sizeof(int16_t));
+    if (!out || !all) {
+        free(out); free(all); asrc_close(src);
+        return report(name, 0, "out of memory");
+    }
+    // the fit needs its second of output however short the timed run is
+    while (done < total || outframes < skip + keep) {
+        for (i=0; i<ASRC_BLOCK; i++, phase++) {
+            in[i * 2] = in[i * 2 + 1] = (int16_t)lrint(32767 * BENCH_SRC_LEVEL * sin(2 * M_PI * BENCH_SRC_TONE_HZ * (double)phase / inrate));
+        }
+        t  = bench_now();
+        n  = asrc_process(src, in, ASRC_BLOCK, out);
+        ns+= bench_now() - t;
+        // one second after the filter has settled goes into the fit
+        for (i=0; i<n; i++) {
+            int64_t k = outframes + i - skip;
+            if (k >= 0 && k < keep) memcpy(all + k * 2, out + i * 2, 2 * sizeof(int16_t));
+        }
+        outframes += n;
+        done      += ASRC_BLOCK;
+    }
+    thdn = thdn_db(all, keep, 2, 2 * M_PI * BENCH_SRC_TONE_HZ / outrate);
+    free(out);
+    free(all);
+    asrc_close(src);
+    return report(name, thdn <= BENCH_SRC_THDN_DB, "%6.1f ns/frame, %5.2f%% of a core, thd+n %6.1f dB (limit %.0f)",
+        (double)ns / outframes, (double)ns / outframes * outrate / 1e7, thdn, BENCH_SRC_THDN_DB);
+}
+
+static int mode_src(struct audio_hw_device *dev)
+{
+    char name[32];
+    int  failed = 0, i;
+    for (i=0; i<(int)(sizeof(g_src_rates) / sizeof(g_src_rates[0])); i++) {
+        snprintf(name, sizeof(name), "%dk>%dk", g_src_rates[i].inrate / 1000, g_src_rates[i].outrate / 1000);
+        if (case_wanted(name)) failed += bench_src(g_src_rates[i].inrate, g_src_rates[i].outrate);
+    }
+    return failed;
+}
+
+static double hwvol_db(const DSP_HWVOL *v, int value)
+{
+    return (v->db_min + (double)(value - v->min) * (v->db_max - v->db_min) / (v->max - v->min)) / 100;
+}
+
+// the codec volume of a stream as the writer sets it, on the "DAC Playback Volume" of the sim
+// taken as 1dB steps. every Q15 volume above the floor of the control is checked, the raw linear
+// mapping of the control range is printed next to it for comparison
+static int mode_volume(struct audio_hw_device *dev)
+{
+    DSP_HWVOL v = { 0, 63, -6300, 0 };
+    double    err = 0, rawerr = 0, want, got;
+    int       failed = 0, gain, value, residual, writes, target, hw;
+
+    for (gain=1; gain<=DSP_GAIN_UNITY; gain++) {
+        want = 20 * log10((double)gain / DSP_GAIN_UNITY);
+        if (want < v.db_min / 100.0) continue;
+        value = dsp_hwvol_value(&v, gain, &residual);
+        got   = hwvol_db(&v, value) + 20 * log10((double)residual / DSP_GAIN_UNITY);
+        if (fabs(got - want) > err) err = fabs(got - want);
+        // software may only attenuate, a control below the volume would need gain above unity
+        if (hwvol_db(&v, value) < want - 1e-9) err = 99;
+        got = hwvol_db(&v, v.min + (v.max - v.min) * gain / DSP_GAIN_UNITY);
+        if (fabs(got - want) > rawerr) rawerr = fabs(got - want);
+    }
+    if (case_wanted("map")) {
+        failed += report("map", err <= BENCH_VOL_ERR_DB, "max error %.4f dB (limit %.2f), raw linear mapping %.1f dB", err, BENCH_VOL_ERR_DB, rawerr);
+    }
+
+    // a change from unity to -20dB: the control moves one step per write while software ramps the rest
+    target = dsp_hwvol_value(&v, DSP_GAIN_UNITY / 10, &residual);
+    err    = 0;
+    for (hw=v.max, writes=0; hw != target; writes++) {
+        hw += hw < target ? 1 : -1;
+        got = hwvol_db(&v, hw) + 20 * log10((double)dsp_hwvol_residual(&v, hw, DSP_GAIN_UNITY / 10) / DSP_GAIN_UNITY);
+        if (fabs(got + 20) > err) err = fabs(got + 20);
+    }
+    if (case_wanted("step")) {
+        failed += report("step", err <= BENCH_VOL_ERR_DB, "0 to -20dB in %d writes of %.2f dB control steps, "
+            "volume off by at most %.4f dB after each", writes, hwvol_db(&v, 1) - hwvol_db(&v, 0), err);
+    }
+
+    // 7.1 on hdmi takes the stream volume in its reorder copy, a ramp from silence to -6dB has to
+    // rise on every channel and settle exactly on half of the samples
+    if (case_wanted("hdmi")) {
+        static int16_t src[BENCH_VOL_FRAMES * 8], dst[BENCH_VOL_FRAMES * 8];
+        DSP_GAIN g;
+        int      ok = 1, i, c;
+        for (i=0; i<BENCH_VOL_FRAMES * 8; i++) src[i] = 16384;
+        dsp_gain_init(&g, 0, 0);
+        dsp_gain_ramp(&g, DSP_GAIN_UNITY / 2, DSP_GAIN_UNITY / 2, BENCH_VOL_FRAMES / 2);
+        dsp_hdmi_order_gain_s16(dst, src, BENCH_VOL_FRAMES, 8, &g);
+        for (i=1; i<BENCH_VOL_FRAMES; i++) {
+            for (c=0; c<8; c++) ok &= dst[i * 8 + c] >= dst[(i - 1) * 8 + c] && dst[i * 8 + c] <= 8192;
+        }
+        for (c=0; c<8; c++) ok &= dst[c] < 64 && dst[(BENCH_VOL_FRAMES - 1) * 8 + c] == 8192;
+        failed += report("hdmi", ok, "7.1 reorder ramps from %d to %d on every channel", dst[0], dst[(BENCH_VOL_FRAMES - 1) * 8]);
+    }
+    return failed;
+}
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed;
+}
+
+// both directions of one hal boundary format through the Q31 intermediate, timed per sample.
+// a round trip has to give back the client samples, float within the one lsb of Q31 its
+// truncation may lose
+static int bench_convert(int fmt, const char *name)
+{
+    static const int32_t FULL[] = { 0x7fffffff, (int32_t)0x80000000, 0, 1, -1, 0x12345678, -0x12345678 };
+    uint8_t  src[BENCH_CVT_SAMPLES * 4], back[BENCH_CVT_SAMPLES * 4];
+    int32_t  q31[BENCH_CVT_SAMPLES];
+    uint32_t seed = 1;
+    int64_t  to_ns = 0, from_ns = 0, t;
+    int      bytes = dsp_fmt_bytes(fmt), exact = 1, i;
+
+    for (i=0; i<BENCH_CVT_SAMPLES; i++) {
+        int32_t v = i < (int)(sizeof(FULL) / sizeof(FULL[0])) ? FULL[i] : (int32_t)bench_rand(&seed);
+        switch (fmt) {
+        case DSP_FMT_S16  : ((int16_t*)src)[i] = v >> 16; break;
+        case DSP_FMT_S24P : src[i * 3] = v >> 8; src[i * 3 + 1] = v >> 16; src[i * 3 + 2] = v >> 24; break;
+        case DSP_FMT_S824 : ((int32_t*)src)[i] = v >> 8; break;
+        case DSP_FMT_S32  : ((int32_t*)src)[i] = v; break;
+        case DSP_FMT_FLOAT: ((float  *)src)[i] = v / 2147483648.0f; break;
+        }
+    }
+    for (i=0; i<BENCH_CVT_ROUNDS; i++) {
+        t        = bench_now();
+        dsp_to_q31(q31, src, fmt, BENCH_CVT_SAMPLES);
+        to_ns   += bench_now() - t;
+        t        = bench_now();
+        dsp_from_q31(back, fmt, q31, BENCH_CVT_SAMPLES, NULL);
+        from_ns += bench_now() - t;
+    }
+    if (fmt == DSP_FMT_FLOAT) {
+        for (i=0; i<BENCH_CVT_SAMPLES; i++) exact &= fabs((double)((float*)back)[i] - ((float*)src)[i]) <= 1.0 / 2147483648.0;
+    } else {
+        exact = memcmp(src, back, BENCH_CVT_SAMPLES * bytes) == 0;
+    }
+    return report(name, exact, "to q31 %5.2f ns/sample, from q31 %5.2f ns/sample, round trip %s", (double)to_ns / BENCH_CVT_ROUNDS / BENCH_CVT_SAMPLES,
+        (double)from_ns / BENCH_CVT_ROUNDS / BENCH_CVT_SAMPLES, exact ? "exact" : "broken");
+}
+
+// Q31 down to 16bit with tpdf dither: the error has to be the +-1 lsb triangle plus rounding,
+// 0.5 lsb rms without bias, and must not follow the signal, a -80dBFS sine is only a few lsb
+static int bench_dither(void)
+{
+    static int32_t q31[BENCH_CVT_SAMPLES];
+    int16_t    out[BENCH_CVT_SAMPLES];
+    DSP_DITHER d;
+    double     sum = 0, sq = 0, max = 0, es = 0, ss = 0, e, s;
+    int64_t    ns = 0, t;
+    int        n = 0, r, i;
+
+    dsp_dither_init(&d, 1);
+    for (r=0; r<BENCH_CVT_ROUNDS; r++) {
+        for (i=0; i<BENCH_CVT_SAMPLES; i++) {
+            q31[i] = (int32_t)lrint(2147483647.0 * pow(10, -80 / 20.0) * sin(2 * M_PI * 997 * (double)(r * BENCH_CVT_SAMPLES + i) / 48000));
+        }
+        t   = bench_now();
+        dsp_from_q31(out, DSP_FMT_S16, q31, BENCH_CVT_SAMPLES, &d);
+        ns += bench_now() - t;
+        for (i=0; i<BENCH_CVT_SAMPLES; i++, n++) {
+            s    = q31[i] / 65536.0;
+            e    = out[i] - s;
+            sum += e;
+            sq  += e * e;
+            es  += e * s;
+            ss  += s * s;
+            if (fabs(e) > max) max = fabs(e);
+        }
+    }
+    sq = sqrt(sq / n);
+    // regression of the error on the signal, 0 when the dither fully decorrelates them
+    es = es / ss;
+    return report("dither", fabs(sum / n) < 0.01 && sq > 0.45 && sq < 0.55 && max <= 1.5 && fabs(es) < 0.01,
+        "%5.2f ns/sample, error mean %+.4f rms %.3f max %.3f lsb, %+.4f of the signal", (double)ns / n, sum / n, sq, max, es);
+}
+
+static int mode_convert(struct audio_hw_device *dev)
+{
+    int failed = 0;
+    if (case_wanted("s16"  )) failed += bench_convert(DSP_FMT_S16  , "s16"  );
+    if (case_wanted("s24p" )) failed += bench_convert(DSP_FMT_S24P , "s24p" );
+    if (case_wanted("s824" )) failed += bench_convert(DSP_FMT_S824 , "s824" );
+    if (case_wanted("s32"  )) failed += bench_convert(DSP_FMT_S32  , "s32"  );
+    if (case_wanted("float")) failed += bench_convert(DSP_FMT_FLOAT, "float");
+    if (case_wanted("dither")) failed += bench_dither();
+    return failed;
+}
+
+static int mode_pipeline(struct audio_hw_device *dev)
+{
+    int failed = 0, i;
+    for (i=0; i<(int)(sizeof(g_outputs) / sizeof(g_outputs[0])); i++) {
+        if (case_wanted(g_outputs[i].name)) failed += bench_output(dev, &g_outputs[i]);
+    }
+    if (case_wanted("in-44k")) failed += bench_input(dev, 44100, AUDIO_CHANNEL_IN_MONO  , "in-44k");
+    if (case_wanted("in-16k")) failed += bench_input(dev, 16000, AUDIO_CHANNEL_IN_STEREO, "in-16k");
+    return failed;
+}
+
+static const BENCH_MODE g_modes[] = {
+    { "pipeline", mode_pipeline, "every output flavour and the capture path, latency, blocking, xruns and resume cost" },
+    { "routing" , mode_routing , "routing, volume, position and dump calls hammered while a normal and a fast stream play" },
+    { "volume"  , mode_volume  , "stream volume on a codec control in dB steps with the software residual, its step ramp and the hdmi reorder gain" },
+    { "convert" , mode_convert , "hal boundary format conversions through Q31, cost per sample, round trips and 16bit dither" },
+    { "latency" , mode_latency , "latency_test round trip on the loopback of the sim, normal and fast output at two loop delays" },
+    { "src"     , mode_src     , "resampler cost per output frame and thd+n of a -6dBFS tone, for each rate pair the hal converts" },
+};
+
+static void usage(void)
+{
+    int i;
+    printf("audio_bench [-t seconds] [-l load threads] [-j jitter us] [-c control write us] [-x max xruns] mode [case]\n");
+    for (i=0; i<(int)(sizeof(g_modes) / sizeof(g_modes[0])); i++) printf("  %-10s %s\n", g_modes[i].name, g_modes[i].help);
+}
+
+// 函数实现
+int main(int argc, char *argv[])
+{
+    struct audio_hw_device *dev;
+    const BENCH_MODE       *mode = NULL;
+    int opt, failed, i;
+
+    while ((opt = getopt(argc, argv, "t:l:j:c:x:h")) != -1) {
+        switch (opt) {
+        case 't': g_seconds   = atoi(optarg); break;
+        case 'l': asim_set_load(atoi(optarg)); break;
+        case 'j': asim_set_jitter(atoi(optarg)); break;
+        case 'c': asim_set_ctl_delay(atoi(optarg)); break;
+        case 'x': g_max_xruns = atoi(optarg); break;
+        default : usage(); return 255;
+        }
+    }
+    for (i=0; optind < argc && i<(int)(sizeof(g_modes) / sizeof(g_modes[0])); i++) {
+        if (strcmp(argv[optind], g_modes[i].name) == 0) mode = &g_modes[i];
+    }
+    if (!mode) {
+        usage();
+        return 255;
+    }
+    if (optind + 1 < argc) g_case = argv[optind + 1];
+
+    if (HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common, AUDIO_HARDWARE_INTERFACE, (struct hw_device_t**)&dev) != 0) {
+        printf("hal open failed\n");
+        return 255;
+    }
+    failed = mode->run(dev);
+    dev->common.close(&dev->common);
+    printf("%s: %s\n", mode->name, failed ? "FAIL" : "PASS");
+    return failed;
+}
@@ -0,0 +1,218 @@
+#define LOG_TAG "audio_capture"
+
+// 包含头文件
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/log.h>
+#include "audio_ring.h"
+#include "audio_stats.h"
+#include "audio_capture.h"
+
+// 内部常量定义
+#define ACAP_RT_PRIORITY   2
+#define ACAP_READ_TIMEOUT  500 // ms
+
+// 内部类型定义
+typedef struct {
+    struct pcm_config  config;
+    struct pcm        *pcm;
+    unsigned int       buffer_frames;
+    AUDIO_RING         ring;
+
+    pthread_mutex_t    lock;  // only used by reader to wait for data
+    pthread_cond_t     cond;
+    pthread_t          thread;
+    int                exit;
+
+    uint32_t           lost;        // frames lost since last acap_frames_lost
+    AUDIO_STATS        stats;       // pcm overruns and kernel buffer fill
+    uint32_t           overflows;   // ring full, reader too slow
+    uint32_t           fill_max;    // highest ring fill level seen, frames
+    uint64_t           captured;    // frames moved into ring
+    uint64_t           pos;         // captured plus frames waiting in kernel at pos_ts, under lock
+    struct timespec    pos_ts;      // CLOCK_MONOTONIC
+} ACAP;
+
+// 内部函数实现
+static void* acap_thread_proc(void *param)
+{
+    ACAP        *cap    = (ACAP*)param;
+    unsigned int period = cap->config.period_size;
+    int          avail;
+    unsigned int pending;
+    struct timespec ts;
+
+    pcm_start(cap->pcm);
+    while (!cap->exit) {
+        avail = pcm_mmap_avail(cap->pcm);
+        if (avail < 0 || (unsigned int)avail > cap->buffer_frames) {
+            // overrun, everything beyond a full buffer was overwritten by hardware
+            uint32_t lost = avail > 0 ? avail - cap->buffer_frames : period;
+            __atomic_add_fetch(&cap->lost, lost, __ATOMIC_RELAXED);
+            astats_xrun(&cap->stats, astats_now());
+            pcm_stop (cap->pcm); // tinyalsa skips prepare unless the pcm was stopped first
+            pcm_start(cap->pcm);
+            continue;
+        }
+        astats_fill(&cap->stats, avail);
+        if ((unsigned int)avail < period) {
+            usleep((uint64_t)(period - avail) * 1000000 / cap->config.rate);
+            continue;
+        }
+
+        while (avail > 0) {
+            void        *area   = NULL;
+            unsigned int offset = 0;
+            unsigned int frames = avail;
+            uint32_t     n, fill;
+            if (pcm_mmap_begin(cap->pcm, &area, &offset, &frames) < 0 || frames == 0) break;
+
+            n = ring_write(&cap->ring, (uint8_t*)area + offset * cap->ring.fsize, frames);
+            if (n < frames) {
+                // drop what does not fit instead of stalling the pcm
+                __atomic_add_fetch(&cap->lost, frames - n, __ATOMIC_RELAXED);
+                cap->overflows++;
+            }
+            pcm_mmap_commit(cap->pcm, offset, frames);
+            cap->captured += n;
+            avail         -= frames;
+
+            fill = ring_avail(&cap->ring);
+            if (fill > cap->fill_max) cap->fill_max = fill;
+        }
+
+        avail = pcm_get_htimestamp(cap->pcm, &pending, &ts);
+        pthread_mutex_lock(&cap->lock);
+        if (avail == 0) {
+            cap->pos    = cap->captured + pending;
+            cap->pos_ts = ts;
+        }
+        pthread_cond_signal(&cap->cond);
+        pthread_mutex_unlock(&cap->lock);
+    }
+    pcm_stop(cap->pcm);
+    return NULL;
+}
+
+// 函数实现
+void* acap_init(int card, int port, struct pcm_config *config, int ring_frames)
+{
+    struct sched_param param;
+    ACAP *cap = (ACAP*)calloc(1, sizeof(ACAP));
+    if (!cap) return NULL;
+
+    cap->config = *config;
+    cap->pcm    = pcm_open(card, port, PCM_IN | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC, &cap->config);
+    if (!pcm_is_ready(cap->pcm)) {
+        ALOGE("cannot open pcm_in driver: %s", pcm_get_error(cap->pcm));
+        pcm_close(cap->pcm);
+        free(cap);
+        return NULL;
+    }
+    cap->buffer_frames = pcm_get_buffer_size(cap->pcm);
+    if (ring_init(&cap->ring, ring_frames, config->channels * sizeof(int16_t)) != 0) {
+        pcm_close(cap->pcm);
+        free(cap);
+        return NULL;
+    }
+
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init (&cap->cond, NULL);
+    if (pthread_create(&cap->thread, NULL, acap_thread_proc, cap) != 0) {
+        pthread_cond_destroy (&cap->cond);
+        pthread_mutex_destroy(&cap->lock);
+        ring_free(&cap->ring);
+        pcm_close(cap->pcm);
+        free(cap);
+        return NULL;
+    }
+
+    param.sched_priority = ACAP_RT_PRIORITY;
+    if (pthread_setschedparam(cap->thread, SCHED_FIFO, &param) != 0) {
+        ALOGW("failed to set capture thread to SCHED_FIFO !\n");
+    }
+    return cap;
+}
+
+void acap_close(void *ctxt)
+{
+    ACAP *cap = (ACAP*)ctxt;
+    if (!cap) return;
+
+    cap->exit = 1;
+    pthread_join(cap->thread, NULL);
+    pthread_cond_destroy (&cap->cond);
+    pthread_mutex_destroy(&cap->lock);
+    ring_free(&cap->ring);
+    pcm_close(cap->pcm);
+    free(cap);
+}
+
+int acap_read(void *ctxt, void *buf, int frames)
+{
+    ACAP    *cap  = (ACAP*)ctxt;
+    uint8_t *dst  = (uint8_t*)buf;
+    int      done = 0;
+
+    while (done < frames) {
+        uint32_t n = ring_read(&cap->ring, dst + done * cap->ring.fsize, frames - done);
+        if (n == 0) {
+            struct timespec ts;
+            int             ret = 0;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += ACAP_READ_TIMEOUT * 1000000L;
+            ts.tv_sec  += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_mutex_lock(&cap->lock);
+            while (ring_avail(&cap->ring) == 0 && ret == 0) {
+                ret = pthread_cond_timedwait(&cap->cond, &cap->lock, &ts);
+            }
+            pthread_mutex_unlock(&cap->lock);
+            if (ret != 0 && ring_avail(&cap->ring) == 0) return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+uint32_t acap_frames_lost(void *ctxt)
+{
+    ACAP *cap = (ACAP*)ctxt;
+    return cap ? __atomic_exchange_n(&cap->lost, 0, __ATOMIC_RELAXED) : 0;
+}
+
+int acap_get_position(void *ctxt, uint64_t *frames, struct timespec *ts)
+{
+    ACAP *cap = (ACAP*)ctxt;
+    int   ret = -1;
+    if (!cap) return -1;
+
+    pthread_mutex_lock(&cap->lock);
+    if (cap->pos_ts.tv_sec || cap->pos_ts.tv_nsec) {
+        *frames = cap->pos;
+        *ts     = cap->pos_ts;
+        ret     = 0;
+    }
+    pthread_mutex_unlock(&cap->lock);
+    return ret;
+}
+
+uint32_t acap_xruns(void *ctxt)
+{
+    ACAP *cap = (ACAP*)ctxt;
+    return cap ? __atomic_load_n(&cap->stats.xruns, __ATOMIC_ACQUIRE) : 0;
+}
+
+void acap_dump(void *ctxt, int fd)
+{
+    ACAP *cap = (ACAP*)ctxt;
+    if (!cap) return;
+    dprintf(fd, "  capture thread: %u/%u frames buffered (max %u), %llu captured, %u ring overflows\n",
+        ring_avail(&cap->ring), cap->ring.size, cap->fill_max, (unsigned long long)cap->captured, cap->overflows);
+    astats_dump(&cap->stats, fd, "    ");
+}
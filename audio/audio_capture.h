@@ -0,0 +1,18 @@
+#ifndef __AUDIO_CAPTURE_H__
+#define __AUDIO_CAPTURE_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <tinyalsa/asoundlib.h>
+
+// 函数声明
+// real-time thread draining a capture pcm into a lock-free ring, so the reader never blocks on the pcm
+void*    acap_init (int card, int port, struct pcm_config *config, int ring_frames);
+void     acap_close(void *ctxt);
+int      acap_read (void *ctxt, void *buf, int frames); // wait until frames are available, return -1 on timeout
+uint32_t acap_frames_lost(void *ctxt);                  // lost since last call, pcm overruns plus ring overflows
+uint32_t acap_xruns(void *ctxt);                        // pcm overruns since init
+int      acap_get_position(void *ctxt, uint64_t *frames, struct timespec *ts); // frames captured by hardware since init at ts, CLOCK_MONOTONIC
+void     acap_dump (void *ctxt, int fd);
+
+#endif
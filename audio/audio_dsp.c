@@ -0,0 +1,465 @@
+#define LOG_TAG "audio_dsp"
+
+// 包含头文件
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DSP_NEON  1
+#endif
+#include "audio_dsp.h"
+
+// 内部常量定义
+#define DITHER_MUL  1664525u    // numerical recipes lcg
+#define DITHER_ADD  1013904223u
+
+// 内部函数实现
+static inline int16_t sat16(int32_t v)
+{
+    return v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+}
+
+// apply gain g to stereo src, either accumulate into acc or store into dst
+static inline void gain_const(int32_t *acc, int16_t *dst, const int16_t *src, int frames, int gainl, int gainr)
+{
+    int unity = gainl >= DSP_GAIN_UNITY && gainr >= DSP_GAIN_UNITY;
+    int n     = frames * 2, i = 0;
+    if (gainl >= DSP_GAIN_UNITY) gainl = DSP_GAIN_UNITY - 1;
+    if (gainr >= DSP_GAIN_UNITY) gainr = DSP_GAIN_UNITY - 1;
+
+    if (unity && dst) {
+        memcpy(dst, src, n * sizeof(int16_t));
+        return;
+    }
+#ifdef DSP_NEON
+    int16_t   gtab[8] = { (int16_t)gainl, (int16_t)gainr, (int16_t)gainl, (int16_t)gainr,
+                          (int16_t)gainl, (int16_t)gainr, (int16_t)gainl, (int16_t)gainr };
+    int16x8_t gain    = vld1q_s16(gtab);
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t s = vld1q_s16(src + i);
+        if (!unity) s = vqrdmulhq_s16(s, gain);
+        if (dst) {
+            vst1q_s16(dst + i, s);
+        } else {
+            vst1q_s32(acc + i + 0, vaddw_s16(vld1q_s32(acc + i + 0), vget_low_s16 (s)));
+            vst1q_s32(acc + i + 4, vaddw_s16(vld1q_s32(acc + i + 4), vget_high_s16(s)));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        int v = unity ? src[i] : (src[i] * ((i & 1) ? gainr : gainl) + 0x4000) >> 15;
+        if (dst) dst[i] = v;
+        else     acc[i] += v;
+    }
+}
+
+static inline void ramp_advance(DSP_GAIN *g, int32_t curl, int32_t curr, int frames)
+{
+    g->left -= frames;
+    if (g->left == 0) {
+        g->cur[0] = g->target[0] << 8;
+        g->cur[1] = g->target[1] << 8;
+    } else {
+        g->cur[0] = curl;
+        g->cur[1] = curr;
+    }
+}
+
+// per frame linear ramp, g->left must cover frames
+static inline void gain_ramp(int32_t *acc, int16_t *dst, const int16_t *src, int frames, DSP_GAIN *g)
+{
+    int32_t curl = g->cur[0], curr = g->cur[1];
+    int     i = 0;
+
+#ifdef DSP_NEON
+    static const int32_t idx[4] = { 0, 1, 2, 3 };
+    int32x4_t vidx  = vld1q_s32(idx);
+    int32x4_t stepl = vmulq_n_s32(vidx, g->step[0]);
+    int32x4_t stepr = vmulq_n_s32(vidx, g->step[1]);
+    for (; i + 4 <= frames; i += 4) {
+        int16x4_t   gl = vqshrn_n_s32(vaddq_s32(vdupq_n_s32(curl), stepl), 8);
+        int16x4_t   gr = vqshrn_n_s32(vaddq_s32(vdupq_n_s32(curr), stepr), 8);
+        int16x4x2_t z  = vzip_s16(gl, gr);
+        int16x8_t   s  = vqrdmulhq_s16(vld1q_s16(src + i * 2), vcombine_s16(z.val[0], z.val[1]));
+        if (dst) {
+            vst1q_s16(dst + i * 2, s);
+        } else {
+            vst1q_s32(acc + i * 2 + 0, vaddw_s16(vld1q_s32(acc + i * 2 + 0), vget_low_s16 (s)));
+            vst1q_s32(acc + i * 2 + 4, vaddw_s16(vld1q_s32(acc + i * 2 + 4), vget_high_s16(s)));
+        }
+        curl += g->step[0] * 4;
+        curr += g->step[1] * 4;
+    }
+#endif
+    for (; i < frames; i++) {
+        int gl = curl >> 8, gr = curr >> 8, l, r;
+        if (gl >= DSP_GAIN_UNITY) gl = DSP_GAIN_UNITY - 1;
+        if (gr >= DSP_GAIN_UNITY) gr = DSP_GAIN_UNITY - 1;
+        l = (src[i * 2 + 0] * gl + 0x4000) >> 15;
+        r = (src[i * 2 + 1] * gr + 0x4000) >> 15;
+        if (dst) {
+            dst[i * 2 + 0] = l;
+            dst[i * 2 + 1] = r;
+        } else {
+            acc[i * 2 + 0] += l;
+            acc[i * 2 + 1] += r;
+        }
+        curl += g->step[0];
+        curr += g->step[1];
+    }
+
+    ramp_advance(g, curl, curr, frames);
+}
+
+static void gain_apply(int32_t *acc, int16_t *dst, const int16_t *src, int frames, DSP_GAIN *g)
+{
+    if (g->left > 0) {
+        int n = frames < g->left ? frames : g->left;
+        gain_ramp(acc, dst, src, n, g);
+        if (acc) acc += n * 2;
+        if (dst) dst += n * 2;
+        src    += n * 2;
+        frames -= n;
+    }
+    if (frames > 0) gain_const(acc, dst, src, frames, g->target[0], g->target[1]);
+}
+
+static inline uint32_t lcg_next(uint32_t *state)
+{
+    *state = *state * DITHER_MUL + DITHER_ADD;
+    return *state;
+}
+
+static inline int clamp_gain(int gain)
+{
+    return gain < 0 ? 0 : gain > DSP_GAIN_UNITY ? DSP_GAIN_UNITY : gain;
+}
+
+// 函数实现
+void dsp_gain_init(DSP_GAIN *g, int gainl, int gainr)
+{
+    g->target[0] = clamp_gain(gainl);
+    g->target[1] = clamp_gain(gainr);
+    g->cur   [0] = g->target[0] << 8;
+    g->cur   [1] = g->target[1] << 8;
+    g->step  [0] = g->step[1] = 0;
+    g->left      = 0;
+}
+
+void dsp_gain_ramp(DSP_GAIN *g, int gainl, int gainr, int frames)
+{
+    g->target[0] = clamp_gain(gainl);
+    g->target[1] = clamp_gain(gainr);
+    if (frames <= 0 || (g->cur[0] == g->target[0] << 8 && g->cur[1] == g->target[1] << 8)) {
+        dsp_gain_init(g, g->target[0], g->target[1]);
+        return;
+    }
+    // ramp starts from wherever the previous one has got to, so retargeting never jumps
+    g->step[0] = ((g->target[0] << 8) - g->cur[0]) / frames;
+    g->step[1] = ((g->target[1] << 8) - g->cur[1]) / frames;
+    g->left    = frames;
+}
+
+void dsp_mix_s16(int32_t *acc, const int16_t *src, int frames, DSP_GAIN *g)
+{
+    gain_apply(acc, NULL, src, frames, g);
+}
+
+void dsp_gain_s16(int16_t *dst, const int16_t *src, int frames, DSP_GAIN *g)
+{
+    gain_apply(NULL, dst, src, frames, g);
+}
+
+void dsp_gain_q31(int32_t *buf, int frames, DSP_GAIN *g)
+{
+    int i = 0, n = frames * 2, gainl, gainr;
+
+    if (g->left > 0) {
+        int32_t curl = g->cur[0], curr = g->cur[1];
+        int     m    = frames < g->left ? frames : g->left;
+        for (; i < m; i++) {
+            buf[i * 2 + 0] = (int32_t)(((int64_t)buf[i * 2 + 0] * (curl >> 8) + 0x4000) >> 15);
+            buf[i * 2 + 1] = (int32_t)(((int64_t)buf[i * 2 + 1] * (curr >> 8) + 0x4000) >> 15);
+            curl += g->step[0];
+            curr += g->step[1];
+        }
+        ramp_advance(g, curl, curr, m);
+        i *= 2;
+    }
+    if (dsp_gain_is_unity(g)) return;
+
+    gainl = g->target[0];
+    gainr = g->target[1];
+#ifdef DSP_NEON
+    int32_t   ql      = gainl >= DSP_GAIN_UNITY ? 0x7fffffff : gainl << 16;
+    int32_t   qr      = gainr >= DSP_GAIN_UNITY ? 0x7fffffff : gainr << 16;
+    int32_t   gtab[4] = { ql, qr, ql, qr };
+    int32x4_t gain    = vld1q_s32(gtab);
+    for (; i + 4 <= n; i += 4) vst1q_s32(buf + i, vqrdmulhq_s32(vld1q_s32(buf + i), gain));
+#endif
+    for (; i < n; i++) buf[i] = (int32_t)(((int64_t)buf[i] * ((i & 1) ? gainr : gainl) + 0x4000) >> 15);
+}
+
+int dsp_hwvol_residual(const DSP_HWVOL *v, int value, int gain)
+{
+    double db;
+    if (v->max <= v->min) return clamp_gain(gain);
+    // in double, a Q15 gain of the lowest steps is too coarse to divide by
+    db = v->db_min + (double)(value - v->min) * (v->db_max - v->db_min) / (v->max - v->min);
+    return clamp_gain((int)lrint(clamp_gain(gain) / pow(10.0, db / 2000)));
+}
+
+int dsp_hwvol_value(const DSP_HWVOL *v, int gain, int *residual)
+{
+    int value;
+    gain = clamp_gain(gain);
+    if (gain == 0 || v->max <= v->min) {
+        *residual = gain;
+        return gain == 0 ? v->min : v->max;
+    }
+    // round up, the control never attenuates more than asked and software takes the rest
+    value = v->min + (int)ceil((2000 * log10((double)gain / DSP_GAIN_UNITY) - v->db_min) * (v->max - v->min) / (v->db_max - v->db_min) - 1e-6);
+    value = value < v->min ? v->min : value > v->max ? v->max : value;
+    *residual = dsp_hwvol_residual(v, value, gain);
+    return value;
+}
+
+void dsp_dither_init(DSP_DITHER *d, uint32_t seed)
+{
+    int i;
+    for (i=0; i<4; i++) d->state[i] = seed + i * 0x9e3779b9u;
+}
+
+int dsp_fmt_bytes(int fmt)
+{
+    switch (fmt) {
+    case DSP_FMT_S16 : return 2;
+    case DSP_FMT_S24P: return 3;
+    default:           return 4;
+    }
+}
+
+void dsp_to_q31(int32_t *dst, const void *src, int fmt, int samples)
+{
+    int i = 0;
+    switch (fmt) {
+    case DSP_FMT_S16: {
+        const int16_t *s = (const int16_t*)src;
+#ifdef DSP_NEON
+        for (; i + 8 <= samples; i += 8) {
+            int16x8_t v = vld1q_s16(s + i);
+            vst1q_s32(dst + i + 0, vshll_n_s16(vget_low_s16 (v), 16));
+            vst1q_s32(dst + i + 4, vshll_n_s16(vget_high_s16(v), 16));
+        }
+#endif
+        for (; i < samples; i++) dst[i] = s[i] * 65536;
+        } break;
+    case DSP_FMT_S24P: {
+        const uint8_t *s = (const uint8_t*)src;
+#ifdef DSP_NEON
+        // deinterleave the bytes, then store (b0 << 8) and (b2 << 8 | b1) as the low and high halves
+        for (; i + 16 <= samples; i += 16) {
+            uint8x16x3_t b = vld3q_u8(s + i * 3);
+            uint16x8x2_t l, h;
+            l.val[0] = vshll_n_u8(vget_low_u8 (b.val[0]), 8);
+            l.val[1] = vorrq_u16 (vshll_n_u8(vget_low_u8 (b.val[2]), 8), vmovl_u8(vget_low_u8 (b.val[1])));
+            h.val[0] = vshll_n_u8(vget_high_u8(b.val[0]), 8);
+            h.val[1] = vorrq_u16 (vshll_n_u8(vget_high_u8(b.val[2]), 8), vmovl_u8(vget_high_u8(b.val[1])));
+            vst2q_u16((uint16_t*)(dst + i + 0), l);
+            vst2q_u16((uint16_t*)(dst + i + 8), h);
+        }
+#endif
+        for (; i < samples; i++) {
+            dst[i] = (int32_t)((uint32_t)s[i * 3 + 0] << 8 | (uint32_t)s[i * 3 + 1] << 16 | (uint32_t)s[i * 3 + 2] << 24);
+        }
+        } break;
+    case DSP_FMT_S824: {
+        const int32_t *s = (const int32_t*)src;
+#ifdef DSP_NEON
+        for (; i + 4 <= samples; i += 4) vst1q_s32(dst + i, vqshlq_n_s32(vld1q_s32(s + i), 8));
+#endif
+        for (; i < samples; i++) {
+            int32_t v = s[i] < -0x800000 ? -0x800000 : s[i] > 0x7fffff ? 0x7fffff : s[i];
+            dst[i] = v * 256;
+        }
+        } break;
+    case DSP_FMT_S32:
+        if (dst != src) memcpy(dst, src, samples * sizeof(int32_t));
+        break;
+    case DSP_FMT_FLOAT: {
+        const float *s = (const float*)src;
+#ifdef DSP_NEON
+        for (; i + 4 <= samples; i += 4) vst1q_s32(dst + i, vcvtq_n_s32_f32(vld1q_f32(s + i), 31));
+#endif
+        for (; i < samples; i++) {
+            float v = s[i];
+            dst[i] = v >= 1.0f ? 0x7fffffff : v > -1.0f ? (int32_t)(v * 2147483648.0f) : (int32_t)0x80000000;
+        }
+        } break;
+    }
+}
+
+void dsp_from_q31(void *dst, int fmt, const int32_t *src, int samples, DSP_DITHER *d)
+{
+    int i = 0;
+    switch (fmt) {
+    case DSP_FMT_S16: {
+        int16_t *o = (int16_t*)dst;
+        if (d) {
+#ifdef DSP_NEON
+            uint32x4_t st  = vld1q_u32(d->state);
+            uint32x4_t mul = vdupq_n_u32(DITHER_MUL);
+            uint32x4_t add = vdupq_n_u32(DITHER_ADD);
+            for (; i + 4 <= samples; i += 4) {
+                uint32x4_t r1 = vmlaq_u32(add, st, mul);
+                uint32x4_t r2 = vmlaq_u32(add, r1, mul);
+                int32x4_t  t  = vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(r1, 16)), vreinterpretq_s32_u32(vshrq_n_u32(r2, 16)));
+                vst1_s16(o + i, vqrshrn_n_s32(vqaddq_s32(vld1q_s32(src + i), t), 16));
+                st = r2;
+            }
+            vst1q_u32(d->state, st);
+#endif
+            // difference of two uniform values is triangular noise of +-1 lsb at 16 bit
+            for (; i < samples; i++) {
+                uint32_t *st = &d->state[i & 3];
+                int32_t   r1 = lcg_next(st) >> 16;
+                int32_t   r2 = lcg_next(st) >> 16;
+                o[i] = sat16((int32_t)(((int64_t)src[i] + r1 - r2 + 0x8000) >> 16));
+            }
+        } else {
+#ifdef DSP_NEON
+            for (; i + 4 <= samples; i += 4) vst1_s16(o + i, vqrshrn_n_s32(vld1q_s32(src + i), 16));
+#endif
+            for (; i < samples; i++) o[i] = sat16((int32_t)(((int64_t)src[i] + 0x8000) >> 16));
+        }
+        } break;
+    case DSP_FMT_S24P: {
+        uint8_t *o = (uint8_t*)dst;
+        for (; i < samples; i++) {
+            int32_t v = src[i] >> 8;
+            o[i * 3 + 0] = v;
+            o[i * 3 + 1] = v >> 8;
+            o[i * 3 + 2] = v >> 16;
+        }
+        } break;
+    case DSP_FMT_S824: {
+        int32_t *o = (int32_t*)dst;
+#ifdef DSP_NEON
+        for (; i + 4 <= samples; i += 4) vst1q_s32(o + i, vshrq_n_s32(vld1q_s32(src + i), 8));
+#endif
+        for (; i < samples; i++) o[i] = src[i] >> 8;
+        } break;
+    case DSP_FMT_S32:
+        if (dst != src) memcpy(dst, src, samples * sizeof(int32_t));
+        break;
+    case DSP_FMT_FLOAT: {
+        float *o = (float*)dst;
+#ifdef DSP_NEON
+        for (; i + 4 <= samples; i += 4) vst1q_f32(o + i, vcvtq_n_f32_s32(vld1q_s32(src + i), 31));
+#endif
+        for (; i < samples; i++) o[i] = src[i] * (1.0f / 2147483648.0f);
+        } break;
+    }
+}
+
+void dsp_store_s16(int16_t *dst, const int32_t *acc, int samples)
+{
+    int i = 0;
+#ifdef DSP_NEON
+    for (; i + 8 <= samples; i += 8) {
+        int16x4_t lo = vqmovn_s32(vld1q_s32(acc + i + 0));
+        int16x4_t hi = vqmovn_s32(vld1q_s32(acc + i + 4));
+        vst1q_s16(dst + i, vcombine_s16(lo, hi));
+    }
+#endif
+    for (; i < samples; i++) dst[i] = sat16(acc[i]);
+}
+
+void dsp_remix_s16(int16_t *dst, int dstch, const int16_t *src, int srcch, int frames)
+{
+    int i = 0;
+    if (dstch == srcch) {
+        memcpy(dst, src, frames * dstch * sizeof(int16_t));
+    } else if (dstch == 1) {
+#ifdef DSP_NEON
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x2_t s = vld2q_s16(src + i * 2);
+            vst1q_s16(dst + i, vhaddq_s16(s.val[0], s.val[1]));
+        }
+#endif
+        for (; i < frames; i++) dst[i] = (src[i * 2] + src[i * 2 + 1]) >> 1;
+    } else {
+#ifdef DSP_NEON
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x2_t d;
+            d.val[0] = d.val[1] = vld1q_s16(src + i);
+            vst2q_s16(dst + i * 2, d);
+        }
+#endif
+        for (; i < frames; i++) dst[i * 2] = dst[i * 2 + 1] = src[i];
+    }
+}
+
+void dsp_hdmi_order_s16(int16_t *dst, const int16_t *src, int frames, int ch)
+{
+    int i = 0, c;
+    if (ch != 6 && ch != 8) {
+        memcpy(dst, src, frames * ch * sizeof(int16_t));
+        return;
+    }
+#ifdef DSP_NEON
+    // a frame is 3 or 4 channel pairs, swap within the center/lfe pair and, for 7.1, swap the
+    // back and side pairs
+    if (ch == 6) {
+        for (; i + 4 <= frames; i += 4) {
+            uint32x4x3_t p = vld3q_u32((const uint32_t*)(src + i * 6));
+            p.val[1] = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(p.val[1])));
+            vst3q_u32((uint32_t*)(dst + i * 6), p);
+        }
+    } else {
+        for (; i + 4 <= frames; i += 4) {
+            uint32x4x4_t p = vld4q_u32((const uint32_t*)(src + i * 8));
+            uint32x4x4_t q;
+            q.val[0] = p.val[0];
+            q.val[1] = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(p.val[1])));
+            q.val[2] = p.val[3];
+            q.val[3] = p.val[2];
+            vst4q_u32((uint32_t*)(dst + i * 8), q);
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *s = src + i * ch;
+        int16_t       *d = dst + i * ch;
+        d[0] = s[0]; d[1] = s[1]; d[2] = s[3]; d[3] = s[2];
+        for (c=4; c<ch; c++) d[c] = s[ch == 8 ? c ^ 2 : c];
+    }
+}
+
+void dsp_hdmi_order_gain_s16(int16_t *dst, const int16_t *src, int frames, int ch, DSP_GAIN *g)
+{
+    int i, c, n;
+    dsp_hdmi_order_s16(dst, src, frames, ch);
+    if (g->left > 0) {
+        int32_t curl = g->cur[0], curr = g->cur[1];
+        n = frames < g->left ? frames : g->left;
+        for (i=0; i<n; i++) {
+            int16_t *d  = dst + i * ch;
+            int      gl = curl >> 8, gr = curr >> 8;
+            if (gl >= DSP_GAIN_UNITY) gl = DSP_GAIN_UNITY - 1;
+            if (gr >= DSP_GAIN_UNITY) gr = DSP_GAIN_UNITY - 1;
+            for (c=0; c<ch; c+=2) {
+                d[c + 0] = (d[c + 0] * gl + 0x4000) >> 15;
+                d[c + 1] = (d[c + 1] * gr + 0x4000) >> 15;
+            }
+            curl += g->step[0];
+            curr += g->step[1];
+        }
+        ramp_advance(g, curl, curr, n);
+        dst    += n * ch;
+        frames -= n;
+    }
+    // a frame of channel pairs is that many stereo frames to the constant gain kernel
+    if (frames > 0 && !dsp_gain_is_unity(g)) gain_const(NULL, dst, dst, frames * ch / 2, g->target[0], g->target[1]);
+}
@@ -0,0 +1,77 @@
+#ifndef __AUDIO_DSP_H__
+#define __AUDIO_DSP_H__
+
+#include <stdint.h>
+
+// 常量定义
+#define DSP_GAIN_UNITY  0x8000  // Q15 gain of 1.0
+
+// sample formats at the hal boundary, all conversions go through a Q31 intermediate
+enum {
+    DSP_FMT_S16,   // AUDIO_FORMAT_PCM_16_BIT
+    DSP_FMT_S24P,  // AUDIO_FORMAT_PCM_24_BIT_PACKED, 3 bytes little endian
+    DSP_FMT_S824,  // AUDIO_FORMAT_PCM_8_24_BIT, same layout as alsa S24_LE
+    DSP_FMT_S32,   // AUDIO_FORMAT_PCM_32_BIT
+    DSP_FMT_FLOAT, // AUDIO_FORMAT_PCM_FLOAT
+};
+
+// 类型定义
+// stereo gain with a per frame linear ramp towards target, gains are Q15 in [0, DSP_GAIN_UNITY]
+typedef struct {
+    int32_t cur   [2]; // current gain in Q23, the extra bits keep slow ramps from stalling
+    int32_t step  [2]; // Q23 increment per frame
+    int     target[2];
+    int     left;      // frames left in current ramp
+} DSP_GAIN;
+
+// codec volume control with its steps evenly spaced in dB, the range a DECLARE_TLV_DB_SCALE
+// control reports. a control is linear in dB, never in amplitude
+typedef struct {
+    int min;    // control range
+    int max;
+    int db_min; // gain at min and max in 0.01dB
+    int db_max;
+} DSP_HWVOL;
+
+// tpdf dither generator, one lcg per simd lane so scalar and neon code give the same noise
+typedef struct {
+    uint32_t state[4];
+} DSP_DITHER;
+
+// 函数声明
+static inline int dsp_gain_is_unity(const DSP_GAIN *g)
+{
+    return g->left == 0 && g->target[0] == DSP_GAIN_UNITY && g->target[1] == DSP_GAIN_UNITY;
+}
+void dsp_gain_init(DSP_GAIN *g, int gainl, int gainr);             // jump to gain
+void dsp_gain_ramp(DSP_GAIN *g, int gainl, int gainr, int frames); // ramp to gain over frames
+// acc[i] += src[i] * gain, interleaved stereo, the ramp advances by frames
+void dsp_mix_s16  (int32_t *acc, const int16_t *src, int frames, DSP_GAIN *g);
+// dst[i] = src[i] * gain, same as dsp_mix_s16 but for a single stream going straight to the pcm
+void dsp_gain_s16 (int16_t *dst, const int16_t *src, int frames, DSP_GAIN *g);
+// saturate mixed samples back to 16bit
+void dsp_store_s16(int16_t *dst, const int32_t *acc, int samples);
+// dst[i] = src[i] * gain on Q31 samples in place, interleaved stereo
+void dsp_gain_q31 (int32_t *buf, int frames, DSP_GAIN *g);
+
+// lowest control value whose gain is not below the Q15 gain, *residual gets the Q15 gain that is
+// left to apply in software so both together give exactly the requested one
+int  dsp_hwvol_value(const DSP_HWVOL *v, int gain, int *residual);
+// Q15 gain software adds to a control value to reach the Q15 gain, unity while the control is below it
+int  dsp_hwvol_residual(const DSP_HWVOL *v, int value, int gain);
+
+void dsp_dither_init(DSP_DITHER *d, uint32_t seed);
+int  dsp_fmt_bytes  (int fmt);
+void dsp_to_q31  (int32_t *dst, const void *src, int fmt, int samples);
+// dst may alias src, d adds +-1 lsb tpdf dither when converting to DSP_FMT_S16
+void dsp_from_q31(void *dst, int fmt, const int32_t *src, int samples, DSP_DITHER *d);
+
+// mono <-> stereo conversion, stereo is averaged down to mono
+void dsp_remix_s16(int16_t *dst, int dstch, const int16_t *src, int srcch, int frames);
+// android 5.1 and 7.1 order (FL FR FC LFE BL BR [SL SR]) to the CEA-861 order of hdmi (FL FR LFE FC
+// RL RR [RLC RRC]), where 7.1 has the side pair on RL/RR. other layouts are copied as they are
+void dsp_hdmi_order_s16(int16_t *dst, const int16_t *src, int frames, int ch);
+// same reorder with the stereo gain applied to every channel pair, left gain on FL, LFE, RL and RLC
+void dsp_hdmi_order_gain_s16(int16_t *dst, const int16_t *src, int frames, int ch, DSP_GAIN *g);
+
+#endif
@@ -0,0 +1,129 @@
+#define LOG_TAG "audio_hdmi"
+
+// 包含头文件
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <cutils/log.h>
+#include <tinyalsa/asoundlib.h>
+#include "audio_hdmi.h"
+
+// 内部常量定义
+#define ELD_MAX_SIZE     256
+#define ELD_VER_CEA861D  2
+#define ELD_MNL_MAX      16
+#define ELD_NAME_OFFSET  20    // monitor name, the short audio descriptors follow it
+#define SAD_SIZE         3
+#define SAD_CODING_LPCM  1
+#define BASIC_RATES      0x07  // 32, 44.1 and 48kHz
+
+// alsa channel positions, SNDRV_CHMAP_xxx
+enum {
+    CHMAP_FL = 3, CHMAP_FR, CHMAP_RL, CHMAP_RR, CHMAP_FC, CHMAP_LFE,
+    CHMAP_SL, CHMAP_SR, CHMAP_RC, CHMAP_FLC, CHMAP_FRC, CHMAP_RLC, CHMAP_RRC,
+};
+
+// 内部函数实现
+// ELD version 2 carries the monitor name and the CEA-861 short audio descriptors of the EDID,
+// a descriptor of n lpcm channels also stands for every smaller layout at the same rates
+static int parse_eld(const uint8_t *eld, int size, AHDMI_CAPS *caps)
+{
+    int mnl, sads, i, c;
+    if (size < ELD_NAME_OFFSET || (eld[0] >> 3) != ELD_VER_CEA861D) return -1;
+    mnl  = eld[4] & 0x1f;
+    sads = eld[5] >> 4;
+    if (mnl > ELD_MNL_MAX || ELD_NAME_OFFSET + mnl + sads * SAD_SIZE > size) return -1;
+
+    memcpy(caps->monitor, eld + ELD_NAME_OFFSET, mnl);
+    caps->monitor[mnl] = '\0';
+    for (i=0; i<sads; i++) {
+        const uint8_t *sad = eld + ELD_NAME_OFFSET + mnl + i * SAD_SIZE;
+        int channels = (sad[0] & 0x07) + 1;
+        if (((sad[0] >> 3) & 0x0f) != SAD_CODING_LPCM) continue;
+        for (c=2; c<=channels; c++) caps->rates[c] |= sad[1] & ((1 << AHDMI_NUM_RATES) - 1);
+    }
+    // a sink has to take basic audio even when its descriptors forget to say so
+    caps->rates[2] |= BASIC_RATES;
+    return 0;
+}
+
+// 函数实现
+void ahdmi_get_caps(int card, int port, AHDMI_CAPS *caps)
+{
+    struct pcm_params *params;
+    struct mixer      *mixer;
+    struct mixer_ctl  *ctl;
+    uint8_t      eld[ELD_MAX_SIZE];
+    unsigned int size = 0, maxch = 2, minrate = 0, maxrate = 0xffffffff;
+    int          i, c;
+
+    memset(caps, 0, sizeof(*caps));
+    // the ELD control is empty while no sink is connected
+    mixer = mixer_open(card);
+    ctl   = mixer ? mixer_get_ctl_by_name(mixer, "ELD") : NULL;
+    if (ctl && mixer_ctl_get_type(ctl) == MIXER_CTL_TYPE_BYTE) {
+        size = mixer_ctl_get_num_values(ctl);
+        if (size > sizeof(eld)) size = sizeof(eld);
+        if (size && mixer_ctl_get_array(ctl, eld, size) != 0) size = 0;
+    }
+    if (mixer) mixer_close(mixer);
+    caps->eld = parse_eld(eld, size, caps) == 0;
+    if (!caps->eld) {
+        memset(caps->rates, 0, sizeof(caps->rates));
+        caps->rates[2] = BASIC_RATES;
+    }
+
+    params = pcm_params_get(card, port, PCM_OUT);
+    if (params) {
+        maxch   = pcm_params_get_max(params, PCM_PARAM_CHANNELS);
+        minrate = pcm_params_get_min(params, PCM_PARAM_RATE);
+        maxrate = pcm_params_get_max(params, PCM_PARAM_RATE);
+        pcm_params_free(params);
+    }
+    for (c=0; c<=AHDMI_MAX_CHANNELS; c++) {
+        for (i=0; i<AHDMI_NUM_RATES; i++) {
+            if ((unsigned int)c > maxch || AHDMI_RATES[i] < minrate || AHDMI_RATES[i] > maxrate) caps->rates[c] &= ~(1 << i);
+        }
+        if (caps->rates[c]) caps->max_channels = c;
+    }
+    ALOGV("hdmi sink %s: %d channels lpcm, rates %#x", caps->eld ? caps->monitor : "without eld",
+          caps->max_channels, caps->rates[caps->max_channels]);
+}
+
+int ahdmi_rate_supported(const AHDMI_CAPS *caps, int channels, uint32_t rate)
+{
+    int i;
+    if (channels < 0 || channels > AHDMI_MAX_CHANNELS) return 0;
+    for (i=0; i<AHDMI_NUM_RATES; i++) {
+        if (AHDMI_RATES[i] == rate) return (caps->rates[channels] >> i) & 1;
+    }
+    return 0;
+}
+
+int ahdmi_set_chmap(int card, int channels)
+{
+    // CEA-861 allocations 0x0b and 0x13, side and back surrounds of 7.1 are RL/RR and RLC/RRC there
+    static const long MAP_51[] = { CHMAP_FL, CHMAP_FR, CHMAP_LFE, CHMAP_FC, CHMAP_RL, CHMAP_RR };
+    static const long MAP_71[] = { CHMAP_FL, CHMAP_FR, CHMAP_LFE, CHMAP_FC, CHMAP_RL, CHMAP_RR, CHMAP_RLC, CHMAP_RRC };
+    const long       *map  = channels == 8 ? MAP_71 : channels == 6 ? MAP_51 : NULL;
+    long              vals[AHDMI_MAX_CHANNELS] = { 0 };
+    struct mixer     *mixer;
+    struct mixer_ctl *ctl;
+    unsigned int      num;
+    int               ret = -ENODEV;
+
+    if (!map) return -EINVAL;
+    mixer = mixer_open(card);
+    ctl   = mixer ? mixer_get_ctl_by_name(mixer, "Playback Channel Map") : NULL;
+    if (ctl) {
+        num = mixer_ctl_get_num_values(ctl);
+        if (num > AHDMI_MAX_CHANNELS) num = AHDMI_MAX_CHANNELS;
+        if (num >= (unsigned int)channels) {
+            memcpy(vals, map, channels * sizeof(long));
+            ret = mixer_ctl_set_array(ctl, vals, num);
+        }
+    }
+    if (mixer) mixer_close(mixer);
+    if (ret != 0) ALOGW("hdmi channel map not set, the driver keeps its default allocation");
+    return ret;
+}
@@ -0,0 +1,31 @@
+#ifndef __AUDIO_HDMI_H__
+#define __AUDIO_HDMI_H__
+
+#include <stdint.h>
+
+// 常量定义
+#define AHDMI_MAX_CHANNELS  8
+#define AHDMI_NUM_RATES     7
+
+// lpcm rates of a CEA-861 short audio descriptor, bit n of AHDMI_CAPS.rates
+static const uint32_t AHDMI_RATES[AHDMI_NUM_RATES] = { 32000, 44100, 48000, 88200, 96000, 176400, 192000 };
+
+// 类型定义
+typedef struct {
+    int      eld;          // 1 when the sink sent an ELD, 0 for the basic audio every sink takes
+    int      max_channels; // lpcm
+    uint32_t rates[AHDMI_MAX_CHANNELS + 1]; // lpcm by channel count, bit n for AHDMI_RATES[n]
+    char     monitor[17];
+} AHDMI_CAPS;
+
+// 函数声明
+// lpcm the hdmi sink takes as reported by the ELD control of the card, limited to what the pcm of
+// the card can do. without an ELD (no sink, or a driver that has no such control) only stereo at
+// 32, 44.1 and 48kHz is reported, which every sink must accept
+void ahdmi_get_caps      (int card, int port, AHDMI_CAPS *caps);
+int  ahdmi_rate_supported(const AHDMI_CAPS *caps, int channels, uint32_t rate);
+// tell the driver the speaker of each pcm channel, so the infoframe carries the matching channel
+// allocation. the channels are expected in the order dsp_hdmi_order_s16 gives
+int  ahdmi_set_chmap     (int card, int channels);
+
+#endif
@@ -26,8 +26,15 @@
 #include <cutils/properties.h>
 
 
-#include <audio_utils/resampler.h>
-#include <audio_route/audio_route.h>
+#include "audio_capture.h"
+#include "audio_dsp.h"
+#include "audio_hdmi.h"
+#include "audio_iec61937.h"
+#include "audio_latency.h"
+#include "audio_mixer.h"
+#include "audio_path.h"
+#include "audio_src.h"
+#include "audio_stats.h"
 
 #include <hardware/hardware.h>
 #include <hardware/audio.h>
@@ -42,17 +49,94 @@
 #define PORT_HDMI     0
 #define PORT_SPDIF    0
 
-#define PLAYBACK_SAMPLE_RATE    44100
+#define PLAYBACK_SAMPLE_RATE    44100   // codec rate when it can not run at MIXER_SAMPLE_RATE
 #define PLAYBACK_PERIOD_SIZE    1024
 #define PLAYBACK_PERIOD_COUNT   4
 #define PLAYBACK_CHANNEL_NUM    2
+#define PLAYBACK_MIN_RATE       8000
+#define PLAYBACK_MAX_RATE       192000
+
+// AUDIO_OUTPUT_FLAG_FAST stream, 2 x 192 frames is 8ms of kernel buffering at 48kHz, 8.7ms at 44.1kHz
+#define FAST_PERIOD_SIZE        192
+#define FAST_PERIOD_COUNT       2
+
+// AUDIO_OUTPUT_FLAG_DEEP_BUFFER stream, about 186ms per period so the cpu only wakes about 5 times per second
+#define DEEP_PERIOD_SIZE        8192
+#define DEEP_PERIOD_COUNT       2
+
+// AUDIO_OUTPUT_FLAG_MMAP_NOIRQ and AUDIO_INPUT_FLAG_MMAP_NOIRQ streams, the client moves bursts of
+// one period, 2ms at 48kHz, straight through the pcm ring. the ring holds what it asks for within
+// these counts
+#define MMAP_PERIOD_SIZE        96
+#define MMAP_MIN_PERIOD_COUNT   2
+#define MMAP_MAX_PERIOD_COUNT   32
+
+// the mmap stream interface of audio.h came with android 8.0, FFHAL_MMAP is set for it by Android.mk
+#ifdef FFHAL_MMAP
+#define OUT_IS_MMAP(out)        ((out)->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ)
+#define IN_IS_MMAP(in)          ((in)->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ)
+#else
+#define OUT_IS_MMAP(out)        0
+#define IN_IS_MMAP(in)          0
+#endif
+
+// codec pcm shared by all streams through the software mixer, mixer runs at half the fast period
+// and fills the buffer as deep as the active tracks allow, 4ms for a fast track, about 60ms for a
+// normal one and the whole 256ms while only deep buffer tracks play, at 48kHz. a fast track keeps
+// the 2 x 192 frames of its own pcm from track write to dac
+#define MIXER_SAMPLE_RATE       48000   // most content is 48kHz, only the rest is resampled
+#define MIXER_PERIOD_SIZE       (FAST_PERIOD_SIZE / 2)
+#define MIXER_PERIOD_COUNT      128
 
 #define CAPTURE_SAMPLE_RATE     44100
 #define CAPTURE_PERIOD_SIZE     512
-#define CAPTURE_PERIOD_COUNT    4
 #define CAPTURE_CHANNEL_NUM     1
+#define CAPTURE_MIN_RATE        8000
+#define CAPTURE_MAX_RATE        48000
+#define CAPTURE_RING_PERIODS    16      // about 186ms the reader may fall behind the capture thread
 
+// volume changes, stream start and mixer track stop are ramped over this many ms to avoid clicks
+#define AUDIO_RAMP_MS           10
+
+// output standby is delayed by this grace period, short sounds in a row reuse the open pcm and route
+#define AUDIO_STANDBY_MS        3000
+#define MAX_OUTPUT_STREAMS      8
+
+// output stream state, the writer reads it without any lock and takes the locks only to change it
+enum {
+    OUT_STATE_STANDBY,  // pcm closed, track stopped
+    OUT_STATE_ACTIVE,   // owned by the writer, no other thread touches pcm, src or gain
+    OUT_STATE_IDLE,     // standby requested, pcm and route are kept until the deadline
+};
+
+// raised by control paths while the writer owns the stream, served at the start of its next write
+#define OUT_REQ_REOPEN          (1 << 0) // hdmi was plugged or unplugged, the pcm must move to the other card
+
+// kernel buffer depth of plain direct playback and capture pcms adapts to their xrun history, it
+// starts shallow, grows by a period when a run had too many xruns and shrinks back after a long
+// clean stretch. the change is applied when the pcm is opened again after standby
+#define ADAPT_MIN_PERIODS       2
+#define ADAPT_MAX_PERIODS       8
+#define ADAPT_XRUN_THRESHOLD    3               // xruns in one run from open to standby
+#define ADAPT_CLEAN_MS          (30 * 60 * 1000) // xrun free running time
+
+enum {
+    ADAPT_HDMI,
+    ADAPT_CODEC,
+    ADAPT_MIC,
+    ADAPT_NUM,
+};
+
+// learned depth is persisted as persist.sys.audio.periods.<name>
+static const char *adapt_names[ADAPT_NUM] = { "hdmi", "codec", "mic" };
+
+// the host build of audio_bench points these into the source tree and /tmp
+#ifndef AUDIO_PATH_XML
 #define AUDIO_PATH_XML   "/system/etc/a64_paths.xml"
+#define AUDIO_PATH_BIN   "/data/misc/audio/a64_paths.bin"
+#endif
+
+#define AUDIO_PARAMETER_LATENCY_TEST "latency_test" // set to start, get returns the result
 
 enum {
     OUT_DEVICE_SPEAKER,
@@ -73,7 +157,31 @@ struct ffhal_stream_in {
     struct pcm_config       config;
     struct pcm                *pcm;
     struct ffhal_audio_device *dev;
+    audio_input_flags_t    flags;
     int                    standby;
+    int                    started;     // mmap stream, between in_start and in_stop
+    int                    use_thread;  // drain the pcm on a real-time thread, in_read only copies from its ring
+    void                  *capture;
+    uint32_t               sample_rate; // client rate, channels and format, config holds what the pcm runs at
+    uint32_t               channels;
+    audio_format_t         format;
+    int                    dsp_fmt;
+    int16_t               *fmt_buf;     // 16bit frames before expanding to client format
+    int32_t               *q31_buf;
+    void                  *src;
+    int16_t               *pcm_buf;     // one pcm period, used when converting
+    int16_t               *cvt_buf;     // converted frames not returned to client yet
+    int                    cvt_pos;
+    int                    cvt_frames;
+    uint64_t               frames_read; // pcm frames read since start, includes frames converted but not returned yet
+    uint64_t               pos_base;    // client frames of earlier runs, capture position never goes back
+    uint64_t               pos_last;    // last capture position reported in this run, pcm frames
+    uint64_t               last_pos;    // hardware capture position at last_ts
+    struct timespec        last_ts;
+    uint32_t               frames_lost;
+    AUDIO_STATS            stats;
+    uint32_t               run_xruns;   // stats.xruns when the pcm was opened
+    int64_t                run_start;
 };
 
 struct ffhal_stream_out {
@@ -82,8 +190,52 @@ struct ffhal_stream_out {
     struct pcm_config       config;
     struct pcm                *pcm;
     struct ffhal_audio_device *dev;
-    int                    standby;
-    unsigned int           written;
+    void                    *track;  // software mixer track, used when playing on codec
+    audio_output_flags_t     flags;
+    uint32_t               sample_rate; // rate of the client data
+    audio_format_t         format;      // format of the client data
+    int                    dsp_fmt;
+    int                    pcm_fmt;     // DSP_FMT_S824 when a direct pcm takes 24bit, DSP_FMT_S16 otherwise
+    int32_t               *q31_buf;     // only for client formats other than 16bit
+    int16_t               *fmt_buf;
+    DSP_DITHER             dither;
+    uint32_t               pcm_rate;    // rate the pcm or mixer runs at, src is used when they differ
+    void                  *src;
+    uint32_t               src_rate;    // pcm rate the src was built for
+    int16_t               *src_buf;
+    int                    state;       // OUT_STATE_xxx, all changes hold both the hw device and stream mutexes
+    int                    request;     // OUT_REQ_xxx
+    uint64_t               written;       // client frames since open, only the writer stores it
+    uint64_t               start_written; // written when the stream last left standby
+    unsigned int           buffer_frames; // kernel buffer size actually granted by driver
+    unsigned int           start_frames;  // start threshold of the direct mmap pcm
+    int                    started;
+    int                    mixer_held;    // mmap stream owning the codec pcm, the mixer is kept off it
+    uint32_t               volume;        // Q15 left | right << 16 set by out_set_volume, applied by the writer
+    int                    gainl;         // Q15 stream volume currently applied
+    int                    gainr;
+    DSP_GAIN               gain;          // software gain on the direct pcm, the mixer track has its own
+    int                    hw_volume;     // volume is set on the codec volume control instead
+    int                    hw_value [2];  // codec volume control value set now, left and right
+    int                    hw_target[2];  // where the writer steps it to, one step per write
+    int16_t               *gain_buf;      // deep buffer stream only, pcm_write needs the scaled copy
+    int16_t               *marker_buf;    // latency test only, the marker replaces the client data
+    void                  *iec;           // IEC61937 packer of a compressed passthrough stream, NULL for pcm
+    size_t                 marker_frames;
+    int64_t                standby_deadline; // OUT_STATE_IDLE only
+    uint32_t               open_count;    // pcm or track started from standby
+    uint32_t               standby_count; // really put in standby
+    uint32_t               resume_count;  // written again within the standby grace period
+    AUDIO_STATS            stats;         // written by the writer only, dump reads it without a lock
+    int                    adapt;         // ADAPT_xxx of the direct pcm, -1 when its depth is fixed
+    uint32_t               run_xruns;     // stats.xruns when the pcm was opened
+    int64_t                run_start;
+};
+
+// kernel buffer depth of one pcm, only touched with the hw device mutex held
+struct ffhal_adapt {
+    int      periods;
+    int64_t  clean_ns;  // running time without xrun since the last change
 };
 
 struct ffhal_audio_device {
@@ -91,24 +243,98 @@ struct ffhal_audio_device {
     pthread_mutex_t lock;   /* see note below on mutex acquisition order */
     int    in_devices;
     int    out_devices;
-    struct audio_route      *aroute;
+    void  *apath;
+    int    route_out[OUT_DEVICE_TAB_SIZE]; // path indexes resolved once at open, -1 if missing
+    int    route_spk_off;
+    int    route_mic;
     struct ffhal_stream_in  *active_input;
-    struct ffhal_stream_out *active_output;
+    int    active_outputs;      /* number of output streams out of standby */
+    void  *mixer;
+    uint32_t mixer_rate;        // codec rate of the mixer, default pcm rate of every output
+    struct mixer     *hw_mixer;   // only opened when a codec volume control is configured
+    struct mixer_ctl *volume_ctl;
+    DSP_HWVOL         volume_range;    // its range in dB, from persist.sys.audio.volume_ctl_db
+    int               volume_saved[2]; // its values before a stream took it, put back on standby
+    int    ramp_ms;
+    int    standby_ms;
+    struct ffhal_stream_out *outputs[MAX_OUTPUT_STREAMS]; // open output streams, for the standby thread
+    pthread_t       standby_thread;
+    pthread_cond_t  standby_cond; // a standby deadline was armed, CLOCK_MONOTONIC
+    int             standby_exit;
+    struct ffhal_adapt adapt[ADAPT_NUM];
+    void  *latency;             // round trip measurement, see AUDIO_PARAMETER_LATENCY_TEST
     bool   mic_mute;
 };
 
+static int64_t get_tick_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int out_get_state(struct ffhal_stream_out *out)
+{
+    return __atomic_load_n(&out->state, __ATOMIC_ACQUIRE);
+}
+
+static void out_set_state(struct ffhal_stream_out *out, int state)
+{
+    __atomic_store_n(&out->state, state, __ATOMIC_RELEASE);
+}
+
+static void adapt_init(struct ffhal_adapt *adapt, int id)
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+
+    snprintf(key, sizeof(key), "persist.sys.audio.periods.%s", adapt_names[id]);
+    property_get(key, value, "");
+    adapt->periods  = value[0] ? atoi(value) : ADAPT_MIN_PERIODS;
+    adapt->periods  = adapt->periods < ADAPT_MIN_PERIODS ? ADAPT_MIN_PERIODS : adapt->periods > ADAPT_MAX_PERIODS ? ADAPT_MAX_PERIODS : adapt->periods;
+    adapt->clean_ns = 0;
+}
+
+// called when the pcm goes to standby with the xruns and duration of the run that ends
+static void adapt_update(struct ffhal_adapt *adapt, int id, uint32_t xruns, int64_t run_ns)
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    int  periods = adapt->periods;
+
+    if (xruns >= ADAPT_XRUN_THRESHOLD) {
+        if (periods < ADAPT_MAX_PERIODS) periods++;
+        adapt->clean_ns = 0;
+    } else if (xruns) {
+        adapt->clean_ns = 0;
+    } else {
+        adapt->clean_ns += run_ns;
+        if (adapt->clean_ns >= ADAPT_CLEAN_MS * 1000000LL) {
+            if (periods > ADAPT_MIN_PERIODS) periods--;
+            adapt->clean_ns = 0;
+        }
+    }
+    if (periods == adapt->periods) return;
+
+    ALOGI("%s pcm goes from %d to %d periods after a run of %lld ms with %u xruns", adapt_names[id],
+        adapt->periods, periods, (long long)(run_ns / 1000000), xruns);
+    adapt->periods = periods;
+    snprintf(key  , sizeof(key  ), "persist.sys.audio.periods.%s", adapt_names[id]);
+    snprintf(value, sizeof(value), "%d", periods);
+    property_set(key, value);
+}
+
 static void select_device(struct ffhal_audio_device *adev)
 {
     int out_dev_id = 0;
     int hp_on      = 0;
     int spk_on     = 0;
-    const char *output_route = NULL;
-    const char *input_route  = NULL;
+    int paths[APATH_MAX_APPLY];
+    int num        = 0;
 
-    audio_route_reset(adev->aroute);
-    audio_route_update_mixer_old_value(adev->aroute);
-    audio_route_apply_path(adev->aroute, "media-speaker-off");
-    if (adev->active_output) {
+    // the cached route of this combination is diffed against the hardware, only changed controls are written
+    if (adev->route_spk_off >= 0) paths[num++] = adev->route_spk_off;
+    if (adev->active_outputs) {
         hp_on  = adev->out_devices & AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
         spk_on = adev->out_devices & AUDIO_DEVICE_OUT_SPEAKER;
         if (spk_on) {
@@ -121,46 +347,253 @@ static void select_device(struct ffhal_audio_device *adev)
             out_dev_id = OUT_DEVICE_HEADPHONE;
         }
         //-- for fmtx
-        output_route = normal_route_configs[out_dev_id];
+        if (adev->route_out[out_dev_id] >= 0) paths[num++] = adev->route_out[out_dev_id];
+    }
+    if (adev->active_input && adev->route_mic >= 0) {
+        paths[num++] = adev->route_mic;
+    }
+    apath_apply(adev->apath, paths, num);
+}
+
+static int get_dsp_format(audio_format_t format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:        return DSP_FMT_S16;
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED: return DSP_FMT_S24P;
+    case AUDIO_FORMAT_PCM_8_24_BIT:      return DSP_FMT_S824;
+    case AUDIO_FORMAT_PCM_32_BIT:        return DSP_FMT_S32;
+    case AUDIO_FORMAT_PCM_FLOAT:         return DSP_FMT_FLOAT;
+    default:                             return -1;
+    }
+}
+
+// compressed formats passed through to hdmi, -1 for anything else
+static int get_iec_codec(audio_format_t format)
+{
+    switch (format & AUDIO_FORMAT_MAIN_MASK) {
+    case AUDIO_FORMAT_AC3:   return AIEC_AC3;
+    case AUDIO_FORMAT_E_AC3: return AIEC_EAC3;
+    case AUDIO_FORMAT_DTS:   return AIEC_DTS;
+    default:                 return -1;
     }
-    if (adev->active_input) {
-        input_route = "media-main-mic";
+}
+
+static int pcm_format_supported(int card, int port, enum pcm_format format)
+{
+    struct pcm_params *params = pcm_params_get(card, port, PCM_OUT);
+    int    ret = 0;
+    if (params) {
+        ret = pcm_params_format_test(params, format);
+        pcm_params_free(params);
     }
-    if (output_route) audio_route_apply_path(adev->aroute, output_route);
-    if (input_route ) audio_route_apply_path(adev->aroute, input_route );
-    audio_route_update_mixer(adev->aroute);
+    return ret;
+}
+
+static int pcm_rate_supported(int card, int port, unsigned int rate)
+{
+    struct pcm_params *params = pcm_params_get(card, port, PCM_OUT);
+    int    ret = 0;
+    if (params) {
+        ret = rate >= pcm_params_get_min(params, PCM_PARAM_RATE) && rate <= pcm_params_get_max(params, PCM_PARAM_RATE);
+        pcm_params_free(params);
+    }
+    return ret;
+}
+
+#ifdef FFHAL_MMAP
+// the pcm of a mmap stream never stops on xrun, a client falling behind hears or records ring
+// data from one lap before, as the dsp of a phone would give it
+static void mmap_config(struct pcm_config *config, int32_t min_size_frames)
+{
+    int count = (min_size_frames + MMAP_PERIOD_SIZE - 1) / MMAP_PERIOD_SIZE;
+    config->period_size       = MMAP_PERIOD_SIZE;
+    config->period_count      = count < MMAP_MIN_PERIOD_COUNT ? MMAP_MIN_PERIOD_COUNT : count > MMAP_MAX_PERIOD_COUNT ? MMAP_MAX_PERIOD_COUNT : count;
+    config->start_threshold   = config->period_size * config->period_count;
+    config->stop_threshold    = INT32_MAX;
+    config->silence_threshold = 0;
+    config->silence_size      = 0;
+    config->avail_min         = config->period_size;
+}
+
+// alsa maps the data area at offset 0 of the pcm fd, so the client maps the same ring through it.
+// a playback ring starts as silence handed over to the client as a whole
+static int mmap_get_info(struct pcm *pcm, int playback, struct audio_mmap_buffer_info *info)
+{
+    unsigned int offset = 0, frames = pcm_get_buffer_size(pcm);
+    void        *area   = NULL;
+    if (pcm_mmap_begin(pcm, &area, &offset, &frames) < 0 || !area) return -ENODEV;
+    info->shared_memory_address = area;
+    info->shared_memory_fd      = pcm_get_poll_fd(pcm);
+    info->buffer_size_frames    = pcm_get_buffer_size(pcm);
+    info->burst_size_frames     = MMAP_PERIOD_SIZE;
+    if (playback) {
+        memset(area, 0, pcm_frames_to_bytes(pcm, info->buffer_size_frames));
+        pcm_mmap_commit(pcm, offset, frames);
+    }
+    return 0;
+}
+
+static int mmap_get_position(struct pcm *pcm, struct audio_mmap_position *position)
+{
+    unsigned int    hw_ptr;
+    struct timespec ts;
+    if (!pcm || pcm_mmap_get_hw_ptr(pcm, &hw_ptr, &ts) < 0) return -EIO;
+    position->position_frames  = (int32_t)hw_ptr;
+    position->time_nanoseconds = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    return 0;
+}
+#endif
+
+// resample only when the pcm can not run at the client rate natively, a bitstream never is
+static int setup_output_src(struct ffhal_stream_out *out)
+{
+    if (out->iec || out->pcm_rate == out->sample_rate) return 0;
+    if (out->src && out->src_rate != out->pcm_rate) {
+        asrc_close(out->src);
+        free(out->src_buf);
+        out->src     = NULL;
+        out->src_buf = NULL;
+    }
+    if (!out->src) {
+        out->src_rate = out->pcm_rate;
+        out->src     = asrc_init(out->sample_rate, out->pcm_rate, out->config.channels, out->config.channels);
+        out->src_buf = out->src ? (int16_t*)malloc(asrc_max_out(out->src, ASRC_BLOCK) * out->config.channels * sizeof(int16_t)) : NULL;
+        if (!out->src_buf) {
+            asrc_close(out->src);
+            out->src = NULL;
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void set_hw_volume(struct mixer_ctl *ctl, const int *values)
+{
+    int num = mixer_ctl_get_num_values(ctl), i;
+    for (i=0; i<num; i++) mixer_ctl_set_value(ctl, i, values[i & 1]);
+}
+
+static int ramp_frames(struct ffhal_audio_device *adev, uint32_t rate)
+{
+    return adev->ramp_ms * rate / 1000;
+}
+
+/* a step of the codec control is heard at once, so the writer moves it one step per write and the
+ * software gain ramps to what the control does not give yet. the control is rounded up, so the
+ * software gain only ever attenuates and both together give exactly the stream volume */
+static void step_hw_volume(struct ffhal_stream_out *out)
+{
+    struct ffhal_audio_device *adev = out->dev;
+    int gain[2] = { out->gainl, out->gainr }, residual[2], i;
+
+    for (i=0; i<2; i++) {
+        if (out->hw_value[i] < out->hw_target[i]) out->hw_value[i]++;
+        if (out->hw_value[i] > out->hw_target[i]) out->hw_value[i]--;
+        residual[i] = dsp_hwvol_residual(&adev->volume_range, out->hw_value[i], gain[i]);
+    }
+    set_hw_volume(adev->volume_ctl, out->hw_value);
+    dsp_gain_ramp(&out->gain, residual[0], residual[1], ramp_frames(adev, out->pcm_rate));
 }
 
 /* must be called with hw device and output stream mutexes locked */
 static int start_output_stream(struct ffhal_stream_out *out)
 {
     struct ffhal_audio_device *adev = out->dev;
-    int card = 0;
-    int port = 0;
-
-    if (adev->out_devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) {
-        card = CARD_HDMI;
-        port = PORT_HDMI;
+    uint32_t volume;
+    int card = CARD_HDMI;
+    int port = PORT_HDMI;
+
+    // codec is shared by all streams through the mixer track, hdmi is opened directly
+    out->pcm_fmt = DSP_FMT_S16;
+    out->adapt   = -1;
+    if (!(adev->out_devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) && out->track) {
+        out->pcm      = NULL;
+        out->pcm_rate = out->config.rate;
     } else {
-        card = CARD_CODEC;
-        port = PORT_CODEC;
-    }
-    out->pcm = pcm_open(card, port, PCM_OUT | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC, &out->config);
-    if (!pcm_is_ready(out->pcm)) {
-        ALOGE("cannot open pcm_out driver: %s", pcm_get_error(out->pcm));
-        pcm_close(out->pcm);
-        adev->active_output = NULL;
-        return -ENODEV;
-    } else {
-        adev->active_output = out;
+        struct pcm_config config = out->config;
+        // a bitstream or more than two channels have no other sink than hdmi, checked at open
+        if (!(adev->out_devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) && !out->iec && out->config.channels <= 2) {
+            card = CARD_CODEC;
+            port = PORT_CODEC;
+        }
+        if (out->sample_rate != config.rate && !out->iec && pcm_rate_supported(card, port, out->sample_rate)) {
+            config.rate = out->sample_rate;
+        }
+        out->pcm_rate = config.rate;
+        // fast, deep buffer and mmap streams keep the depth their flags ask for
+        if (!(out->flags & (AUDIO_OUTPUT_FLAG_FAST | AUDIO_OUTPUT_FLAG_DEEP_BUFFER)) && !OUT_IS_MMAP(out)) {
+            out->adapt          = card == CARD_HDMI ? ADAPT_HDMI : ADAPT_CODEC;
+            config.period_count = adev->adapt[out->adapt].periods;
+        }
+        // wider client formats keep 24 bits when the card takes them and nothing needs resampling,
+        // multichannel stays 16bit for the channel reorder done in the mmap copy
+        if (out->dsp_fmt != DSP_FMT_S16 && config.rate == out->sample_rate && config.channels <= 2 &&
+            pcm_format_supported(card, port, PCM_FORMAT_S24_LE)) {
+            config.format = PCM_FORMAT_S24_LE;
+            out->pcm_fmt  = DSP_FMT_S824;
+        }
+        // deep buffer stream is period interrupt driven, so the cpu sleeps for a whole period between writes
+        if (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+            out->pcm = pcm_open(card, port, PCM_OUT | PCM_MONOTONIC, &config);
+        } else {
+            out->pcm = pcm_open(card, port, PCM_OUT | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC, &config);
+        }
+        if (!pcm_is_ready(out->pcm)) {
+            ALOGE("cannot open pcm_out driver: %s", pcm_get_error(out->pcm));
+            pcm_close(out->pcm);
+            out->pcm = NULL;
+            return -ENODEV;
+        }
+        if (config.channels > 2) ahdmi_set_chmap(card, config.channels);
+        out->buffer_frames = pcm_get_buffer_size(out->pcm);
+        out->start_frames  = config.start_threshold ? config.start_threshold : out->buffer_frames / 2;
+        out->started       = 0;
+        out->run_xruns     = __atomic_load_n(&out->stats.xruns, __ATOMIC_ACQUIRE);
+        out->run_start     = get_tick_ns();
+
+        // a stream owning the codec can use its volume control, hdmi has none so the gain is done here.
+        // a volume set before the first write is taken now, so the control is not stepped to it
+        volume         = __atomic_load_n(&out->volume, __ATOMIC_ACQUIRE);
+        out->gainl     = volume & 0xffff;
+        out->gainr     = volume >> 16;
+        out->hw_volume = card == CARD_CODEC && adev->volume_ctl;
+        if (out->hw_volume) {
+            // nothing is playing yet, the control goes straight to the stream volume
+            int residual[2];
+            adev->volume_saved[0] = mixer_ctl_get_value(adev->volume_ctl, 0);
+            adev->volume_saved[1] = mixer_ctl_get_num_values(adev->volume_ctl) > 1 ? mixer_ctl_get_value(adev->volume_ctl, 1) : adev->volume_saved[0];
+            out->hw_value[0] = out->hw_target[0] = dsp_hwvol_value(&adev->volume_range, out->gainl, &residual[0]);
+            out->hw_value[1] = out->hw_target[1] = dsp_hwvol_value(&adev->volume_range, out->gainr, &residual[1]);
+            set_hw_volume(adev->volume_ctl, out->hw_value);
+            dsp_gain_init(&out->gain, 0, 0);
+            dsp_gain_ramp(&out->gain, residual[0], residual[1], ramp_frames(adev, out->pcm_rate));
+        } else if (out->iec) {
+            // bursts must reach the sink bit exact, the decoder there applies the volume
+            dsp_gain_init(&out->gain, DSP_GAIN_UNITY, DSP_GAIN_UNITY);
+        } else {
+            dsp_gain_init(&out->gain, 0, 0);
+            dsp_gain_ramp(&out->gain, out->gainl, out->gainr, ramp_frames(adev, out->pcm_rate));
+        }
+        if ((out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) && !out->gain_buf) {
+            out->gain_buf = (int16_t*)malloc(ASRC_BLOCK * out->config.channels * sizeof(int16_t));
+        }
     }
+    if (setup_output_src(out) != 0 || (out->pcm && (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) && !out->gain_buf)) {
+        if (out->pcm) pcm_close(out->pcm);
+        out->pcm = NULL;
+        return -ENOMEM;
+    }
+    out->open_count++;
+    out->start_written = out->written;
+    adev->active_outputs++;
     select_device(adev);
     return 0;
 }
 
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
-    return PLAYBACK_SAMPLE_RATE;
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    return out->sample_rate;
 }
 
 static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -172,7 +605,8 @@ static size_t out_get_buffer_size(const struct audio_stream *stream)
 {
     /* return the closest majoring multiple of 16 frames, as
      * audioflinger expects audio buffers to be a multiple of 16 frames */
-    size_t size = PLAYBACK_PERIOD_SIZE;
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    size_t size = (size_t)out->config.period_size * out->sample_rate / out->config.rate;
     size = ((size + 15) / 16) * 16;
     return size * audio_stream_out_frame_size((struct audio_stream_out *)stream);
 }
@@ -180,16 +614,18 @@ static size_t out_get_buffer_size(const struct audio_stream *stream)
 static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
 {
     struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
-    if (out->config.channels == 1) {
-        return AUDIO_CHANNEL_OUT_MONO;
-    } else {
-        return AUDIO_CHANNEL_OUT_STEREO;
+    switch (out->config.channels) {
+    case 1:  return AUDIO_CHANNEL_OUT_MONO;
+    case 6:  return AUDIO_CHANNEL_OUT_5POINT1;
+    case 8:  return AUDIO_CHANNEL_OUT_7POINT1;
+    default: return AUDIO_CHANNEL_OUT_STEREO;
     }
 }
 
 static audio_format_t out_get_format(const struct audio_stream *stream)
 {
-    return AUDIO_FORMAT_PCM_16_BIT;
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    return out->format;
 }
 
 static int out_set_format(struct audio_stream *stream, audio_format_t format)
@@ -197,37 +633,100 @@ static int out_set_format(struct audio_stream *stream, audio_format_t format)
     return -ENOSYS;
 }
 
+/* must be called with hw device and output stream mutexes locked, by the writer itself or
+ * while the stream is not OUT_STATE_ACTIVE */
 static int do_output_standby(struct ffhal_stream_out *out)
 {
     struct ffhal_audio_device *adev = out->dev;
 
-    if (!out->standby) {
-        pcm_close(out->pcm);
-        out->standby        = 1;
+    if (out->state != OUT_STATE_STANDBY) {
+        if (out->pcm) {
+            if (out->adapt >= 0) {
+                adapt_update(&adev->adapt[out->adapt], out->adapt, __atomic_load_n(&out->stats.xruns, __ATOMIC_ACQUIRE) - out->run_xruns,
+                             get_tick_ns() - out->run_start);
+            }
+            pcm_close(out->pcm);
+            if (out->hw_volume) set_hw_volume(adev->volume_ctl, adev->volume_saved);
+            out->hw_volume = 0;
+            if (out->mixer_held) amixer_hold(adev->mixer, 0);
+            out->mixer_held = 0;
+        } else {
+            amixer_track_stop(out->track);
+        }
+        asrc_reset(out->src);
+        aiec_reset(out->iec);
         out->pcm            = NULL;
-        adev->active_output = NULL;
-        adev->out_devices   = AUDIO_DEVICE_NONE;
-        select_device(adev);
+        out->standby_count++;
+        out_set_state(out, OUT_STATE_STANDBY);
+        if (--adev->active_outputs == 0) {
+            adev->out_devices = AUDIO_DEVICE_NONE;
+            select_device(adev);
+        }
     }
     return 0;
 }
 
-static int out_standby(struct audio_stream *stream)
+// keep pcm and route open for the grace period, the standby thread puts the stream in standby
+// when the deadline passes without a write. direct pcm is stopped so it does not underrun,
+// a mixer track keeps the shared pcm running on silence
+static void out_standby_delayed(struct ffhal_stream_out *out)
 {
-    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
-    int    status;
+    struct ffhal_audio_device *adev = out->dev;
+    if (out->state != OUT_STATE_ACTIVE) return;
+    if (out->pcm) {
+        pcm_stop(out->pcm);
+        out->started = 0;
+    } else {
+        amixer_track_idle(out->track);
+    }
+    out->standby_deadline = get_tick_ns() + adev->standby_ms * 1000000LL;
+    out_set_state(out, OUT_STATE_IDLE);
+    pthread_cond_signal(&adev->standby_cond);
+}
 
-//  pthread_mutex_lock(&out->dev->lock);
-    pthread_mutex_lock(&out->lock);
-    status = do_output_standby(out);
-    pthread_mutex_unlock(&out->lock);
-//  pthread_mutex_unlock(&out->dev->lock);
+static void* standby_thread_proc(void *param)
+{
+    struct ffhal_audio_device *adev = (struct ffhal_audio_device *)param;
+    int64_t now, next;
+    int     i;
 
-    return status;
+    pthread_mutex_lock(&adev->lock);
+    while (!adev->standby_exit) {
+        now  = get_tick_ns();
+        next = 0;
+        for (i=0; i<MAX_OUTPUT_STREAMS; i++) {
+            struct ffhal_stream_out *out = adev->outputs[i];
+            if (!out) continue;
+            pthread_mutex_lock(&out->lock);
+            if (out->state == OUT_STATE_IDLE) {
+                if (now >= out->standby_deadline) {
+                    do_output_standby(out);
+                } else if (!next || out->standby_deadline < next) {
+                    next = out->standby_deadline;
+                }
+            }
+            pthread_mutex_unlock(&out->lock);
+        }
+        if (next) {
+            struct timespec ts = { next / 1000000000LL, next % 1000000000LL };
+            pthread_cond_timedwait(&adev->standby_cond, &adev->lock, &ts);
+        } else {
+            pthread_cond_wait(&adev->standby_cond, &adev->lock);
+        }
+    }
+    pthread_mutex_unlock(&adev->lock);
+    return NULL;
 }
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    int state = out_get_state(out);
+    dprintf(fd, "output %p: flags %#x, %u Hz, %u channels, %s, %u opens, %u standbys, %u resumed within grace period\n", out,
+        out->flags, out->sample_rate, out->config.channels, state == OUT_STATE_STANDBY ? "standby" : state == OUT_STATE_IDLE ? "standby pending" : "active",
+        out->open_count, out->standby_count, out->resume_count);
+    astats_dump(&out->stats, fd, "  ");
+    aiec_dump(out->iec, fd);
     return 0;
 }
 
@@ -248,8 +747,13 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         pthread_mutex_lock(&adev->lock);
         pthread_mutex_lock(&out->lock);
         if (((adev->out_devices & AUDIO_DEVICE_OUT_ALL) != val) && (val != 0)) {
-            if (out == adev->active_output) {
-                if ( (val & AUDIO_DEVICE_OUT_AUX_DIGITAL) ^ (adev->out_devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) ) {
+            // the ring of a mmap stream stays on its card, the client creates a new one after rerouting
+            if (((val & AUDIO_DEVICE_OUT_AUX_DIGITAL) ^ (adev->out_devices & AUDIO_DEVICE_OUT_AUX_DIGITAL)) && !OUT_IS_MMAP(out)) {
+                // an active stream belongs to its writer, which moves to the other card at its next
+                // write, so routing never closes the pcm under a write in progress
+                if (out->state == OUT_STATE_ACTIVE) {
+                    __atomic_fetch_or(&out->request, OUT_REQ_REOPEN, __ATOMIC_RELEASE);
+                } else {
                     do_output_standby(out);
                 }
             }
@@ -265,57 +769,415 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
     return ret;
 }
 
+// answers the queries for dynamic profiles of a direct pcm output, from what the hdmi sink reports
 static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
 {
-    return strdup("");
+    struct ffhal_stream_out *out   = (struct ffhal_stream_out *)stream;
+    struct str_parms        *parms = str_parms_create_str(keys);
+    char       value[256] = "";
+    int        len = 0, i;
+    AHDMI_CAPS caps;
+
+    if (parms && (out->flags & AUDIO_OUTPUT_FLAG_DIRECT) && !out->iec) {
+        ahdmi_get_caps(CARD_HDMI, PORT_HDMI, &caps);
+        if (str_parms_has_key(parms, AUDIO_PARAMETER_STREAM_SUP_CHANNELS)) {
+            len += snprintf(value + len, sizeof(value) - len, "%s%s=AUDIO_CHANNEL_OUT_STEREO%s%s", len ? ";" : "",
+                            AUDIO_PARAMETER_STREAM_SUP_CHANNELS, caps.rates[6] ? "|AUDIO_CHANNEL_OUT_5POINT1" : "",
+                            caps.rates[8] ? "|AUDIO_CHANNEL_OUT_7POINT1" : "");
+        }
+        if (str_parms_has_key(parms, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES) && len < (int)sizeof(value)) {
+            len += snprintf(value + len, sizeof(value) - len, "%s%s=", len ? ";" : "", AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES);
+            for (i=0; i<AHDMI_NUM_RATES && len < (int)sizeof(value); i++) {
+                if (caps.rates[out->config.channels] & (1 << i)) {
+                    len += snprintf(value + len, sizeof(value) - len, "%s%u", value[len - 1] == '=' ? "" : "|", AHDMI_RATES[i]);
+                }
+            }
+        }
+        if (str_parms_has_key(parms, AUDIO_PARAMETER_STREAM_SUP_FORMATS) && len < (int)sizeof(value)) {
+            len += snprintf(value + len, sizeof(value) - len, "%s%s=AUDIO_FORMAT_PCM_16_BIT", len ? ";" : "",
+                            AUDIO_PARAMETER_STREAM_SUP_FORMATS);
+        }
+    }
+    if (parms) str_parms_destroy(parms);
+    return strdup(value);
 }
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
-    return (PLAYBACK_PERIOD_SIZE * PLAYBACK_PERIOD_COUNT * 1000) / out->config.rate;
+    unsigned int frames = out->buffer_frames;
+    // before the first write report the requested size, after that the size granted by driver
+    if (frames == 0) frames = out->config.period_size * out->config.period_count;
+    if (out->track && !out->pcm) frames = amixer_track_get_latency(out->track);
+    return (frames * 1000 + out->config.rate - 1) / out->config.rate;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left, float right)
 {
-    return -ENOSYS;
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    uint32_t gainl = (uint32_t)((left  < 0.0f ? 0.0f : left  > 1.0f ? 1.0f : left ) * DSP_GAIN_UNITY + 0.5f);
+    uint32_t gainr = (uint32_t)((right < 0.0f ? 0.0f : right > 1.0f ? 1.0f : right) * DSP_GAIN_UNITY + 0.5f);
+
+    // bursts are decoded by the sink and can not be scaled, audioflinger keeps that volume
+    if (out->iec) return -ENOSYS;
+    // only published here, the writer ramps to it before its next buffer
+    __atomic_store_n(&out->volume, gainl | (gainr << 16), __ATOMIC_RELEASE);
+    return 0;
+}
+
+// called by the writer on an active stream only
+static void out_apply_volume(struct ffhal_stream_out *out, uint32_t volume)
+{
+    struct ffhal_audio_device *adev = out->dev;
+
+    out->gainl = volume & 0xffff;
+    out->gainr = volume >> 16;
+    if (out->iec) return;
+    if (out->track) amixer_track_set_gain(out->track, out->gainl, out->gainr);
+    if (out->pcm && out->hw_volume) {
+        int residual;
+        out->hw_target[0] = dsp_hwvol_value(&adev->volume_range, out->gainl, &residual);
+        out->hw_target[1] = dsp_hwvol_value(&adev->volume_range, out->gainr, &residual);
+        step_hw_volume(out);
+    } else if (out->pcm) {
+        dsp_gain_ramp(&out->gain, out->gainl, out->gainr, ramp_frames(adev, out->pcm_rate));
+    }
+}
+
+// replaces pcm_mmap_write, the gain, with the hdmi channel order for multichannel, is applied in the same pass that
+// copies into the mmap area
+static int out_write_mmap(struct ffhal_stream_out *out, const void *buf, size_t frames)
+{
+    unsigned int buffer = out->buffer_frames;
+    unsigned int period = out->config.period_size;
+    int          ch     = out->config.channels;
+    int          fsize  = ch * dsp_fmt_bytes(out->pcm_fmt);
+
+    while (frames > 0) {
+        void        *area   = NULL;
+        unsigned int offset = 0;
+        unsigned int n;
+        int          avail  = pcm_mmap_avail(out->pcm);
+        if (avail < 0 || (unsigned int)avail > buffer) {
+            // underrun, the hardware sync fails once the kernel stopped the pcm for it
+            astats_xrun(&out->stats, astats_now());
+            pcm_stop(out->pcm); // tinyalsa skips prepare unless the pcm was stopped first
+            if (pcm_prepare(out->pcm) != 0) return -EIO;
+            out->started = 0;
+            continue;
+        }
+        if (!out->started && buffer - avail >= out->start_frames) {
+            if (pcm_start(out->pcm) != 0) return -EIO;
+            out->started = 1;
+        }
+        if ((unsigned int)avail < period && (unsigned int)avail < frames) {
+            // NOIRQ pcm can not be polled, sleep until about a period is free
+            usleep((uint64_t)(period - avail) * 1000000 / out->pcm_rate);
+            continue;
+        }
+
+        n = (unsigned int)avail < frames ? (unsigned int)avail : frames;
+        if (pcm_mmap_begin(out->pcm, &area, &offset, &n) < 0 || n == 0) return -EIO;
+        // 24bit frames already had the gain applied before they were narrowed
+        if (ch == 2 && out->pcm_fmt == DSP_FMT_S16 && !dsp_gain_is_unity(&out->gain)) dsp_gain_s16((int16_t*)area + offset * ch, (const int16_t*)buf, n, &out->gain);
+        else if (ch > 2) dsp_hdmi_order_gain_s16((int16_t*)area + offset * ch, (const int16_t*)buf, n, ch, &out->gain);
+        else memcpy((uint8_t*)area + offset * fsize, buf, n * fsize);
+        pcm_mmap_commit(out->pcm, offset, n);
+        buf     = (const uint8_t*)buf + n * fsize;
+        frames -= n;
+    }
+    if (!out->started && buffer - pcm_mmap_avail(out->pcm) >= out->start_frames) {
+        if (pcm_start(out->pcm) == 0) out->started = 1;
+    }
+    return 0;
+}
+
+static int out_write_pcm(struct ffhal_stream_out *out, const void *buffer, size_t frames)
+{
+    size_t frame_size = out->config.channels * dsp_fmt_bytes(out->pcm_fmt);
+    if (!out->pcm) {
+        return amixer_track_write(out->track, buffer, frames) < 0 ? -EIO : 0;
+    } else if (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        const int16_t *src = (const int16_t *)buffer;
+        size_t         done, n;
+        int            ret = 0;
+        if (dsp_gain_is_unity(&out->gain) || out->config.channels != 2 || out->pcm_fmt != DSP_FMT_S16) {
+            ret = pcm_write(out->pcm, buffer, frames * frame_size);
+        } else {
+            for (done = 0; done < frames && ret == 0; done += n) {
+                n   = frames - done < ASRC_BLOCK ? frames - done : ASRC_BLOCK;
+                dsp_gain_s16(out->gain_buf, src + done * 2, n, &out->gain);
+                ret = pcm_write(out->pcm, out->gain_buf, n * frame_size);
+            }
+        }
+        if (ret == 0) out->started = 1;
+        return ret;
+    } else {
+        return out_write_mmap(out, buffer, frames);
+    }
+}
+
+static int out_write_s16(struct ffhal_stream_out *out, const int16_t *buffer, size_t frames)
+{
+    size_t done, n;
+    int    ret = 0;
+    if (out->pcm_rate == out->sample_rate) return out_write_pcm(out, buffer, frames);
+    for (done = 0; done < frames && ret == 0; done += n) {
+        n   = frames - done < ASRC_BLOCK ? frames - done : ASRC_BLOCK;
+        ret = out_write_pcm(out, out->src_buf, asrc_process(out->src, buffer + done * out->config.channels, n, out->src_buf));
+    }
+    return ret;
+}
+
+// wider client formats stay 24bit on a S24_LE pcm, anything else is dithered down to 16bit
+static int out_write_q31(struct ffhal_stream_out *out, const void *buffer, size_t frames)
+{
+    const uint8_t *src   = (const uint8_t *)buffer;
+    int            ch    = out->config.channels;
+    size_t         fsize = ch * dsp_fmt_bytes(out->dsp_fmt);
+    size_t         done, n;
+    int            ret = 0;
+
+    for (done = 0; done < frames && ret == 0; done += n) {
+        n = frames - done < ASRC_BLOCK ? frames - done : ASRC_BLOCK;
+        dsp_to_q31(out->q31_buf, src + done * fsize, out->dsp_fmt, n * ch);
+        if (out->pcm && out->pcm_fmt == DSP_FMT_S824) {
+            if (ch == 2) dsp_gain_q31(out->q31_buf, n, &out->gain);
+            dsp_from_q31(out->q31_buf, DSP_FMT_S824, out->q31_buf, n * ch, NULL);
+            ret = out_write_pcm(out, out->q31_buf, n);
+        } else {
+            dsp_from_q31(out->fmt_buf, DSP_FMT_S16, out->q31_buf, n * ch, &out->dither);
+            ret = out_write_s16(out, out->fmt_buf, n);
+        }
+    }
+    return ret;
+}
+
+/* the only place the writer takes the hw device and stream mutexes: leaving standby or the
+ * grace period, and serving requests raised by control paths while the stream was active */
+static int out_resume(struct ffhal_stream_out *out)
+{
+    struct ffhal_audio_device *adev = out->dev;
+    int    ret = 0;
+
+    astats_break(&out->stats);
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&out->lock);
+    if (__atomic_exchange_n(&out->request, 0, __ATOMIC_ACQ_REL) & OUT_REQ_REOPEN) {
+        // routing already set the new devices, keep them when the last active output goes away
+        int devices = adev->out_devices;
+        do_output_standby(out);
+        adev->out_devices = devices;
+    }
+    if (out->state == OUT_STATE_STANDBY) {
+        ret = start_output_stream(out);
+        if (ret == 0) out_set_state(out, OUT_STATE_ACTIVE);
+    } else if (out->state == OUT_STATE_IDLE) {
+        // written again within the grace period, pcm and route are still set up
+        out->resume_count++;
+        if (out->pcm && !(out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER)) pcm_prepare(out->pcm);
+        out_set_state(out, OUT_STATE_ACTIVE);
+    }
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+    return ret;
+}
+
+// kernel buffer fill after a write, the deep buffer pcm_write restarts an underrun pcm silently
+// so an underrun shows up here as a started pcm that is not running
+static void out_sample_fill(struct ffhal_stream_out *out)
+{
+    struct timespec ts;
+    unsigned int    avail;
+
+    if (!out->pcm) return;
+    if (pcm_get_htimestamp(out->pcm, &avail, &ts) != 0) {
+        if (out->started && (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER)) astats_xrun(&out->stats, astats_now());
+        return;
+    }
+    astats_fill(&out->stats, avail < out->buffer_frames ? out->buffer_frames - avail : 0);
+}
+
+/* must be called with the output stream mutex locked, timestamp is CLOCK_MONOTONIC as every
+ * pcm is opened with PCM_MONOTONIC */
+static int out_get_position(struct ffhal_stream_out *out, uint64_t *frames, struct timespec *timestamp)
+{
+    // sampled before the kernel queue, a write finishing in between can only make the position lag
+    uint64_t     written = __atomic_load_n(&out->written, __ATOMIC_ACQUIRE);
+    unsigned int delay   = 0;
+    int          ret     = -1;
+
+    if (out->pcm) {
+        unsigned int avail;
+        if (pcm_get_htimestamp(out->pcm, &avail, timestamp) == 0) {
+            // frames still queued in kernel = granted buffer size - avail, the deep buffer can
+            // hold hundreds of ms so the requested size is not precise enough here
+            if (avail > out->buffer_frames) avail = out->buffer_frames; // underrun, nothing queued
+            delay = out->buffer_frames - avail;
+            ret   = 0;
+        }
+    } else if (out->track && out->state != OUT_STATE_STANDBY) {
+        ret = amixer_track_get_delay(out->track, &delay, timestamp);
+    }
+
+    if (ret == 0) {
+        // delay is counted at pcm rate, written at client rate
+        if (out->pcm_rate != out->sample_rate) delay = (uint64_t)delay * out->sample_rate / out->pcm_rate;
+        if (written >= delay) {
+            *frames = written - delay;
+        } else {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* latency test, the marker starts at client frame start. when it leaves the dac follows from the
+ * position right after it was queued, frames ahead of it not in the track ring any more are in
+ * the kernel buffer */
+static void out_time_marker(struct ffhal_stream_out *out, int64_t write_ns, uint64_t start)
+{
+    struct timespec ts;
+    uint64_t presented;
+    int64_t  ahead, ring = 0;
+    int      ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_position(out, &presented, &ts);
+    pthread_mutex_unlock(&out->lock);
+    if (ret != 0) {
+        // pcm not started yet, it plays after everything queued so far
+        presented = out->written > out->buffer_frames ? out->written - out->buffer_frames : 0;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    }
+    ahead = start > presented ? start - presented : 0;
+    if (out->track) {
+        ring = (int64_t)amixer_track_get_queued(out->track) * out->sample_rate / out->pcm_rate - (int64_t)(out->written - start);
+        if (ring < 0) ring = 0;
+        if (ring > ahead) ring = ahead;
+    }
+    alat_output_timing(out->dev->latency, write_ns, ts.tv_sec * 1000000000LL + ts.tv_nsec + ahead * 1000000000LL / out->sample_rate,
+        (int)(ahead - ring), out->sample_rate);
+}
+
+// compressed passthrough, every burst this write completes goes to the pcm. written counts frames
+// of the decoded stream, so positions are at the client rate as for pcm
+static int out_write_iec(struct ffhal_stream_out *out, const void *buffer, size_t bytes)
+{
+    const uint8_t *src = (const uint8_t *)buffer;
+    const int16_t *burst;
+    int            used, frames, ret = 0;
+
+    while (bytes > 0 && ret == 0) {
+        frames = aiec_pack(out->iec, src, bytes, &used, &burst);
+        src   += used;
+        bytes -= used;
+        if (frames > 0) {
+            ret = out_write_pcm(out, burst, frames);
+            if (ret == 0) __atomic_store_n(&out->written, out->written + (uint64_t)frames * out->sample_rate / out->pcm_rate, __ATOMIC_RELEASE);
+        }
+    }
+    return ret;
+}
+
+// the last e-ac3 group of the stream has no next header to close its burst
+static void out_flush_iec(struct ffhal_stream_out *out)
+{
+    const int16_t *burst;
+    int            frames = aiec_flush(out->iec, &burst);
+    if (frames > 0 && out_write_pcm(out, burst, frames) == 0) {
+        __atomic_store_n(&out->written, out->written + (uint64_t)frames * out->sample_rate / out->pcm_rate, __ATOMIC_RELEASE);
+    }
+}
+
+static int out_standby(struct audio_stream *stream)
+{
+    struct ffhal_stream_out   *out  = (struct ffhal_stream_out *)stream;
+    struct ffhal_audio_device *adev = out->dev;
+    int    status = 0;
+
+    // standby comes from the writer, which still owns the active stream and plays the last burst without the locks
+    if (out->iec && out_get_state(out) == OUT_STATE_ACTIVE) out_flush_iec(out);
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&out->lock);
+    // a mmap ring belongs to its client until standby, which gives it up at once
+    if (adev->standby_ms > 0 && !OUT_IS_MMAP(out)) {
+        out_standby_delayed(out);
+    } else {
+        status = do_output_standby(out);
+    }
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+
+    return status;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void *buffer, size_t bytes)
 {
     int    ret;
     struct ffhal_stream_out   *out  = (struct ffhal_stream_out *)stream;
-    struct ffhal_audio_device *adev = out->dev;
     size_t frame_size = audio_stream_out_frame_size(stream);
     size_t out_frames = bytes / frame_size;
-    int    kernel_frames;
-
-    /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-     * on the output stream mutex - e.g. executing select_mode() while holding the hw device
-     * mutex
+    uint32_t volume;
+    int64_t  marker_ns = 0;
+    int      marker    = -1;
+
+    /* an active stream is owned by its writer (the fast mixer thread for a FAST stream), the
+     * steady state takes no mutex at all. control paths never change an active stream, they
+     * publish volume and raise requests which are served here, so a write never waits behind
+     * routing or parameter changes. the state only leaves OUT_STATE_ACTIVE through out_standby,
+     * which audioflinger calls from the writer thread
      */
-    pthread_mutex_lock(&adev->lock);
-    pthread_mutex_lock(&out->lock);
-    if (out->standby) {
-        ret = start_output_stream(out);
+    if (out_get_state(out) != OUT_STATE_ACTIVE || __atomic_load_n(&out->request, __ATOMIC_ACQUIRE)) {
+        ret = out_resume(out);
         if (ret != 0) {
             ALOGD("failed to start output stream !");
-            pthread_mutex_unlock(&adev->lock);
             goto exit;
-        } else {
-            out->standby = 0;
         }
     }
-    pthread_mutex_unlock(&adev->lock);
+    if (!out->iec) astats_call(&out->stats, astats_now(), (int64_t)out_frames * 1000000000LL / out->sample_rate);
+    volume = __atomic_load_n(&out->volume, __ATOMIC_ACQUIRE);
+    if (volume != ((uint32_t)out->gainl | ((uint32_t)out->gainr << 16))) {
+        out_apply_volume(out, volume);
+    } else if (out->hw_volume && (out->hw_value[0] != out->hw_target[0] || out->hw_value[1] != out->hw_target[1])) {
+        step_hw_volume(out);
+    }
 
-    ret = pcm_mmap_write(out->pcm, buffer, out_frames * frame_size);
+    if (!out->iec && alat_output_wanted(out->dev->latency, out) && out->pcm_fmt == DSP_FMT_S16) {
+        if (out->marker_frames < out_frames) {
+            free(out->marker_buf);
+            out->marker_buf    = (int16_t*)malloc(out_frames * out->config.channels * sizeof(int16_t));
+            out->marker_frames = out->marker_buf ? out_frames : 0;
+        }
+        if (!out->marker_buf) {
+            ret = -ENOMEM;
+            goto exit;
+        }
+        // -1 when another stream claimed the test meanwhile, then the client data plays as is
+        marker = alat_output(out->dev->latency, out, out->marker_buf, out_frames, out->config.channels, out->sample_rate);
+        if (marker > 0) marker_ns = get_tick_ns();
+    }
+
+    if (out->iec) {
+        ret = out_write_iec(out, buffer, bytes);
+    } else if (marker >= 0) {
+        ret = out_write_s16(out, out->marker_buf, out_frames);
+    } else if (out->dsp_fmt == DSP_FMT_S16) {
+        ret = out_write_s16(out, (const int16_t *)buffer, out_frames);
+    } else {
+        ret = out_write_q31(out, buffer, out_frames);
+    }
     if (ret == 0) {
-        out->written += out_frames;
+        if (!out->iec) __atomic_store_n(&out->written, out->written + out_frames, __ATOMIC_RELEASE);
+        out_sample_fill(out);
+        if (marker_ns) out_time_marker(out, marker_ns, out->written - out_frames);
     }
 
 exit:
-    pthread_mutex_unlock(&out->lock);
     if (ret != 0) {
+        // the pcm or mixer is dead, counted and logged, then the caller is paced as if it had played
+        uint32_t errors = astats_error(&out->stats, ret);
+        if ((errors & (errors - 1)) == 0) ALOGE("out_write failed %d, %u failures so far !", ret, errors);
         usleep((int64_t)bytes * 1000000 / audio_stream_out_frame_size(stream) / out_get_sample_rate(&stream->common));
     }
 
@@ -326,26 +1188,30 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
                                    uint64_t *frames, struct timespec *timestamp)
 {
     struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
-    int ret = -1;
-
-    if (out->pcm) {
-        unsigned int avail;
-        if (pcm_get_htimestamp(out->pcm, &avail, timestamp) == 0) {
-            size_t kernel_buffer_size = out->config.period_size * out->config.period_count;
-            int64_t signed_frames = out->written - kernel_buffer_size + avail;
-            if (signed_frames >= 0) {
-                *frames = signed_frames;
-                ret = 0;
-            }
-        }
-    }
+    uint64_t     written;
+    int          ret;
 
+    // the writer does not hold the stream mutex, it only keeps the standby thread from closing the pcm here
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_position(out, &written, timestamp);
+    pthread_mutex_unlock(&out->lock);
+    if (ret == 0) *frames = written;
     return ret;
 }
 
+// frames presented since the stream left standby, wraps like the 32bit dsp counter it stands for
 static int out_get_render_position(const struct audio_stream_out *stream, uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    struct timespec ts;
+    uint64_t        frames;
+    int             ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_position(out, &frames, &ts);
+    if (ret == 0) *dsp_frames = (uint32_t)(frames > out->start_written ? frames - out->start_written : 0);
+    pthread_mutex_unlock(&out->lock);
+    return ret == 0 ? 0 : -EINVAL;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -363,15 +1229,131 @@ static int out_get_next_write_timestamp(const struct audio_stream_out *stream, i
     return -EINVAL;
 }
 
+#ifdef FFHAL_MMAP
+// opens the pcm and leaves the stream active with its ring owned by the client, until standby
+static int out_create_mmap_buffer(const struct audio_stream_out *stream, int32_t min_size_frames,
+                                  struct audio_mmap_buffer_info *info)
+{
+    struct ffhal_stream_out   *out  = (struct ffhal_stream_out *)stream;
+    struct ffhal_audio_device *adev = out->dev;
+    int    ret = -ENOSYS;
+
+    if (!info || min_size_frames <= 0) return -EINVAL;
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&out->lock);
+    if (OUT_IS_MMAP(out) && out->state == OUT_STATE_STANDBY) {
+        mmap_config(&out->config, min_size_frames);
+        ret = start_output_stream(out);
+        if (ret == 0) {
+            out_set_state(out, OUT_STATE_ACTIVE);
+            // the codec pcm opened, so the mixer had none. it waits until standby gives it back
+            // and the streams on it fail their writes at once meanwhile
+            out->mixer_held = !(adev->out_devices & AUDIO_DEVICE_OUT_AUX_DIGITAL);
+            if (out->mixer_held) amixer_hold(adev->mixer, 1);
+            ret = mmap_get_info(out->pcm, 1, info);
+            if (ret != 0) do_output_standby(out);
+        }
+    } else if (OUT_IS_MMAP(out)) {
+        ret = -EBUSY;
+    }
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+    return ret;
+}
+
+static int out_get_mmap_position(const struct audio_stream_out *stream, struct audio_mmap_position *position)
+{
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    int    ret;
+    if (!OUT_IS_MMAP(out) || !position) return -ENOSYS;
+    pthread_mutex_lock(&out->lock);
+    ret = mmap_get_position(out->pcm, position);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_start(const struct audio_stream_out *stream)
+{
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    int    ret = -ENOSYS;
+    if (!OUT_IS_MMAP(out)) return ret;
+    pthread_mutex_lock(&out->lock);
+    if (out->pcm && !out->started) {
+        ret = pcm_start(out->pcm) == 0 ? 0 : -EIO;
+        out->started = ret == 0;
+    } else {
+        ret = out->pcm ? 0 : -EINVAL;
+    }
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_stop(const struct audio_stream_out *stream)
+{
+    struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
+    if (!OUT_IS_MMAP(out)) return -ENOSYS;
+    pthread_mutex_lock(&out->lock);
+    if (out->pcm && out->started) pcm_stop(out->pcm);
+    out->started = 0;
+    pthread_mutex_unlock(&out->lock);
+    return 0;
+}
+#endif
+
 /** audio_stream_in implementation **/
+static size_t get_input_period_frames(uint32_t rate)
+{
+    /* same period duration at every rate, rounded to the multiple of 16 frames audioflinger expects */
+    size_t size = (size_t)CAPTURE_PERIOD_SIZE * rate / CAPTURE_SAMPLE_RATE;
+    return ((size + 15) / 16) * 16;
+}
+
 static int start_input_stream(struct ffhal_stream_in *in)
 {
     struct ffhal_audio_device *adev = in->dev;
+    int    convert = in->config.rate != in->sample_rate || in->config.channels != in->channels;
 
-    in->pcm = pcm_open(0, PORT_CODEC, PCM_IN, &in->config);
+    if (convert && !in->pcm_buf) {
+        int cvt_size = in->config.period_size;
+        if (in->config.rate != in->sample_rate) {
+            in->src  = asrc_init(in->config.rate, in->sample_rate, in->config.channels, in->channels);
+            cvt_size = in->src ? asrc_max_out(in->src, in->config.period_size) : 0;
+        }
+        in->pcm_buf = (int16_t*)malloc(in->config.period_size * in->config.channels * sizeof(int16_t));
+        in->cvt_buf = (int16_t*)malloc(cvt_size * in->channels * sizeof(int16_t));
+        if (!cvt_size || !in->pcm_buf || !in->cvt_buf) {
+            asrc_close(in->src);
+            free(in->pcm_buf);
+            free(in->cvt_buf);
+            in->src     = NULL;
+            in->pcm_buf = NULL;
+            in->cvt_buf = NULL;
+            return -ENOMEM;
+        }
+    }
+    asrc_reset(in->src);
+    in->config.period_count = adev->adapt[ADAPT_MIC].periods;
+    in->run_xruns   = __atomic_load_n(&in->stats.xruns, __ATOMIC_ACQUIRE);
+    in->run_start   = get_tick_ns();
+    in->cvt_frames  = 0;
+    in->frames_read = 0;
+    memset(&in->last_ts, 0, sizeof(in->last_ts));
+
+    if (in->use_thread) {
+        in->capture = acap_init(CARD_CODEC, PORT_CODEC, &in->config, in->config.period_size * CAPTURE_RING_PERIODS);
+        if (in->capture) {
+            adev->active_input = in;
+            select_device(adev);
+            return 0;
+        }
+        ALOGW("failed to start capture thread, fall back to blocking read !");
+    }
+
+    in->pcm = pcm_open(0, PORT_CODEC, PCM_IN | PCM_MONOTONIC, &in->config);
     if (!pcm_is_ready(in->pcm)) {
         ALOGE("cannot open pcm_in driver: %s", pcm_get_error(in->pcm));
         pcm_close(in->pcm);
+        in->pcm = NULL;
         adev->active_input = NULL;
         return -ENOMEM;
     } else {
@@ -384,7 +1366,8 @@ static int start_input_stream(struct ffhal_stream_in *in)
 
 static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
-    return CAPTURE_SAMPLE_RATE;
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    return in->sample_rate;
 }
 
 static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -394,17 +1377,14 @@ static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
 
 static size_t in_get_buffer_size(const struct audio_stream *stream)
 {
-    /* return the closest majoring multiple of 16 frames, as
-     * audioflinger expects audio buffers to be a multiple of 16 frames */
-    size_t size = CAPTURE_PERIOD_SIZE;
-    size = ((size + 15) / 16) * 16;
-    return size * audio_stream_in_frame_size((struct audio_stream_in *)stream);
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    return get_input_period_frames(in->sample_rate) * audio_stream_in_frame_size((struct audio_stream_in *)stream);
 }
 
 static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
 {
     struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
-    if (in->config.channels == 1) {
+    if (in->channels == 1) {
         return AUDIO_CHANNEL_IN_MONO;
     } else {
         return AUDIO_CHANNEL_IN_STEREO;
@@ -413,7 +1393,8 @@ static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
 
 static audio_format_t in_get_format(const struct audio_stream *stream)
 {
-    return AUDIO_FORMAT_PCM_16_BIT;
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    return in->format;
 }
 
 static int in_set_format(struct audio_stream *stream, audio_format_t format)
@@ -427,9 +1408,21 @@ static int do_input_standby(struct ffhal_stream_in *in)
     struct ffhal_audio_device *adev = in->dev;
 
     if (!in->standby) {
-        pcm_close(in->pcm);
+        // the capture thread counts its own overruns, a blocking read finds them from position gaps
+        uint32_t xruns = in->capture ? acap_xruns(in->capture) : __atomic_load_n(&in->stats.xruns, __ATOMIC_ACQUIRE) - in->run_xruns;
+        if (!IN_IS_MMAP(in)) adapt_update(&adev->adapt[ADAPT_MIC], ADAPT_MIC, xruns, get_tick_ns() - in->run_start);
+        // frames still pending in kernel are dropped, the next run continues from what was reported
+        in->pos_base += (in->frames_read > in->pos_last ? in->frames_read : in->pos_last) * in->sample_rate / in->config.rate;
+        in->pos_last  = 0;
+        if (in->capture) {
+            acap_close(in->capture);
+        } else {
+            pcm_close(in->pcm);
+        }
         in->standby        = 1;
+        in->started        = 0;
         in->pcm            = NULL;
+        in->capture        = NULL;
         adev->active_input = NULL;
         adev->in_devices   = AUDIO_DEVICE_NONE;
         select_device(adev);
@@ -439,19 +1432,26 @@ static int do_input_standby(struct ffhal_stream_in *in)
 
 static int in_standby(struct audio_stream *stream)
 {
-    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    struct ffhal_stream_in    *in   = (struct ffhal_stream_in *)stream;
+    struct ffhal_audio_device *adev = in->dev;
     int    status;
 
-//  pthread_mutex_lock(&in->dev->lock);
+    // same order as out_standby, the mic adaptation and the route belong to the device
+    pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&in->lock);
     status = do_input_standby(in);
     pthread_mutex_unlock(&in->lock);
-//  pthread_mutex_unlock(&in->dev->lock);
+    pthread_mutex_unlock(&adev->lock);
     return status;
 }
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    dprintf(fd, "input %p: %u Hz, %u channels, %s, %u frames lost not reported yet\n", in, in->sample_rate, in->channels,
+        in->standby ? "standby" : "active", __atomic_load_n(&in->frames_lost, __ATOMIC_RELAXED));
+    astats_dump(&in->stats, fd, "  ");
+    acap_dump(in->capture, fd);
     return 0;
 }
 
@@ -470,27 +1470,152 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
     return -ENOSYS;
 }
 
+static int in_read_pcm(struct ffhal_stream_in *in, void *buffer, size_t frames)
+{
+    int ret;
+    if (in->capture) {
+        ret = acap_read(in->capture, buffer, frames);
+    } else {
+        ret = pcm_read(in->pcm, buffer, frames * in->config.channels * sizeof(int16_t));
+    }
+    if (ret == 0) in->frames_read += frames;
+    return ret;
+}
+
+// read pcm periods and convert rate and channels in one pass, keep the frames left over for next call
+static int in_read_converted(struct ffhal_stream_in *in, int16_t *buffer, int frames)
+{
+    int done = 0, n, ret;
+    while (done < frames) {
+        if (in->cvt_frames == 0) {
+            ret = in_read_pcm(in, in->pcm_buf, in->config.period_size);
+            if (ret != 0) return ret;
+            if (in->src) {
+                in->cvt_frames = asrc_process(in->src, in->pcm_buf, in->config.period_size, in->cvt_buf);
+            } else {
+                dsp_remix_s16(in->cvt_buf, in->channels, in->pcm_buf, in->config.channels, in->config.period_size);
+                in->cvt_frames = in->config.period_size;
+            }
+            in->cvt_pos = 0;
+        }
+        n = frames - done < in->cvt_frames ? frames - done : in->cvt_frames;
+        memcpy(buffer + done * in->channels, in->cvt_buf + in->cvt_pos * in->channels, n * in->channels * sizeof(int16_t));
+        in->cvt_pos    += n;
+        in->cvt_frames -= n;
+        done           += n;
+    }
+    return 0;
+}
+
+// hardware capture position should advance with the clock, a shortfall means the pcm overran
+// and tinyalsa silently restarted it, count the gap as lost frames
+static void in_update_frames_lost(struct ffhal_stream_in *in)
+{
+    struct timespec ts;
+    unsigned int    avail;
+    uint64_t        pos;
+
+    // capture thread knows exactly how much it dropped
+    if (in->capture) {
+        uint32_t lost = acap_frames_lost(in->capture);
+        if (lost) __atomic_add_fetch(&in->frames_lost, (uint32_t)((uint64_t)lost * in->sample_rate / in->config.rate), __ATOMIC_RELAXED);
+        return;
+    }
+    if (pcm_get_htimestamp(in->pcm, &avail, &ts) != 0) return;
+    astats_fill(&in->stats, avail);
+    pos = in->frames_read + avail;
+    if (in->last_ts.tv_sec || in->last_ts.tv_nsec) {
+        int64_t ns       = (ts.tv_sec - in->last_ts.tv_sec) * 1000000000LL + (ts.tv_nsec - in->last_ts.tv_nsec);
+        int64_t expected = ns * in->config.rate / 1000000000LL;
+        int64_t gap      = expected - (int64_t)(pos - in->last_pos);
+        if (gap > (int64_t)in->config.period_size) {
+            astats_xrun(&in->stats, astats_now());
+            __atomic_add_fetch(&in->frames_lost, (uint32_t)(gap * in->sample_rate / in->config.rate), __ATOMIC_RELAXED);
+        }
+    }
+    in->last_ts  = ts;
+    in->last_pos = pos;
+}
+
+/* must be called with the input stream mutex locked, pcm frames captured in this run at the
+ * CLOCK_MONOTONIC timestamp */
+static int in_get_position(struct ffhal_stream_in *in, uint64_t *frames, struct timespec *ts)
+{
+    unsigned int avail;
+    if (in->capture) return acap_get_position(in->capture, frames, ts) == 0 ? 0 : -ENOSYS;
+    if (in->pcm && pcm_get_htimestamp(in->pcm, &avail, ts) == 0) {
+        *frames = in->frames_read + avail;
+        return 0;
+    }
+    return -ENOSYS;
+}
+
+// latency test, the capture time of buffer[0] is back from the capture position by what was
+// captured after it, converted frames not returned yet included
+static void in_feed_marker(struct ffhal_stream_in *in, const int16_t *buffer, int frames)
+{
+    struct timespec ts;
+    uint64_t pos;
+    int64_t  first;
+    if (in_get_position(in, &pos, &ts) != 0) return;
+    first = (int64_t)in->frames_read - (int64_t)(in->cvt_frames + frames) * in->config.rate / in->sample_rate;
+    alat_input(in->dev->latency, buffer, frames, in->channels, in->sample_rate,
+        ts.tv_sec * 1000000000LL + ts.tv_nsec - ((int64_t)pos - first) * 1000000000LL / in->config.rate);
+}
+
+static int in_read_s16(struct ffhal_stream_in *in, int16_t *buffer, int frames)
+{
+    int ret = in->pcm_buf ? in_read_converted(in, buffer, frames) : in_read_pcm(in, buffer, frames);
+    if (ret == 0 && alat_input_wanted(in->dev->latency)) in_feed_marker(in, buffer, frames);
+    return ret;
+}
+
+// capture is 16bit, widening to the client format is exact so no dither is needed
+static int in_read_q31(struct ffhal_stream_in *in, void *buffer, int frames)
+{
+    uint8_t *dst   = (uint8_t *)buffer;
+    int      chunk = get_input_period_frames(in->sample_rate);
+    int      fsize = in->channels * dsp_fmt_bytes(in->dsp_fmt);
+    int      done, n, ret = 0;
+
+    for (done = 0; done < frames && ret == 0; done += n) {
+        n   = frames - done < chunk ? frames - done : chunk;
+        ret = in_read_s16(in, in->fmt_buf, n);
+        dsp_to_q31  (in->q31_buf, in->fmt_buf, DSP_FMT_S16, n * in->channels);
+        dsp_from_q31(dst + done * fsize, in->dsp_fmt, in->q31_buf, n * in->channels, NULL);
+    }
+    return ret;
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void *buffer, size_t bytes)
 {
     int ret = 0;
     struct ffhal_stream_in    *in   = (struct ffhal_stream_in *)stream;
     struct ffhal_audio_device *adev = in->dev;
 
-    pthread_mutex_lock(&adev->lock);
+    /* like out_write, the hw device mutex is only taken to leave standby */
     pthread_mutex_lock(&in->lock);
     if (in->standby) {
-        ret = start_input_stream(in);
+        pthread_mutex_unlock(&in->lock);
+        pthread_mutex_lock(&adev->lock);
+        pthread_mutex_lock(&in->lock);
+        ret = in->standby ? start_input_stream(in) : 0;
+        pthread_mutex_unlock(&adev->lock);
         if (ret != 0) {
             ALOGD("failed to start input stream !");
-            pthread_mutex_unlock(&adev->lock);
             goto exit;
-        } else {
-            in->standby = 0;
         }
+        in->standby = 0;
+        astats_break(&in->stats);
     }
-    pthread_mutex_unlock(&adev->lock);
+    astats_call(&in->stats, astats_now(), (int64_t)(bytes / audio_stream_in_frame_size(stream)) * 1000000000LL / in->sample_rate);
 
-    ret = pcm_read(in->pcm, buffer, bytes);
+    if (in->dsp_fmt == DSP_FMT_S16) {
+        ret = in_read_s16(in, (int16_t *)buffer, bytes / audio_stream_in_frame_size(stream));
+    } else {
+        ret = in_read_q31(in, buffer, bytes / audio_stream_in_frame_size(stream));
+    }
+    if (ret == 0) in_update_frames_lost(in);
     if (adev->mic_mute) {
         memset(buffer, 0, bytes);
     }
@@ -498,16 +1623,117 @@ static ssize_t in_read(struct audio_stream_in *stream, void *buffer, size_t byte
 exit:
     pthread_mutex_unlock(&in->lock);
     if (ret < 0) {
+        uint32_t errors = astats_error(&in->stats, ret);
+        if ((errors & (errors - 1)) == 0) ALOGE("in_read failed %d, %u failures so far !", ret, errors);
         usleep((int64_t)bytes * 1000000 / audio_stream_in_frame_size(stream) /
                 in_get_sample_rate(&stream->common));
     }
     return bytes;
 }
 
-static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
+// client frames captured by hardware since open, not going back across standby
+static int in_get_capture_position(const struct audio_stream_in *stream, int64_t *frames, int64_t *time)
+{
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    struct timespec ts;
+    uint64_t        pos;
+    int             ret;
+
+    pthread_mutex_lock(&in->lock);
+    ret = in_get_position(in, &pos, &ts);
+    if (ret == 0) {
+        if (pos < in->pos_last) pos = in->pos_last;
+        in->pos_last = pos;
+        *frames = (int64_t)(in->pos_base + pos * in->sample_rate / in->config.rate);
+        *time   = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+#ifdef FFHAL_MMAP
+// the mmap capture pcm runs at the client rate and channels, checked at open, nothing is converted
+static int in_create_mmap_buffer(const struct audio_stream_in *stream, int32_t min_size_frames,
+                                 struct audio_mmap_buffer_info *info)
+{
+    struct ffhal_stream_in    *in   = (struct ffhal_stream_in *)stream;
+    struct ffhal_audio_device *adev = in->dev;
+    int    ret = -ENOSYS;
+
+    if (!info || min_size_frames <= 0) return -EINVAL;
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&in->lock);
+    if (IN_IS_MMAP(in) && in->standby) {
+        mmap_config(&in->config, min_size_frames);
+        in->pcm = pcm_open(CARD_CODEC, PORT_CODEC, PCM_IN | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC, &in->config);
+        if (!pcm_is_ready(in->pcm)) {
+            ALOGE("cannot open mmap pcm_in driver: %s", pcm_get_error(in->pcm));
+            pcm_close(in->pcm);
+            in->pcm = NULL;
+            ret     = -ENODEV;
+        } else {
+            in->standby        = 0;
+            in->started        = 0;
+            in->frames_read    = 0;
+            in->run_xruns      = __atomic_load_n(&in->stats.xruns, __ATOMIC_ACQUIRE);
+            in->run_start      = get_tick_ns();
+            adev->active_input = in;
+            select_device(adev);
+            ret = mmap_get_info(in->pcm, 0, info);
+            if (ret != 0) do_input_standby(in);
+        }
+    } else if (IN_IS_MMAP(in)) {
+        ret = -EBUSY;
+    }
+    pthread_mutex_unlock(&in->lock);
+    pthread_mutex_unlock(&adev->lock);
+    return ret;
+}
+
+static int in_get_mmap_position(const struct audio_stream_in *stream, struct audio_mmap_position *position)
+{
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    int    ret;
+    if (!IN_IS_MMAP(in) || !position) return -ENOSYS;
+    pthread_mutex_lock(&in->lock);
+    ret = mmap_get_position(in->pcm, position);
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+static int in_start(const struct audio_stream_in *stream)
+{
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    int    ret = -ENOSYS;
+    if (!IN_IS_MMAP(in)) return ret;
+    pthread_mutex_lock(&in->lock);
+    if (in->pcm && !in->started) {
+        ret = pcm_start(in->pcm) == 0 ? 0 : -EIO;
+        in->started = ret == 0;
+    } else {
+        ret = in->pcm ? 0 : -EINVAL;
+    }
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+static int in_stop(const struct audio_stream_in *stream)
 {
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    if (!IN_IS_MMAP(in)) return -ENOSYS;
+    pthread_mutex_lock(&in->lock);
+    if (in->pcm && in->started) pcm_stop(in->pcm);
+    in->started = 0;
+    pthread_mutex_unlock(&in->lock);
     return 0;
 }
+#endif
+
+static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
+{
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
+    return __atomic_exchange_n(&in->frames_lost, 0, __ATOMIC_RELAXED);
+}
 
 static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
@@ -529,6 +1755,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 {
     struct ffhal_audio_device *adev = (struct ffhal_audio_device *)dev;
     struct ffhal_stream_out   *out;
+    int    i;
 
     out = (struct ffhal_stream_out *)calloc(1, sizeof(struct ffhal_stream_out));
     if (!out) {
@@ -536,10 +1763,20 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     }
 
     out->config.channels     = PLAYBACK_CHANNEL_NUM;
-    out->config.rate         = PLAYBACK_SAMPLE_RATE;
+    out->config.rate         = adev->mixer_rate;
     out->config.format       = PCM_FORMAT_S16_LE;
-    out->config.period_size  = PLAYBACK_PERIOD_SIZE;
-    out->config.period_count = PLAYBACK_PERIOD_COUNT;
+    if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        out->config.period_size     = FAST_PERIOD_SIZE;
+        out->config.period_count    = FAST_PERIOD_COUNT;
+        out->config.start_threshold = FAST_PERIOD_SIZE; // start as soon as the first period is written
+        out->config.avail_min       = FAST_PERIOD_SIZE;
+    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        out->config.period_size     = DEEP_PERIOD_SIZE;
+        out->config.period_count    = DEEP_PERIOD_COUNT;
+    } else {
+        out->config.period_size     = PLAYBACK_PERIOD_SIZE;
+        out->config.period_count    = PLAYBACK_PERIOD_COUNT;
+    }
 
     out->stream.common.get_sample_rate      = out_get_sample_rate;
     out->stream.common.set_sample_rate      = out_set_sample_rate;
@@ -559,14 +1796,126 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.get_render_position         = out_get_render_position;
     out->stream.get_next_write_timestamp    = out_get_next_write_timestamp;
     out->stream.get_presentation_position   = out_get_presentation_position;
+#ifdef FFHAL_MMAP
+    out->stream.start                       = out_start;
+    out->stream.stop                        = out_stop;
+    out->stream.create_mmap_buffer          = out_create_mmap_buffer;
+    out->stream.get_mmap_position           = out_get_mmap_position;
+#endif
 
     out->dev             = adev;
-    out->standby         = 1;
+    out->flags           = flags;
+    out->state           = OUT_STATE_STANDBY;
+    out->volume          = DSP_GAIN_UNITY | (DSP_GAIN_UNITY << 16);
+    out->gainl           = DSP_GAIN_UNITY;
+    out->gainr           = DSP_GAIN_UNITY;
+    dsp_gain_init(&out->gain, DSP_GAIN_UNITY, DSP_GAIN_UNITY);
+
+    // any rate in range is accepted, it is resampled to the mixer rate or played natively on hdmi
+    out->sample_rate = adev->mixer_rate;
+    if (config->sample_rate >= PLAYBACK_MIN_RATE && config->sample_rate <= PLAYBACK_MAX_RATE) {
+        out->sample_rate = config->sample_rate;
+    }
+    out->pcm_rate = out->config.rate;
+
+    // 5.1 and 7.1 run their own pcm on hdmi at the client rate, when the sink takes that layout
+    if ((flags & AUDIO_OUTPUT_FLAG_DIRECT) && !(flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) &&
+        (config->channel_mask == AUDIO_CHANNEL_OUT_5POINT1 || config->channel_mask == AUDIO_CHANNEL_OUT_7POINT1)) {
+        int        channels = audio_channel_count_from_out_mask(config->channel_mask);
+        AHDMI_CAPS caps;
+        ahdmi_get_caps(CARD_HDMI, PORT_HDMI, &caps);
+        if (!ahdmi_rate_supported(&caps, channels, out->sample_rate)) {
+            ALOGE("hdmi sink does not take %d channels at %u Hz !", channels, out->sample_rate);
+            free(out);
+            return -EINVAL;
+        }
+        out->config.channels = channels;
+        out->config.rate     = out->sample_rate;
+        out->pcm_rate        = out->sample_rate;
+    }
+
+#ifdef FFHAL_MMAP
+    // the client writes the pcm ring itself, so the pcm has to run at what the client asked for
+    if (OUT_IS_MMAP(out)) {
+        int card = (devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) ? CARD_HDMI : CARD_CODEC;
+        int port = (devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) ? PORT_HDMI : PORT_CODEC;
+        if ((config->format != AUDIO_FORMAT_DEFAULT && config->format != AUDIO_FORMAT_PCM_16_BIT) || (config->channel_mask && config->channel_mask != AUDIO_CHANNEL_OUT_STEREO) ||
+            !pcm_rate_supported(card, port, out->sample_rate)) {
+            config->sample_rate  = adev->mixer_rate;
+            config->channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+            config->format       = AUDIO_FORMAT_PCM_16_BIT;
+            free(out);
+            return -EINVAL;
+        }
+        out->config.rate = out->sample_rate;
+        out->pcm_rate    = out->sample_rate;
+        mmap_config(&out->config, MMAP_PERIOD_SIZE * MMAP_MIN_PERIOD_COUNT);
+    }
+#endif
+
+    // float and 24/32bit are converted in the hal, the mixer and most sinks are 16bit
+    out->format  = AUDIO_FORMAT_PCM_16_BIT;
+    out->dsp_fmt = DSP_FMT_S16;
+    if (get_dsp_format(config->format) > DSP_FMT_S16) {
+        out->format  = config->format;
+        out->dsp_fmt = get_dsp_format(config->format);
+        out->q31_buf = (int32_t*)malloc(ASRC_BLOCK * out->config.channels * sizeof(int32_t));
+        out->fmt_buf = (int16_t*)malloc(ASRC_BLOCK * out->config.channels * sizeof(int16_t));
+        if (!out->q31_buf || !out->fmt_buf) {
+            free(out->q31_buf);
+            free(out->fmt_buf);
+            free(out);
+            return -ENOMEM;
+        }
+        dsp_dither_init(&out->dither, (uint32_t)(uintptr_t)out);
+    }
+
+    // ac3, e-ac3 and dts are wrapped in IEC61937 bursts for the sink to decode, a pcm carrying e-ac3
+    // runs at 4 times the stream rate
+    if ((flags & AUDIO_OUTPUT_FLAG_DIRECT) && get_iec_codec(config->format) >= 0) {
+        int codec = get_iec_codec(config->format);
+        if (!pcm_rate_supported(CARD_HDMI, PORT_HDMI, out->sample_rate * aiec_rate_factor(codec))) {
+            ALOGE("hdmi can not carry format %#x at %u Hz !", config->format, out->sample_rate);
+            free(out);
+            return -EINVAL;
+        }
+        out->iec = aiec_init(codec);
+        if (!out->iec) {
+            free(out);
+            return -ENOMEM;
+        }
+        out->format              = config->format;
+        out->config.rate         = out->sample_rate * aiec_rate_factor(codec);
+        out->config.period_size  = aiec_period(codec);
+        out->config.period_count = PLAYBACK_PERIOD_COUNT;
+        out->pcm_rate            = out->config.rate;
+    }
+
+    // stereo pcm can be mixed after conversion to 16bit, others go to their own pcm
+    if (adev->mixer && out->config.channels == PLAYBACK_CHANNEL_NUM && !out->iec && !OUT_IS_MMAP(out)) {
+        out->track = amixer_track_open(adev->mixer, (flags & AUDIO_OUTPUT_FLAG_FAST) ? AMIXER_TRACK_FAST :
+                                       (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) ? AMIXER_TRACK_DEEP : 0,
+                                       out->config.period_size * out->config.period_count);
+    }
 
     config->format       = out_get_format(&out->stream.common);
     config->channel_mask = out_get_channels(&out->stream.common);
     config->sample_rate  = out_get_sample_rate(&out->stream.common);
 
+    pthread_mutex_lock(&adev->lock);
+    for (i=0; i<MAX_OUTPUT_STREAMS && adev->outputs[i]; i++);
+    if (i < MAX_OUTPUT_STREAMS) adev->outputs[i] = out;
+    pthread_mutex_unlock(&adev->lock);
+    if (i == MAX_OUTPUT_STREAMS) {
+        ALOGE("too many output streams !");
+        amixer_track_close(out->track);
+        aiec_close(out->iec);
+        free(out->q31_buf);
+        free(out->fmt_buf);
+        free(out);
+        return -ENOMEM;
+    }
+
     *stream_out = &out->stream;
 
     return 0;
@@ -577,18 +1926,64 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
 {
     struct ffhal_stream_out *out = (struct ffhal_stream_out *)stream;
     struct ffhal_audio_device *adev = out->dev;
-    out_standby(&stream->common);
+    int    i;
+
+    pthread_mutex_lock(&adev->lock);
+    for (i=0; i<MAX_OUTPUT_STREAMS; i++) {
+        if (adev->outputs[i] == out) adev->outputs[i] = NULL;
+    }
+    pthread_mutex_lock(&out->lock);
+    do_output_standby(out);
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+    alat_output_close(adev->latency, out);
+
+    amixer_track_close(out->track);
+    asrc_close(out->src);
+    free(out->src_buf);
+    free(out->gain_buf);
+    free(out->marker_buf);
+    aiec_close(out->iec);
+    free(out->q31_buf);
+    free(out->fmt_buf);
     free(stream);
 }
 
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 {
-    return -ENOSYS;
+    struct ffhal_audio_device *adev = (struct ffhal_audio_device *)dev;
+    struct str_parms *parms;
+    char   value[32];
+    int    ret = -ENOSYS;
+
+    parms = str_parms_create_str(kvpairs);
+    if (!parms) return -EINVAL;
+
+    // the next 16bit output buffer carries the marker, the result is read back with get_parameters
+    if (str_parms_get_str(parms, AUDIO_PARAMETER_LATENCY_TEST, value, sizeof(value)) >= 0) {
+        if (strcmp(value, "start") == 0) {
+            alat_start(adev->latency);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+
+    str_parms_destroy(parms);
+    return ret;
 }
 
 static char * adev_get_parameters(const struct audio_hw_device *dev, const char *keys)
 {
-    return strdup("");
+    struct ffhal_audio_device *adev = (struct ffhal_audio_device *)dev;
+    struct str_parms *parms = str_parms_create_str(keys);
+    char   value[256] = "";
+
+    if (parms && str_parms_has_key(parms, AUDIO_PARAMETER_LATENCY_TEST)) {
+        alat_result(adev->latency, value, sizeof(value));
+    }
+    if (parms) str_parms_destroy(parms);
+    return strdup(value);
 }
 
 static int adev_init_check(const struct audio_hw_device *dev)
@@ -642,7 +2037,8 @@ static int adev_get_mic_mute(const struct audio_hw_device *dev, bool *state)
 
 static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev, const struct audio_config *config)
 {
-    return CAPTURE_PERIOD_SIZE * CAPTURE_CHANNEL_NUM * sizeof(int16_t);
+    size_t sample_size = get_dsp_format(config->format) < 0 ? sizeof(int16_t) : audio_bytes_per_sample(config->format);
+    return get_input_period_frames(config->sample_rate) * audio_channel_count_from_in_mask(config->channel_mask) * sample_size;
 }
 
 static int adev_open_input_stream(struct audio_hw_device *dev,
@@ -650,7 +2046,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         audio_devices_t devices,
         struct audio_config *config,
         struct audio_stream_in **stream_in,
-        audio_input_flags_t flags __unused,
+        audio_input_flags_t flags,
         const char *address __unused,
         audio_source_t source __unused)
 {
@@ -658,16 +2054,75 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     struct ffhal_stream_in    *in;
     int    ret;
 
+    struct pcm_params         *params;
+    uint32_t rate     = config->sample_rate ? config->sample_rate : CAPTURE_SAMPLE_RATE;
+    uint32_t channels = config->channel_mask ? audio_channel_count_from_in_mask(config->channel_mask) : CAPTURE_CHANNEL_NUM;
+
+    if (rate < CAPTURE_MIN_RATE || rate > CAPTURE_MAX_RATE || channels < 1 || channels > 2 ||
+        (config->format != AUDIO_FORMAT_DEFAULT && get_dsp_format(config->format) < 0)) {
+        config->sample_rate  = CAPTURE_SAMPLE_RATE;
+        config->channel_mask = AUDIO_CHANNEL_IN_MONO;
+        config->format       = AUDIO_FORMAT_PCM_16_BIT;
+        return -EINVAL;
+    }
+
     in = (struct ffhal_stream_in *)calloc(1, sizeof(struct ffhal_stream_in));
     if (!in) {
         return -ENOMEM;
     }
+    in->sample_rate = rate;
+    in->channels    = channels;
+    in->format      = config->format == AUDIO_FORMAT_DEFAULT ? AUDIO_FORMAT_PCM_16_BIT : config->format;
+    in->dsp_fmt     = get_dsp_format(in->format);
+    if (in->dsp_fmt != DSP_FMT_S16) {
+        in->fmt_buf = (int16_t*)malloc(get_input_period_frames(rate) * channels * sizeof(int16_t));
+        in->q31_buf = (int32_t*)malloc(get_input_period_frames(rate) * channels * sizeof(int32_t));
+        if (!in->fmt_buf || !in->q31_buf) {
+            free(in->fmt_buf);
+            free(in->q31_buf);
+            free(in);
+            return -ENOMEM;
+        }
+    }
 
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.sys.audio.capthread", value, "0");
+    in->use_thread = atoi(value);
+
+    // run the pcm at the requested rate and channels when the codec can, convert otherwise
     in->config.channels     = CAPTURE_CHANNEL_NUM;
     in->config.rate         = CAPTURE_SAMPLE_RATE;
+    params = pcm_params_get(CARD_CODEC, PORT_CODEC, PCM_IN);
+    if (params) {
+        if (rate >= pcm_params_get_min(params, PCM_PARAM_RATE) && rate <= pcm_params_get_max(params, PCM_PARAM_RATE)) {
+            in->config.rate = rate;
+        }
+        if (channels >= pcm_params_get_min(params, PCM_PARAM_CHANNELS) && channels <= pcm_params_get_max(params, PCM_PARAM_CHANNELS)) {
+            in->config.channels = channels;
+        }
+        pcm_params_free(params);
+    }
     in->config.format       = PCM_FORMAT_S16_LE;
-    in->config.period_size  = CAPTURE_PERIOD_SIZE;
-    in->config.period_count = CAPTURE_PERIOD_COUNT;
+    in->config.period_size  = get_input_period_frames(in->config.rate);
+    in->config.period_count = adev->adapt[ADAPT_MIC].periods;
+    in->flags               = flags;
+
+#ifdef FFHAL_MMAP
+    // the client reads the pcm ring itself, so the codec has to capture exactly what it asked for
+    if (IN_IS_MMAP(in)) {
+        if (in->config.rate != rate || in->config.channels != channels || in->dsp_fmt != DSP_FMT_S16) {
+            config->sample_rate  = in->config.rate;
+            config->channel_mask = in->config.channels == 1 ? AUDIO_CHANNEL_IN_MONO : AUDIO_CHANNEL_IN_STEREO;
+            config->format       = AUDIO_FORMAT_PCM_16_BIT;
+            free(in->fmt_buf);
+            free(in->q31_buf);
+            free(in);
+            return -EINVAL;
+        }
+        in->use_thread = 0;
+        mmap_config(&in->config, MMAP_PERIOD_SIZE * MMAP_MIN_PERIOD_COUNT);
+    }
+#endif
 
     in->stream.common.get_sample_rate     = in_get_sample_rate;
     in->stream.common.set_sample_rate     = in_set_sample_rate;
@@ -684,30 +2139,74 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.set_gain                   = in_set_gain;
     in->stream.read                       = in_read;
     in->stream.get_input_frames_lost      = in_get_input_frames_lost;
+    in->stream.get_capture_position       = in_get_capture_position;
+#ifdef FFHAL_MMAP
+    in->stream.start                      = in_start;
+    in->stream.stop                       = in_stop;
+    in->stream.create_mmap_buffer         = in_create_mmap_buffer;
+    in->stream.get_mmap_position          = in_get_mmap_position;
+#endif
 
     in->dev     = adev;
     in->standby = 1;
 
+    config->sample_rate  = in->sample_rate;
+    config->channel_mask = in_get_channels(&in->stream.common);
+    config->format       = in->format;
+
     *stream_in = &in->stream;
     return 0;
 }
 
 static void adev_close_input_stream(struct audio_hw_device *dev, struct audio_stream_in *stream)
 {
+    struct ffhal_stream_in *in = (struct ffhal_stream_in *)stream;
     in_standby(&stream->common);
+    asrc_close(in->src);
+    free(in->pcm_buf);
+    free(in->cvt_buf);
+    free(in->fmt_buf);
+    free(in->q31_buf);
     free(stream);
     return;
 }
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct ffhal_audio_device *adev = (struct ffhal_audio_device *)device;
+    int    i;
+
+    // audioflinger only dumps the device, so every open stream is dumped from here
+    pthread_mutex_lock(&adev->lock);
+    dprintf(fd, "ffhal: out devices %#x, in devices %#x, %d active outputs, standby grace %d ms\n",
+        adev->out_devices, adev->in_devices, adev->active_outputs, adev->standby_ms);
+    dprintf(fd, "adaptive pcm depth: hdmi %d, codec %d, mic %d periods\n",
+        adev->adapt[ADAPT_HDMI].periods, adev->adapt[ADAPT_CODEC].periods, adev->adapt[ADAPT_MIC].periods);
+    for (i=0; i<MAX_OUTPUT_STREAMS; i++) {
+        if (adev->outputs[i]) out_dump(&adev->outputs[i]->stream.common, fd);
+    }
+    if (adev->active_input) in_dump(&adev->active_input->stream.common, fd);
+    amixer_dump(adev->mixer, fd);
+    apath_dump(adev->apath, fd);
+    pthread_mutex_unlock(&adev->lock);
     return 0;
 }
 
 static int adev_close(hw_device_t *device)
 {
     struct ffhal_audio_device *adev = (struct ffhal_audio_device *)device;
-    audio_route_free(adev->aroute);
+    if (adev->standby_ms > 0) {
+        pthread_mutex_lock(&adev->lock);
+        adev->standby_exit = 1;
+        pthread_cond_signal(&adev->standby_cond);
+        pthread_mutex_unlock(&adev->lock);
+        pthread_join(adev->standby_thread, NULL);
+    }
+    pthread_cond_destroy(&adev->standby_cond);
+    amixer_close(adev->mixer);
+    if (adev->hw_mixer) mixer_close(adev->hw_mixer);
+    apath_close(adev->apath);
+    alat_close(adev->latency);
     free(device);
     return 0;
 }
@@ -715,7 +2214,8 @@ static int adev_close(hw_device_t *device)
 static int adev_open(const hw_module_t* module, const char* name, hw_device_t** device)
 {
     struct ffhal_audio_device *adev;
-    int    ret;
+    char   value[PROPERTY_VALUE_MAX];
+    int    ret, i;
 
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
         return -EINVAL;
@@ -749,8 +2249,61 @@ static int adev_open(const hw_module_t* module, const char* name, hw_device_t**
 
     adev->out_devices = AUDIO_DEVICE_NONE;
     adev->in_devices  = AUDIO_DEVICE_NONE;
+    for (i=0; i<ADAPT_NUM; i++) adapt_init(&adev->adapt[i], i);
+    adev->latency = alat_init();
+
+    adev->apath = apath_init(CARD_MIXER, AUDIO_PATH_XML, AUDIO_PATH_BIN);
+    for (i=0; i<OUT_DEVICE_TAB_SIZE; i++) {
+        adev->route_out[i] = apath_find(adev->apath, normal_route_configs[i]);
+    }
+    adev->route_spk_off = apath_find(adev->apath, "media-speaker-off");
+    adev->route_mic     = apath_find(adev->apath, "media-main-mic");
+
+    // the codec runs at 48kHz when it can, so 48kHz streams are mixed without resampling
+    adev->mixer_rate = pcm_rate_supported(CARD_CODEC, PORT_CODEC, MIXER_SAMPLE_RATE) ? MIXER_SAMPLE_RATE : PLAYBACK_SAMPLE_RATE;
+    struct pcm_config mixer_config = {
+        .channels     = PLAYBACK_CHANNEL_NUM,
+        .rate         = adev->mixer_rate,
+        .period_size  = MIXER_PERIOD_SIZE,
+        .period_count = MIXER_PERIOD_COUNT,
+        .format       = PCM_FORMAT_S16_LE,
+    };
+    property_get("persist.sys.audio.ramp_ms", value, "");
+    adev->ramp_ms = value[0] ? atoi(value) : AUDIO_RAMP_MS;
+    if (adev->ramp_ms < 0) adev->ramp_ms = 0;
+    adev->mixer = amixer_init(CARD_CODEC, PORT_CODEC, &mixer_config, ramp_frames(adev, mixer_config.rate));
+
+    property_get("persist.sys.audio.standby_ms", value, "");
+    adev->standby_ms = value[0] ? atoi(value) : AUDIO_STANDBY_MS;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->standby_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (adev->standby_ms > 0 && pthread_create(&adev->standby_thread, NULL, standby_thread_proc, adev) != 0) {
+        ALOGW("failed to create standby thread, standby is not delayed !");
+        adev->standby_ms = 0;
+    }
 
-    adev->aroute = audio_route_init(CARD_MIXER, AUDIO_PATH_XML);
+    // name of a codec playback volume control, when set a stream owning the codec pcm uses it for set_volume.
+    // tinyalsa has no tlv access, so its dB range comes with it as "min,max" in 0.01dB, -6300,0 for
+    // a control of 1dB steps. without the range the volume stays in software
+    property_get("persist.sys.audio.volume_ctl", value, "");
+    if (value[0] && (adev->hw_mixer = mixer_open(CARD_CODEC))) {
+        char range[PROPERTY_VALUE_MAX];
+        adev->volume_ctl = mixer_get_ctl_by_name(adev->hw_mixer, value);
+        property_get("persist.sys.audio.volume_ctl_db", range, "");
+        if (adev->volume_ctl && sscanf(range, "%d,%d", &adev->volume_range.db_min, &adev->volume_range.db_max) == 2
+            && adev->volume_range.db_min < adev->volume_range.db_max) {
+            adev->volume_range.min = mixer_ctl_get_range_min(adev->volume_ctl);
+            adev->volume_range.max = mixer_ctl_get_range_max(adev->volume_ctl);
+        } else {
+            ALOGW("volume control %s %s, volume is done in software !", value, adev->volume_ctl ? "has no dB range" : "not found");
+            adev->volume_ctl = NULL;
+            mixer_close(adev->hw_mixer);
+            adev->hw_mixer = NULL;
+        }
+    }
 
     *device = &adev->hw_device.common;
     return 0;
@@ -0,0 +1,327 @@
+#define LOG_TAG "audio_iec61937"
+
+// 包含头文件
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cutils/log.h>
+#include "audio_iec61937.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define AIEC_NEON  1
+#endif
+
+// 内部常量定义
+#define AIEC_PA          0xF872  // burst preamble sync words
+#define AIEC_PB          0x4E1F
+#define AIEC_PREAMBLE    8       // bytes of Pa Pb Pc Pd
+#define AIEC_MAX_HEADER  8       // codec frame header bytes needed to know the frame size
+#define AIEC_EAC3_BLOCKS 6       // audio blocks in one e-ac3 burst
+
+// Pc data types
+#define AIEC_TYPE_AC3    1
+#define AIEC_TYPE_DTS1   11      // 512 frames
+#define AIEC_TYPE_DTS2   12      // 1024 frames
+#define AIEC_TYPE_DTS3   13      // 2048 frames
+#define AIEC_TYPE_EAC3   21
+
+// 内部类型定义
+typedef struct {
+    int size;        // bytes
+    int period;      // frames of the burst carrying it
+    int type;
+    int blocks;      // audio blocks, e-ac3 bursts are closed at six
+    int independent; // an e-ac3 dependent substream stays in the burst of its independent frame
+    int swap;        // big endian 16bit words are sent byte swapped
+} AIEC_FRAME;
+
+typedef struct {
+    int         codec;
+    uint8_t    *burst;      // preamble and payload, AIEC_MAX_PERIOD frames and room for a header after it
+    int         period;     // of the burst being built
+    int         type;
+    int         swap;
+    int         blocks;
+    int         fill;       // payload bytes
+    int         frame;      // payload offset of the codec frame being collected
+    int         frame_size; // 0 while its header is incomplete
+    int         skip;       // bytes left of a dropped frame
+    AIEC_FRAME  cur;
+    uint8_t     carry[AIEC_MAX_HEADER]; // header of the frame after a burst handed out
+    int         carry_len;
+    uint32_t    bursts;
+    uint32_t    dropped;    // frames with a bad header or too big for a burst
+    uint32_t    skipped;    // bytes skipped looking for a sync word
+} AIEC;
+
+// frame sizes of ac3, frmsizecod / 2 indexes the bitrate
+static const uint16_t g_ac3_kbps     [19] = { 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 576, 640 };
+static const uint16_t g_ac3_words_44k[19] = { 69, 87, 104, 121, 139, 174, 208, 243, 278, 348, 417, 487, 557, 696, 835, 975, 1114, 1253, 1393 };
+static const uint8_t  g_eac3_blocks  [4]  = { 1, 2, 3, 6 };
+
+// 内部函数实现
+static int aiec_header_len(int codec)
+{
+    return codec == AIEC_DTS ? 8 : 6;
+}
+
+// the first n bytes of a header match a sync word
+static int aiec_sync(int codec, const uint8_t *h, int n)
+{
+    static const uint8_t ac3[2] = { 0x0b, 0x77 }, dts_be[4] = { 0x7f, 0xfe, 0x80, 0x01 }, dts_le[4] = { 0xfe, 0x7f, 0x01, 0x80 };
+    if (codec != AIEC_DTS) return memcmp(h, ac3, n < 2 ? n : 2) == 0;
+    if (n > 4) n = 4;
+    return memcmp(h, dts_be, n) == 0 || memcmp(h, dts_le, n) == 0;
+}
+
+static int aiec_parse(int codec, const uint8_t *h, AIEC_FRAME *f)
+{
+    int bsid;
+    memset(f, 0, sizeof(*f));
+    f->independent = 1;
+    f->swap        = 1;
+
+    if (codec == AIEC_DTS) {
+        uint8_t b[AIEC_MAX_HEADER];
+        int     i, nblks;
+        // little endian words already are in pcm byte order
+        f->swap = h[0] == 0x7f;
+        for (i=0; i<AIEC_MAX_HEADER; i++) b[i] = f->swap ? h[i] : h[i ^ 1];
+        nblks     = ((b[4] & 1) << 6) | (b[5] >> 2);
+        f->size   = (((b[5] & 3) << 12) | (b[6] << 4) | (b[7] >> 4)) + 1;
+        f->period = (nblks + 1) * 32;
+        f->blocks = 1;
+        switch (f->period) {
+        case 512 : f->type = AIEC_TYPE_DTS1; break;
+        case 1024: f->type = AIEC_TYPE_DTS2; break;
+        case 2048: f->type = AIEC_TYPE_DTS3; break;
+        default  : return -1;
+        }
+        return f->size >= 96 ? 0 : -1;
+    }
+
+    bsid = h[5] >> 3;
+    if (bsid <= 10) {
+        int fscod = h[4] >> 6, code = h[4] & 0x3f;
+        if (fscod == 3 || code >= 38) return -1;
+        if (fscod == 0) f->size = g_ac3_kbps[code >> 1] * 4;
+        if (fscod == 1) f->size = (g_ac3_words_44k[code >> 1] + (code & 1)) * 2;
+        if (fscod == 2) f->size = g_ac3_kbps[code >> 1] * 6;
+        f->blocks = AIEC_EAC3_BLOCKS;
+        // an e-ac3 stream may carry an ac3 core, it goes in an e-ac3 burst like any six block frame
+        f->type   = codec == AIEC_EAC3 ? AIEC_TYPE_EAC3 : AIEC_TYPE_AC3;
+        f->period = codec == AIEC_EAC3 ? AIEC_MAX_PERIOD : 1536;
+        return 0;
+    }
+    if (bsid > 16 || codec != AIEC_EAC3) return -1;
+    f->size        = ((((h[2] & 7) << 8) | h[3]) + 1) * 2;
+    f->blocks      = (h[4] >> 6) == 3 ? AIEC_EAC3_BLOCKS : g_eac3_blocks[(h[4] >> 4) & 3];
+    f->independent = (h[2] >> 6) != 1;
+    f->type        = AIEC_TYPE_EAC3;
+    f->period      = AIEC_MAX_PERIOD;
+    return f->size >= AIEC_MAX_HEADER ? 0 : -1;
+}
+
+static void aiec_swap16(uint8_t *buf, int bytes)
+{
+    int i = 0;
+#ifdef AIEC_NEON
+    for (; i + 16 <= bytes; i += 16) vst1q_u8(buf + i, vrev16q_u8(vld1q_u8(buf + i)));
+#endif
+    for (; i + 4 <= bytes; i += 4) {
+        uint32_t w;
+        memcpy(&w, buf + i, 4);
+        w = ((w >> 8) & 0x00ff00ff) | ((w << 8) & 0xff00ff00);
+        memcpy(buf + i, &w, 4);
+    }
+    for (; i + 2 <= bytes; i += 2) {
+        uint8_t t = buf[i];
+        buf[i]     = buf[i + 1];
+        buf[i + 1] = t;
+    }
+}
+
+// the payload is swapped in place once, padded with zeros to the repetition period
+static int aiec_finish(AIEC *iec, int len, const int16_t **burst)
+{
+    uint16_t *pre  = (uint16_t*)iec->burst;
+    int       even = (len + 1) & ~1;
+
+    if (len & 1) iec->burst[AIEC_PREAMBLE + len] = 0;
+    if (iec->swap) aiec_swap16(iec->burst + AIEC_PREAMBLE, even);
+    memset(iec->burst + AIEC_PREAMBLE + even, 0, iec->period * 4 - AIEC_PREAMBLE - even);
+    pre[0] = AIEC_PA;
+    pre[1] = AIEC_PB;
+    pre[2] = iec->type;
+    pre[3] = iec->type == AIEC_TYPE_EAC3 ? len : len * 8; // e-ac3 length is in bytes, the others in bits
+
+    iec->bursts++;
+    iec->fill       = 0;
+    iec->frame      = 0;
+    iec->frame_size = 0;
+    *burst = (const int16_t*)iec->burst;
+    return iec->period;
+}
+
+/* the header of the frame at iec->frame is complete. return 1 when it closes the burst before it,
+ * the header is carried over to the next burst then */
+static int aiec_open_frame(AIEC *iec)
+{
+    uint8_t *hdr = iec->burst + AIEC_PREAMBLE + iec->frame;
+    int      hlen = aiec_header_len(iec->codec);
+
+    if (aiec_parse(iec->codec, hdr, &iec->cur) != 0) {
+        // a false sync or a broken frame, hunt again after its header
+        if ((iec->dropped++ & 63) == 0) ALOGW("bad frame header, %u frames dropped so far", iec->dropped);
+        iec->fill = iec->frame;
+        return 0;
+    }
+    if (iec->frame > 0 && iec->cur.independent && (iec->blocks >= AIEC_EAC3_BLOCKS
+        || iec->frame + iec->cur.size > iec->period * 4 - AIEC_PREAMBLE)) {
+        memcpy(iec->carry, hdr, hlen);
+        iec->carry_len = hlen;
+        return 1;
+    }
+    if (iec->frame == 0 && !iec->cur.independent) {
+        // joined the stream in the middle of a frame group, wait for its next independent frame
+        iec->skip = iec->cur.size - hlen;
+        iec->fill = 0;
+        return 0;
+    }
+    if (iec->frame == 0) {
+        iec->period = iec->cur.period;
+        iec->type   = iec->cur.type;
+        iec->swap   = iec->cur.swap;
+        iec->blocks = 0;
+    }
+    if (iec->frame + iec->cur.size > iec->period * 4 - AIEC_PREAMBLE) {
+        if ((iec->dropped++ & 63) == 0) ALOGW("frame of %d bytes does not fit a burst, %u frames dropped so far", iec->cur.size, iec->dropped);
+        iec->skip = iec->cur.size - hlen;
+        iec->fill = iec->frame;
+        return 0;
+    }
+    if (iec->cur.independent) iec->blocks += iec->cur.blocks;
+    iec->frame_size = iec->cur.size;
+    return 0;
+}
+
+// 函数实现
+void* aiec_init(int codec)
+{
+    AIEC *iec = (AIEC*)calloc(1, sizeof(AIEC));
+    if (!iec) return NULL;
+    iec->codec = codec;
+    iec->burst = (uint8_t*)malloc(AIEC_MAX_PERIOD * 4 + AIEC_MAX_HEADER);
+    if (!iec->burst) {
+        free(iec);
+        return NULL;
+    }
+    return iec;
+}
+
+void aiec_close(void *ctxt)
+{
+    AIEC *iec = (AIEC*)ctxt;
+    if (!iec) return;
+    free(iec->burst);
+    free(iec);
+}
+
+void aiec_reset(void *ctxt)
+{
+    AIEC *iec = (AIEC*)ctxt;
+    if (!iec) return;
+    iec->fill       = 0;
+    iec->frame      = 0;
+    iec->frame_size = 0;
+    iec->skip       = 0;
+    iec->carry_len  = 0;
+}
+
+int aiec_period(int codec)
+{
+    return codec == AIEC_AC3 ? 1536 : codec == AIEC_EAC3 ? AIEC_MAX_PERIOD : 512;
+}
+
+int aiec_rate_factor(int codec)
+{
+    return codec == AIEC_EAC3 ? 4 : 1;
+}
+
+int aiec_pack(void *ctxt, const void *data, int bytes, int *used, const int16_t **burst)
+{
+    AIEC          *iec     = (AIEC*)ctxt;
+    const uint8_t *src     = (const uint8_t*)data;
+    uint8_t       *payload = iec->burst + AIEC_PREAMBLE;
+    int            hlen    = aiec_header_len(iec->codec);
+    int            pos     = 0, n;
+
+    if (iec->carry_len) {
+        memcpy(payload, iec->carry, iec->carry_len);
+        iec->fill      = iec->carry_len;
+        iec->carry_len = 0;
+        aiec_open_frame(iec);
+    }
+
+    while (pos < bytes) {
+        if (iec->skip) {
+            n = bytes - pos < iec->skip ? bytes - pos : iec->skip;
+            iec->skip -= n;
+            pos       += n;
+            continue;
+        }
+        if (iec->frame_size == 0) {
+            // the header is collected byte by byte, only while hunting does this run longer than a header
+            n = iec->fill - iec->frame;
+            payload[iec->fill++] = src[pos++];
+            if (!aiec_sync(iec->codec, payload + iec->frame, n + 1)) {
+                iec->skipped += n + 1;
+                iec->fill     = iec->frame;
+                if (n > 0 && aiec_sync(iec->codec, src + pos - 1, 1)) {
+                    payload[iec->fill++] = src[pos - 1];
+                    iec->skipped--;
+                }
+                continue;
+            }
+            if (n + 1 == hlen && aiec_open_frame(iec)) {
+                *used = pos;
+                return aiec_finish(iec, iec->frame, burst);
+            }
+            continue;
+        }
+
+        n = iec->frame + iec->frame_size - iec->fill;
+        if (n > bytes - pos) n = bytes - pos;
+        memcpy(payload + iec->fill, src + pos, n);
+        iec->fill += n;
+        pos       += n;
+        if (iec->fill == iec->frame + iec->frame_size) {
+            // ac3 and dts frames make a burst each, e-ac3 waits for the next independent frame
+            if (iec->codec != AIEC_EAC3) {
+                *used = pos;
+                return aiec_finish(iec, iec->fill, burst);
+            }
+            iec->frame      = iec->fill;
+            iec->frame_size = 0;
+        }
+    }
+    *used = pos;
+    return 0;
+}
+
+int aiec_flush(void *ctxt, const int16_t **burst)
+{
+    AIEC *iec = (AIEC*)ctxt;
+    // only a complete group between frames, a dependent frame of it could still be on its way otherwise
+    if (!iec || iec->codec != AIEC_EAC3 || iec->carry_len || iec->frame == 0 || iec->frame_size
+        || iec->fill != iec->frame || iec->blocks < AIEC_EAC3_BLOCKS) return 0;
+    return aiec_finish(iec, iec->frame, burst);
+}
+
+void aiec_dump(void *ctxt, int fd)
+{
+    AIEC *iec = (AIEC*)ctxt;
+    if (!iec) return;
+    dprintf(fd, "  iec61937: %u bursts, %u frames dropped, %u bytes skipped for sync\n", iec->bursts, iec->dropped, iec->skipped);
+}
@@ -0,0 +1,31 @@
+#ifndef __AUDIO_IEC61937_H__
+#define __AUDIO_IEC61937_H__
+
+#include <stdint.h>
+
+// 常量定义
+enum {
+    AIEC_AC3,   // AUDIO_FORMAT_AC3, bursts of 1536 frames at the stream rate
+    AIEC_EAC3,  // AUDIO_FORMAT_E_AC3, bursts of 6144 frames at 4 times the stream rate
+    AIEC_DTS,   // AUDIO_FORMAT_DTS, 16bit big or little endian core, bursts of 512 to 2048 frames
+};
+
+#define AIEC_MAX_PERIOD  6144  // frames of the longest burst
+
+// 函数声明
+// IEC61937 packer for compressed passthrough, the bitstream is cut into codec frames and every
+// frame (six audio blocks for e-ac3) becomes one data burst of 16bit stereo frames for an hdmi pcm
+void* aiec_init  (int codec);
+void  aiec_close (void *ctxt);
+void  aiec_reset (void *ctxt); // drop a partly collected burst, after standby
+int   aiec_period(int codec);  // frames of a typical burst, for sizing the pcm
+int   aiec_rate_factor(int codec); // pcm rate over stream rate
+// consume up to bytes of bitstream, *used tells how many. return the frames of a burst completed
+// on the way, which *burst points to until the next call, or 0 when all bytes went in
+int   aiec_pack  (void *ctxt, const void *data, int bytes, int *used, const int16_t **burst);
+// an e-ac3 burst is closed by the header of the next group, at the end of the stream the last
+// group of six blocks is closed here instead. return its frames like aiec_pack, or 0
+int   aiec_flush (void *ctxt, const int16_t **burst);
+void  aiec_dump  (void *ctxt, int fd);
+
+#endif
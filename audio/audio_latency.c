@@ -0,0 +1,344 @@
+#define LOG_TAG "audio_latency"
+
+// 包含头文件
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cutils/log.h>
+#include "audio_latency.h"
+
+// 内部常量定义
+#define ALAT_MARKER_MS   20      // chirp length, long enough to stand out of room noise
+#define ALAT_F0          500.0   // Hz, chirp start
+#define ALAT_F1          3000.0  // Hz, chirp end, well below the nyquist of the lowest codec rate
+#define ALAT_LEVEL       16384   // -6dBFS
+#define ALAT_THRESHOLD   0.5     // normalized correlation needed to accept a peak
+#define ALAT_MIN_ENERGY  1e-6    // below this the window is silence, nothing to correlate
+
+enum {
+    ALAT_IDLE,
+    ALAT_ARMED,     // waiting for the first output buffer
+    ALAT_INJECTING, // marker spans several output buffers
+    ALAT_WAITING,   // marker played, searching capture
+    ALAT_DONE,
+    ALAT_FAILED,
+};
+
+// 内部类型定义
+typedef struct {
+    pthread_mutex_t lock;
+    int          state;       // written under lock, read lock-free by the audio threads
+    int64_t      start_ns;
+    const char  *error;
+
+    int16_t     *marker;      // output side, at output rate
+    int          marker_len;
+    int          marker_rate;
+    int          marker_pos;
+    void        *owner;       // output stream that claimed the armed test, the only one injecting
+    int64_t      write_ns;    // marker start handed to the hal
+    int64_t      play_ns;     // marker start leaves the dac, predicted from the output position
+    double       out_hal_ms;
+    double       out_kernel_ms;
+
+    float       *tmpl;        // input side, at input rate
+    float       *hist;        // last tmpl_len capture samples, hist_pos is the oldest
+    int          tmpl_len;
+    int          tmpl_rate;
+    double       tmpl_energy;
+    double       hist_energy;
+    int          hist_pos;
+    int          hist_fill;
+    int          input_seen;
+    double       peak;        // best normalized correlation so far
+    int64_t      peak_ns;     // capture time of the marker start at that peak
+    int          peak_age;    // samples since the peak, it is final when no better one came for a marker length
+
+    double       total_ms;
+    double       codec_ms;
+    double       in_ms;
+} ALAT;
+
+// 内部函数实现
+static int64_t get_tick_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// hann windowed linear chirp, its autocorrelation has a single narrow peak unlike a tone burst
+static float* alat_make_chirp(int rate, int *len)
+{
+    int    n = rate * ALAT_MARKER_MS / 1000, i;
+    double t = (double)n / rate;
+    float *chirp = (float*)malloc(n * sizeof(float));
+    if (!chirp) return NULL;
+    for (i=0; i<n; i++) {
+        double x = (double)i / rate;
+        double w = 0.5 - 0.5 * cos(2 * M_PI * i / (n - 1));
+        chirp[i] = (float)(w * sin(2 * M_PI * (ALAT_F0 * x + (ALAT_F1 - ALAT_F0) * x * x / (2 * t))));
+    }
+    *len = n;
+    return chirp;
+}
+
+static void alat_set_state(ALAT *lat, int state)
+{
+    __atomic_store_n(&lat->state, state, __ATOMIC_RELEASE);
+}
+
+static void alat_fail(ALAT *lat, const char *error)
+{
+    lat->error = error;
+    alat_set_state(lat, ALAT_FAILED);
+    ALOGW("latency test failed: %s", error);
+}
+
+static int alat_prepare_input(ALAT *lat, int rate)
+{
+    int i;
+    if (lat->tmpl && lat->tmpl_rate == rate) return 0;
+    free(lat->tmpl);
+    free(lat->hist);
+    lat->hist = NULL;
+    lat->tmpl = alat_make_chirp(rate, &lat->tmpl_len);
+    if (lat->tmpl) lat->hist = (float*)calloc(lat->tmpl_len, sizeof(float));
+    if (!lat->hist) return -1;
+    lat->tmpl_rate   = rate;
+    lat->tmpl_energy = 0;
+    for (i=0; i<lat->tmpl_len; i++) lat->tmpl_energy += lat->tmpl[i] * lat->tmpl[i];
+    lat->hist_energy = 0;
+    lat->hist_pos    = 0;
+    lat->hist_fill   = 0;
+    return 0;
+}
+
+static double alat_correlate(ALAT *lat)
+{
+    int    len  = lat->tmpl_len, head = len - lat->hist_pos, i;
+    float *tmpl = lat->tmpl, *hist = lat->hist;
+    double sum  = 0;
+    // hist is a ring, oldest sample at hist_pos lines up with tmpl[0]
+    for (i=0; i<head; i++) sum += tmpl[i] * hist[lat->hist_pos + i];
+    for (i=head; i<len; i++) sum += tmpl[i] * hist[i - head];
+    return sum;
+}
+
+// 函数实现
+void* alat_init(void)
+{
+    ALAT *lat = (ALAT*)calloc(1, sizeof(ALAT));
+    if (!lat) return NULL;
+    pthread_mutex_init(&lat->lock, NULL);
+    return lat;
+}
+
+void alat_close(void *ctxt)
+{
+    ALAT *lat = (ALAT*)ctxt;
+    if (!lat) return;
+    free(lat->marker);
+    free(lat->tmpl);
+    free(lat->hist);
+    pthread_mutex_destroy(&lat->lock);
+    free(lat);
+}
+
+void alat_start(void *ctxt)
+{
+    ALAT *lat = (ALAT*)ctxt;
+    if (!lat) return;
+    pthread_mutex_lock(&lat->lock);
+    lat->start_ns   = get_tick_ns();
+    lat->error      = NULL;
+    lat->input_seen = 0;
+    lat->peak       = 0;
+    lat->hist_fill  = 0;
+    __atomic_store_n(&lat->owner, NULL, __ATOMIC_RELEASE);
+    alat_set_state(lat, ALAT_ARMED);
+    pthread_mutex_unlock(&lat->lock);
+    ALOGD("latency test started");
+}
+
+int alat_output_wanted(void *ctxt, void *owner)
+{
+    ALAT *lat = (ALAT*)ctxt;
+    int   state;
+    if (!lat) return 0;
+    state = __atomic_load_n(&lat->state, __ATOMIC_ACQUIRE);
+    return state == ALAT_ARMED || (state == ALAT_INJECTING && __atomic_load_n(&lat->owner, __ATOMIC_ACQUIRE) == owner);
+}
+
+int alat_output(void *ctxt, void *owner, int16_t *buf, int frames, int ch, int rate)
+{
+    ALAT *lat   = (ALAT*)ctxt;
+    int   first = 0, i, j;
+
+    pthread_mutex_lock(&lat->lock);
+    if (lat->state == ALAT_ARMED) {
+        if (!lat->marker || lat->marker_rate != rate) {
+            float *chirp = alat_make_chirp(rate, &lat->marker_len);
+            free(lat->marker);
+            lat->marker = chirp ? (int16_t*)malloc(lat->marker_len * sizeof(int16_t)) : NULL;
+            if (lat->marker) for (i=0; i<lat->marker_len; i++) lat->marker[i] = (int16_t)(chirp[i] * ALAT_LEVEL);
+            lat->marker_rate = rate;
+            free(chirp);
+        }
+        if (!lat->marker) {
+            alat_fail(lat, "no memory");
+            pthread_mutex_unlock(&lat->lock);
+            return -1;
+        }
+        lat->marker_pos = 0;
+        __atomic_store_n(&lat->owner, owner, __ATOMIC_RELEASE);
+        alat_set_state(lat, ALAT_INJECTING);
+        first = 1;
+    }
+    if (lat->state != ALAT_INJECTING || lat->owner != owner) {
+        // another stream claimed the marker, or it is already played
+        pthread_mutex_unlock(&lat->lock);
+        return -1;
+    }
+
+    // the client data is replaced, silence after the marker keeps the correlation clean
+    for (i=0; i<frames; i++) {
+        int16_t s = lat->marker_pos < lat->marker_len ? lat->marker[lat->marker_pos++] : 0;
+        for (j=0; j<ch; j++) *buf++ = s;
+    }
+    if (lat->marker_pos >= lat->marker_len) alat_set_state(lat, ALAT_WAITING);
+    pthread_mutex_unlock(&lat->lock);
+    return first;
+}
+
+void alat_output_close(void *ctxt, void *owner)
+{
+    ALAT *lat = (ALAT*)ctxt;
+    if (!lat) return;
+    pthread_mutex_lock(&lat->lock);
+    if (lat->owner == owner) {
+        if (lat->state == ALAT_INJECTING) alat_fail(lat, "output closed");
+        __atomic_store_n(&lat->owner, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lat->lock);
+}
+
+void alat_output_timing(void *ctxt, int64_t write_ns, int64_t play_ns, int kernel_frames, int rate)
+{
+    ALAT *lat = (ALAT*)ctxt;
+    pthread_mutex_lock(&lat->lock);
+    lat->write_ns      = write_ns;
+    lat->play_ns       = play_ns;
+    lat->out_kernel_ms = kernel_frames * 1000.0 / rate;
+    // includes the time the write blocked on a full ring or kernel buffer
+    lat->out_hal_ms    = (play_ns - write_ns) / 1000000.0 - lat->out_kernel_ms;
+    if (lat->out_hal_ms < 0) lat->out_hal_ms = 0;
+    pthread_mutex_unlock(&lat->lock);
+}
+
+int alat_input_wanted(void *ctxt)
+{
+    ALAT *lat = (ALAT*)ctxt;
+    int   state;
+    if (!lat) return 0;
+    state = __atomic_load_n(&lat->state, __ATOMIC_ACQUIRE);
+    return state == ALAT_INJECTING || state == ALAT_WAITING;
+}
+
+void alat_input(void *ctxt, const int16_t *buf, int frames, int ch, int rate, int64_t capture_ns)
+{
+    ALAT   *lat = (ALAT*)ctxt;
+    int64_t now = get_tick_ns();
+    int     i, k;
+
+    pthread_mutex_lock(&lat->lock);
+    if (lat->state != ALAT_INJECTING && lat->state != ALAT_WAITING) goto done;
+    if (alat_prepare_input(lat, rate) != 0) {
+        alat_fail(lat, "no memory");
+        goto done;
+    }
+    lat->input_seen = 1;
+
+    for (i=0; i<frames; i++, buf+=ch) {
+        float  x   = buf[0] / 32768.0f, old = lat->hist[lat->hist_pos];
+        double ncc;
+        lat->hist[lat->hist_pos] = x;
+        if (++lat->hist_pos == lat->tmpl_len) {
+            lat->hist_pos = 0;
+            // running sum drifts with float rounding, recompute once per window
+            lat->hist_energy = 0;
+            for (k=0; k<lat->tmpl_len; k++) lat->hist_energy += lat->hist[k] * lat->hist[k];
+        } else {
+            lat->hist_energy += x * x - old * old;
+        }
+        if (lat->hist_fill < lat->tmpl_len) {
+            lat->hist_fill++;
+            continue;
+        }
+
+        if (lat->peak > 0) lat->peak_age++;
+        if (lat->hist_energy > ALAT_MIN_ENERGY) {
+            ncc = alat_correlate(lat) / sqrt(lat->tmpl_energy * lat->hist_energy);
+            if (ncc > ALAT_THRESHOLD && ncc > lat->peak) {
+                // window ends at sample i, the marker started tmpl_len - 1 samples before
+                lat->peak     = ncc;
+                lat->peak_ns  = capture_ns + (int64_t)(i - lat->tmpl_len + 1) * 1000000000LL / rate;
+                lat->peak_age = 0;
+            }
+        }
+
+        if (lat->peak > 0 && lat->peak_age >= lat->tmpl_len && lat->state == ALAT_WAITING) {
+            // the client reads the rest of this buffer now, what it waited since capture is input buffering
+            lat->in_ms    = (now - capture_ns) / 1000000.0 - (double)(frames - 1) * 1000.0 / rate;
+            lat->codec_ms = (lat->peak_ns - lat->play_ns) / 1000000.0;
+            lat->total_ms = (lat->peak_ns - lat->write_ns) / 1000000.0 + lat->in_ms;
+            alat_set_state(lat, ALAT_DONE);
+            ALOGD("latency test: total %.2fms, out hal %.2fms, out kernel %.2fms, codec %.2fms, in %.2fms, peak %.2f",
+                lat->total_ms, lat->out_hal_ms, lat->out_kernel_ms, lat->codec_ms, lat->in_ms, lat->peak);
+            break;
+        }
+    }
+
+done:
+    pthread_mutex_unlock(&lat->lock);
+}
+
+int alat_result(void *ctxt, char *str, int size)
+{
+    ALAT *lat = (ALAT*)ctxt;
+    int   ret;
+    if (!lat) return snprintf(str, size, "latency_test=failed;latency_error=not available");
+
+    pthread_mutex_lock(&lat->lock);
+    if (lat->state >= ALAT_ARMED && lat->state <= ALAT_WAITING && get_tick_ns() - lat->start_ns > ALAT_TIMEOUT_MS * 1000000LL) {
+        if (lat->state == ALAT_ARMED) {
+            alat_fail(lat, "no output written");
+        } else if (!lat->input_seen) {
+            alat_fail(lat, "no input read");
+        } else {
+            alat_fail(lat, "marker not found in capture");
+        }
+    }
+
+    switch (lat->state) {
+    case ALAT_IDLE:
+        ret = snprintf(str, size, "latency_test=idle");
+        break;
+    case ALAT_DONE:
+        ret = snprintf(str, size, "latency_test=done;latency_total_ms=%.2f;latency_out_hal_ms=%.2f;latency_out_kernel_ms=%.2f;"
+            "latency_codec_ms=%.2f;latency_in_ms=%.2f;latency_peak=%.2f",
+            lat->total_ms, lat->out_hal_ms, lat->out_kernel_ms, lat->codec_ms, lat->in_ms, lat->peak);
+        break;
+    case ALAT_FAILED:
+        ret = snprintf(str, size, "latency_test=failed;latency_error=%s", lat->error);
+        break;
+    default:
+        ret = snprintf(str, size, "latency_test=running");
+        break;
+    }
+    pthread_mutex_unlock(&lat->lock);
+    return ret;
+}
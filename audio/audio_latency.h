@@ -0,0 +1,28 @@
+#ifndef __AUDIO_LATENCY_H__
+#define __AUDIO_LATENCY_H__
+
+#include <stdint.h>
+
+// 常量定义
+#define ALAT_TIMEOUT_MS  3000  // a measurement fails when the marker was not found by then
+
+// 函数声明
+// round trip latency measurement, a chirp marker replaces the start of one output buffer and is
+// found again in the capture stream by normalized cross-correlation. the hal passes the time each
+// buffer is played or was captured, so the round trip is split into output buffering, the codec
+// and analog path, and input buffering
+void* alat_init  (void);
+void  alat_close (void *ctxt);
+void  alat_start (void *ctxt);
+int   alat_result(void *ctxt, char *str, int size); // key=value pairs for adev_get_parameters
+
+// the first output that writes after alat_start owns the test, other outputs are not touched
+int   alat_output_wanted(void *ctxt, void *owner); // lock-free check for the writer, marker still to be played by owner
+int   alat_output       (void *ctxt, void *owner, int16_t *buf, int frames, int ch, int rate); // marker and silence, return 1 when buf[0] is the marker start, -1 when owner is not injecting and buf is untouched
+void  alat_output_close (void *ctxt, void *owner); // owner goes away, a marker it did not finish fails the test
+void  alat_output_timing(void *ctxt, int64_t write_ns, int64_t play_ns, int kernel_frames, int rate); // what is not in the kernel buffer is hal buffering
+
+int   alat_input_wanted (void *ctxt);  // lock-free check for the reader
+void  alat_input        (void *ctxt, const int16_t *buf, int frames, int ch, int rate, int64_t capture_ns); // capture_ns is when buf[0] was captured
+
+#endif
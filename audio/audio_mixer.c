@@ -0,0 +1,642 @@
+#define LOG_TAG "audio_mixer"
+
+// 包含头文件
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/log.h>
+#include "audio_dsp.h"
+#include "audio_mixer.h"
+#include "audio_ring.h"
+#include "audio_stats.h"
+
+// 内部常量定义
+#define AMIXER_MAX_TRACKS    8
+#define AMIXER_RT_PRIORITY   3   // same as audioflinger fast mixer
+#define AMIXER_FAST_PERIODS  2   // hardware fill level in periods while a fast track is active
+#define AMIXER_NORMAL_PERIODS 30 // while a normal track is active, refilled from half of it
+#define AMIXER_DEEP_LOW_PERIODS 16 // only deep tracks: the whole buffer, refilled when this much is left
+#define AMIXER_WRITE_TIMEOUT 500 // ms, writer gives up if mixer does not consume anything
+
+// 内部类型定义
+typedef struct tagAMIXER AMIXER;
+
+typedef struct {
+    AMIXER   *mixer;
+    int       flags;
+    AUDIO_RING ring;    // written by stream, read by mixer thread
+    uint32_t  limit;    // frames the writer may queue in ring, a fast track leaves its hardware fill out
+    int       active;   // set by first write, cleared by stop
+    int       stopping; // frames left to fade out before the track really stops
+    int       idle;     // stream is in delayed standby, running dry is expected
+    int       joining;  // started, the mixer has not placed it in the hardware buffer yet
+    uint64_t  pos;      // mixer position of the next frame of this track, behind written while catching up
+    int       gainl;    // gain set by client, DSP_GAIN ramps towards it
+    int       gainr;
+    DSP_GAIN  gain;
+    uint64_t  mixed;    // frames taken out of ring since last stop
+    uint64_t  mix_end;  // mixer position right after the last frame of this track
+    uint32_t  underruns;
+} AMIXER_TRACK;
+
+struct tagAMIXER {
+    int                card;
+    int                port;
+    struct pcm_config  config;
+    struct pcm        *pcm;
+    unsigned int       buffer_frames;
+    int                started;
+    int                ramp_frames; // length of volume, start and stop ramps
+    int                held;        // a stream of its own owns the pcm, see amixer_hold
+    uint32_t           open_failures;
+
+    pthread_mutex_t    lock;      // protects tracks and pcm, held while mixing
+    pthread_cond_t     cond_mix;  // a track became active, wakes the mixer thread out of any sleep
+    pthread_cond_t     cond_space;// mixer consumed frames
+    pthread_t          thread;
+    int                exit;
+
+    AMIXER_TRACK      *tracks[AMIXER_MAX_TRACKS];
+    int32_t           *acc;       // one period accumulator
+
+    uint64_t           written;   // frames committed to pcm since open
+    uint64_t           played;    // frames played by hardware at ts
+    struct timespec    ts;
+    AUDIO_STATS        stats;     // pcm xruns, fill level and mixer wakeup jitter
+    uint32_t           wakeups;   // mixing passes since init, what the cpu pays for the fill level
+};
+
+// 内部函数实现
+static int amixer_open_pcm(AMIXER *mixer)
+{
+    int      i;
+    uint32_t failures;
+    mixer->pcm = pcm_open(mixer->card, mixer->port, PCM_OUT | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC, &mixer->config);
+    if (!pcm_is_ready(mixer->pcm)) {
+        // retried every 100ms while tracks play, only logged on every power of 2 failures
+        failures = ++mixer->open_failures;
+        if ((failures & (failures - 1)) == 0) {
+            ALOGE("cannot open pcm_out driver: %s, %u failures so far", pcm_get_error(mixer->pcm), failures);
+        }
+        pcm_close(mixer->pcm);
+        mixer->pcm = NULL;
+        return -ENODEV;
+    }
+    mixer->open_failures = 0;
+    mixer->buffer_frames = pcm_get_buffer_size(mixer->pcm);
+    mixer->started       = 0;
+    mixer->written       = 0;
+    for (i=0; i<AMIXER_MAX_TRACKS; i++) {
+        if (mixer->tracks[i]) mixer->tracks[i]->pos = 0;
+    }
+    mixer->played        = 0;
+    memset(&mixer->ts, 0, sizeof(mixer->ts));
+    return 0;
+}
+
+static void amixer_close_pcm(AMIXER *mixer)
+{
+    if (mixer->pcm) {
+        pcm_close(mixer->pcm);
+        mixer->pcm = NULL;
+    }
+}
+
+// room the writer has left, the ring is rounded up to a power of 2 and may be larger than the limit
+static uint32_t amixer_track_space(AMIXER_TRACK *track)
+{
+    uint32_t queued = track->ring.head - __atomic_load_n(&track->ring.tail, __ATOMIC_ACQUIRE);
+    return queued < track->limit ? track->limit - queued : 0;
+}
+
+// must be called with mixer lock held
+static void amixer_track_reset(AMIXER_TRACK *track)
+{
+    track->active   = 0;
+    track->stopping = 0;
+    track->idle     = 0;
+    ring_reset(&track->ring);
+    track->mixed    = 0;
+    track->mix_end  = 0;
+}
+
+// pull up to frames from track ring into acc, return frames actually mixed
+static int amixer_track_mix(AMIXER *mixer, AMIXER_TRACK *track, int frames)
+{
+    int      lagging = track->pos < mixer->written; // catching up, its writer may simply not be there yet
+    uint32_t len;
+    int      n = 0;
+
+    if (track->stopping && frames > track->stopping) frames = track->stopping;
+    while (n < frames) {
+        int16_t *src = (int16_t*)ring_read_ptr(&track->ring, &len);
+        if (len == 0) break;
+        if (len > (uint32_t)(frames - n)) len = frames - n;
+        dsp_mix_s16(mixer->acc + n * 2, src, len, &track->gain);
+        ring_read_done(&track->ring, len);
+        n += len;
+    }
+
+    if (n > 0) {
+        track->mixed  += n;
+        track->pos    += n;
+        track->mix_end = track->pos;
+    }
+    if (track->stopping) {
+        // fade out done, or the ring ran dry before it was
+        track->stopping -= n;
+        if (track->stopping <= 0 || n < frames) amixer_track_reset(track);
+    } else if (n < frames && !track->idle && !lagging) {
+        track->underruns++;
+    }
+    return n;
+}
+
+/* hardware fill for track flags, target is what gets queued and the mixer wakes to refill at low:
+ * a few ms for a fast track, about 60ms refilled from half for a normal one, and for deep tracks
+ * the whole buffer, which is left to drain for about 240ms
+ */
+static void amixer_fill(AMIXER *mixer, int flags, unsigned int *target, unsigned int *low)
+{
+    unsigned int period = mixer->config.period_size;
+    if (flags & AMIXER_TRACK_FAST) {
+        *target = period * AMIXER_FAST_PERIODS;
+        *low    = *target - period;
+    } else if (!(flags & AMIXER_TRACK_DEEP)) {
+        *target = period * AMIXER_NORMAL_PERIODS;
+        *low    = *target / 2;
+    } else {
+        *target = mixer->buffer_frames - period;
+        *low    = period * AMIXER_DEEP_LOW_PERIODS;
+    }
+}
+
+/* a track starting while the buffer holds more than it wants queued, a fast track behind a deep
+ * fill, does not wait behind all of it. it is added onto the frames already committed, keeping
+ * its own fill ahead of the hardware pointer, until the end of the buffer drains down to it.
+ * area and offset are those of pcm_mmap_begin, return microseconds until it wants more
+ */
+static int amixer_track_catch_up(AMIXER *mixer, AMIXER_TRACK *track, int16_t *area, unsigned int offset, unsigned int queued)
+{
+    unsigned int period = mixer->config.period_size;
+    unsigned int buffer = mixer->buffer_frames;
+    uint64_t     hw     = mixer->written - queued; // next frame the hardware reads
+    uint64_t     end;
+    unsigned int target, low;
+    DSP_GAIN     unity;
+
+    amixer_fill(mixer, track->flags, &target, &low);
+    if (track->joining) {
+        track->joining = 0;
+        track->pos     = hw + target;
+    } else if (track->pos < hw + period) {
+        // its writer fell behind the hardware, the frames in between are gone
+        if (!track->idle) track->underruns++;
+        track->pos = hw + period;
+    }
+    if (track->pos > mixer->written) track->pos = mixer->written;
+    end = hw + target < mixer->written ? hw + target : mixer->written;
+
+    dsp_gain_init(&unity, DSP_GAIN_UNITY, DSP_GAIN_UNITY);
+    while (track->active && track->pos < end) {
+        unsigned int back = mixer->written - track->pos;
+        unsigned int at   = (offset + buffer - back % buffer) % buffer;
+        int          n    = end - track->pos < period ? end - track->pos : period;
+        if (n > (int)(buffer - at)) n = buffer - at;
+
+        memset(mixer->acc, 0, n * 2 * sizeof(int32_t));
+        dsp_mix_s16(mixer->acc, area + at * 2, n, &unity);
+        n = amixer_track_mix(mixer, track, n);
+        if (n == 0) break;
+        dsp_store_s16(area + at * 2, mixer->acc, n * 2);
+    }
+    if (track->pos <= hw + low) return 1000;
+    return (int)((track->pos - hw - low) * 1000000 / mixer->config.rate);
+}
+
+/* mix until the hardware buffer reaches the fill target, return microseconds to sleep. the fill is
+ * that of the most demanding active track, with only deep tracks the cpu wakes about 4 times per
+ * second, less than the 5 of the deep pcm of its own they had before sharing the codec
+ */
+static int amixer_mix(AMIXER *mixer, int flags)
+{
+    unsigned int period = mixer->config.period_size;
+    unsigned int buffer = mixer->buffer_frames;
+    unsigned int target, low, avail, queued, offset, frames;
+    void        *area;
+    int          ret, i, sleep_us = -1;
+
+    amixer_fill(mixer, flags, &target, &low);
+
+    ret = pcm_mmap_avail(mixer->pcm);
+    if (ret < 0 || (unsigned int)ret > buffer) {
+        astats_xrun(&mixer->stats, astats_now());
+        pcm_stop   (mixer->pcm); // tinyalsa skips prepare unless the pcm was stopped first
+        pcm_prepare(mixer->pcm);
+        mixer->started = 0;
+        ret = buffer;
+        // what the tracks were catching up with is gone
+        for (i=0; i<AMIXER_MAX_TRACKS; i++) {
+            if (mixer->tracks[i] && mixer->tracks[i]->pos < mixer->written) mixer->tracks[i]->pos = mixer->written;
+        }
+    }
+    avail  = ret;
+    queued = buffer - avail;
+    if (pcm_get_htimestamp(mixer->pcm, &avail, &mixer->ts) == 0 && avail <= buffer) {
+        mixer->played = mixer->written - (buffer - avail);
+        astats_fill(&mixer->stats, buffer - avail);
+    }
+
+    frames = 0;
+    if (pcm_mmap_begin(mixer->pcm, &area, &offset, &frames) == 0) {
+        for (i=0; i<AMIXER_MAX_TRACKS; i++) {
+            AMIXER_TRACK *track = mixer->tracks[i];
+            if (!track || !track->active || (!track->joining && track->pos >= mixer->written)) continue;
+            ret = amixer_track_catch_up(mixer, track, (int16_t*)area, offset, queued);
+            if (track->active && track->pos < mixer->written && (sleep_us < 0 || ret < sleep_us)) sleep_us = ret;
+        }
+    }
+
+    while (queued + period <= target) {
+        area   = NULL;
+        offset = 0;
+        frames = period;
+        if (pcm_mmap_begin(mixer->pcm, &area, &offset, &frames) < 0 || frames == 0) break;
+
+        memset(mixer->acc, 0, frames * 2 * sizeof(int32_t));
+        for (i=0; i<AMIXER_MAX_TRACKS; i++) {
+            AMIXER_TRACK *track = mixer->tracks[i];
+            if (!track || track->joining || track->pos < mixer->written) continue;
+            if (track->active) amixer_track_mix(mixer, track, frames);
+            // a track that ran dry stays in step with the buffer, it just added silence
+            track->pos = mixer->written + frames;
+        }
+        dsp_store_s16((int16_t*)area + offset * 2, mixer->acc, frames * 2);
+
+        pcm_mmap_commit(mixer->pcm, offset, frames);
+        mixer->written += frames;
+        queued         += frames;
+    }
+    if (!mixer->started && queued > 0) {
+        if (pcm_start(mixer->pcm) == 0) mixer->started = 1;
+    }
+    pthread_cond_broadcast(&mixer->cond_space);
+
+    if (queued <= low) return 1000;
+    ret = (int)((uint64_t)(queued - low) * 1000000 / mixer->config.rate);
+    // a track catching up is refilled on its own schedule
+    return sleep_us >= 0 && sleep_us < ret ? sleep_us : ret;
+}
+
+// sleep with the lock released, a track becoming active cuts it short
+static void amixer_sleep(AMIXER *mixer, int us)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += (us % 1000000) * 1000L;
+    ts.tv_sec  += us / 1000000 + ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    // woken before the time asked for, the next interval is not jitter
+    if (pthread_cond_timedwait(&mixer->cond_mix, &mixer->lock, &ts) == 0) astats_break(&mixer->stats);
+}
+
+static void* amixer_thread_proc(void *param)
+{
+    AMIXER *mixer = (AMIXER*)param;
+    int     active, flags, sleep_us = 0, i;
+
+    pthread_mutex_lock(&mixer->lock);
+    while (!mixer->exit) {
+        // fast if any active track is, deep only if all of them are
+        for (active=0, flags=AMIXER_TRACK_DEEP, i=0; i<AMIXER_MAX_TRACKS; i++) {
+            if (mixer->tracks[i] && mixer->tracks[i]->active) {
+                active++;
+                flags |= mixer->tracks[i]->flags & AMIXER_TRACK_FAST;
+                if (!(mixer->tracks[i]->flags & AMIXER_TRACK_DEEP)) flags &= ~AMIXER_TRACK_DEEP;
+            }
+        }
+        // while a stream of its own holds the pcm there is nothing to retry, amixer_hold wakes it
+        if (!active || mixer->held) {
+            amixer_close_pcm(mixer);
+            astats_break(&mixer->stats);
+            pthread_cond_wait(&mixer->cond_mix, &mixer->lock);
+            continue;
+        }
+
+        if (!mixer->pcm && amixer_open_pcm(mixer) != 0) {
+            pthread_cond_broadcast(&mixer->cond_space); // let writers see the failure
+            sleep_us = 100 * 1000;
+        } else {
+            // the time since the last wakeup beyond the sleep asked for is scheduling latency plus mixing
+            astats_call(&mixer->stats, astats_now(), sleep_us * 1000LL);
+            sleep_us = amixer_mix(mixer, flags);
+            mixer->wakeups++;
+        }
+        amixer_sleep(mixer, sleep_us);
+    }
+    amixer_close_pcm(mixer);
+    pthread_mutex_unlock(&mixer->lock);
+    return NULL;
+}
+
+// 函数实现
+void* amixer_init(int card, int port, struct pcm_config *config, int ramp_frames)
+{
+    struct sched_param param;
+    pthread_condattr_t attr;
+    AMIXER *mixer = (AMIXER*)calloc(1, sizeof(AMIXER));
+    if (!mixer) return NULL;
+
+    mixer->card   = card;
+    mixer->port   = port;
+    mixer->config = *config;
+    mixer->ramp_frames = ramp_frames;
+    mixer->acc    = (int32_t*)malloc(config->period_size * 2 * sizeof(int32_t));
+    if (!mixer->acc) {
+        free(mixer);
+        return NULL;
+    }
+
+    pthread_mutex_init(&mixer->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&mixer->cond_mix  , &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init (&mixer->cond_space, NULL);
+    if (pthread_create(&mixer->thread, NULL, amixer_thread_proc, mixer) != 0) {
+        pthread_cond_destroy (&mixer->cond_space);
+        pthread_cond_destroy (&mixer->cond_mix  );
+        pthread_mutex_destroy(&mixer->lock);
+        free(mixer->acc);
+        free(mixer);
+        return NULL;
+    }
+
+    param.sched_priority = AMIXER_RT_PRIORITY;
+    if (pthread_setschedparam(mixer->thread, SCHED_FIFO, &param) != 0) {
+        ALOGW("failed to set mixer thread to SCHED_FIFO !\n");
+    }
+    return mixer;
+}
+
+void amixer_close(void *ctxt)
+{
+    AMIXER *mixer = (AMIXER*)ctxt;
+    if (!mixer) return;
+
+    pthread_mutex_lock(&mixer->lock);
+    mixer->exit = 1;
+    pthread_cond_signal(&mixer->cond_mix);
+    pthread_mutex_unlock(&mixer->lock);
+    pthread_join(mixer->thread, NULL);
+
+    pthread_cond_destroy (&mixer->cond_space);
+    pthread_cond_destroy (&mixer->cond_mix  );
+    pthread_mutex_destroy(&mixer->lock);
+    free(mixer->acc);
+    free(mixer);
+}
+
+void* amixer_track_open(void *ctxt, int flags, int frames)
+{
+    AMIXER       *mixer = (AMIXER*)ctxt;
+    AMIXER_TRACK *track;
+    int           i;
+    if (!mixer) return NULL;
+
+    track = (AMIXER_TRACK*)calloc(1, sizeof(AMIXER_TRACK));
+    if (!track) return NULL;
+    // a fast track gets the frames it asked for through the whole path, what the mixer keeps in
+    // hardware for it is taken off its queue, at least one period stays for the writer
+    track->limit = frames;
+    if (flags & AMIXER_TRACK_FAST) {
+        uint32_t period = mixer->config.period_size, hw = period * AMIXER_FAST_PERIODS;
+        track->limit = frames > (int)(hw + period) ? frames - hw : period;
+    }
+    if (ring_init(&track->ring, track->limit, 2 * sizeof(int16_t)) != 0) {
+        free(track);
+        return NULL;
+    }
+    track->mixer = mixer;
+    track->flags = flags;
+    track->gainl = DSP_GAIN_UNITY;
+    track->gainr = DSP_GAIN_UNITY;
+    dsp_gain_init(&track->gain, DSP_GAIN_UNITY, DSP_GAIN_UNITY);
+
+    pthread_mutex_lock(&mixer->lock);
+    for (i=0; i<AMIXER_MAX_TRACKS && mixer->tracks[i]; i++);
+    if (i < AMIXER_MAX_TRACKS) mixer->tracks[i] = track;
+    pthread_mutex_unlock(&mixer->lock);
+
+    if (i == AMIXER_MAX_TRACKS) {
+        ALOGE("too many mixer tracks !\n");
+        ring_free(&track->ring);
+        free(track);
+        return NULL;
+    }
+    return track;
+}
+
+void amixer_track_close(void *ctxt)
+{
+    AMIXER_TRACK *track = (AMIXER_TRACK*)ctxt;
+    AMIXER       *mixer;
+    int           i;
+    if (!track) return;
+
+    mixer = track->mixer;
+    pthread_mutex_lock(&mixer->lock);
+    for (i=0; i<AMIXER_MAX_TRACKS; i++) {
+        if (mixer->tracks[i] == track) mixer->tracks[i] = NULL;
+    }
+    pthread_mutex_unlock(&mixer->lock);
+    ring_free(&track->ring);
+    free(track);
+}
+
+int amixer_track_write(void *ctxt, const void *buf, int frames)
+{
+    AMIXER_TRACK  *track = (AMIXER_TRACK*)ctxt;
+    AMIXER        *mixer = track->mixer;
+    const int16_t *src   = (const int16_t*)buf;
+    int            done  = 0;
+    uint32_t       n;
+
+    // the pcm is not the mixer's, fail at once so the caller paces itself instead of timing out
+    if (__atomic_load_n(&mixer->held, __ATOMIC_ACQUIRE)) return -1;
+    if (!track->active || track->stopping || track->idle) {
+        pthread_mutex_lock(&mixer->lock);
+        track->idle = 0;
+        // restarted while still fading out, drop the tail so the new data starts clean
+        if (track->stopping) amixer_track_reset(track);
+        if (!track->active) {
+            // fade in from silence, the first frames may land on a non zero sample
+            dsp_gain_init(&track->gain, 0, 0);
+            dsp_gain_ramp(&track->gain, track->gainl, track->gainr, mixer->ramp_frames);
+            track->active  = 1;
+            track->joining = 1;
+        }
+        pthread_cond_signal(&mixer->cond_mix);
+        pthread_mutex_unlock(&mixer->lock);
+    }
+
+    while (done < frames) {
+        n = amixer_track_space(track);
+        if (n > (uint32_t)(frames - done)) n = frames - done;
+        if (n) n = ring_write(&track->ring, src + done * 2, n);
+        if (n == 0) {
+            // ring is full, wait for the mixer thread, only this slow path takes the mixer lock
+            struct timespec ts;
+            int             ret = 0;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += AMIXER_WRITE_TIMEOUT * 1000000L;
+            ts.tv_sec  += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_mutex_lock(&mixer->lock);
+            while (amixer_track_space(track) == 0 && ret == 0) {
+                ret = pthread_cond_timedwait(&mixer->cond_space, &mixer->lock, &ts);
+            }
+            pthread_mutex_unlock(&mixer->lock);
+            if (ret != 0 && amixer_track_space(track) == 0) return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+void amixer_track_stop(void *ctxt)
+{
+    AMIXER_TRACK *track = (AMIXER_TRACK*)ctxt;
+    AMIXER       *mixer;
+    if (!track) return;
+
+    mixer = track->mixer;
+    pthread_mutex_lock(&mixer->lock);
+    if (track->active && !track->stopping && mixer->pcm && mixer->ramp_frames > 0 && ring_avail(&track->ring) > 0) {
+        // keep mixing the queued frames while ramping to zero, the mixer thread drops the rest
+        uint32_t fade = ring_avail(&track->ring);
+        if (fade > (uint32_t)mixer->ramp_frames) fade = mixer->ramp_frames;
+        dsp_gain_ramp(&track->gain, 0, 0, fade);
+        track->stopping = fade;
+    } else if (!track->stopping) {
+        amixer_track_reset(track);
+    }
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+void amixer_track_idle(void *ctxt)
+{
+    AMIXER_TRACK *track = (AMIXER_TRACK*)ctxt;
+    AMIXER       *mixer;
+    if (!track) return;
+
+    mixer = track->mixer;
+    pthread_mutex_lock(&mixer->lock);
+    if (track->active) track->idle = 1;
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+void amixer_hold(void *ctxt, int hold)
+{
+    AMIXER *mixer = (AMIXER*)ctxt;
+    if (!mixer) return;
+
+    pthread_mutex_lock(&mixer->lock);
+    __atomic_store_n(&mixer->held, hold, __ATOMIC_RELEASE);
+    if (!hold) mixer->open_failures = 0;
+    pthread_cond_signal(&mixer->cond_mix);
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+void amixer_track_set_gain(void *ctxt, int gainl, int gainr)
+{
+    AMIXER_TRACK *track = (AMIXER_TRACK*)ctxt;
+    AMIXER       *mixer;
+    if (!track) return;
+
+    mixer = track->mixer;
+    pthread_mutex_lock(&mixer->lock);
+    track->gainl = gainl < 0 ? 0 : gainl > DSP_GAIN_UNITY ? DSP_GAIN_UNITY : gainl;
+    track->gainr = gainr < 0 ? 0 : gainr > DSP_GAIN_UNITY ? DSP_GAIN_UNITY : gainr;
+    if (!track->stopping) {
+        if (track->active) dsp_gain_ramp(&track->gain, track->gainl, track->gainr, mixer->ramp_frames);
+        else               dsp_gain_init(&track->gain, track->gainl, track->gainr);
+    }
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+int amixer_track_get_latency(void *ctxt)
+{
+    AMIXER_TRACK *track = (AMIXER_TRACK*)ctxt;
+    AMIXER       *mixer = track->mixer;
+    int           hw    = (track->flags & AMIXER_TRACK_FAST) ? mixer->config.period_size * AMIXER_FAST_PERIODS
+                        : (track->flags & AMIXER_TRACK_DEEP) ? mixer->config.period_size * (mixer->config.period_count - 1)
+                                                              : mixer->config.period_size * AMIXER_NORMAL_PERIODS;
+    return track->limit + hw;
+}
+
+int amixer_track_get_delay(void *ctxt, unsigned int *frames, struct timespec *ts)
+{
+    AMIXER_TRACK *track = (AMIXER_TRACK*)ctxt;
+    AMIXER       *mixer = track->mixer;
+    int           ret   = -1;
+
+    pthread_mutex_lock(&mixer->lock);
+    if (mixer->pcm && track->active && (mixer->ts.tv_sec || mixer->ts.tv_nsec)) {
+        // frames of this track still in hardware buffer are the ones mixed after played position
+        uint64_t pending = track->mix_end > mixer->played ? track->mix_end - mixer->played : 0;
+        if (pending > track->mixed) pending = track->mixed;
+        *frames = (unsigned int)pending + (track->ring.head - track->ring.tail);
+        *ts     = mixer->ts;
+        ret     = 0;
+    }
+    pthread_mutex_unlock(&mixer->lock);
+    return ret;
+}
+
+int amixer_track_get_queued(void *ctxt)
+{
+    AMIXER_TRACK *track = (AMIXER_TRACK*)ctxt;
+    return track->ring.head - __atomic_load_n(&track->ring.tail, __ATOMIC_ACQUIRE);
+}
+
+void amixer_dump(void *ctxt, int fd)
+{
+    AMIXER  *mixer = (AMIXER*)ctxt;
+    uint32_t underruns[AMIXER_MAX_TRACKS];
+    int      flags[AMIXER_MAX_TRACKS], active[AMIXER_MAX_TRACKS], queued[AMIXER_MAX_TRACKS];
+    uint32_t wakeups;
+    int      i, open = 0, held;
+    if (!mixer) return;
+
+    // copied under the lock and printed after it, a slow reader of the dump must not stall mixing
+    pthread_mutex_lock(&mixer->lock);
+    for (i=0; i<AMIXER_MAX_TRACKS; i++) {
+        AMIXER_TRACK *track = mixer->tracks[i];
+        if (!track) {
+            flags[i] = -1;
+            continue;
+        }
+        flags    [i] = track->flags;
+        active   [i] = track->active;
+        queued   [i] = track->ring.head - track->ring.tail;
+        underruns[i] = track->underruns;
+        open = 1;
+    }
+    wakeups = mixer->wakeups;
+    held    = mixer->held;
+    pthread_mutex_unlock(&mixer->lock);
+
+    dprintf(fd, "mixer: card %d port %d, %u x %u frames at %u Hz, pcm %s, %u wakeups\n", mixer->card, mixer->port,
+        mixer->config.period_count, mixer->config.period_size, mixer->config.rate, held ? "held by a mmap stream" : mixer->pcm ? "open" : "closed", wakeups);
+    astats_dump(&mixer->stats, fd, "  ");
+    for (i=0; open && i<AMIXER_MAX_TRACKS; i++) {
+        if (flags[i] < 0) continue;
+        dprintf(fd, "  track %d: %s%s, %d frames queued, %u underruns\n", i,
+            (flags[i] & AMIXER_TRACK_FAST) ? "fast" : (flags[i] & AMIXER_TRACK_DEEP) ? "deep" : "normal",
+            active[i] ? " active" : "", queued[i], underruns[i]);
+    }
+}
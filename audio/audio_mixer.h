@@ -0,0 +1,33 @@
+#ifndef __AUDIO_MIXER_H__
+#define __AUDIO_MIXER_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <tinyalsa/asoundlib.h>
+
+// 常量定义
+#define AMIXER_TRACK_FAST  (1 << 0)  // keep the hardware buffer short while this track is active
+#define AMIXER_TRACK_DEEP  (1 << 1)  // may wait behind a full hardware buffer, the mixer wakes rarely while only these play
+
+// 函数声明
+// software mixer owning one playback pcm, every output stream writes into its own track,
+// the mixer thread sums all active tracks straight into the pcm mmap buffer
+void* amixer_init (int card, int port, struct pcm_config *config, int ramp_frames);
+void  amixer_close(void *ctxt);
+
+void* amixer_track_open (void *ctxt, int flags, int frames);
+void  amixer_track_close(void *track);
+int   amixer_track_write(void *track, const void *buf, int frames); // block until queued, return -1 if pcm is dead
+void  amixer_track_stop (void *track); // fade out over the ramp, then drop queued frames and stop mixing
+void  amixer_track_idle (void *track); // play out queued frames and keep the pcm running on silence until next write or stop
+void  amixer_track_set_gain    (void *track, int gainl, int gainr);  // Q15, DSP_GAIN_UNITY is 1.0, ramped
+int   amixer_track_get_latency (void *track); // frames
+int   amixer_track_get_delay   (void *track, unsigned int *frames, struct timespec *ts); // frames written but not played yet
+int   amixer_track_get_queued  (void *track); // frames written but not mixed yet, lock-free for the writer
+
+// a stream outside the mixer opened the pcm, the mixer stops trying to open it and track writes
+// fail at once until it is released with hold 0
+void  amixer_hold(void *ctxt, int hold);
+void  amixer_dump(void *ctxt, int fd);
+
+#endif
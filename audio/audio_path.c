@@ -0,0 +1,546 @@
+#define LOG_TAG "audio_path"
+
+// 包含头文件
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <expat.h>
+#include <cutils/log.h>
+#include <tinyalsa/asoundlib.h>
+#include "audio_path.h"
+
+// 内部常量定义
+#define APATH_MAX_CTLS   128
+#define APATH_MAX_PATHS  32
+#define APATH_MAX_CACHE  16  // (output device, input active) combinations seen so far
+#define APATH_BIN_MAGIC  0x48545041 // "APTH"
+#define APATH_BIN_VER    1
+#define APATH_NAME_LEN   32
+
+// 内部类型定义
+typedef struct {
+    struct mixer_ctl *ctl;
+    int               id;    // value index, -1 sets every value of the control
+} APATH_CTL;
+
+typedef struct {
+    int32_t slot;
+    int32_t value;
+} APATH_SETTING; // also the layout of settings in the binary table
+
+// binary table compiled from the xml against one card, the header is followed by
+// ctl_num APATH_BIN_CTL, path_num APATH_BIN_PATH and set_num APATH_SETTING
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t card_sum;  // checksum of the card control list, control ids are only valid for it
+    uint32_t xml_size;  // source xml, the table is rebuilt when it changes
+    uint32_t xml_mtime;
+    uint32_t ctl_num;
+    uint32_t path_num;
+    uint32_t set_num;
+    uint32_t data_sum;  // checksum of everything after the header
+} APATH_BIN_HEADER;
+
+typedef struct {
+    uint32_t ctl;       // tinyalsa control index
+    int32_t  id;
+    int32_t  init;
+} APATH_BIN_CTL;
+
+typedef struct {
+    char     name[APATH_NAME_LEN];
+    uint32_t first;     // index of first setting
+    uint32_t num;
+} APATH_BIN_PATH;
+
+typedef struct {
+    char          *name;
+    APATH_SETTING *settings;
+    int            num;
+} APATH_PATH;
+
+typedef struct {
+    int      key[APATH_MAX_APPLY];
+    int      keylen;
+    int      state[APATH_MAX_CTLS]; // resolved value of every control slot
+    uint32_t hits;
+} APATH_ROUTE;
+
+typedef struct {
+    struct mixer *mixer;
+    void         *map;                   // mapped binary table, path names and settings point into it
+    size_t        map_size;
+    APATH_CTL     ctls [APATH_MAX_CTLS];
+    int           init [APATH_MAX_CTLS]; // value when no path is applied
+    int           cur  [APATH_MAX_CTLS]; // value last written to hardware
+    int           ctl_num;
+    APATH_PATH    paths[APATH_MAX_PATHS];
+    int           path_num;
+    APATH_ROUTE   routes[APATH_MAX_CACHE];
+    int           route_num;
+    int           route_next;            // replaced next when cache is full
+
+    int           parse_path;            // path being parsed, -1 at top level
+    int           parse_depth;
+
+    uint32_t      switches;
+    uint32_t      misses;
+    uint32_t      writes;
+    int64_t       time_last;             // ns
+    int64_t       time_max;
+    int64_t       time_total;
+} APATH;
+
+// 内部函数实现
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// names, types and sizes of all card controls, a table built for another card or kernel is rejected
+static uint32_t card_checksum(struct mixer *mixer)
+{
+    uint32_t h = 2166136261u;
+    unsigned int i, n = mixer_get_num_ctls(mixer);
+    for (i=0; i<n; i++) {
+        struct mixer_ctl *ctl  = mixer_get_ctl(mixer, i);
+        const char       *name = mixer_ctl_get_name(ctl);
+        uint32_t          info[3];
+        info[0] = mixer_ctl_get_type(ctl);
+        info[1] = mixer_ctl_get_num_values(ctl);
+        info[2] = info[0] == MIXER_CTL_TYPE_ENUM ? mixer_ctl_get_num_enums(ctl) : 0;
+        h = fnv1a(h, name, strlen(name) + 1);
+        h = fnv1a(h, info, sizeof(info));
+    }
+    return h;
+}
+
+static int64_t get_tick_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void write_slot(APATH *apath, int slot, int value)
+{
+    APATH_CTL *c = &apath->ctls[slot];
+    int        i, n;
+    if (c->id >= 0) {
+        mixer_ctl_set_value(c->ctl, c->id, value);
+    } else {
+        for (n=mixer_ctl_get_num_values(c->ctl), i=0; i<n; i++) mixer_ctl_set_value(c->ctl, i, value);
+    }
+}
+
+static int get_slot(APATH *apath, const char *name, int id)
+{
+    struct mixer_ctl *ctl = mixer_get_ctl_by_name(apath->mixer, name);
+    int               i;
+    if (!ctl) {
+        ALOGE("control %s not found !", name);
+        return -1;
+    }
+    for (i=0; i<apath->ctl_num; i++) {
+        if (apath->ctls[i].ctl == ctl && apath->ctls[i].id == id) return i;
+    }
+    if (apath->ctl_num == APATH_MAX_CTLS) {
+        ALOGE("too many route controls !");
+        return -1;
+    }
+    apath->ctls[i].ctl = ctl;
+    apath->ctls[i].id  = id;
+    apath->init[i]     = apath->cur[i] = mixer_ctl_get_value(ctl, id < 0 ? 0 : id);
+    return apath->ctl_num++;
+}
+
+static int parse_value(struct mixer_ctl *ctl, const char *str, int *value)
+{
+    int i, n;
+    switch (mixer_ctl_get_type(ctl)) {
+    case MIXER_CTL_TYPE_ENUM:
+        for (n=mixer_ctl_get_num_enums(ctl), i=0; i<n; i++) {
+            if (strcmp(mixer_ctl_get_enum_string(ctl, i), str) == 0) {
+                *value = i;
+                return 0;
+            }
+        }
+        return -1;
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+        *value = strtol(str, NULL, 0);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static int add_setting(APATH_PATH *path, int slot, int value)
+{
+    APATH_SETTING *s;
+    int            i;
+    for (i=0; i<path->num; i++) {
+        if (path->settings[i].slot == slot) {
+            path->settings[i].value = value;
+            return 0;
+        }
+    }
+    s = (APATH_SETTING*)realloc(path->settings, (path->num + 1) * sizeof(APATH_SETTING));
+    if (!s) return -1;
+    s[path->num].slot  = slot;
+    s[path->num].value = value;
+    path->settings     = s;
+    path->num++;
+    return 0;
+}
+
+static void XMLCALL start_tag(void *data, const XML_Char *tag, const XML_Char **attr)
+{
+    APATH      *apath = (APATH*)data;
+    const char *name  = NULL, *value = NULL, *id = NULL;
+    int         i, slot, val;
+
+    for (i=0; attr[i]; i+=2) {
+        if      (strcmp(attr[i], "name" ) == 0) name  = attr[i + 1];
+        else if (strcmp(attr[i], "value") == 0) value = attr[i + 1];
+        else if (strcmp(attr[i], "id"   ) == 0) id    = attr[i + 1];
+    }
+
+    if (strcmp(tag, "path") == 0) {
+        if (apath->parse_depth++ > 0) {
+            // reference to a path defined earlier, its settings are copied in
+            int sub = name ? apath_find(apath, name) : -1;
+            if (sub < 0 || apath->parse_path < 0) {
+                ALOGE("unknown sub path %s !", name ? name : "");
+                return;
+            }
+            for (i=0; i<apath->paths[sub].num; i++) {
+                add_setting(&apath->paths[apath->parse_path], apath->paths[sub].settings[i].slot, apath->paths[sub].settings[i].value);
+            }
+        } else if (name && apath->path_num < APATH_MAX_PATHS) {
+            apath->parse_path = apath->path_num;
+            apath->paths[apath->path_num++].name = strdup(name);
+        } else {
+            ALOGE("invalid or too many paths !");
+        }
+    } else if (strcmp(tag, "ctl") == 0) {
+        if (!name || !value) return;
+        slot = get_slot(apath, name, id ? atoi(id) : -1);
+        if (slot < 0) return;
+        if (parse_value(apath->ctls[slot].ctl, value, &val) != 0) {
+            ALOGE("invalid value %s for control %s !", value, name);
+            return;
+        }
+        if (apath->parse_depth == 0) {
+            apath->init[slot] = val;
+        } else if (apath->parse_path >= 0) {
+            add_setting(&apath->paths[apath->parse_path], slot, val);
+        }
+    }
+}
+
+static void XMLCALL end_tag(void *data, const XML_Char *tag)
+{
+    APATH *apath = (APATH*)data;
+    if (strcmp(tag, "path") == 0 && --apath->parse_depth == 0) apath->parse_path = -1;
+}
+
+static int load_xml(APATH *apath, const char *xml)
+{
+    XML_Parser parser;
+    FILE      *fp;
+    char       buf[1024];
+    int        len, ret = 0;
+
+    fp = fopen(xml, "r");
+    if (!fp) {
+        ALOGE("failed to open %s !", xml);
+        return -ENOENT;
+    }
+    parser = XML_ParserCreate(NULL);
+    if (!parser) {
+        fclose(fp);
+        return -ENOMEM;
+    }
+    XML_SetUserData(parser, apath);
+    XML_SetElementHandler(parser, start_tag, end_tag);
+    apath->parse_path = -1;
+    do {
+        len = fread(buf, 1, sizeof(buf), fp);
+        if (XML_Parse(parser, buf, len, len == 0) == XML_STATUS_ERROR) {
+            ALOGE("failed to parse %s !", xml);
+            ret = -EINVAL;
+            break;
+        }
+    } while (len > 0);
+    XML_ParserFree(parser);
+    fclose(fp);
+    return ret;
+}
+
+static int load_bin(APATH *apath, const char *bin, uint32_t card_sum, const struct stat *xst)
+{
+    APATH_BIN_HEADER *hdr;
+    APATH_BIN_CTL    *ctls;
+    APATH_BIN_PATH   *paths;
+    APATH_SETTING    *sets;
+    struct stat       st;
+    size_t            size;
+    unsigned int      i, num;
+    int               fd;
+
+    fd = open(bin, O_RDONLY);
+    if (fd < 0) return -ENOENT;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(APATH_BIN_HEADER)) {
+        close(fd);
+        return -EINVAL;
+    }
+    hdr = (APATH_BIN_HEADER*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) return -ENOMEM;
+
+    size = sizeof(*hdr) + hdr->ctl_num * sizeof(APATH_BIN_CTL) + hdr->path_num * sizeof(APATH_BIN_PATH) + hdr->set_num * sizeof(APATH_SETTING);
+    if (  hdr->magic != APATH_BIN_MAGIC || hdr->version != APATH_BIN_VER || hdr->card_sum != card_sum
+       || hdr->xml_size != (uint32_t)xst->st_size || hdr->xml_mtime != (uint32_t)xst->st_mtime
+       || hdr->ctl_num > APATH_MAX_CTLS || hdr->path_num > APATH_MAX_PATHS || size != (size_t)st.st_size
+       || hdr->data_sum != fnv1a(2166136261u, hdr + 1, size - sizeof(*hdr))) {
+        ALOGW("%s is stale, rebuild it from xml !", bin);
+        munmap(hdr, st.st_size);
+        return -EINVAL;
+    }
+
+    ctls  = (APATH_BIN_CTL *)(hdr + 1);
+    paths = (APATH_BIN_PATH*)(ctls  + hdr->ctl_num);
+    sets  = (APATH_SETTING *)(paths + hdr->path_num);
+    num   = mixer_get_num_ctls(apath->mixer);
+    for (i=0; i<hdr->ctl_num; i++) {
+        if (ctls[i].ctl >= num) break;
+        apath->ctls[i].ctl = mixer_get_ctl(apath->mixer, ctls[i].ctl);
+        apath->ctls[i].id  = ctls[i].id;
+        apath->init[i]     = ctls[i].init;
+        apath->cur [i]     = mixer_ctl_get_value(apath->ctls[i].ctl, ctls[i].id < 0 ? 0 : ctls[i].id);
+    }
+    for (; i == hdr->ctl_num && apath->path_num < (int)hdr->path_num; apath->path_num++) {
+        APATH_BIN_PATH *p = &paths[apath->path_num];
+        if (p->first + p->num > hdr->set_num || p->name[APATH_NAME_LEN - 1]) break;
+        apath->paths[apath->path_num].name     = p->name;
+        apath->paths[apath->path_num].settings = sets + p->first;
+        apath->paths[apath->path_num].num      = p->num;
+    }
+    if (i != hdr->ctl_num || apath->path_num != (int)hdr->path_num) {
+        apath->path_num = 0;
+        munmap(hdr, st.st_size);
+        return -EINVAL;
+    }
+    apath->ctl_num  = hdr->ctl_num;
+    apath->map      = hdr;
+    apath->map_size = st.st_size;
+    return 0;
+}
+
+static int ctl_index(struct mixer *mixer, struct mixer_ctl *ctl)
+{
+    unsigned int i, n = mixer_get_num_ctls(mixer);
+    for (i=0; i<n; i++) {
+        if (mixer_get_ctl(mixer, i) == ctl) return i;
+    }
+    return -1;
+}
+
+static int save_bin(APATH *apath, const char *bin, uint32_t card_sum, const struct stat *xst)
+{
+    APATH_BIN_HEADER hdr = {0};
+    APATH_BIN_CTL    ctls [APATH_MAX_CTLS];
+    APATH_BIN_PATH   paths[APATH_MAX_PATHS];
+    char             tmp[256];
+    uint32_t         sum = 2166136261u;
+    int              fd, i, ret = 0;
+
+    memset(paths, 0, sizeof(paths));
+    for (i=0; i<apath->ctl_num; i++) {
+        int idx = ctl_index(apath->mixer, apath->ctls[i].ctl);
+        if (idx < 0) return -EINVAL;
+        ctls[i].ctl  = idx;
+        ctls[i].id   = apath->ctls[i].id;
+        ctls[i].init = apath->init[i];
+    }
+    for (i=0; i<apath->path_num; i++) {
+        if (strlen(apath->paths[i].name) >= APATH_NAME_LEN) return -EINVAL;
+        strcpy(paths[i].name, apath->paths[i].name);
+        paths[i].first = hdr.set_num;
+        paths[i].num   = apath->paths[i].num;
+        hdr.set_num   += apath->paths[i].num;
+    }
+    sum = fnv1a(sum, ctls , apath->ctl_num  * sizeof(APATH_BIN_CTL ));
+    sum = fnv1a(sum, paths, apath->path_num * sizeof(APATH_BIN_PATH));
+    for (i=0; i<apath->path_num; i++) sum = fnv1a(sum, apath->paths[i].settings, apath->paths[i].num * sizeof(APATH_SETTING));
+
+    hdr.magic     = APATH_BIN_MAGIC;
+    hdr.version   = APATH_BIN_VER;
+    hdr.card_sum  = card_sum;
+    hdr.xml_size  = xst->st_size;
+    hdr.xml_mtime = xst->st_mtime;
+    hdr.ctl_num   = apath->ctl_num;
+    hdr.path_num  = apath->path_num;
+    hdr.data_sum  = sum;
+
+    // written aside and renamed, a concurrent open never maps a half written table
+    snprintf(tmp, sizeof(tmp), "%s.tmp", bin);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -errno;
+    if (  write(fd, &hdr , sizeof(hdr)) != sizeof(hdr)
+       || write(fd, ctls , apath->ctl_num  * sizeof(APATH_BIN_CTL )) != (ssize_t)(apath->ctl_num  * sizeof(APATH_BIN_CTL ))
+       || write(fd, paths, apath->path_num * sizeof(APATH_BIN_PATH)) != (ssize_t)(apath->path_num * sizeof(APATH_BIN_PATH))) {
+        ret = -EIO;
+    }
+    for (i=0; i<apath->path_num && ret == 0; i++) {
+        ssize_t len = apath->paths[i].num * sizeof(APATH_SETTING);
+        if (write(fd, apath->paths[i].settings, len) != len) ret = -EIO;
+    }
+    close(fd);
+    if (ret == 0 && rename(tmp, bin) != 0) ret = -errno;
+    if (ret != 0) unlink(tmp);
+    return ret;
+}
+
+static APATH_ROUTE* get_route(APATH *apath, const int *paths, int num)
+{
+    APATH_ROUTE *route;
+    int          i, j;
+
+    for (i=0; i<apath->route_num; i++) {
+        route = &apath->routes[i];
+        if (route->keylen == num && memcmp(route->key, paths, num * sizeof(int)) == 0) {
+            route->hits++;
+            return route;
+        }
+    }
+
+    apath->misses++;
+    if (apath->route_num < APATH_MAX_CACHE) {
+        route = &apath->routes[apath->route_num++];
+    } else {
+        route = &apath->routes[apath->route_next];
+        apath->route_next = (apath->route_next + 1) % APATH_MAX_CACHE;
+    }
+    memcpy(route->key, paths, num * sizeof(int));
+    memcpy(route->state, apath->init, apath->ctl_num * sizeof(int));
+    route->keylen = num;
+    route->hits   = 0;
+    for (i=0; i<num; i++) {
+        APATH_PATH *path = &apath->paths[paths[i]];
+        for (j=0; j<path->num; j++) route->state[path->settings[j].slot] = path->settings[j].value;
+    }
+    return route;
+}
+
+// 函数实现
+void* apath_init(int card, const char *xml, const char *bin)
+{
+    struct stat xst = {0};
+    uint32_t    card_sum;
+    APATH      *apath = (APATH*)calloc(1, sizeof(APATH));
+    if (!apath) return NULL;
+
+    apath->mixer = mixer_open(card);
+    if (!apath->mixer) {
+        ALOGE("failed to open mixer of card %d !", card);
+        free(apath);
+        return NULL;
+    }
+
+    stat(xml, &xst);
+    card_sum = bin ? card_checksum(apath->mixer) : 0;
+    if (bin && load_bin(apath, bin, card_sum, &xst) == 0) return apath;
+
+    if (load_xml(apath, xml) != 0) {
+        apath_close(apath);
+        return NULL;
+    }
+    if (bin && save_bin(apath, bin, card_sum, &xst) != 0) {
+        ALOGW("failed to save %s !", bin);
+    }
+    return apath;
+}
+
+void apath_close(void *ctxt)
+{
+    APATH *apath = (APATH*)ctxt;
+    int    i;
+    if (!apath) return;
+    if (apath->map) {
+        munmap(apath->map, apath->map_size);
+    } else {
+        for (i=0; i<apath->path_num; i++) {
+            free(apath->paths[i].name);
+            free(apath->paths[i].settings);
+        }
+    }
+    mixer_close(apath->mixer);
+    free(apath);
+}
+
+int apath_find(void *ctxt, const char *name)
+{
+    APATH *apath = (APATH*)ctxt;
+    int    i;
+    if (!apath) return -1;
+    for (i=0; i<apath->path_num; i++) {
+        if (strcmp(apath->paths[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+int apath_apply(void *ctxt, const int *paths, int num)
+{
+    APATH       *apath = (APATH*)ctxt;
+    APATH_ROUTE *route;
+    int64_t      tick;
+    int          i, n = 0;
+    if (!apath || num > APATH_MAX_APPLY) return -1;
+    for (i=0; i<num; i++) {
+        if (paths[i] < 0 || paths[i] >= apath->path_num) return -1;
+    }
+
+    tick  = get_tick_ns();
+    route = get_route(apath, paths, num);
+    for (i=0; i<apath->ctl_num; i++) {
+        if (route->state[i] != apath->cur[i]) {
+            write_slot(apath, i, route->state[i]);
+            apath->cur[i] = route->state[i];
+            n++;
+        }
+    }
+    tick = get_tick_ns() - tick;
+
+    apath->switches++;
+    apath->writes    += n;
+    apath->time_last  = tick;
+    apath->time_total+= tick;
+    if (tick > apath->time_max) apath->time_max = tick;
+    return n;
+}
+
+void apath_dump(void *ctxt, int fd)
+{
+    APATH *apath = (APATH*)ctxt;
+    if (!apath) return;
+    dprintf(fd, "route: %d controls, %d paths from %s, %d cached routes, %u switches (%u resolved), %u control writes\n",
+        apath->ctl_num, apath->path_num, apath->map ? "table" : "xml", apath->route_num, apath->switches, apath->misses, apath->writes);
+    dprintf(fd, "route switch time: last %lld us, max %lld us, avg %lld us\n",
+        (long long)apath->time_last / 1000, (long long)apath->time_max / 1000,
+        (long long)(apath->switches ? apath->time_total / apath->switches / 1000 : 0));
+}
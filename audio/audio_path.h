@@ -0,0 +1,18 @@
+#ifndef __AUDIO_PATH_H__
+#define __AUDIO_PATH_H__
+
+// 常量定义
+#define APATH_MAX_APPLY  4  // paths combined into one route
+
+// 函数声明
+// mixer route engine for the libaudioroute paths xml, each combination of paths is resolved once
+// and cached, switching routes only writes the controls whose value differs from the hardware.
+// the xml is compiled into a binary table at bin on first open, later opens only map the table
+// and check it against the card controls and the xml, bin may be NULL to always parse the xml
+void* apath_init (int card, const char *xml, const char *bin);
+void  apath_close(void *ctxt);
+int   apath_find (void *ctxt, const char *name);           // path index, -1 if not found
+int   apath_apply(void *ctxt, const int *paths, int num);  // later paths override earlier ones, return controls written
+void  apath_dump (void *ctxt, int fd);
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef __AUDIO_RING_H__
+#define __AUDIO_RING_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 类型定义
+// single producer single consumer frame ring, head and tail only grow and wrap naturally
+typedef struct {
+    uint8_t  *buf;
+    uint32_t  size;  // frames, power of 2
+    uint32_t  fsize; // bytes per frame
+    uint32_t  head;  // frames written, only advanced by producer
+    uint32_t  tail;  // frames read, only advanced by consumer
+} AUDIO_RING;
+
+// 函数实现
+static inline int ring_init(AUDIO_RING *ring, uint32_t frames, uint32_t fsize)
+{
+    uint32_t size = 1;
+    while (size < frames) size <<= 1;
+    ring->buf   = (uint8_t*)malloc(size * fsize);
+    ring->size  = size;
+    ring->fsize = fsize;
+    ring->head  = ring->tail = 0;
+    return ring->buf ? 0 : -1;
+}
+
+static inline void ring_free(AUDIO_RING *ring)
+{
+    free(ring->buf);
+    ring->buf = NULL;
+}
+
+// only when neither side is running
+static inline void ring_reset(AUDIO_RING *ring)
+{
+    ring->tail = ring->head;
+}
+
+static inline uint32_t ring_avail(AUDIO_RING *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+static inline uint32_t ring_space(AUDIO_RING *ring)
+{
+    return ring->size - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+// contiguous readable region, consumer side
+static inline void* ring_read_ptr(AUDIO_RING *ring, uint32_t *frames)
+{
+    uint32_t idx = ring->tail & (ring->size - 1);
+    uint32_t n   = ring_avail(ring);
+    if (n > ring->size - idx) n = ring->size - idx;
+    *frames = n;
+    return ring->buf + idx * ring->fsize;
+}
+
+static inline void ring_read_done(AUDIO_RING *ring, uint32_t frames)
+{
+    __atomic_store_n(&ring->tail, ring->tail + frames, __ATOMIC_RELEASE);
+}
+
+// contiguous writable region, producer side
+static inline void* ring_write_ptr(AUDIO_RING *ring, uint32_t *frames)
+{
+    uint32_t idx = ring->head & (ring->size - 1);
+    uint32_t n   = ring_space(ring);
+    if (n > ring->size - idx) n = ring->size - idx;
+    *frames = n;
+    return ring->buf + idx * ring->fsize;
+}
+
+static inline void ring_write_done(AUDIO_RING *ring, uint32_t frames)
+{
+    __atomic_store_n(&ring->head, ring->head + frames, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t ring_write(AUDIO_RING *ring, const void *data, uint32_t frames)
+{
+    uint32_t done = 0, n;
+    while (done < frames) {
+        uint8_t *dst = (uint8_t*)ring_write_ptr(ring, &n);
+        if (n == 0) break;
+        if (n > frames - done) n = frames - done;
+        memcpy(dst, (const uint8_t*)data + done * ring->fsize, n * ring->fsize);
+        ring_write_done(ring, n);
+        done += n;
+    }
+    return done;
+}
+
+static inline uint32_t ring_read(AUDIO_RING *ring, void *data, uint32_t frames)
+{
+    uint32_t done = 0, n;
+    while (done < frames) {
+        uint8_t *src = (uint8_t*)ring_read_ptr(ring, &n);
+        if (n == 0) break;
+        if (n > frames - done) n = frames - done;
+        memcpy((uint8_t*)data + done * ring->fsize, src, n * ring->fsize);
+        ring_read_done(ring, n);
+        done += n;
+    }
+    return done;
+}
+
+#endif
@@ -0,0 +1,861 @@
+#define LOG_TAG "audio_sim"
+
+// 包含头文件
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <tinyalsa/asoundlib.h>
+#include "audio_sim.h"
+
+// 内部常量定义
+#define ASIM_CARDS       3
+#define ASIM_MAX_CTLS    32
+#define ASIM_MAX_ENUMS   4
+#define ASIM_MAX_VALUES  8
+#define ASIM_ELD_SIZE    44
+#define ASIM_ELD_LPCM    29     // byte of the lpcm descriptor that holds the channel count
+#define ASIM_MAX_LOAD    16
+#define ASIM_SINE_HZ     1000
+#define ASIM_SINE_AMP    16384  // -6dBFS
+#define ASIM_LOOP_FRAMES 65536  // power of 2, about 1.4s at 48kHz
+
+enum {
+    ASIM_STATE_SETUP,
+    ASIM_STATE_PREPARED,
+    ASIM_STATE_RUNNING,
+    ASIM_STATE_XRUN,
+};
+
+// 内部类型定义
+typedef struct {
+    unsigned int rate_min, rate_max;
+    unsigned int ch_min, ch_max;
+    unsigned int formats;  // 1 << PCM_FORMAT_xxx
+    int          capture;
+} ASIM_CARD;
+
+typedef struct {
+    const char         *name;
+    enum mixer_ctl_type type;
+    int                 num_values;
+    int                 min, max;
+    const char         *enums[ASIM_MAX_ENUMS];
+} ASIM_CTL_DESC;
+
+struct pcm {
+    pthread_mutex_t   lock;
+    int               ready;
+    int               card;
+    unsigned int      flags;
+    struct pcm_config config;
+    unsigned int      buffer_size;
+    unsigned int      frame_bytes;
+    uint8_t          *buf;        // the mmap area
+    int               fd;         // shared memory behind buf, what a mmap client maps, -1 when buf is heap
+    int               state;
+    int               prepared;   // like tinyalsa, prepare does nothing while set and only stop clears it
+    uint64_t          hw;         // frames the hardware played or captured
+    uint64_t          appl;       // frames the application wrote or read
+    uint64_t          start_hw;
+    int64_t           start_ns;   // CLOCK_MONOTONIC of start_hw, periods complete every period_size frames after it
+    double            phase;      // sine of a capture pcm
+    char              error[128];
+};
+
+// codec playback as heard by the microphone, slots are indexed by the CLOCK_MONOTONIC time a frame
+// was played counted in frames of the playback rate
+typedef struct {
+    pthread_mutex_t lock;
+    int             delay_ms;  // 0 when off
+    unsigned int    rate;      // of the playback pcm filling it
+    int16_t         samples[ASIM_LOOP_FRAMES];
+    uint64_t        stamps [ASIM_LOOP_FRAMES]; // frame index + 1 of each slot, stale slots read as silence
+} ASIM_LOOP;
+
+struct pcm_params {
+    int card;
+};
+
+struct mixer_ctl {
+    const ASIM_CTL_DESC *desc;
+    int                  values[ASIM_MAX_VALUES];
+    uint8_t              bytes [ASIM_ELD_SIZE]; // of a byte control
+    unsigned int         num_bytes;
+};
+
+struct mixer {
+    unsigned int     num;
+    struct mixer_ctl ctls[ASIM_MAX_CTLS];
+};
+
+static const ASIM_CARD g_cards[ASIM_CARDS] = {
+    {  8000,  48000, 1, 2, 1 << PCM_FORMAT_S16_LE, 1 },                            // ASIM_CARD_CODEC
+    { 32000, 192000, 2, 8, (1 << PCM_FORMAT_S16_LE) | (1 << PCM_FORMAT_S24_LE), 0 }, // ASIM_CARD_HDMI
+    { 32000,  48000, 2, 2, 1 << PCM_FORMAT_S16_LE, 0 },                            // ASIM_CARD_SPDIF
+};
+
+// the codec controls a64_paths.xml uses, plus a volume control for persist.sys.audio.volume_ctl
+static const ASIM_CTL_DESC g_codec_ctls[] = {
+    { "ADCL Mux"                          , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "NULL", "ADC" } },
+    { "ADCR Mux"                          , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "NULL", "ADC" } },
+    { "AIF1 AD0L Mixer ADCL Switch"       , MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "AIF1 AD0R Mixer ADCR Switch"       , MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "AIF1IN0L Mux"                      , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "AIF1_DA0L", "AIF1_DA0R" } },
+    { "AIF1IN0R Mux"                      , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "AIF1_DA0R", "AIF1_DA0L" } },
+    { "AIF1OUT0L Mux"                     , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "AIF1_AD0L", "AIF1_AD0R" } },
+    { "AIF1OUT0R Mux"                     , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "AIF1_AD0R", "AIF1_AD0L" } },
+    { "DACL Mixer AIF1DA0L Switch"        , MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "DACR Mixer AIF1DA0R Switch"        , MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "External Speaker Switch"           , MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "HP_L Mux"                          , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "DACL HPL Switch", "Left Output Mixer" } },
+    { "HP_R Mux"                          , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "DACR HPR Switch", "Right Output Mixer" } },
+    { "Headphone Switch"                  , MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "LADC input Mixer MIC1 boost Switch", MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "Left Output Mixer DACL Switch"     , MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "Left Output Mixer DACR Switch"     , MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "RADC input Mixer MIC1 boost Switch", MIXER_CTL_TYPE_BOOL, 1, 0, 1 },
+    { "SPK_L Mux"                         , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "MIXL MIXR Switch", "MIXL Switch" } },
+    { "SPK_R Mux"                         , MIXER_CTL_TYPE_ENUM, 1, 0, 1 , { "MIXR MIXL Switch", "MIXR Switch" } },
+    { "DAC Playback Volume"               , MIXER_CTL_TYPE_INT , 2, 0, 63 },
+};
+
+static const ASIM_CTL_DESC g_hdmi_ctls[] = {
+    { "ELD"                 , MIXER_CTL_TYPE_BYTE, 0, 0, 255 },
+    { "Playback Channel Map", MIXER_CTL_TYPE_INT , 8, 0, 36  },
+};
+
+// ELD of a 7.1 receiver named "ffhal sim": lpcm 8 channels 32 to 192kHz, ac3, dts and e-ac3
+static const uint8_t g_hdmi_eld[ASIM_ELD_SIZE] = {
+    0x10, 0x00, 0x0a, 0x00, 0x69, 0x40, 0x00, 0x4f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 'f' , 'f' , 'h' , 'a' , 'l' , ' ' , 's' , 'i' , 'm' , 0x0f, 0x7f, 0x07,
+    0x15, 0x07, 0x50, 0x3d, 0x07, 0xc0, 0x57, 0x07, 0x01, 0x00, 0x00, 0x00,
+};
+
+static pthread_once_t g_once   = PTHREAD_ONCE_INIT;
+static int            g_jitter = 0;  // us
+static int            g_ctl_us = 0;  // time every control write takes
+static int            g_load   = 0;  // busy threads running
+static uint32_t       g_xruns  = 0;
+static uint32_t       g_seed   = 1;
+static ASIM_LOOP      g_loop   = { PTHREAD_MUTEX_INITIALIZER };
+static int            g_sink   = 8;  // lpcm channels of the hdmi sink, 0 when none is connected
+static int            g_busy[ASIM_CARDS][2]; // pcms opened for playback and capture, one each like alsa
+static pthread_mutex_t g_busy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 内部函数实现
+static int64_t asim_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void* asim_load_proc(void *param)
+{
+    volatile uint32_t x = 0;
+    (void)param;
+    for (;;) x = x * 1664525 + 1013904223;
+    return NULL;
+}
+
+static void asim_init_once(void)
+{
+    const char *env;
+    if ((env = getenv("AUDIO_SIM_JITTER_US"   ))) asim_set_jitter(atoi(env));
+    if ((env = getenv("AUDIO_SIM_LOAD_THREADS"))) asim_set_load  (atoi(env));
+    if ((env = getenv("AUDIO_SIM_LOOPBACK_MS" ))) asim_set_loopback(atoi(env));
+    if ((env = getenv("AUDIO_SIM_HDMI_SINK"   ))) asim_set_hdmi_sink(atoi(env));
+    if ((env = getenv("AUDIO_SIM_CTL_US"      ))) asim_set_ctl_delay(atoi(env));
+}
+
+// a codec control write goes over i2c or a slow regmap on the real card
+static void asim_ctl_write(void)
+{
+    int us = __atomic_load_n(&g_ctl_us, __ATOMIC_RELAXED);
+    if (us > 0) usleep(us);
+}
+
+// sleep until a period completes, late by up to the configured scheduling jitter
+static void asim_sleep_until(int64_t ns)
+{
+    struct timespec ts;
+    int             jitter = __atomic_load_n(&g_jitter, __ATOMIC_RELAXED);
+    if (jitter > 0) {
+        uint32_t seed = __atomic_add_fetch(&g_seed, 0x9e3779b9, __ATOMIC_RELAXED);
+        seed = seed * 1664525 + 1013904223;
+        ns  += (int64_t)(seed % (uint32_t)jitter) * 1000;
+    }
+    ts.tv_sec  = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int64_t asim_frames_to_ns(struct pcm *pcm, uint64_t frames)
+{
+    return (int64_t)(frames * 1000000000ULL / pcm->config.rate);
+}
+
+static void asim_gen_sine(struct pcm *pcm, uint64_t from, uint64_t to)
+{
+    double step = 2.0 * M_PI * ASIM_SINE_HZ / pcm->config.rate;
+    // only the last buffer of frames survives in the ring anyway
+    if (to - from > pcm->buffer_size) {
+        pcm->phase += step * (double)(to - from - pcm->buffer_size);
+        from        = to - pcm->buffer_size;
+    }
+    for (; from < to; from++) {
+        int16_t     *frame = (int16_t*)(pcm->buf + (from % pcm->buffer_size) * pcm->frame_bytes);
+        int16_t      s     = (int16_t)(sin(pcm->phase) * ASIM_SINE_AMP);
+        unsigned int ch;
+        for (ch=0; ch<pcm->config.channels; ch++) frame[ch] = s;
+        pcm->phase += step;
+    }
+    pcm->phase = fmod(pcm->phase, 2.0 * M_PI);
+}
+
+// split so a long uptime at 192kHz does not overflow
+static uint64_t asim_ns_to_frames(int64_t ns, unsigned int rate)
+{
+    return (uint64_t)(ns / 1000000000LL) * rate + (uint64_t)(ns % 1000000000LL) * rate / 1000000000ULL;
+}
+
+static int asim_loop_active(struct pcm *pcm)
+{
+    return pcm->card == ASIM_CARD_CODEC && __atomic_load_n(&g_loop.delay_ms, __ATOMIC_RELAXED) > 0;
+}
+
+// frames from..to of a playback pcm just left the dac, the first channel goes to the loop
+static void asim_loop_write(struct pcm *pcm, uint64_t from, uint64_t to)
+{
+    uint64_t base = asim_ns_to_frames(pcm->start_ns, pcm->config.rate) - pcm->start_hw;
+    if (pcm->config.format != PCM_FORMAT_S16_LE) return;
+    if (to - from > ASIM_LOOP_FRAMES) from = to - ASIM_LOOP_FRAMES;
+
+    pthread_mutex_lock(&g_loop.lock);
+    if (g_loop.rate != pcm->config.rate) {
+        memset(g_loop.stamps, 0, sizeof(g_loop.stamps));
+        g_loop.rate = pcm->config.rate;
+    }
+    for (; from < to; from++) {
+        uint64_t idx  = base + from;
+        uint32_t slot = idx & (ASIM_LOOP_FRAMES - 1);
+        g_loop.samples[slot] = *(int16_t*)(pcm->buf + (from % pcm->buffer_size) * pcm->frame_bytes);
+        g_loop.stamps [slot] = idx + 1;
+    }
+    pthread_mutex_unlock(&g_loop.lock);
+}
+
+// frames from..to of a capture pcm hear what was played delay_ms before, the nearest played
+// frame is taken when the playback runs at another rate
+static void asim_loop_read(struct pcm *pcm, uint64_t from, uint64_t to)
+{
+    int64_t delay = (int64_t)__atomic_load_n(&g_loop.delay_ms, __ATOMIC_RELAXED) * 1000000LL;
+    if (to - from > pcm->buffer_size) from = to - pcm->buffer_size;
+
+    pthread_mutex_lock(&g_loop.lock);
+    for (; from < to; from++) {
+        int16_t     *frame = (int16_t*)(pcm->buf + (from % pcm->buffer_size) * pcm->frame_bytes);
+        int64_t      ns    = pcm->start_ns + asim_frames_to_ns(pcm, from - pcm->start_hw) - delay;
+        uint64_t     idx   = g_loop.rate ? asim_ns_to_frames(ns, g_loop.rate) : 0;
+        uint32_t     slot  = idx & (ASIM_LOOP_FRAMES - 1);
+        int16_t      s     = g_loop.rate && g_loop.stamps[slot] == idx + 1 ? g_loop.samples[slot] : 0;
+        unsigned int ch;
+        for (ch=0; ch<pcm->config.channels; ch++) frame[ch] = s;
+    }
+    pthread_mutex_unlock(&g_loop.lock);
+}
+
+// advance the hardware pointer and detect xruns like the kernel, avail reaching stop_threshold stops
+// the pcm. an irq driven pcm moves at period interrupts, a PCM_NOIRQ pcm is synced from the dma
+// position so it moves every frame. must be called with pcm lock held
+static void asim_update(struct pcm *pcm)
+{
+    uint64_t hw;
+    if (pcm->state != ASIM_STATE_RUNNING) return;
+
+    hw  = (uint64_t)(asim_now() - pcm->start_ns) * pcm->config.rate / 1000000000ULL;
+    if (!(pcm->flags & PCM_NOIRQ)) hw -= hw % pcm->config.period_size;
+    hw += pcm->start_hw;
+    if (pcm->flags & PCM_IN) {
+        if (asim_loop_active(pcm)) {
+            asim_loop_read(pcm, pcm->hw, hw);
+        } else {
+            asim_gen_sine(pcm, pcm->hw, hw);
+        }
+        pcm->hw = hw;
+        if (pcm->hw - pcm->appl >= pcm->config.stop_threshold) {
+            pcm->state = ASIM_STATE_XRUN;
+            __atomic_add_fetch(&g_xruns, 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        // the hardware never runs past what was written, it stops there with an underrun
+        if (pcm->buffer_size - (int64_t)(pcm->appl - hw) >= pcm->config.stop_threshold) {
+            pcm->state = ASIM_STATE_XRUN;
+            __atomic_add_fetch(&g_xruns, 1, __ATOMIC_RELAXED);
+            if (hw > pcm->appl) hw = pcm->appl;
+        }
+        if (asim_loop_active(pcm)) asim_loop_write(pcm, pcm->hw, hw);
+        pcm->hw = hw;
+    }
+}
+
+static int asim_avail(struct pcm *pcm)
+{
+    if (pcm->flags & PCM_IN) return (int)(pcm->hw - pcm->appl);
+    return (int)(pcm->buffer_size - (pcm->appl - pcm->hw));
+}
+
+static int asim_prepare(struct pcm *pcm)
+{
+    if (pcm->prepared) return 0;
+    pcm->state    = ASIM_STATE_PREPARED;
+    pcm->prepared = 1;
+    pcm->hw       = 0;
+    pcm->appl     = 0;
+    return 0;
+}
+
+static int asim_start(struct pcm *pcm)
+{
+    if (!pcm->prepared) asim_prepare(pcm);
+    if (pcm->state == ASIM_STATE_RUNNING) return 0;
+    if (pcm->state != ASIM_STATE_PREPARED) return -EBADFD;
+    pcm->state    = ASIM_STATE_RUNNING;
+    pcm->start_hw = pcm->hw;
+    pcm->start_ns = asim_now();
+    return 0;
+}
+
+static void asim_stop(struct pcm *pcm)
+{
+    pcm->state    = ASIM_STATE_SETUP;
+    pcm->prepared = 0;
+}
+
+// a blocking write or read on a pcm that stopped with an xrun restarts it, as tinyalsa does
+static void asim_restart_xrun(struct pcm *pcm)
+{
+    if (pcm->state == ASIM_STATE_XRUN) asim_stop(pcm);
+    if (!pcm->prepared) asim_prepare(pcm);
+}
+
+static int64_t asim_next_period(struct pcm *pcm)
+{
+    uint64_t done = pcm->hw - pcm->start_hw + pcm->config.period_size;
+    return pcm->start_ns + asim_frames_to_ns(pcm, done);
+}
+
+// the ring lives in shared memory like a dma buffer, so a mmap client can map it through the fd
+static uint8_t* asim_alloc_ring(size_t bytes, int *fd)
+{
+    void *p;
+#ifdef SYS_memfd_create
+    *fd = syscall(SYS_memfd_create, "audio_sim", 0);
+    if (*fd >= 0) {
+        p = ftruncate(*fd, bytes) == 0 ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0) : MAP_FAILED;
+        if (p != MAP_FAILED) return (uint8_t*)p;
+        close(*fd);
+    }
+#endif
+    *fd = -1;
+    return (uint8_t*)calloc(1, bytes);
+}
+
+static unsigned int asim_format_bytes(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S8:      return 1;
+    case PCM_FORMAT_S24_3LE: return 3;
+    case PCM_FORMAT_S24_LE:
+    case PCM_FORMAT_S32_LE:  return 4;
+    default:                 return 2;
+    }
+}
+
+// 函数实现
+void asim_set_jitter(int us)
+{
+    __atomic_store_n(&g_jitter, us > 0 ? us : 0, __ATOMIC_RELAXED);
+}
+
+void asim_set_ctl_delay(int us)
+{
+    __atomic_store_n(&g_ctl_us, us > 0 ? us : 0, __ATOMIC_RELAXED);
+}
+
+void asim_set_load(int threads)
+{
+    // busy threads can not be stopped, the count only grows
+    while (__atomic_load_n(&g_load, __ATOMIC_RELAXED) < threads && __atomic_load_n(&g_load, __ATOMIC_RELAXED) < ASIM_MAX_LOAD) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, asim_load_proc, NULL) != 0) break;
+        pthread_detach(thread);
+        __atomic_add_fetch(&g_load, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void asim_set_loopback(int ms)
+{
+    __atomic_store_n(&g_loop.delay_ms, ms > 0 ? ms : 0, __ATOMIC_RELAXED);
+}
+
+void asim_set_hdmi_sink(int channels)
+{
+    __atomic_store_n(&g_sink, channels < 0 ? 0 : channels > 8 ? 8 : channels, __ATOMIC_RELAXED);
+}
+
+uint32_t asim_get_xruns(void)
+{
+    return __atomic_load_n(&g_xruns, __ATOMIC_RELAXED);
+}
+
+struct pcm* pcm_open(unsigned int card, unsigned int device, unsigned int flags, struct pcm_config *config)
+{
+    struct pcm      *pcm = (struct pcm*)calloc(1, sizeof(struct pcm));
+    const ASIM_CARD *c   = card < ASIM_CARDS ? &g_cards[card] : NULL;
+    if (!pcm) return NULL;
+
+    pthread_once(&g_once, asim_init_once);
+    pthread_mutex_init(&pcm->lock, NULL);
+    pcm->card  = card;
+    pcm->flags = flags;
+    pcm->fd    = -1;
+    if (!c || device != 0 || ((flags & PCM_IN) && !c->capture)) {
+        snprintf(pcm->error, sizeof(pcm->error), "cannot open device (%u:%u) %s", card, device, (flags & PCM_IN) ? "in" : "out");
+        return pcm;
+    }
+    if (!config || config->rate < c->rate_min || config->rate > c->rate_max || config->channels < c->ch_min
+        || config->channels > c->ch_max || !(c->formats & (1 << config->format)) || config->period_size == 0) {
+        snprintf(pcm->error, sizeof(pcm->error), "cannot set hw params on card %u", card);
+        return pcm;
+    }
+
+    pcm->config = *config;
+    if (pcm->config.period_count < 2) pcm->config.period_count = 2;
+    pcm->buffer_size = pcm->config.period_size * pcm->config.period_count;
+    pcm->frame_bytes = pcm->config.channels * asim_format_bytes(pcm->config.format);
+    // thresholds default as tinyalsa sets them
+    if (!pcm->config.start_threshold) pcm->config.start_threshold = (flags & PCM_IN) ? 1 : pcm->buffer_size / 2;
+    if (!pcm->config.stop_threshold ) pcm->config.stop_threshold  = (flags & PCM_IN) ? pcm->buffer_size * 10 : pcm->buffer_size;
+    pthread_mutex_lock(&g_busy_lock);
+    if (g_busy[card][!!(flags & PCM_IN)]) {
+        pthread_mutex_unlock(&g_busy_lock);
+        snprintf(pcm->error, sizeof(pcm->error), "cannot open device (%u:%u) %s: device busy", card, device, (flags & PCM_IN) ? "in" : "out");
+        return pcm;
+    }
+    pcm->buf = asim_alloc_ring(pcm->buffer_size * pcm->frame_bytes, &pcm->fd);
+    if (!pcm->buf) {
+        pthread_mutex_unlock(&g_busy_lock);
+        snprintf(pcm->error, sizeof(pcm->error), "cannot allocate buffer");
+        return pcm;
+    }
+    g_busy[card][!!(flags & PCM_IN)] = 1;
+    pthread_mutex_unlock(&g_busy_lock);
+    asim_prepare(pcm);
+    pcm->ready = 1;
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (!pcm) return 0;
+    if (pcm->ready) {
+        pthread_mutex_lock(&g_busy_lock);
+        g_busy[pcm->card][!!(pcm->flags & PCM_IN)] = 0;
+        pthread_mutex_unlock(&g_busy_lock);
+    }
+    pthread_mutex_destroy(&pcm->lock);
+    if (pcm->fd >= 0) {
+        munmap(pcm->buf, pcm->buffer_size * pcm->frame_bytes);
+        close(pcm->fd);
+    } else {
+        free(pcm->buf);
+    }
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm && pcm->ready;
+}
+
+const char* pcm_get_error(struct pcm *pcm)
+{
+    return pcm ? pcm->error : "no memory";
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_size;
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->frame_bytes;
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / pcm->frame_bytes;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    int ret;
+    pthread_mutex_lock(&pcm->lock);
+    ret = asim_prepare(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+    int ret;
+    pthread_mutex_lock(&pcm->lock);
+    ret = asim_start(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    pthread_mutex_lock(&pcm->lock);
+    asim_stop(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    const uint8_t *src    = (const uint8_t*)data;
+    unsigned int   frames = count / pcm->frame_bytes;
+
+    pthread_mutex_lock(&pcm->lock);
+    while (frames > 0) {
+        unsigned int offset, n;
+        asim_restart_xrun(pcm);
+        asim_update(pcm);
+        if (pcm->state == ASIM_STATE_XRUN) continue;
+
+        n = (unsigned int)asim_avail(pcm);
+        if (n == 0) {
+            int64_t next = asim_next_period(pcm);
+            pthread_mutex_unlock(&pcm->lock);
+            asim_sleep_until(next);
+            pthread_mutex_lock(&pcm->lock);
+            continue;
+        }
+        offset = pcm->appl % pcm->buffer_size;
+        if (n > frames) n = frames;
+        if (n > pcm->buffer_size - offset) n = pcm->buffer_size - offset;
+        memcpy(pcm->buf + offset * pcm->frame_bytes, src, n * pcm->frame_bytes);
+        pcm->appl += n;
+        src       += n * pcm->frame_bytes;
+        frames    -= n;
+        if (pcm->state == ASIM_STATE_PREPARED && pcm->appl - pcm->hw >= pcm->config.start_threshold) asim_start(pcm);
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    uint8_t     *dst    = (uint8_t*)data;
+    unsigned int frames = count / pcm->frame_bytes;
+
+    pthread_mutex_lock(&pcm->lock);
+    while (frames > 0) {
+        unsigned int offset, n;
+        asim_restart_xrun(pcm);
+        asim_start(pcm);
+        asim_update(pcm);
+        if (pcm->state == ASIM_STATE_XRUN) continue;
+
+        n = (unsigned int)asim_avail(pcm);
+        if (n == 0) {
+            int64_t next = asim_next_period(pcm);
+            pthread_mutex_unlock(&pcm->lock);
+            asim_sleep_until(next);
+            pthread_mutex_lock(&pcm->lock);
+            continue;
+        }
+        offset = pcm->appl % pcm->buffer_size;
+        if (n > frames) n = frames;
+        if (n > pcm->buffer_size - offset) n = pcm->buffer_size - offset;
+        memcpy(dst, pcm->buf + offset * pcm->frame_bytes, n * pcm->frame_bytes);
+        pcm->appl += n;
+        dst       += n * pcm->frame_bytes;
+        frames    -= n;
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+// a pcm stopped by an xrun fails the hardware sync like the kernel does
+int pcm_mmap_avail(struct pcm *pcm)
+{
+    int ret;
+    pthread_mutex_lock(&pcm->lock);
+    asim_update(pcm);
+    ret = pcm->state == ASIM_STATE_XRUN ? -EPIPE : asim_avail(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+int pcm_avail_update(struct pcm *pcm)
+{
+    return pcm_mmap_avail(pcm);
+}
+
+int pcm_mmap_begin(struct pcm *pcm, void **areas, unsigned int *offset, unsigned int *frames)
+{
+    int avail;
+    pthread_mutex_lock(&pcm->lock);
+    avail   = asim_avail(pcm);
+    *areas  = pcm->buf;
+    *offset = pcm->appl % pcm->buffer_size;
+    if (avail < 0) avail = 0;
+    if (*frames > (unsigned int)avail) *frames = avail;
+    if (*frames > pcm->buffer_size - *offset) *frames = pcm->buffer_size - *offset;
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_mmap_commit(struct pcm *pcm, unsigned int offset, unsigned int frames)
+{
+    pthread_mutex_lock(&pcm->lock);
+    pcm->appl += frames;
+    pthread_mutex_unlock(&pcm->lock);
+    return frames;
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail, struct timespec *tstamp)
+{
+    int64_t ns;
+    int     ret = -1;
+
+    pthread_mutex_lock(&pcm->lock);
+    asim_update(pcm);
+    if (pcm->state == ASIM_STATE_RUNNING) {
+        // the hardware pointer is sampled when it last moved
+        ns = pcm->start_ns + asim_frames_to_ns(pcm, pcm->hw - pcm->start_hw);
+        tstamp->tv_sec  = ns / 1000000000LL;
+        tstamp->tv_nsec = ns % 1000000000LL;
+        *avail = asim_avail(pcm);
+        ret    = 0;
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+int pcm_get_poll_fd(struct pcm *pcm)
+{
+    return pcm->fd;
+}
+
+// hardware pointer and the time it got there, as the kernel status page of a mmap pcm gives them
+int pcm_mmap_get_hw_ptr(struct pcm *pcm, unsigned int *hw_ptr, struct timespec *tstamp)
+{
+    int64_t ns;
+    int     ret = -1;
+
+    pthread_mutex_lock(&pcm->lock);
+    asim_update(pcm);
+    if (pcm->state == ASIM_STATE_RUNNING) {
+        ns = pcm->start_ns + asim_frames_to_ns(pcm, pcm->hw - pcm->start_hw);
+        tstamp->tv_sec  = ns / 1000000000LL;
+        tstamp->tv_nsec = ns % 1000000000LL;
+        *hw_ptr = (unsigned int)pcm->hw;
+        ret     = 0;
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+struct pcm_params* pcm_params_get(unsigned int card, unsigned int device, unsigned int flags)
+{
+    struct pcm_params *params;
+    if (card >= ASIM_CARDS || device != 0 || ((flags & PCM_IN) && !g_cards[card].capture)) return NULL;
+    params = (struct pcm_params*)malloc(sizeof(struct pcm_params));
+    if (params) params->card = card;
+    return params;
+}
+
+void pcm_params_free(struct pcm_params *params)
+{
+    free(params);
+}
+
+unsigned int pcm_params_get_min(struct pcm_params *params, enum pcm_param param)
+{
+    const ASIM_CARD *c = &g_cards[params->card];
+    switch (param) {
+    case PCM_PARAM_RATE:        return c->rate_min;
+    case PCM_PARAM_CHANNELS:    return c->ch_min;
+    case PCM_PARAM_PERIOD_SIZE: return 16;
+    case PCM_PARAM_PERIODS:     return 2;
+    default:                    return 0;
+    }
+}
+
+unsigned int pcm_params_get_max(struct pcm_params *params, enum pcm_param param)
+{
+    const ASIM_CARD *c = &g_cards[params->card];
+    switch (param) {
+    case PCM_PARAM_RATE:        return c->rate_max;
+    case PCM_PARAM_CHANNELS:    return c->ch_max;
+    case PCM_PARAM_PERIOD_SIZE: return 16384;
+    case PCM_PARAM_PERIODS:     return 32;
+    default:                    return 0;
+    }
+}
+
+int pcm_params_format_test(struct pcm_params *params, enum pcm_format format)
+{
+    return format >= 0 && (g_cards[params->card].formats & (1 << format)) != 0;
+}
+
+struct mixer* mixer_open(unsigned int card)
+{
+    struct mixer *mixer;
+    unsigned int  i;
+    int           sink;
+    if (card >= ASIM_CARDS) return NULL;
+    pthread_once(&g_once, asim_init_once);
+
+    mixer = (struct mixer*)calloc(1, sizeof(struct mixer));
+    if (mixer && card == ASIM_CARD_CODEC) {
+        mixer->num = sizeof(g_codec_ctls) / sizeof(g_codec_ctls[0]);
+        for (i=0; i<mixer->num; i++) mixer->ctls[i].desc = &g_codec_ctls[i];
+    } else if (mixer && card == ASIM_CARD_HDMI) {
+        mixer->num = sizeof(g_hdmi_ctls) / sizeof(g_hdmi_ctls[0]);
+        for (i=0; i<mixer->num; i++) mixer->ctls[i].desc = &g_hdmi_ctls[i];
+        // the ELD is read when the sink is plugged, the driver leaves it empty without one
+        sink = __atomic_load_n(&g_sink, __ATOMIC_RELAXED);
+        if (sink) {
+            memcpy(mixer->ctls[0].bytes, g_hdmi_eld, ASIM_ELD_SIZE);
+            mixer->ctls[0].bytes[ASIM_ELD_LPCM] = (g_hdmi_eld[ASIM_ELD_LPCM] & ~0x07) | (sink - 1);
+            mixer->ctls[0].num_bytes = ASIM_ELD_SIZE;
+        }
+    }
+    return mixer;
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    free(mixer);
+}
+
+unsigned int mixer_get_num_ctls(struct mixer *mixer)
+{
+    return mixer->num;
+}
+
+struct mixer_ctl* mixer_get_ctl(struct mixer *mixer, unsigned int id)
+{
+    return id < mixer->num ? &mixer->ctls[id] : NULL;
+}
+
+struct mixer_ctl* mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    unsigned int i;
+    for (i=0; i<mixer->num; i++) {
+        if (strcmp(mixer->ctls[i].desc->name, name) == 0) return &mixer->ctls[i];
+    }
+    return NULL;
+}
+
+const char* mixer_ctl_get_name(struct mixer_ctl *ctl)
+{
+    return ctl->desc->name;
+}
+
+enum mixer_ctl_type mixer_ctl_get_type(struct mixer_ctl *ctl)
+{
+    return ctl->desc->type;
+}
+
+unsigned int mixer_ctl_get_num_values(struct mixer_ctl *ctl)
+{
+    return ctl->desc->type == MIXER_CTL_TYPE_BYTE ? ctl->num_bytes : (unsigned int)ctl->desc->num_values;
+}
+
+unsigned int mixer_ctl_get_num_enums(struct mixer_ctl *ctl)
+{
+    return ctl->desc->type == MIXER_CTL_TYPE_ENUM ? ctl->desc->max + 1 : 0;
+}
+
+const char* mixer_ctl_get_enum_string(struct mixer_ctl *ctl, unsigned int enum_id)
+{
+    return enum_id < mixer_ctl_get_num_enums(ctl) ? ctl->desc->enums[enum_id] : NULL;
+}
+
+int mixer_ctl_get_range_min(struct mixer_ctl *ctl)
+{
+    return ctl->desc->min;
+}
+
+int mixer_ctl_get_range_max(struct mixer_ctl *ctl)
+{
+    return ctl->desc->max;
+}
+
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    return id < (unsigned int)ctl->desc->num_values ? ctl->values[id] : -EINVAL;
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    if (id >= (unsigned int)ctl->desc->num_values || value < ctl->desc->min || value > ctl->desc->max) return -EINVAL;
+    ctl->values[id] = value;
+    asim_ctl_write();
+    return 0;
+}
+
+// byte controls copy bytes, int controls take longs like tinyalsa does
+int mixer_ctl_get_array(struct mixer_ctl *ctl, void *array, size_t count)
+{
+    size_t i;
+    if (count > mixer_ctl_get_num_values(ctl)) return -EINVAL;
+    if (ctl->desc->type == MIXER_CTL_TYPE_BYTE) {
+        memcpy(array, ctl->bytes, count);
+    } else {
+        for (i=0; i<count; i++) ((long*)array)[i] = ctl->values[i];
+    }
+    return 0;
+}
+
+int mixer_ctl_set_array(struct mixer_ctl *ctl, const void *array, size_t count)
+{
+    size_t i;
+    if (count > mixer_ctl_get_num_values(ctl) || ctl->desc->type == MIXER_CTL_TYPE_BYTE) return -EINVAL;
+    for (i=0; i<count; i++) {
+        long v = ((const long*)array)[i];
+        if (v < ctl->desc->min || v > ctl->desc->max) return -EINVAL;
+    }
+    for (i=0; i<count; i++) ctl->values[i] = (int)((const long*)array)[i];
+    asim_ctl_write();
+    return 0;
+}
+
+int mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string)
+{
+    unsigned int i, n = mixer_ctl_get_num_enums(ctl);
+    for (i=0; i<n; i++) {
+        if (strcmp(ctl->desc->enums[i], string) == 0) {
+            ctl->values[0] = i;
+            asim_ctl_write();
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
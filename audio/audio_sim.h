@@ -0,0 +1,27 @@
+#ifndef __AUDIO_SIM_H__
+#define __AUDIO_SIM_H__
+
+#include <stdint.h>
+
+// 常量定义
+#define ASIM_CARD_CODEC  0  // playback and capture, codec controls and a volume control
+#define ASIM_CARD_HDMI   1  // playback only, 32 to 192kHz, 16 and 24bit, ELD of a 7.1 sink
+#define ASIM_CARD_SPDIF  2  // playback only
+
+// 函数声明
+// simulated tinyalsa backend, linked instead of libtinyalsa the hal runs unchanged on a host or a
+// board without the codec. every pcm is driven by CLOCK_MONOTONIC at period granularity like a dma
+// interrupt, hardware timestamps are the period boundaries and xruns happen as on a real card.
+// a capture pcm produces a 1kHz sine, or with the loopback on hears the codec playback. like alsa
+// a card opens one playback and one capture pcm at a time, and the ring of a pcm is shared memory
+// a mmap client maps through pcm_get_poll_fd.
+// AUDIO_SIM_JITTER_US, AUDIO_SIM_LOAD_THREADS, AUDIO_SIM_LOOPBACK_MS, AUDIO_SIM_HDMI_SINK and
+// AUDIO_SIM_CTL_US in the environment set the functions below before the first pcm or mixer is opened
+void     asim_set_jitter  (int us);      // random extra delay of every period wakeup, models scheduling latency
+void     asim_set_load    (int threads); // busy threads competing with the audio threads for the cpu
+void     asim_set_loopback(int ms);      // codec capture hears codec playback ms later, like a speaker to mic path, 0 is off
+void     asim_set_hdmi_sink(int channels); // lpcm channels the hdmi sink reports in its ELD, 0 unplugs it
+void     asim_set_ctl_delay(int us);   // time every mixer control write takes, like a codec behind i2c
+uint32_t asim_get_xruns (void);        // xruns of all simulated pcms so far
+
+#endif
@@ -0,0 +1,232 @@
+#define LOG_TAG "audio_src"
+
+// 包含头文件
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ASRC_NEON  1
+#endif
+#include "audio_src.h"
+
+// 内部常量定义
+#define ASRC_PHASE_BITS  7                     // 128 phases, coefficients are interpolated in between
+#define ASRC_PHASES      (1 << ASRC_PHASE_BITS)
+#define ASRC_MIN_TAPS    32
+#define ASRC_MAX_TAPS    128
+#define ASRC_KAISER_BETA 8.0
+#define ASRC_PASSBAND    0.92                  // cutoff relative to the lower nyquist frequency
+
+// 内部类型定义
+typedef struct {
+    int       inrate;
+    int       outrate;
+    int       inch;
+    int       outch;
+    int       planes;   // history planes, 1 when channels are mixed
+    int       taps;
+    uint64_t  step;     // input frames per output frame, Q32
+    uint64_t  pos;      // position of next output in hist, Q32
+    int       fill;     // frames in hist
+    float    *coef;     // (ASRC_PHASES + 1) rows of taps
+    float    *delta;    // coef[p + 1] - coef[p], so interpolation is one multiply-add
+    float    *hist[ASRC_MAX_CHANNELS]; // planar history, taps + ASRC_BLOCK frames
+} ASRC;
+
+// 内部函数实现
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0, k;
+    for (k=1; k<32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum  += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+static void build_table(ASRC *src)
+{
+    double fc   = ASRC_PASSBAND * (src->outrate < src->inrate ? (double)src->outrate / src->inrate : 1.0);
+    double half = src->taps / 2.0;
+    double i0b  = bessel_i0(ASRC_KAISER_BETA);
+    int    p, k;
+
+    for (p=0; p<=ASRC_PHASES; p++) {
+        float *row = src->coef + p * src->taps;
+        double sum = 0;
+        for (k=0; k<src->taps; k++) {
+            // output lies between hist[taps/2 - 1] and hist[taps/2], p / ASRC_PHASES past the former
+            double t = k - (half - 1) - (double)p / ASRC_PHASES;
+            double w = t / half;
+            double h = t == 0 ? fc : sin(M_PI * fc * t) / (M_PI * t);
+            w = fabs(w) >= 1 ? 0 : bessel_i0(ASRC_KAISER_BETA * sqrt(1 - w * w)) / i0b;
+            row[k] = (float)(h * w);
+            sum   += h * w;
+        }
+        for (k=0; k<src->taps; k++) row[k] = (float)(row[k] / sum); // unity dc gain for every phase
+    }
+    for (p=0; p<ASRC_PHASES; p++) {
+        for (k=0; k<src->taps; k++) {
+            src->delta[p * src->taps + k] = src->coef[(p + 1) * src->taps + k] - src->coef[p * src->taps + k];
+        }
+    }
+}
+
+static inline int16_t to_s16(float v)
+{
+    v *= 32768.0f;
+    return v >= 32767.0f ? 32767 : v <= -32768.0f ? -32768 : (int16_t)lrintf(v);
+}
+
+// convert to float planar history, down mix stereo to mono on the way
+static void load_input(ASRC *src, const int16_t *in, int frames)
+{
+    float *h0 = src->hist[0] + src->fill;
+    float *h1 = src->hist[1] + src->fill;
+    int    i  = 0;
+
+    if (src->inch == 1) {
+#ifdef ASRC_NEON
+        for (; i + 4 <= frames; i += 4) {
+            vst1q_f32(h0 + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vld1_s16(in + i))), 1.0f / 32768.0f));
+        }
+#endif
+        for (; i < frames; i++) h0[i] = in[i] * (1.0f / 32768.0f);
+    } else if (src->planes == 1) {
+#ifdef ASRC_NEON
+        for (; i + 4 <= frames; i += 4) {
+            int16x4x2_t s = vld2_s16(in + i * 2);
+            vst1q_f32(h0 + i, vmulq_n_f32(vcvtq_f32_s32(vaddl_s16(s.val[0], s.val[1])), 1.0f / 65536.0f));
+        }
+#endif
+        for (; i < frames; i++) h0[i] = (in[i * 2] + in[i * 2 + 1]) * (1.0f / 65536.0f);
+    } else {
+#ifdef ASRC_NEON
+        for (; i + 4 <= frames; i += 4) {
+            int16x4x2_t s = vld2_s16(in + i * 2);
+            vst1q_f32(h0 + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(s.val[0])), 1.0f / 32768.0f));
+            vst1q_f32(h1 + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(s.val[1])), 1.0f / 32768.0f));
+        }
+#endif
+        for (; i < frames; i++) {
+            h0[i] = in[i * 2 + 0] * (1.0f / 32768.0f);
+            h1[i] = in[i * 2 + 1] * (1.0f / 32768.0f);
+        }
+    }
+    src->fill += frames;
+}
+
+// 函数实现
+void* asrc_init(int inrate, int outrate, int inch, int outch)
+{
+    ASRC *src;
+    int   taps, c;
+    if (inrate <= 0 || outrate <= 0 || inch  < 1 || inch  > ASRC_MAX_CHANNELS
+                                    || outch < 1 || outch > ASRC_MAX_CHANNELS) return NULL;
+
+    // keep about the same number of zero crossings when the cutoff drops for down sampling
+    taps = outrate < inrate ? (int)((int64_t)ASRC_MIN_TAPS * inrate / outrate) : ASRC_MIN_TAPS;
+    taps = (taps + 3) & ~3;
+    if (taps > ASRC_MAX_TAPS) taps = ASRC_MAX_TAPS;
+
+    src = (ASRC*)calloc(1, sizeof(ASRC));
+    if (!src) return NULL;
+    src->inrate   = inrate;
+    src->outrate  = outrate;
+    src->inch     = inch;
+    src->outch    = outch;
+    src->planes   = inch == outch ? inch : 1;
+    src->taps     = taps;
+    src->step     = ((uint64_t)inrate << 32) / outrate;
+    src->coef     = (float*)malloc((ASRC_PHASES + 1) * taps * sizeof(float));
+    src->delta    = (float*)malloc( ASRC_PHASES      * taps * sizeof(float));
+    for (c=0; c<src->planes; c++) {
+        src->hist[c] = (float*)malloc((taps + ASRC_BLOCK) * sizeof(float));
+    }
+    if (!src->coef || !src->delta || !src->hist[0] || (src->planes == 2 && !src->hist[1])) {
+        asrc_close(src);
+        return NULL;
+    }
+    build_table(src);
+    asrc_reset(src);
+    return src;
+}
+
+void asrc_close(void *ctxt)
+{
+    ASRC *src = (ASRC*)ctxt;
+    int   c;
+    if (!src) return;
+    for (c=0; c<ASRC_MAX_CHANNELS; c++) free(src->hist[c]);
+    free(src->coef );
+    free(src->delta);
+    free(src);
+}
+
+void asrc_reset(void *ctxt)
+{
+    ASRC *src = (ASRC*)ctxt;
+    int   c;
+    if (!src) return;
+    // prime with silence so the first input frame lines up with the filter center
+    src->fill = src->taps / 2 - 1;
+    src->pos  = 0;
+    for (c=0; c<src->planes; c++) memset(src->hist[c], 0, src->fill * sizeof(float));
+}
+
+int asrc_max_out(void *ctxt, int inframes)
+{
+    ASRC *src = (ASRC*)ctxt;
+    return (int)(((int64_t)inframes * src->outrate + src->inrate - 1) / src->inrate) + 2;
+}
+
+int asrc_process(void *ctxt, const int16_t *in, int inframes, int16_t *out)
+{
+    ASRC  *src  = (ASRC*)ctxt;
+    int    taps = src->taps;
+    int    ch   = src->planes;
+    int    n    = 0, c, k, used;
+
+    if (inframes > ASRC_BLOCK) inframes = ASRC_BLOCK;
+    load_input(src, in, inframes);
+
+    while ((int)(src->pos >> 32) + taps <= src->fill) {
+        int          idx   = (int)(src->pos >> 32);
+        uint32_t     frac  = (uint32_t)src->pos;
+        int          p     = frac >> (32 - ASRC_PHASE_BITS);
+        float        a     = (float)(frac << ASRC_PHASE_BITS) * (1.0f / 4294967296.0f);
+        const float *coef  = src->coef  + p * taps;
+        const float *delta = src->delta + p * taps;
+        for (c=0; c<ch; c++) {
+            const float *h   = src->hist[c] + idx;
+            float        acc = 0;
+            k = 0;
+#ifdef ASRC_NEON
+            float32x4_t va  = vdupq_n_f32(a);
+            float32x4_t sum = vdupq_n_f32(0);
+            for (; k<taps; k+=4) {
+                float32x4_t cf = vmlaq_f32(vld1q_f32(coef + k), vld1q_f32(delta + k), va);
+                sum = vmlaq_f32(sum, vld1q_f32(h + k), cf);
+            }
+            float32x2_t s2 = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+            acc = vget_lane_f32(vpadd_f32(s2, s2), 0);
+#endif
+            for (; k<taps; k++) acc += h[k] * (coef[k] + a * delta[k]);
+            out[n * src->outch + c] = to_s16(acc);
+        }
+        if (ch < src->outch) out[n * 2 + 1] = out[n * 2]; // mono to stereo
+        src->pos += src->step;
+        n++;
+    }
+
+    // drop history no longer needed by any future output
+    used = (int)(src->pos >> 32);
+    if (used > 0) {
+        for (c=0; c<ch; c++) memmove(src->hist[c], src->hist[c] + used, (src->fill - used) * sizeof(float));
+        src->fill -= used;
+        src->pos  -= (uint64_t)used << 32;
+    }
+    return n;
+}
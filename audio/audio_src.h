@@ -0,0 +1,19 @@
+#ifndef __AUDIO_SRC_H__
+#define __AUDIO_SRC_H__
+
+#include <stdint.h>
+
+// 常量定义
+#define ASRC_MAX_CHANNELS  2
+#define ASRC_BLOCK         1024  // max input frames per asrc_process call
+
+// 函数声明
+// polyphase windowed sinc sample rate converter, 16bit interleaved in/out,
+// mono <-> stereo conversion is done in the same pass when inch != outch
+void* asrc_init    (int inrate, int outrate, int inch, int outch);
+void  asrc_close   (void *ctxt);
+void  asrc_reset   (void *ctxt);
+int   asrc_max_out (void *ctxt, int inframes); // output frames needed for inframes of input
+int   asrc_process (void *ctxt, const int16_t *in, int inframes, int16_t *out); // return output frames
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef __AUDIO_STATS_H__
+#define __AUDIO_STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// 常量定义
+#define ASTATS_XRUN_HIST    8  // timestamps of the most recent xruns kept for dump
+#define ASTATS_JITTER_BINS  6  // deviation of the call interval from the buffer duration
+
+static const int ASTATS_JITTER_MS[ASTATS_JITTER_BINS - 1] = { 1, 2, 5, 10, 20 };
+
+// 类型定义
+// per stream telemetry, updated only by the audio thread of the stream and read by dump without
+// any lock. every field is accessed with relaxed atomics, so a dump may mix two consecutive calls
+typedef struct {
+    uint32_t  xruns;
+    int64_t   xrun_ns[ASTATS_XRUN_HIST]; // CLOCK_MONOTONIC, slot xruns % ASTATS_XRUN_HIST is the oldest
+    uint32_t  errors;     // failed pcm writes or reads
+    int32_t   last_error;
+    uint32_t  calls;      // intervals measured
+    int64_t   last_call;  // CLOCK_MONOTONIC ns of the previous call, 0 when the next interval does not count
+    int64_t   jitter_max; // ns
+    uint32_t  jitter[ASTATS_JITTER_BINS];
+    uint32_t  fills;      // kernel buffer fill samples
+    uint32_t  fill_min;   // frames
+    uint32_t  fill_max;
+    uint32_t  fill_last;
+} AUDIO_STATS;
+
+// 函数实现
+static inline int64_t astats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// stream left steady state (standby, resume), the next interval is not jitter
+static inline void astats_break(AUDIO_STATS *s)
+{
+    __atomic_store_n(&s->last_call, 0, __ATOMIC_RELAXED);
+}
+
+// called once per write or read, period_ns is the duration of the buffer passed
+static inline void astats_call(AUDIO_STATS *s, int64_t now, int64_t period_ns)
+{
+    int64_t last = __atomic_load_n(&s->last_call, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->last_call, now, __ATOMIC_RELAXED);
+    if (last) {
+        int64_t dev = now - last - period_ns;
+        int     bin = 0;
+        if (dev < 0) dev = -dev;
+        while (bin < ASTATS_JITTER_BINS - 1 && dev >= ASTATS_JITTER_MS[bin] * 1000000LL) bin++;
+        __atomic_add_fetch(&s->jitter[bin], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+        if (dev > __atomic_load_n(&s->jitter_max, __ATOMIC_RELAXED)) __atomic_store_n(&s->jitter_max, dev, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void astats_xrun(AUDIO_STATS *s, int64_t now)
+{
+    uint32_t n = __atomic_load_n(&s->xruns, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->xrun_ns[n % ASTATS_XRUN_HIST], now, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->xruns, n + 1, __ATOMIC_RELEASE);
+}
+
+// return the error count, callers log when it is a power of 2 so a dead pcm does not flood logcat
+static inline uint32_t astats_error(AUDIO_STATS *s, int err)
+{
+    __atomic_store_n(&s->last_error, err, __ATOMIC_RELAXED);
+    return __atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+}
+
+static inline void astats_fill(AUDIO_STATS *s, uint32_t frames)
+{
+    uint32_t n = __atomic_load_n(&s->fills, __ATOMIC_RELAXED);
+    if (n == 0 || frames < __atomic_load_n(&s->fill_min, __ATOMIC_RELAXED)) __atomic_store_n(&s->fill_min, frames, __ATOMIC_RELAXED);
+    if (n == 0 || frames > __atomic_load_n(&s->fill_max, __ATOMIC_RELAXED)) __atomic_store_n(&s->fill_max, frames, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->fill_last, frames, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->fills, n + 1, __ATOMIC_RELAXED);
+}
+
+static inline void astats_dump(AUDIO_STATS *s, int fd, const char *prefix)
+{
+    int64_t  now   = astats_now();
+    uint32_t xruns = __atomic_load_n(&s->xruns, __ATOMIC_ACQUIRE);
+    uint32_t i, n;
+
+    dprintf(fd, "%s%u xruns, %u errors (last %d)\n", prefix, xruns,
+        __atomic_load_n(&s->errors, __ATOMIC_RELAXED), __atomic_load_n(&s->last_error, __ATOMIC_RELAXED));
+    if (xruns) {
+        n = xruns < ASTATS_XRUN_HIST ? xruns : ASTATS_XRUN_HIST;
+        dprintf(fd, "%s  last xruns (s ago):", prefix);
+        for (i=1; i<=n; i++) {
+            int64_t ns = __atomic_load_n(&s->xrun_ns[(xruns - i) % ASTATS_XRUN_HIST], __ATOMIC_RELAXED);
+            dprintf(fd, " %lld.%03lld", (long long)((now - ns) / 1000000000LL), (long long)((now - ns) / 1000000 % 1000));
+        }
+        dprintf(fd, "\n");
+    }
+    if (__atomic_load_n(&s->calls, __ATOMIC_RELAXED)) {
+        dprintf(fd, "%s  interval jitter: <1ms %u, <2ms %u, <5ms %u, <10ms %u, <20ms %u, >=20ms %u, max %lldus\n", prefix,
+            __atomic_load_n(&s->jitter[0], __ATOMIC_RELAXED), __atomic_load_n(&s->jitter[1], __ATOMIC_RELAXED),
+            __atomic_load_n(&s->jitter[2], __ATOMIC_RELAXED), __atomic_load_n(&s->jitter[3], __ATOMIC_RELAXED),
+            __atomic_load_n(&s->jitter[4], __ATOMIC_RELAXED), __atomic_load_n(&s->jitter[5], __ATOMIC_RELAXED),
+            (long long)(__atomic_load_n(&s->jitter_max, __ATOMIC_RELAXED) / 1000));
+    }
+    if (__atomic_load_n(&s->fills, __ATOMIC_RELAXED)) {
+        dprintf(fd, "%s  kernel buffer fill: %u frames now, min %u, max %u\n", prefix,
+            __atomic_load_n(&s->fill_last, __ATOMIC_RELAXED), __atomic_load_n(&s->fill_min, __ATOMIC_RELAXED),
+            __atomic_load_n(&s->fill_max, __ATOMIC_RELAXED));
+    }
+}
+
+#endif
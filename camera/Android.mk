@@ -25,6 +25,8 @@ LOCAL_C_INCLUDES += \
 
 LOCAL_SRC_FILES := \
     v4l2dev.cpp \
+    cam3a.cpp \
+    camparam.cpp \
     camdev.cpp \
     camhal.cpp
 
@@ -33,6 +35,8 @@ LOCAL_SHARED_LIBRARIES := \
     libcutils \
     libui
 
+LOCAL_ARM_NEON := true
+
 LOCAL_CFLAGS += -Wall -Wextra -fvisibility=hidden
 #LOCAL_CFLAGS += -DANDROID_5_1
 
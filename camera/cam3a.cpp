@@ -0,0 +1,366 @@
+#define LOG_TAG "cam3a"
+
+// 包含头文件
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/videodev2.h>
+#include <utils/Log.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CAM3A_NEON  1
+#endif
+#include "v4l2dev.h"
+#include "cam3a.h"
+
+// 内部常量定义
+#define CAM3A_SAMPLE_ROWS   96   // about this many luma rows are sampled per frame
+#define CAM3A_AE_INTERVAL   3    // sensors apply new exposure 2 ~ 3 frames later
+#define CAM3A_AE_TARGET     120  // target mean luma
+#define CAM3A_AE_DEADBAND   20   // Q8, no change while |ratio - 1| < 8%
+#define CAM3A_AWB_Y_MIN     32   // zones darker or brighter than this are not gray world candidates
+#define CAM3A_AWB_Y_MAX     224
+#define CAM3A_AWB_DEADBAND  8    // Q8
+#define CAM3A_LOG_INTERVAL  300  // frames between two timing reports
+
+// 内部类型定义
+typedef struct {
+    uint32_t id;
+    int      avail;
+    int      min;
+    int      max;
+    int      step;
+    int      cur;
+} CAM3A_CTRL;
+
+typedef struct {
+    void        *v4l2;
+    CAM3A_STATS  stats;
+    uint32_t     frame;
+    CAM3A_CTRL   exposure;
+    CAM3A_CTRL   gain;
+    CAM3A_CTRL   rbal;
+    CAM3A_CTRL   bbal;
+    CAM3A_CTRL   wbtemp;
+    uint32_t     cost_sum; // us
+    uint32_t     cost_max; // us
+} CAM3A;
+
+// 内部函数实现
+static int query_ctrl(void *v4l2, uint32_t id, CAM3A_CTRL *ctrl)
+{
+    V4L2DEV_CTRL_INFO info;
+    if (v4l2dev_ctrl_query(v4l2, id, &info) != 0) {
+        ctrl->avail = 0;
+        return -1;
+    }
+    ctrl->id    = id;
+    ctrl->avail = 1;
+    ctrl->min   = info.min;
+    ctrl->max   = info.max;
+    ctrl->step  = info.step;
+    ctrl->cur   = info.cur;
+    return 0;
+}
+
+// stage all changed controls, they go to the driver in one VIDIOC_S_EXT_CTRLS
+static int apply_ctrls(void *v4l2, uint32_t *ids, int *vals, int n)
+{
+    int i;
+    if (n <= 0) return 0;
+    for (i=0; i<n; i++) v4l2dev_ctrl_set(v4l2, ids[i], vals[i]);
+    return v4l2dev_ctrl_flush(v4l2);
+}
+
+static int clamp_ctrl(CAM3A_CTRL *ctrl, int64_t val)
+{
+    if (val < ctrl->min) val = ctrl->min;
+    if (val > ctrl->max) val = ctrl->max;
+    return (int)(ctrl->min + (val - ctrl->min) / ctrl->step * ctrl->step);
+}
+
+// scale a control value by a Q8 ratio, always moving by at least one step
+static int scale_ctrl(CAM3A_CTRL *ctrl, int ratio)
+{
+    int val = clamp_ctrl(ctrl, ((int64_t)ctrl->cur * ratio + 128) >> 8);
+    if (val == ctrl->cur) {
+        if (ratio > 256) val = clamp_ctrl(ctrl, (int64_t)ctrl->cur + ctrl->step);
+        if (ratio < 256) val = clamp_ctrl(ctrl, (int64_t)ctrl->cur - ctrl->step);
+    }
+    return val;
+}
+
+#ifdef CAM3A_NEON
+static inline uint32_t hsum_u16(uint16x8_t v)
+{
+    uint64x2_t s = vpaddlq_u32(vpaddlq_u16(v));
+    return (uint32_t)(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+}
+#endif
+
+// sum lane 0 ~ 3 of every 4 bytes group in [p, p + n), and histogram lane 0 if hist is not NULL
+static void sum_span(const uint8_t *p, int n, uint32_t sum[4], uint32_t *hist)
+{
+    int i = 0;
+#ifdef CAM3A_NEON
+    uint8_t    tmp[16];
+    uint16x8_t acc0 = vdupq_n_u16(0), acc1 = vdupq_n_u16(0), acc2 = vdupq_n_u16(0), acc3 = vdupq_n_u16(0);
+    int        blocks = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint8x16x4_t px = vld4q_u8(p + i);
+        acc0 = vaddq_u16(acc0, vpaddlq_u8(px.val[0]));
+        acc1 = vaddq_u16(acc1, vpaddlq_u8(px.val[1]));
+        acc2 = vaddq_u16(acc2, vpaddlq_u8(px.val[2]));
+        acc3 = vaddq_u16(acc3, vpaddlq_u8(px.val[3]));
+        if (hist) {
+            int j;
+            vst1q_u8(tmp, vshrq_n_u8(px.val[0], 2));
+            for (j=0; j<16; j++) hist[tmp[j]]++;
+        }
+        if (++blocks == 128) { // keep u16 lanes from overflow
+            sum[0] += hsum_u16(acc0); acc0 = vdupq_n_u16(0);
+            sum[1] += hsum_u16(acc1); acc1 = vdupq_n_u16(0);
+            sum[2] += hsum_u16(acc2); acc2 = vdupq_n_u16(0);
+            sum[3] += hsum_u16(acc3); acc3 = vdupq_n_u16(0);
+            blocks  = 0;
+        }
+    }
+    sum[0] += hsum_u16(acc0);
+    sum[1] += hsum_u16(acc1);
+    sum[2] += hsum_u16(acc2);
+    sum[3] += hsum_u16(acc3);
+#endif
+    for (; i + 4 <= n; i += 4) {
+        sum[0] += p[i + 0];
+        sum[1] += p[i + 1];
+        sum[2] += p[i + 2];
+        sum[3] += p[i + 3];
+        if (hist) hist[p[i] >> 2]++;
+    }
+}
+
+static uint8_t clip_u8(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static void run_ae(CAM3A *cam, uint32_t *ids, int *vals, int *n)
+{
+    CAM3A_STATS *stats  = &cam->stats;
+    int          target = CAM3A_AE_TARGET;
+    int          mean   = stats->mean_y > 0 ? stats->mean_y : 1;
+    int          ratio, bright, exp, gain;
+
+    if (!cam->exposure.avail && !cam->gain.avail) return;
+
+    // aim lower if more than 2% of the samples are clipped highlights
+    bright = stats->hist[CAM3A_HIST_BINS - 1] + stats->hist[CAM3A_HIST_BINS - 2];
+    if (bright * 50 > (int)stats->total) target = target * 3 / 4;
+
+    ratio = target * 256 / mean;
+    if (abs(ratio - 256) < CAM3A_AE_DEADBAND) return;
+    ratio = 256 + (ratio - 256) / 2; // damping
+    if (ratio < 128) ratio = 128;
+    if (ratio > 512) ratio = 512;
+
+    exp  = cam->exposure.cur;
+    gain = cam->gain.cur;
+    if (ratio > 256) {
+        // brighter: longer exposure first, then the rest as gain
+        if (cam->exposure.avail) exp = scale_ctrl(&cam->exposure, ratio);
+        if (cam->gain.avail && (!cam->exposure.avail || exp == cam->exposure.cur)) {
+            gain = scale_ctrl(&cam->gain, ratio);
+        }
+    } else {
+        // darker: drop gain first to keep noise low, then exposure
+        if (cam->gain.avail && cam->gain.cur > cam->gain.min) gain = scale_ctrl(&cam->gain, ratio);
+        else if (cam->exposure.avail) exp = scale_ctrl(&cam->exposure, ratio);
+    }
+
+    if (cam->exposure.avail && exp != cam->exposure.cur) {
+        ids[*n] = cam->exposure.id; vals[(*n)++] = exp;
+        cam->exposure.cur = exp;
+    }
+    if (cam->gain.avail && gain != cam->gain.cur) {
+        ids[*n] = cam->gain.id; vals[(*n)++] = gain;
+        cam->gain.cur = gain;
+    }
+}
+
+static void run_awb(CAM3A *cam, uint32_t *ids, int *vals, int *n)
+{
+    CAM3A_STATS *stats = &cam->stats;
+    uint32_t     r = 0, g = 0, b = 0;
+    int          zones = 0, rg, bg, i, j;
+
+    for (i=0; i<CAM3A_ZONE_ROWS; i++) {
+        for (j=0; j<CAM3A_ZONE_COLS; j++) {
+            int y = stats->zone_y[i][j];
+            if (y < CAM3A_AWB_Y_MIN || y > CAM3A_AWB_Y_MAX) continue;
+            r += stats->zone_r[i][j];
+            g += stats->zone_g[i][j];
+            b += stats->zone_b[i][j];
+            zones++;
+        }
+    }
+    if (zones < 4 || !r || !b) return;
+
+    // gray world, gains in Q8 to bring r and b to g
+    rg = g * 256 / r;
+    bg = g * 256 / b;
+    if (abs(rg - 256) < CAM3A_AWB_DEADBAND && abs(bg - 256) < CAM3A_AWB_DEADBAND) return;
+    rg = 256 + (rg - 256) / 2;
+    bg = 256 + (bg - 256) / 2;
+
+    if (cam->rbal.avail && cam->bbal.avail) {
+        int rv = scale_ctrl(&cam->rbal, rg);
+        int bv = scale_ctrl(&cam->bbal, bg);
+        if (rv != cam->rbal.cur) { ids[*n] = cam->rbal.id; vals[(*n)++] = rv; cam->rbal.cur = rv; }
+        if (bv != cam->bbal.cur) { ids[*n] = cam->bbal.id; vals[(*n)++] = bv; cam->bbal.cur = bv; }
+    } else if (cam->wbtemp.avail) {
+        // a blue cast means the illuminant is hotter than the current setting
+        int tv = clamp_ctrl(&cam->wbtemp, (int64_t)cam->wbtemp.cur + (int)(b * 256 / r - 256) * 10);
+        if (tv != cam->wbtemp.cur) { ids[*n] = cam->wbtemp.id; vals[(*n)++] = tv; cam->wbtemp.cur = tv; }
+    }
+}
+
+// 函数实现
+int cam3a_stats(uint8_t *data, int pixfmt, int w, int h, int stride, CAM3A_STATS *stats)
+{
+    uint32_t sum_y[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS] = {{0}};
+    uint32_t sum_u[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS] = {{0}};
+    uint32_t sum_v[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS] = {{0}};
+    uint32_t cnt  [CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS] = {{0}};
+    uint32_t wsum = 0, wcnt = 0;
+    int      ystep, bpp, i, y, r, c;
+
+    switch (pixfmt) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21: bpp = 1; break;
+    case V4L2_PIX_FMT_YUYV: bpp = 2; break;
+    default: return -1;
+    }
+    if (!data || w < CAM3A_ZONE_COLS * 4 || h < CAM3A_ZONE_ROWS * 2) return -1;
+    if (stride < w * bpp) stride = w * bpp;
+
+    memset(stats->hist, 0, sizeof(stats->hist));
+    ystep = (h / CAM3A_SAMPLE_ROWS) & ~1;
+    if (ystep < 2) ystep = 2;
+
+    for (y=0; y<h; y+=ystep) {
+        uint8_t *row = data + y * stride;
+        uint8_t *uv  = data + stride * h + (y / 2) * stride;
+        r = y * CAM3A_ZONE_ROWS / h;
+        for (c=0; c<CAM3A_ZONE_COLS; c++) {
+            int      x0 = ((c + 0) * w / CAM3A_ZONE_COLS * bpp) & ~3;
+            int      x1 = ((c + 1) * w / CAM3A_ZONE_COLS * bpp) & ~3;
+            uint32_t s[4] = {0};
+            sum_span(row + x0, x1 - x0, s, stats->hist);
+            sum_y[r][c] += s[0];
+            if (pixfmt == V4L2_PIX_FMT_YUYV) {
+                sum_u[r][c] += s[1];
+                sum_v[r][c] += s[3];
+            } else {
+                uint32_t t[4] = {0};
+                sum_span(uv + x0, x1 - x0, t, NULL);
+                sum_u[r][c] += pixfmt == V4L2_PIX_FMT_NV12 ? t[0] : t[1];
+                sum_v[r][c] += pixfmt == V4L2_PIX_FMT_NV12 ? t[1] : t[0];
+            }
+            cnt[r][c] += (x1 - x0) / 4;
+        }
+    }
+
+    stats->total = 0;
+    for (r=0; r<CAM3A_ZONE_ROWS; r++) {
+        for (c=0; c<CAM3A_ZONE_COLS; c++) {
+            int n = cnt[r][c] ? cnt[r][c] : 1;
+            int yy, uu, vv, wt;
+            yy = sum_y[r][c] / n;
+            uu = sum_u[r][c] / n - 128;
+            vv = sum_v[r][c] / n - 128;
+            stats->zone_y[r][c] = clip_u8(yy);
+            stats->zone_u[r][c] = clip_u8(uu + 128);
+            stats->zone_v[r][c] = clip_u8(vv + 128);
+            // bt.601, Q8
+            stats->zone_r[r][c] = clip_u8(yy + ((359 * vv) >> 8));
+            stats->zone_g[r][c] = clip_u8(yy - ((88 * uu + 183 * vv) >> 8));
+            stats->zone_b[r][c] = clip_u8(yy + ((454 * uu) >> 8));
+            // center zones count twice for exposure
+            wt    = (r >= CAM3A_ZONE_ROWS / 4 && r < CAM3A_ZONE_ROWS * 3 / 4 && c >= CAM3A_ZONE_COLS / 4 && c < CAM3A_ZONE_COLS * 3 / 4) ? 2 : 1;
+            wsum += yy * wt;
+            wcnt += wt;
+        }
+    }
+    for (i=0; i<CAM3A_HIST_BINS; i++) stats->total += stats->hist[i];
+    stats->mean_y = wsum / wcnt;
+    return 0;
+}
+
+void* cam3a_init(void *v4l2)
+{
+    uint32_t ids [4];
+    int      vals[4];
+    int      n = 0;
+    CAM3A   *cam = (CAM3A*)calloc(1, sizeof(CAM3A));
+    if (!cam) return NULL;
+
+    cam->v4l2 = v4l2;
+    if (query_ctrl(v4l2, V4L2_CID_EXPOSURE_ABSOLUTE, &cam->exposure) != 0) {
+        query_ctrl(v4l2, V4L2_CID_EXPOSURE, &cam->exposure);
+    }
+    query_ctrl(v4l2, V4L2_CID_GAIN , &cam->gain);
+    query_ctrl(v4l2, V4L2_CID_RED_BALANCE , &cam->rbal);
+    query_ctrl(v4l2, V4L2_CID_BLUE_BALANCE, &cam->bbal);
+    query_ctrl(v4l2, V4L2_CID_WHITE_BALANCE_TEMPERATURE, &cam->wbtemp);
+    if (!cam->exposure.avail && !cam->gain.avail && !cam->wbtemp.avail && !(cam->rbal.avail && cam->bbal.avail)) {
+        ALOGD("cam3a: no exposure, gain or white balance control, software 3a disabled !\n");
+        free(cam);
+        return NULL;
+    }
+
+    // turn off on-sensor loops for the controls we drive
+    if (cam->exposure.avail) { ids[n] = V4L2_CID_EXPOSURE_AUTO; vals[n++] = V4L2_EXPOSURE_MANUAL; }
+    if (cam->gain.avail    ) { ids[n] = V4L2_CID_AUTOGAIN     ; vals[n++] = 0; }
+    if (cam->wbtemp.avail || (cam->rbal.avail && cam->bbal.avail)) { ids[n] = V4L2_CID_AUTO_WHITE_BALANCE; vals[n++] = 0; }
+    apply_ctrls(v4l2, ids, vals, n);
+
+    ALOGD("cam3a: exposure %d [%d, %d], gain %d [%d, %d], wb %s\n",
+        cam->exposure.cur, cam->exposure.min, cam->exposure.max,
+        cam->gain.cur, cam->gain.min, cam->gain.max,
+        (cam->rbal.avail && cam->bbal.avail) ? "r/b balance" : cam->wbtemp.avail ? "temperature" : "none");
+    return cam;
+}
+
+void cam3a_close(void *ctxt)
+{
+    free(ctxt);
+}
+
+void cam3a_process(void *ctxt, int pixfmt, uint8_t *data, int w, int h, int stride)
+{
+    CAM3A          *cam = (CAM3A*)ctxt;
+    struct timespec ts1, ts2;
+    uint32_t        ids [8];
+    int             vals[8];
+    int             n = 0, cost;
+    if (!cam) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    if (cam3a_stats(data, pixfmt, w, h, stride, &cam->stats) == 0) {
+        if (cam->frame % CAM3A_AE_INTERVAL == 0) {
+            run_ae (cam, ids, vals, &n);
+            run_awb(cam, ids, vals, &n);
+        }
+        apply_ctrls(cam->v4l2, ids, vals, n);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts2);
+
+    cost = (ts2.tv_sec - ts1.tv_sec) * 1000000 + (ts2.tv_nsec - ts1.tv_nsec) / 1000;
+    cam->cost_sum += cost;
+    if (cam->cost_max < (uint32_t)cost) cam->cost_max = cost;
+    if (++cam->frame % CAM3A_LOG_INTERVAL == 0) {
+        ALOGD("cam3a: mean y %d, cost avg %u us, max %u us\n", cam->stats.mean_y,
+            cam->cost_sum / CAM3A_LOG_INTERVAL, cam->cost_max);
+        cam->cost_sum = cam->cost_max = 0;
+    }
+}
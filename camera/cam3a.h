@@ -0,0 +1,31 @@
+#ifndef __CAM3A_H__
+#define __CAM3A_H__
+
+#include <stdint.h>
+
+// 常量定义
+#define CAM3A_ZONE_COLS  8
+#define CAM3A_ZONE_ROWS  6
+#define CAM3A_HIST_BINS  64
+
+// 类型定义
+// image statistics of one frame, built on a subsampled grid
+typedef struct {
+    uint32_t hist[CAM3A_HIST_BINS]; // luma histogram, bin = y >> 2
+    uint32_t total;                 // number of sampled luma pixels
+    int      mean_y;                // center weighted mean luma
+    uint8_t  zone_y[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS];
+    uint8_t  zone_u[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS];
+    uint8_t  zone_v[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS];
+    uint8_t  zone_r[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS];
+    uint8_t  zone_g[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS];
+    uint8_t  zone_b[CAM3A_ZONE_ROWS][CAM3A_ZONE_COLS];
+} CAM3A_STATS;
+
+// 函数声明
+void* cam3a_init   (void *v4l2);
+void  cam3a_close  (void *ctxt);
+void  cam3a_process(void *ctxt, int pixfmt, uint8_t *data, int w, int h, int stride);
+int   cam3a_stats  (uint8_t *data, int pixfmt, int w, int h, int stride, CAM3A_STATS *stats);
+
+#endif
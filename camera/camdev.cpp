@@ -1,14 +1,82 @@
 // ͷļ
 #define LOG_TAG "ffhalcamdev"
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/videodev2.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <hardware/hardware.h>
 #include <hardware/camera_common.h>
 #include <hardware/camera.h>
 #include "v4l2dev.h"
 #include "camdev.h"
+#include "camparam.h"
 
 // ڲͶ
+typedef struct {
+    const char *name;
+    int         value;
+} CAMDEV_ENUM;
+
+// camera parameter mapped onto a v4l2 control
+typedef struct {
+    const char        *key;
+    int                cid;
+    const CAMDEV_ENUM *values; // NULL for integer parameter
+} CAMDEV_CTRL_MAP;
+
+static const CAMDEV_ENUM g_antibanding_values[] = {
+    { "off" , V4L2_CID_POWER_LINE_FREQUENCY_DISABLED },
+    { "50hz", V4L2_CID_POWER_LINE_FREQUENCY_50HZ     },
+    { "60hz", V4L2_CID_POWER_LINE_FREQUENCY_60HZ     },
+    { "auto", V4L2_CID_POWER_LINE_FREQUENCY_AUTO     },
+    { NULL  , 0 },
+};
+
+static const CAMDEV_ENUM g_focus_mode_values[] = {
+    { "auto"              , 1 },
+    { "continuous-video"  , 1 },
+    { "continuous-picture", 1 },
+    { "infinity"          , 0 },
+    { "fixed"             , 0 },
+    { NULL                , 0 },
+};
+
+// white balance temperature in kelvin, 0 means V4L2_CID_AUTO_WHITE_BALANCE
+static const CAMDEV_ENUM g_whitebalance_values[] = {
+    { "auto"           , 0    },
+    { "incandescent"   , 2800 },
+    { "fluorescent"    , 4000 },
+    { "daylight"       , 5500 },
+    { "cloudy-daylight", 6500 },
+    { NULL             , 0    },
+};
+
+static const CAMDEV_CTRL_MAP g_ctrl_map[] = {
+    { "brightness"  , V4L2_CID_BRIGHTNESS               , NULL                  },
+    { "contrast"    , V4L2_CID_CONTRAST                 , NULL                  },
+    { "saturation"  , V4L2_CID_SATURATION               , NULL                  },
+    { "sharpness"   , V4L2_CID_SHARPNESS                , NULL                  },
+    { "hue"         , V4L2_CID_HUE                      , NULL                  },
+    { "antibanding" , V4L2_CID_POWER_LINE_FREQUENCY     , g_antibanding_values  },
+    { "focus-mode"  , V4L2_CID_FOCUS_AUTO               , g_focus_mode_values   },
+    { "whitebalance", V4L2_CID_WHITE_BALANCE_TEMPERATURE, g_whitebalance_values },
+};
+#define CTRL_MAP_NUM  ((int)(sizeof(g_ctrl_map) / sizeof(g_ctrl_map[0])))
+
+// frames handed to the recorder, copied out of the v4l2 buffers as nv21
+#define VIDEO_FRAME_COUNT   6
+// preview callback frames, reused in turn, the client copies a preview frame inside its callback
+#define PREVIEW_FRAME_COUNT 2
+#define PICTURE_TIMEOUT_MS  2000
+
+// parameter change mask, bit n for g_ctrl_map[n]
+#define CHANGE_STREAM  (1u << 31)
+#define CHANGE_LOWLAT  (1u << 30)
+
 typedef struct {
     hw_device_t       common;
     camera_device_ops_t *ops;
@@ -25,27 +93,334 @@ typedef struct {
     void                           *v4l2dev;
     #define STATUS_PREVIEW_EN       (1 << 0)
     int32_t                         status;
+    pthread_mutex_t                 lock;
+    void                           *params; // current parameter state, see camparam.h
+    // frame consumer state, cb_lock is taken on capture thread so it never nests inside v4l2dev_close
+    #define FRAME_RECORDING         (1 << 0)
+    #define FRAME_PICTURE_REQ       (1 << 1) // next frame the consumer can hold goes to picture thread
+    pthread_mutex_t                 cb_lock;
+    pthread_cond_t                  cb_cond;
+    int32_t                         frame_state;
+    camera_memory_t                *video_mem;   // VIDEO_FRAME_COUNT nv21 frames in one allocation
+    size_t                          video_size;
+    int                             video_busy[VIDEO_FRAME_COUNT]; // 1 while the recorder has the frame
+    int                             video_copying;
+    camera_memory_t                *preview_mem; // PREVIEW_FRAME_COUNT nv21 frames, allocated when preview starts
+    size_t                          preview_size;
+    int                             preview_next;
+    int                             preview_copying;
+    V4L2DEV_FRAME                  *picture;     // frame held by v4l2dev_frame_acquire for picture thread
+    void                           *picture_dev;
+    pthread_t                       picture_thread;
+    int                             picture_running;
     //-- camera device context
 } ffhal_camera_device_t;
 
 // ڲʵ
-static void read_data_by_key(const char *section, const char *key, char *data, int len)
+static int find_enum_value(const CAMDEV_ENUM *values, const char *name, int *value)
 {
-    char *str = NULL;
-    int   i   = 0;
-    if (!section) return;
-    str = strstr(section, key);
+    for (; values->name; values++) {
+        if (strcmp(values->name, name) == 0) {
+            *value = values->value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const char* find_enum_name(const CAMDEV_ENUM *values, int value)
+{
+    for (; values->name; values++) {
+        if (values->value == value) return values->name;
+    }
+    return NULL;
+}
+
+static uint32_t change_mask(const char *key)
+{
+    int i;
+    if (strcmp(key, "preview-size") == 0 || strcmp(key, "preview-frame-rate") == 0) {
+        return CHANGE_STREAM;
+    }
+    if (strcmp(key, "preview-low-latency") == 0) {
+        return CHANGE_LOWLAT;
+    }
+    for (i=0; i<CTRL_MAP_NUM; i++) {
+        if (strcmp(key, g_ctrl_map[i].key) == 0) return 1u << i;
+    }
+    return 0;
+}
+
+static size_t nv21_size(const V4L2DEV_FRAME *frame)
+{
+    return (size_t)frame->width * frame->height * 3 / 2;
+}
+
+// convert a captured frame into the yuv420sp (nv21) layout camera clients expect
+static void frame_to_nv21(const V4L2DEV_FRAME *frame, uint8_t *dst)
+{
+    const uint8_t *src;
+    uint8_t       *uv = dst + frame->width * frame->height;
+    int            x, y;
+
+    if (frame->pixfmt == V4L2_PIX_FMT_YUYV) {
+        for (y=0; y<frame->height; y++) {
+            src = (const uint8_t*)frame->data[0] + y * frame->linesize[0];
+            for (x=0; x<frame->width; x++) *dst++ = src[x * 2];
+            // chroma of even rows, Y0 U Y1 V gives V U pairs
+            if (y & 1) continue;
+            for (x=0; x<frame->width; x+=2, uv+=2) {
+                uv[0] = src[x * 2 + 3];
+                uv[1] = src[x * 2 + 1];
+            }
+        }
+        return;
+    }
+    for (y=0; y<frame->height; y++, dst+=frame->width) {
+        memcpy(dst, (const uint8_t*)frame->data[0] + y * frame->linesize[0], frame->width);
+    }
+    for (y=0; y<frame->height/2; y++, uv+=frame->width) {
+        src = (const uint8_t*)frame->data[1] + y * frame->linesize[1];
+        if (frame->pixfmt == V4L2_PIX_FMT_NV21) {
+            memcpy(uv, src, frame->width);
+        } else {
+            for (x=0; x<frame->width; x+=2) { uv[x] = src[x + 1]; uv[x + 1] = src[x]; }
+        }
+    }
+}
+
+// preview callbacks, recording and take_picture all get their frames here
+static void camdev_frame_consumer(void *cbctxt, V4L2DEV_FRAME *frame)
+{
+    ffhal_camera_device_t *cam  = (ffhal_camera_device_t*)cbctxt;
+    int32_t                msgs = cam->msg_enabler;
+    size_t                 size = nv21_size(frame);
+    int                    idx  = -1, pidx = -1, i;
+
+    pthread_mutex_lock(&cam->cb_lock);
+    if ((cam->frame_state & FRAME_PICTURE_REQ) && !cam->picture && v4l2dev_frame_acquire(cam->v4l2dev, frame) == 0) {
+        cam->picture     = frame;
+        cam->picture_dev = cam->v4l2dev;
+        cam->frame_state&=~FRAME_PICTURE_REQ;
+        pthread_cond_broadcast(&cam->cb_cond);
+    }
+    if ((cam->frame_state & FRAME_RECORDING) && cam->video_mem && cam->video_size == size) {
+        for (i=0; i<VIDEO_FRAME_COUNT && cam->video_busy[i]; i++);
+        if (i < VIDEO_FRAME_COUNT) {
+            cam->video_busy[i] = 1;
+            cam->video_copying++;
+            idx = i;
+        }
+    }
+    if ((msgs & CAMERA_MSG_PREVIEW_FRAME) && (cam->status & STATUS_PREVIEW_EN) && cam->cb_data && cam->preview_mem && cam->preview_size == size) {
+        pidx = cam->preview_next;
+        cam->preview_next = (cam->preview_next + 1) % PREVIEW_FRAME_COUNT;
+        cam->preview_copying++;
+    }
+    pthread_mutex_unlock(&cam->cb_lock);
+
+    // callbacks are made without cb_lock, clients may call back into the hal from them
+    if (pidx >= 0) {
+        frame_to_nv21(frame, (uint8_t*)cam->preview_mem->data + pidx * size);
+        cam->cb_data(CAMERA_MSG_PREVIEW_FRAME, cam->preview_mem, pidx, NULL, cam->cb_user);
+        pthread_mutex_lock(&cam->cb_lock);
+        cam->preview_copying--;
+        pthread_cond_broadcast(&cam->cb_cond);
+        pthread_mutex_unlock(&cam->cb_lock);
+    }
+    if (idx >= 0) {
+        int sent = (msgs & CAMERA_MSG_VIDEO_FRAME) && cam->cb_timestamp;
+        frame_to_nv21(frame, (uint8_t*)cam->video_mem->data + idx * size);
+        if (sent) cam->cb_timestamp(frame->pts, CAMERA_MSG_VIDEO_FRAME, cam->video_mem, idx, cam->cb_user);
+        pthread_mutex_lock(&cam->cb_lock);
+        if (!sent) cam->video_busy[idx] = 0;
+        cam->video_copying--;
+        pthread_cond_broadcast(&cam->cb_cond);
+        pthread_mutex_unlock(&cam->cb_lock);
+    }
+}
+
+static void* camdev_picture_thread_proc(void *param)
+{
+    ffhal_camera_device_t *cam   = (ffhal_camera_device_t*)param;
+    V4L2DEV_FRAME         *frame = NULL;
+    void                  *v4l2  = NULL;
+    camera_memory_t       *mem;
+    struct timespec        ts;
+    int                    ret   = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec  += PICTURE_TIMEOUT_MS / 1000;
+    ts.tv_nsec += PICTURE_TIMEOUT_MS % 1000 * 1000000;
+    if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+
+    pthread_mutex_lock(&cam->cb_lock);
+    while (!cam->picture && (cam->frame_state & FRAME_PICTURE_REQ) && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&cam->cb_cond, &cam->cb_lock, &ts);
+    }
+    frame = cam->picture;
+    v4l2  = cam->picture_dev;
+    cam->picture      = NULL;
+    cam->frame_state &= ~FRAME_PICTURE_REQ;
+    pthread_mutex_unlock(&cam->cb_lock);
+
+    if (!frame) {
+        // cancelled, or capture is not running
+        if (ret == ETIMEDOUT && (cam->msg_enabler & CAMERA_MSG_ERROR) && cam->cb_notify) {
+            cam->cb_notify(CAMERA_MSG_ERROR, CAMERA_ERROR_UNKNOWN, 0, cam->cb_user);
+        }
+        return NULL;
+    }
+    if ((cam->msg_enabler & CAMERA_MSG_SHUTTER) && cam->cb_notify) {
+        cam->cb_notify(CAMERA_MSG_SHUTTER, 0, 0, cam->cb_user);
+    }
+    if ((cam->msg_enabler & CAMERA_MSG_RAW_IMAGE) && cam->cb_data && cam->cb_memory) {
+        mem = cam->cb_memory(-1, nv21_size(frame), 1, cam->cb_user);
+        if (mem && mem->data) {
+            frame_to_nv21(frame, (uint8_t*)mem->data);
+            cam->cb_data(CAMERA_MSG_RAW_IMAGE, mem, 0, NULL, cam->cb_user);
+        }
+        if (mem) mem->release(mem);
+    } else if ((cam->msg_enabler & CAMERA_MSG_RAW_IMAGE_NOTIFY) && cam->cb_notify) {
+        cam->cb_notify(CAMERA_MSG_RAW_IMAGE_NOTIFY, 0, 0, cam->cb_user);
+    }
+    v4l2dev_frame_release(v4l2, frame);
+    return NULL;
+}
+
+// (re)allocate the preview callback frames for the current preview size, or free them when en is 0,
+// so the capture thread never allocates shared memory per frame
+static void preview_mem_update(ffhal_camera_device_t *cam, int en)
+{
+    V4L2DEV_FRAME    fmt;
+    camera_memory_t *mem;
+    size_t           size = 0;
+
+    if (en && cam->cb_memory && cam->v4l2dev) {
+        fmt.width  = v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_WIDTH );
+        fmt.height = v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_HEIGHT);
+        size       = nv21_size(&fmt);
+    }
+    pthread_mutex_lock(&cam->cb_lock);
+    if (!cam->preview_mem || cam->preview_size != size) {
+        // the capture thread may still be filling a frame
+        while (cam->preview_copying) pthread_cond_wait(&cam->cb_cond, &cam->cb_lock);
+        if (cam->preview_mem) cam->preview_mem->release(cam->preview_mem);
+        cam->preview_mem  = NULL;
+        cam->preview_size = 0;
+        cam->preview_next = 0;
+        mem = size ? cam->cb_memory(-1, size, PREVIEW_FRAME_COUNT, cam->cb_user) : NULL;
+        if (mem && mem->data) {
+            cam->preview_mem  = mem;
+            cam->preview_size = size;
+        } else if (mem) {
+            mem->release(mem);
+        }
+    }
+    pthread_mutex_unlock(&cam->cb_lock);
+}
+
+// drop a pending take_picture and wait for its thread, the held frame must go back before v4l2dev_close
+static void picture_cancel(ffhal_camera_device_t *cam)
+{
+    pthread_mutex_lock(&cam->cb_lock);
+    cam->frame_state &= ~FRAME_PICTURE_REQ;
+    pthread_cond_broadcast(&cam->cb_cond);
+    pthread_mutex_unlock(&cam->cb_lock);
+    if (cam->picture_running) {
+        pthread_join(cam->picture_thread, NULL);
+        cam->picture_running = 0;
+    }
+}
+
+// stage the stored value of a mapped parameter, it is applied by v4l2dev_ctrl_flush
+static void stage_ctrl(ffhal_camera_device_t *cam, int idx)
+{
+    const CAMDEV_CTRL_MAP *map = &g_ctrl_map[idx];
+    const char            *str = camparam_get(cam->params, map->key);
+    int                    val;
+
     if (!str) return;
-    else str += strlen(key);
-    for (; *str && *str != ';'; str++) {
-        if (*str == '=') break;
+    if (map->values) {
+        if (find_enum_value(map->values, str, &val) != 0) return;
+    } else {
+        val = atoi(str);
+    }
+    if (map->cid == V4L2_CID_WHITE_BALANCE_TEMPERATURE) {
+        // software 3a switched the sensor loop to manual and owns the balance, also after a reopen
+        if (v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_SOFT3A)) return;
+        v4l2dev_ctrl_set(cam->v4l2dev, V4L2_CID_AUTO_WHITE_BALANCE, val == 0);
+        if (val == 0) return;
+    }
+    v4l2dev_ctrl_set(cam->v4l2dev, map->cid, val);
+}
+
+// direct render mode, capture thread renders the preview right after de-queue
+static void apply_low_latency(ffhal_camera_device_t *cam)
+{
+    const char *val = camparam_get(cam->params, "preview-low-latency");
+    v4l2dev_set_direct_render(cam->v4l2dev, val && strcmp(val, "on") == 0);
+}
+
+// publish current state and capabilities of the v4l2 device into the parameter store
+static void camdev_update_params(ffhal_camera_device_t *cam)
+{
+    V4L2DEV_CTRL_INFO info;
+    char              str[128];
+    int               i, n;
+
+    if (!cam->v4l2dev) return;
+    snprintf(str, sizeof(str), "%dx%d",
+        v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_WIDTH),
+        v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_HEIGHT));
+    camparam_set    (cam->params, "preview-size", str);
+    camparam_set    (cam->params, "preview-size-values", "640x480,1280x720,1920x1080");
+    camparam_set_int(cam->params, "preview-frame-rate", v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_FRATE));
+    camparam_set    (cam->params, "preview-frame-rate-values", "25,30");
+    camparam_set    (cam->params, "preview-format", "yuv420sp");
+    camparam_set    (cam->params, "preview-format-values", "yuv420sp");
+    camparam_set    (cam->params, "video-frame-format", "yuv420sp");
+    if (!camparam_get(cam->params, "preview-low-latency")) {
+        char lowlat[PROPERTY_VALUE_MAX];
+        property_get("persist.sys.camera.lowlatency", lowlat, "0");
+        camparam_set(cam->params, "preview-low-latency", atoi(lowlat) ? "on" : "off");
     }
-    if (*str != '=') return;
-    for (str++; *str == ' '; str++);
-    for (i=0; i<len-1 && *str && *str != ';'; i++) {
-        *data++ = *str++;
+    camparam_set    (cam->params, "preview-low-latency-values", "off,on");
+
+    for (i=0; i<CTRL_MAP_NUM; i++) {
+        const CAMDEV_CTRL_MAP *map = &g_ctrl_map[i];
+        const CAMDEV_ENUM     *e;
+        char                   key[64];
+        if (v4l2dev_ctrl_query(cam->v4l2dev, map->cid, &info) != 0) continue;
+        if (!map->values) {
+            camparam_set_int(cam->params, map->key, info.cur);
+            snprintf(key, sizeof(key), "min-%s" , map->key); camparam_set_int(cam->params, key, info.min );
+            snprintf(key, sizeof(key), "max-%s" , map->key); camparam_set_int(cam->params, key, info.max );
+            snprintf(key, sizeof(key), "%s-step", map->key); camparam_set_int(cam->params, key, info.step);
+            continue;
+        }
+        if (map->cid == V4L2_CID_WHITE_BALANCE_TEMPERATURE) {
+            // the temperature control keeps a stale value while the balance runs automatically
+            V4L2DEV_CTRL_INFO awb;
+            int soft3a = v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_SOFT3A);
+            int autowb = soft3a || (v4l2dev_ctrl_query(cam->v4l2dev, V4L2_CID_AUTO_WHITE_BALANCE, &awb) == 0 && awb.cur);
+            const char *name = autowb ? map->values[0].name : find_enum_name(map->values, info.cur);
+            if (soft3a || !camparam_get(cam->params, map->key)) camparam_set(cam->params, map->key, name ? name : map->values[0].name);
+            if (soft3a) {
+                snprintf(key, sizeof(key), "%s-values", map->key);
+                camparam_set(cam->params, key, map->values[0].name);
+                continue;
+            }
+        } else if (!camparam_get(cam->params, map->key)) {
+            const char *name = find_enum_name(map->values, info.cur);
+            camparam_set(cam->params, map->key, name ? name : map->values[0].name);
+        }
+        for (n=0, e=map->values; e->name && n<(int)sizeof(str); e++) {
+            n += snprintf(str + n, sizeof(str) - n, "%s%s", e->name, e[1].name ? "," : "");
+        }
+        snprintf(key, sizeof(key), "%s-values", map->key);
+        camparam_set(cam->params, key, str);
     }
-    *data = '\0';
 }
 
 static int camdev_set_preview_window(struct camera_device *dev, struct preview_stream_ops *window)
@@ -95,6 +470,7 @@ static int camdev_start_preview(struct camera_device *dev)
         v4l2dev_preview_start(cam->v4l2dev);
         cam->status |= STATUS_PREVIEW_EN;
     }
+    preview_mem_update(cam, 1);
     return 0;
 }
 
@@ -105,6 +481,7 @@ static void camdev_stop_preview(struct camera_device *dev)
         v4l2dev_preview_stop(cam->v4l2dev);
         cam->status &=~STATUS_PREVIEW_EN;
     }
+    preview_mem_update(cam, 0);
 }
 
 static int camdev_preview_enabled(struct camera_device *dev)
@@ -132,20 +509,59 @@ static int camdev_store_meta_data_in_buffers(struct camera_device *dev, int enab
 
 static int camdev_start_recording(struct camera_device *dev)
 {
-    return 0;
+    ffhal_camera_device_t *cam = (ffhal_camera_device_t*)dev;
+    V4L2DEV_FRAME          fmt;
+    int                    ret = 0;
+
+    if (!cam->cb_memory) return -EINVAL;
+    pthread_mutex_lock(&cam->lock);
+    fmt.width  = v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_WIDTH );
+    fmt.height = v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_HEIGHT);
+    pthread_mutex_lock(&cam->cb_lock);
+    if (!(cam->frame_state & FRAME_RECORDING)) {
+        cam->video_size = nv21_size(&fmt);
+        cam->video_mem  = cam->cb_memory(-1, cam->video_size, VIDEO_FRAME_COUNT, cam->cb_user);
+        if (cam->video_mem && cam->video_mem->data) {
+            memset(cam->video_busy, 0, sizeof(cam->video_busy));
+            cam->frame_state |= FRAME_RECORDING;
+        } else {
+            if (cam->video_mem) cam->video_mem->release(cam->video_mem);
+            cam->video_mem = NULL;
+            ret = -ENOMEM;
+        }
+    }
+    pthread_mutex_unlock(&cam->cb_lock);
+    pthread_mutex_unlock(&cam->lock);
+    return ret;
 }
 
 static void camdev_stop_recording(struct camera_device *dev)
 {
+    ffhal_camera_device_t *cam = (ffhal_camera_device_t*)dev;
+    pthread_mutex_lock(&cam->cb_lock);
+    cam->frame_state &= ~FRAME_RECORDING;
+    // the capture thread may still be filling a frame
+    while (cam->video_copying) pthread_cond_wait(&cam->cb_cond, &cam->cb_lock);
+    if (cam->video_mem) cam->video_mem->release(cam->video_mem);
+    cam->video_mem = NULL;
+    pthread_mutex_unlock(&cam->cb_lock);
 }
 
 static int camdev_recording_enabled(struct camera_device *dev)
 {
-    return 0;
+    ffhal_camera_device_t *cam = (ffhal_camera_device_t*)dev;
+    return (cam->frame_state & FRAME_RECORDING) ? 1 : 0;
 }
 
 static void camdev_release_recording_frame(struct camera_device *dev, const void *opaque)
 {
+    ffhal_camera_device_t *cam = (ffhal_camera_device_t*)dev;
+    pthread_mutex_lock(&cam->cb_lock);
+    if (cam->video_mem && opaque >= cam->video_mem->data) {
+        size_t idx = ((const uint8_t*)opaque - (const uint8_t*)cam->video_mem->data) / cam->video_size;
+        if (idx < VIDEO_FRAME_COUNT) cam->video_busy[idx] = 0;
+    }
+    pthread_mutex_unlock(&cam->cb_lock);
 }
 
 static int camdev_auto_focus(struct camera_device *dev)
@@ -158,36 +574,60 @@ static int camdev_cancel_auto_focus(struct camera_device *dev)
     return 0;
 }
 
+// the frame is delivered as CAMERA_MSG_RAW_IMAGE in nv21, there is no jpeg encoder in this hal
 static int camdev_take_picture(struct camera_device *dev)
 {
+    ffhal_camera_device_t *cam = (ffhal_camera_device_t*)dev;
+    picture_cancel(cam);
+    pthread_mutex_lock(&cam->cb_lock);
+    cam->frame_state |= FRAME_PICTURE_REQ;
+    pthread_mutex_unlock(&cam->cb_lock);
+    if (pthread_create(&cam->picture_thread, NULL, camdev_picture_thread_proc, cam) != 0) {
+        pthread_mutex_lock(&cam->cb_lock);
+        cam->frame_state &= ~FRAME_PICTURE_REQ;
+        pthread_mutex_unlock(&cam->cb_lock);
+        return -EAGAIN;
+    }
+    cam->picture_running = 1;
     return 0;
 }
 
 static int camdev_cancel_picture(struct camera_device *dev)
 {
+    picture_cancel((ffhal_camera_device_t*)dev);
     return 0;
 }
 
 static int camdev_set_parameters(struct camera_device *dev, const char *params)
 {
     ffhal_camera_device_t *cam = (ffhal_camera_device_t*)dev;
-    int   w = 0, h = 0, frate = 0;
-    char  data[64] = "";
-    char *temp     = NULL;
-
-    read_data_by_key(params, "preview-size", data, sizeof(data));
-    temp = strchr(data, 'x');
-    if (temp) *temp = ' ';
-    sscanf(data, "%d %d", &w, &h);
-
-    read_data_by_key(params, "preview-frame-rate", data, sizeof(data));
-    frate = atoi(data);
+    void       *req     = camparam_create();
+    uint32_t    changed = 0;
+    const char *key, *val;
+    int         w = 0, h = 0, frate = 0, i;
+
+    if (!req) return -ENOMEM;
+    camparam_parse(req, params);
+
+    // merge the request into current state, only changed keys touch the hardware
+    pthread_mutex_lock(&cam->lock);
+    for (i=0; (i = camparam_next(req, i, &key, &val)) > 0; ) {
+        if (camparam_set(cam->params, key, val) > 0) changed |= change_mask(key);
+    }
+    camparam_destroy(req);
 
-    if (  w != v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_WIDTH)
-       || h != v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_HEIGHT)
-       || frate != v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_FRATE) )
+    if (changed & CHANGE_STREAM) {
+        val = camparam_get(cam->params, "preview-size");
+        if (val) sscanf(val, "%dx%d", &w, &h);
+        frate = camparam_get_int(cam->params, "preview-frame-rate", 0);
+    }
+    if (  (changed & CHANGE_STREAM)
+       && (  w != v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_WIDTH)
+          || h != v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_HEIGHT)
+          || frate != v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_FRATE) ) )
     {
         if (cam->v4l2dev) {
+            picture_cancel(cam);
             if ((cam->status & STATUS_PREVIEW_EN) != 0) {
                 v4l2dev_preview_stop(cam->v4l2dev);
             }
@@ -196,32 +636,48 @@ static int camdev_set_parameters(struct camera_device *dev, const char *params)
         }
         cam->v4l2dev = v4l2dev_init(CAM_DEV_FILE, 0, w, h, frate);
         if (cam->v4l2dev) {
+            // controls of the new device start from driver defaults
+            for (i=0; i<CTRL_MAP_NUM; i++) stage_ctrl(cam, i);
+            v4l2dev_add_consumer(cam->v4l2dev, camdev_frame_consumer, cam);
+            apply_low_latency(cam);
             v4l2dev_capture_start(cam->v4l2dev);
             if ((cam->status & STATUS_PREVIEW_EN) != 0) {
                 v4l2dev_preview_start(cam->v4l2dev);
+                preview_mem_update(cam, 1);
             }
         }
+    } else {
+        for (i=0; i<CTRL_MAP_NUM; i++) {
+            if (changed & (1u << i)) stage_ctrl(cam, i);
+        }
+    }
+
+    if (changed & CHANGE_LOWLAT) {
+        apply_low_latency(cam);
     }
+    if (changed) {
+        v4l2dev_ctrl_flush(cam->v4l2dev);
+        camdev_update_params(cam);
+    }
+    pthread_mutex_unlock(&cam->lock);
     return 0;
 }
 
 static char* camdev_get_parameters(struct camera_device *dev)
 {
-    static char g_camera_params_str[256] = {0};
     ffhal_camera_device_t *cam = (ffhal_camera_device_t*)dev;
-    sprintf(g_camera_params_str,
-        "preview-size=%dx%d;"
-        "preview-size-values=640x480,1280x720,1920x1080;"
-        "preview-frame-rate=%d;"
-        "preview-frame-rate-values=25,30;",
-        v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_WIDTH),
-        v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_HEIGHT),
-        v4l2dev_get_param(cam->v4l2dev, V4L2DEV_PARAM_VIDEO_FRATE) );
-    return g_camera_params_str;
+    const char *flat;
+    char       *str;
+    pthread_mutex_lock(&cam->lock);
+    flat = camparam_flatten(cam->params);
+    str  = strdup(flat ? flat : "");
+    pthread_mutex_unlock(&cam->lock);
+    return str;
 }
 
 static void camdev_put_parameters(struct camera_device *dev, char *params)
 {
+    free(params);
 }
 
 static int camdev_send_command(struct camera_device *dev, int32_t cmd, int32_t arg1, int32_t arg2)
@@ -253,13 +709,21 @@ static int camdev_send_command(struct camera_device *dev, int32_t cmd, int32_t a
 static void camdev_release(struct camera_device *dev)
 {
     ffhal_camera_device_t *camdev = (ffhal_camera_device_t*)dev;
+    picture_cancel(camdev);
+    camdev_stop_recording(dev);
     v4l2dev_capture_stop(camdev->v4l2dev);
     v4l2dev_close(camdev->v4l2dev);
     camdev->v4l2dev = NULL;
+    preview_mem_update(camdev, 0);
 }
 
 static int camdev_dump(struct camera_device *dev, int fd)
 {
+    ffhal_camera_device_t *cam = (ffhal_camera_device_t*)dev;
+    pthread_mutex_lock(&cam->lock);
+    dprintf(fd, "camera %d parameters: %s\n", cam->cameraid, camparam_flatten(cam->params));
+    v4l2dev_dump(cam->v4l2dev, fd);
+    pthread_mutex_unlock(&cam->lock);
     return 0;
 }
 
@@ -310,6 +774,7 @@ int camdev_open(const hw_module_t *mod, const char *name, hw_device_t **dev)
     int id = atoi(name);
     ffhal_camera_device_t *camdev = NULL;
     camera_device_ops_t   *camops = NULL;
+    pthread_condattr_t     attr;
 
     if (id >= CAM_DEV_NUM) {
         ALOGD("cameraid out of bounds, cameraid = %d, num supported = %d", id, CAM_DEV_NUM);
@@ -329,6 +794,16 @@ int camdev_open(const hw_module_t *mod, const char *name, hw_device_t **dev)
     camdev->ops            = &g_camdev_ops;
     camdev->cameraid       = id;
     camdev->v4l2dev        = v4l2dev_init(CAM_DEV_FILE, 0, 640, 480, 30);
+    camdev->params         = camparam_create();
+    pthread_mutex_init(&camdev->lock, NULL);
+    pthread_mutex_init(&camdev->cb_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&camdev->cb_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    v4l2dev_add_consumer(camdev->v4l2dev, camdev_frame_consumer, camdev);
+    camdev_update_params(camdev);
+    apply_low_latency(camdev);
     v4l2dev_capture_start(camdev->v4l2dev);
 
     *dev = &camdev->common;
@@ -338,8 +813,15 @@ int camdev_open(const hw_module_t *mod, const char *name, hw_device_t **dev)
 int camdev_close(hw_device_t *device)
 {
     ffhal_camera_device_t *camdev = (ffhal_camera_device_t*)device;
+    picture_cancel(camdev);
+    camdev_stop_recording((struct camera_device*)camdev);
     v4l2dev_capture_stop(camdev->v4l2dev);
     v4l2dev_close(camdev->v4l2dev);
+    preview_mem_update(camdev, 0);
+    camparam_destroy(camdev->params);
+    pthread_mutex_destroy(&camdev->lock);
+    pthread_mutex_destroy(&camdev->cb_lock);
+    pthread_cond_destroy (&camdev->cb_cond);
     free(camdev);
     return 0;
 }
@@ -0,0 +1,235 @@
+#define LOG_TAG "camparam"
+
+// 包含头文件
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "camparam.h"
+
+// 内部常量定义
+#define CAMPARAM_TABLE_SIZE  64  // initial hash table size, must be power of 2
+
+// 内部类型定义
+typedef struct {
+    char *key;
+    char *val;
+} CAMPARAM_ITEM;
+
+typedef struct {
+    CAMPARAM_ITEM *items;      // in insertion order, which is also the flatten order
+    int            item_num;
+    int            item_cap;
+    int           *table;      // open addressing, item index + 1, 0 means empty slot
+    int            table_size;
+    char          *flat;       // cached flatten string, rebuilt only when dirty
+    int            dirty;
+} CAMPARAM;
+
+// 内部函数实现
+static uint32_t hash_key(const char *key, int len)
+{
+    uint32_t h = 2166136261u; // fnv-1a
+    while (len-- > 0) {
+        h ^= (uint8_t)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int find_slot(CAMPARAM *param, const char *key, int klen)
+{
+    int mask = param->table_size - 1;
+    int slot = hash_key(key, klen) & mask;
+    while (param->table[slot]) {
+        const char *k = param->items[param->table[slot] - 1].key;
+        if (strncmp(k, key, klen) == 0 && k[klen] == '\0') break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int grow_table(CAMPARAM *param)
+{
+    int  size  = param->table_size * 2;
+    int *table = (int*)calloc(size, sizeof(int));
+    int  i;
+    if (!table) return -1;
+
+    free(param->table);
+    param->table      = table;
+    param->table_size = size;
+    for (i=0; i<param->item_num; i++) {
+        const char *key = param->items[i].key;
+        param->table[find_slot(param, key, strlen(key))] = i + 1;
+    }
+    return 0;
+}
+
+static char* strndup_s(const char *str, int len)
+{
+    char *s = (char*)malloc(len + 1);
+    if (s) {
+        memcpy(s, str, len);
+        s[len] = '\0';
+    }
+    return s;
+}
+
+static int set_item(CAMPARAM *param, const char *key, int klen, const char *val, int vlen)
+{
+    CAMPARAM_ITEM *item;
+    char          *v;
+    int            slot = find_slot(param, key, klen);
+
+    if (param->table[slot]) {
+        item = &param->items[param->table[slot] - 1];
+        if (strncmp(item->val, val, vlen) == 0 && item->val[vlen] == '\0') return 0;
+        if (!(v = strndup_s(val, vlen))) return -1;
+        free(item->val);
+        item->val     = v;
+        param->dirty  = 1;
+        return 1;
+    }
+
+    if ((param->item_num + 1) * 4 > param->table_size * 3) {
+        if (grow_table(param) != 0) return -1;
+        slot = find_slot(param, key, klen);
+    }
+    if (param->item_num == param->item_cap) {
+        int            cap   = param->item_cap ? param->item_cap * 2 : CAMPARAM_TABLE_SIZE / 2;
+        CAMPARAM_ITEM *items = (CAMPARAM_ITEM*)realloc(param->items, cap * sizeof(CAMPARAM_ITEM));
+        if (!items) return -1;
+        param->items    = items;
+        param->item_cap = cap;
+    }
+
+    item = &param->items[param->item_num];
+    item->key = strndup_s(key, klen);
+    item->val = strndup_s(val, vlen);
+    if (!item->key || !item->val) {
+        free(item->key);
+        free(item->val);
+        return -1;
+    }
+    param->table[slot] = ++param->item_num;
+    param->dirty       = 1;
+    return 1;
+}
+
+// 函数实现
+void* camparam_create(void)
+{
+    CAMPARAM *param = (CAMPARAM*)calloc(1, sizeof(CAMPARAM));
+    if (!param) return NULL;
+    param->table_size = CAMPARAM_TABLE_SIZE;
+    param->table      = (int*)calloc(param->table_size, sizeof(int));
+    if (!param->table) {
+        free(param);
+        return NULL;
+    }
+    return param;
+}
+
+void camparam_destroy(void *ctxt)
+{
+    CAMPARAM *param = (CAMPARAM*)ctxt;
+    int       i;
+    if (!param) return;
+    for (i=0; i<param->item_num; i++) {
+        free(param->items[i].key);
+        free(param->items[i].val);
+    }
+    free(param->items);
+    free(param->table);
+    free(param->flat );
+    free(param);
+}
+
+int camparam_parse(void *ctxt, const char *str)
+{
+    CAMPARAM *param = (CAMPARAM*)ctxt;
+    int       n = 0;
+    if (!param || !str) return 0;
+
+    while (*str) {
+        const char *key = str, *val, *end;
+        int         klen, vlen;
+        for (end=str; *end && *end != ';'; end++);
+        str = *end ? end + 1 : end;
+
+        while (key < end && *key == ' ') key++;
+        for (val=key; val < end && *val != '='; val++);
+        if (val == end || val == key) continue;
+        for (klen=val-key; klen > 0 && key[klen-1] == ' '; klen--);
+        for (val++; val < end && *val == ' '; val++);
+        for (vlen=end-val; vlen > 0 && val[vlen-1] == ' '; vlen--);
+
+        if (set_item(param, key, klen, val, vlen) >= 0) n++;
+    }
+    return n;
+}
+
+const char* camparam_get(void *ctxt, const char *key)
+{
+    CAMPARAM *param = (CAMPARAM*)ctxt;
+    int       slot;
+    if (!param || !key) return NULL;
+    slot = find_slot(param, key, strlen(key));
+    return param->table[slot] ? param->items[param->table[slot] - 1].val : NULL;
+}
+
+int camparam_get_int(void *ctxt, const char *key, int def)
+{
+    const char *val = camparam_get(ctxt, key);
+    return val && *val ? atoi(val) : def;
+}
+
+int camparam_set(void *ctxt, const char *key, const char *val)
+{
+    CAMPARAM *param = (CAMPARAM*)ctxt;
+    if (!param || !key || !val) return -1;
+    return set_item(param, key, strlen(key), val, strlen(val));
+}
+
+int camparam_set_int(void *ctxt, const char *key, int val)
+{
+    char str[16];
+    snprintf(str, sizeof(str), "%d", val);
+    return camparam_set(ctxt, key, str);
+}
+
+int camparam_next(void *ctxt, int idx, const char **key, const char **val)
+{
+    CAMPARAM *param = (CAMPARAM*)ctxt;
+    if (!param || idx < 0 || idx >= param->item_num) return -1;
+    if (key) *key = param->items[idx].key;
+    if (val) *val = param->items[idx].val;
+    return idx + 1;
+}
+
+const char* camparam_flatten(void *ctxt)
+{
+    CAMPARAM *param = (CAMPARAM*)ctxt;
+    char     *flat, *p;
+    int       len = 1, i;
+    if (!param) return NULL;
+    if (param->flat && !param->dirty) return param->flat;
+
+    for (i=0; i<param->item_num; i++) {
+        len += strlen(param->items[i].key) + strlen(param->items[i].val) + 2;
+    }
+    flat = (char*)realloc(param->flat, len);
+    if (!flat) return param->flat;
+
+    for (p=flat, i=0; i<param->item_num; i++) {
+        int klen = strlen(param->items[i].key);
+        int vlen = strlen(param->items[i].val);
+        memcpy(p, param->items[i].key, klen); p += klen; *p++ = '=';
+        memcpy(p, param->items[i].val, vlen); p += vlen; *p++ = ';';
+    }
+    *p = '\0';
+    param->flat  = flat;
+    param->dirty = 0;
+    return flat;
+}
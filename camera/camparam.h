@@ -0,0 +1,16 @@
+#ifndef __CAMPARAM_H__
+#define __CAMPARAM_H__
+
+// 函数声明
+// key/value store for camera parameter strings like "k1=v1;k2=v2;"
+void*       camparam_create (void);
+void        camparam_destroy(void *ctxt);
+int         camparam_parse  (void *ctxt, const char *str);
+const char* camparam_get    (void *ctxt, const char *key);
+int         camparam_get_int(void *ctxt, const char *key, int def);
+int         camparam_set    (void *ctxt, const char *key, const char *val); // return 1 if value changed
+int         camparam_set_int(void *ctxt, const char *key, int val);
+int         camparam_next   (void *ctxt, int idx, const char **key, const char **val);
+const char* camparam_flatten(void *ctxt);
+
+#endif
@@ -5,6 +5,8 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <linux/videodev2.h>
@@ -14,49 +16,96 @@
 #include <ui/Rect.h>
 #include <ui/GraphicBufferMapper.h>
 #include <utils/Log.h>
+#include <cutils/properties.h>
 #include "v4l2dev.h"
+#include "cam3a.h"
 
 using namespace android;
 
 // 内部常量定义
 #define DO_USE_VAR(v)   do { v = v; } while (0)
-#define VIDEO_CAPTURE_BUFFER_COUNT  3
+#define VIDEO_CAPTURE_BUFFER_COUNT  6
+#define VIDEO_MIN_QUEUED_BUFFERS    2   // consumers can not hold the buffers the driver needs to keep capturing
+#define V4L2DEV_MAX_CONSUMERS       8
+#define V4L2DEV_MAX_CTRLS           64
+#define V4L2DEV_LATENCY_NUM         128 // number of recent frames kept for latency statistics
+#define V4L2DEV_RT_PRIORITY         2   // SCHED_FIFO priority of capture thread in direct render mode
 #define NATIVE_WIN_BUFFER_COUNT     3
 #define DEF_WIN_PIX_FMT         HAL_PIXEL_FORMAT_YCrCb_420_SP // HAL_PIXEL_FORMAT_RGBX_8888 or HAL_PIXEL_FORMAT_YCrCb_420_SP
 #define V4L2DEV_GRALLOC_USAGE   (GRALLOC_USAGE_SW_READ_NEVER | GRALLOC_USAGE_SW_WRITE_NEVER | GRALLOC_USAGE_HW_TEXTURE)
 
 // 内部类型定义
 struct video_buffer {
-    void    *addr;
-    unsigned len;
+    V4L2DEV_FRAME      frame;  // must be the first member
+    struct v4l2_buffer buf;
+    void              *addr;
+    unsigned           len;
+    int                refcnt; // 0 means the buffer is queued in driver
+    int64_t            dqtime; // monotonic ns when it was de-queued
+};
+
+struct video_consumer {
+    V4L2DEV_FRAME_CALLBACK callback;
+    void                  *cbctxt;
+};
+
+struct video_ctrl {
+    uint32_t id;
+    uint32_t flags;
+    int      min;
+    int      max;
+    int      step;
+    int      def;
+    int      cur;   // value last written to or read from driver
+    int      val;   // staged value, applied by v4l2dev_ctrl_flush
+    int      dirty;
 };
 
 // v4l2dev context
 typedef struct {
-    struct v4l2_buffer       buf;
     struct video_buffer      vbs[VIDEO_CAPTURE_BUFFER_COUNT];
     int                      fd;
-    void                    *window;
+    void                    *window;        // set and used under render_lock
     int                      win_w;
     int                      win_h;
     #define V4L2DEV_TS_EXIT       (1 << 0)
     #define V4L2DEV_TS_PAUSE      (1 << 1)
     #define V4L2DEV_TS_PREVIEW    (1 << 2)
+    #define V4L2DEV_TS_DIRECT     (1 << 3) // capture thread renders preview by itself
     sem_t                    sem_render;
     pthread_t                thread_id_render;
     pthread_t                thread_id_capture;
     int                      thread_state;
-    int                      update_flag;
+    int                      update_flag;   // protected by render_lock
     int                      cam_pixfmt;
     int                      cam_stride;
     int                      cam_w;
     int                      cam_h;
     int                      cam_frate_num; // camera frame rate num get from v4l2 interface
     int                      cam_frate_den; // camera frame rate den get from v4l2 interface
-    V4L2DEV_CAPTURE_CALLBACK callback;
+    void                    *cam3a;         // software 3a, NULL if disabled
+    pthread_mutex_t          ctrl_lock;
+    struct video_ctrl        ctrls[V4L2DEV_MAX_CTRLS]; // sorted by id
+    int                      ctrl_num;
+    pthread_mutex_t          frame_lock;    // protects buffer refcnt, consumers and render_frame
+    struct video_consumer    consumers[V4L2DEV_MAX_CONSUMERS];
+    int                      consumer_num;
+    int                      dequeued;      // number of buffers out of driver
+    uint32_t                 frames_dropped;
+    V4L2DEV_FRAME           *render_frame;  // latest frame waiting for render thread
+    pthread_mutex_t          render_lock;   // one renderer at a time, also guards window and latency ring
+    uint32_t                 lat_ring[V4L2DEV_LATENCY_NUM]; // de-queue to preview enqueue latency in us
+    uint32_t                 lat_num;
 } V4L2DEV;
 
 // 内部函数实现
+static int64_t get_tick_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static void render_v4l2(V4L2DEV *dev,
                         void *dstbuf, int dstlen, int dstfmt, int dstw, int dsth,
                         void *srcbuf, int srclen, int srcfmt, int srcw, int srch, int pts)
@@ -95,9 +144,128 @@ static void render_v4l2(V4L2DEV *dev,
     }
 }
 
+// render a frame into preview window and record its de-queue to enqueue latency,
+// capture thread in direct mode and render thread may both get here around a mode switch
+static void v4l2dev_render_frame(V4L2DEV *dev, V4L2DEV_FRAME *frame)
+{
+    struct video_buffer       *vb      = (struct video_buffer*)frame;
+    struct preview_stream_ops *preview;
+    buffer_handle_t           *buf     = NULL;
+    int                        stride  = 0;
+    int                        success = 0;
+
+    pthread_mutex_lock(&dev->render_lock);
+    preview = (struct preview_stream_ops*)dev->window;
+    if (dev->update_flag) {
+        if (preview) {
+            preview->set_usage           (preview, V4L2DEV_GRALLOC_USAGE);
+            preview->set_buffer_count    (preview, NATIVE_WIN_BUFFER_COUNT);
+            preview->set_buffers_geometry(preview, dev->cam_w, dev->cam_h, DEF_WIN_PIX_FMT);
+            preview->set_crop            (preview, 0, 0, dev->cam_w, dev->cam_h);
+        }
+        dev->update_flag = 0;
+    }
+
+    int   pts  = (int)(frame->pts / 1000);
+    char *data = (char*)frame->data[0];
+    int   len  = frame->bytesused;
+
+    if (preview && 0 == preview->dequeue_buffer(preview, &buf, &stride)) {
+        if (0 == preview->lock_buffer(preview, buf)) {
+            GraphicBufferMapper &mapper = GraphicBufferMapper::get();
+            Rect                 rect(dev->cam_w, dev->cam_h);
+            void                *dst    = NULL;
+            if (0 == mapper.lock(*buf, GRALLOC_USAGE_SW_WRITE_OFTEN, rect, &dst)) {
+                render_v4l2(dev,
+                    dst , -1 , DEF_WIN_PIX_FMT, dev->cam_w, dev->cam_h,
+                    data, len, dev->cam_pixfmt, dev->cam_w, dev->cam_h, pts);
+                mapper.unlock(*buf);
+                success = 1;
+            }
+        }
+
+        if (success) {
+            if (preview->enqueue_buffer(preview, buf) != 0) {
+                ALOGW("preview->enqueue_buffer failed !\n");
+            } else {
+                dev->lat_ring[dev->lat_num++ % V4L2DEV_LATENCY_NUM] = (uint32_t)((get_tick_ns() - vb->dqtime) / 1000);
+            }
+        } else {
+            preview->cancel_buffer(preview, buf);
+        }
+    }
+    pthread_mutex_unlock(&dev->render_lock);
+}
+
+// preview consumer, renders in place in direct mode, otherwise hands the frame to render thread
+static void v4l2dev_preview_consumer(void *cbctxt, V4L2DEV_FRAME *frame)
+{
+    V4L2DEV       *dev = (V4L2DEV*)cbctxt;
+    V4L2DEV_FRAME *old;
+
+    if (!(dev->thread_state & V4L2DEV_TS_PREVIEW)) return;
+    if (dev->thread_state & V4L2DEV_TS_DIRECT) {
+        v4l2dev_render_frame(dev, frame);
+        return;
+    }
+    if (v4l2dev_frame_acquire(dev, frame) != 0) return;
+
+    pthread_mutex_lock(&dev->frame_lock);
+    old = dev->render_frame;
+    dev->render_frame = frame;
+    pthread_mutex_unlock(&dev->frame_lock);
+
+    // render thread is still busy with the previous frame, drop the older one
+    if (old) v4l2dev_frame_release(dev, old);
+    else sem_post(&dev->sem_render);
+}
+
+static void v4l2dev_cam3a_consumer(void *cbctxt, V4L2DEV_FRAME *frame)
+{
+    V4L2DEV *dev = (V4L2DEV*)cbctxt;
+    cam3a_process(dev->cam3a, frame->pixfmt, (uint8_t*)frame->data[0], frame->width, frame->height, frame->linesize[0]);
+}
+
+static void v4l2dev_fill_frame(V4L2DEV *dev, struct video_buffer *vb)
+{
+    V4L2DEV_FRAME *frame  = &vb->frame;
+    uint8_t       *base   = (uint8_t*)vb->addr;
+    int            stride = dev->cam_stride;
+
+    memset(frame, 0, sizeof(V4L2DEV_FRAME));
+    frame->pixfmt    = dev->cam_pixfmt;
+    frame->width     = dev->cam_w;
+    frame->height    = dev->cam_h;
+    frame->bytesused = vb->buf.bytesused;
+    frame->sequence  = vb->buf.sequence;
+    if ((vb->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        frame->pts = (int64_t)vb->buf.timestamp.tv_sec * 1000000000LL + (int64_t)vb->buf.timestamp.tv_usec * 1000;
+    } else {
+        frame->pts = vb->dqtime;
+    }
+
+    if (dev->cam_pixfmt == V4L2_PIX_FMT_YUYV) {
+        if (stride < dev->cam_w * 2) stride = dev->cam_w * 2;
+        frame->planes      = 1;
+        frame->data    [0] = base;
+        frame->linesize[0] = stride;
+    } else { // nv12 & nv21, interleaved chroma plane follows luma plane
+        if (stride < dev->cam_w) stride = dev->cam_w;
+        frame->planes      = 2;
+        frame->data    [0] = base;
+        frame->data    [1] = base + stride * dev->cam_h;
+        frame->linesize[0] = stride;
+        frame->linesize[1] = stride;
+    }
+}
+
 static void* v4l2dev_capture_thread_proc(void *param)
 {
-    V4L2DEV  *dev = (V4L2DEV*)param;
+    V4L2DEV              *dev = (V4L2DEV*)param;
+    struct v4l2_buffer    buf;
+    struct video_buffer  *vb;
+    struct video_consumer consumers[V4L2DEV_MAX_CONSUMERS];
+    int                   num, i;
 
     //++ for select
     fd_set        fds;
@@ -121,37 +289,40 @@ static void* v4l2dev_capture_thread_proc(void *param)
             continue;
         }
 
-        // dequeue camera video buffer
-        if (-1 == ioctl(dev->fd, VIDIOC_DQBUF, &dev->buf)) {
+        // dequeue camera video buffer, the capture thread reference is taken in the same
+        // frame_lock section, so capture_stop never finds it out of driver with no reference
+        // and queues it again under the consumers
+        memset(&buf, 0, sizeof(buf));
+        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        pthread_mutex_lock(&dev->frame_lock);
+        if (-1 == ioctl(dev->fd, VIDIOC_DQBUF, &buf) || buf.index >= VIDEO_CAPTURE_BUFFER_COUNT) {
+            pthread_mutex_unlock(&dev->frame_lock);
             ALOGD("failed to de-queue buffer !\n");
             continue;
         }
 
-//      ALOGD("%d. bytesused: %d, sequence: %d, length = %d\n", dev->buf.index, dev->buf.bytesused,
-//              dev->buf.sequence, dev->buf.length);
-//      ALOGD("timestamp: %ld, %ld\n", dev->buf.timestamp.tv_sec, dev->buf.timestamp.tv_usec);
-
-        if (dev->thread_state & V4L2DEV_TS_PREVIEW) {
-            sem_post(&dev->sem_render);
+//      ALOGD("%d. bytesused: %d, sequence: %d, length = %d\n", buf.index, buf.bytesused,
+//              buf.sequence, buf.length);
+//      ALOGD("timestamp: %ld, %ld\n", buf.timestamp.tv_sec, buf.timestamp.tv_usec);
+
+        // capture thread holds one reference while consumers are called
+        vb         = &dev->vbs[buf.index];
+        vb->buf    = buf;
+        vb->dqtime = get_tick_ns();
+        vb->refcnt = 1;
+        dev->dequeued++;
+        v4l2dev_fill_frame(dev, vb);
+        num = dev->consumer_num;
+        memcpy(consumers, dev->consumers, num * sizeof(struct video_consumer));
+        pthread_mutex_unlock(&dev->frame_lock);
+
+        for (i=0; i<num; i++) {
+            consumers[i].callback(consumers[i].cbctxt, &vb->frame);
         }
 
-        if (dev->callback) {
-            int      camw = dev->cam_w;
-            int      camh = dev->cam_h;
-            uint8_t *cbuf = (uint8_t*)dev->vbs[dev->buf.index].addr;
-            void    *data[8]     = { (uint8_t*)cbuf, (uint8_t*)cbuf + camw * camh, (uint8_t*)cbuf + camw * camh };
-            int      linesize[8] = { camw, camw / 1, camw / 1 };
-            int      pts  = (int)(dev->buf.timestamp.tv_sec * 1000 + dev->buf.timestamp.tv_usec / 1000);
-            if (dev->cam_pixfmt == V4L2_PIX_FMT_YUYV) {
-                linesize[0] = camw * 2;
-            }
-            dev->callback(dev, data, linesize, pts);
-        }
-
-        // requeue camera video buffer
-        if (-1 == ioctl(dev->fd, VIDIOC_QBUF , &dev->buf)) {
-            ALOGD("failed to en-queue buffer !\n");
-        }
+        // requeue camera video buffer when no consumer holds it
+        v4l2dev_frame_release(dev, &vb->frame);
     }
 
 //  ALOGD("v4l2dev_capture_thread_proc exited !");
@@ -160,11 +331,8 @@ static void* v4l2dev_capture_thread_proc(void *param)
 
 static void* v4l2dev_render_thread_proc(void *param)
 {
-    V4L2DEV                   *dev     = (V4L2DEV*)param;
-    struct preview_stream_ops *preview = NULL;
-    buffer_handle_t           *buf     = NULL;
-    int                        stride  = 0;
-    int                        success = 0;
+    V4L2DEV       *dev = (V4L2DEV*)param;
+    V4L2DEV_FRAME *frame;
 
     while (!(dev->thread_state & V4L2DEV_TS_EXIT)) {
         if (0 != sem_wait(&dev->sem_render)) {
@@ -176,43 +344,14 @@ static void* v4l2dev_render_thread_proc(void *param)
             break;
         }
 
-        if (dev->update_flag) {
-            preview = (struct preview_stream_ops*)dev->window;
-            if (preview) {
-                preview->set_usage           (preview, V4L2DEV_GRALLOC_USAGE);
-                preview->set_buffer_count    (preview, NATIVE_WIN_BUFFER_COUNT);
-                preview->set_buffers_geometry(preview, dev->cam_w, dev->cam_h, DEF_WIN_PIX_FMT);
-                preview->set_crop            (preview, 0, 0, dev->cam_w, dev->cam_h);
-            }
-            dev->update_flag = 0;
-        }
-
-        int   pts  = (int)(dev->buf.timestamp.tv_usec + dev->buf.timestamp.tv_sec * 1000000);
-        char *data = (char*)dev->vbs[dev->buf.index].addr;
-        int   len  = dev->buf.bytesused;
-
-        if (preview && 0 == preview->dequeue_buffer(preview, &buf, &stride)) {
-            success = 0;
-            if (0 == preview->lock_buffer(preview, buf)) {
-                GraphicBufferMapper &mapper = GraphicBufferMapper::get();
-                Rect                 rect(dev->cam_w, dev->cam_h);
-                void                *dst    = NULL;
-                if (0 == mapper.lock(*buf, GRALLOC_USAGE_SW_WRITE_OFTEN, rect, &dst)) {
-                    render_v4l2(dev,
-                        dst , -1 , DEF_WIN_PIX_FMT, dev->cam_w, dev->cam_h,
-                        data, len, dev->cam_pixfmt, dev->cam_w, dev->cam_h, pts);
-                    mapper.unlock(*buf);
-                    success = 1;
-                }
-            }
+        pthread_mutex_lock(&dev->frame_lock);
+        frame = dev->render_frame;
+        dev->render_frame = NULL;
+        pthread_mutex_unlock(&dev->frame_lock);
 
-            if (success) {
-                if (preview->enqueue_buffer(preview, buf) != 0) {
-                    ALOGW("preview->enqueue_buffer failed !\n");
-                }
-            } else {
-                preview->cancel_buffer(preview, buf);
-            }
+        if (frame) {
+            v4l2dev_render_frame(dev, frame);
+            v4l2dev_frame_release(dev, frame);
         }
     }
 
@@ -277,6 +416,92 @@ static int v4l2_try_fmt_size(int fd, int fmt, int *width, int *height)
     return 0;
 }
 
+static int v4l2_add_ctrl(V4L2DEV *dev, uint32_t id, uint32_t type, uint32_t flags, int64_t min, int64_t max, uint64_t step, int64_t def)
+{
+    struct video_ctrl *ctrl;
+
+    if (flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_READ_ONLY)) return 0;
+    switch (type) {
+    case V4L2_CTRL_TYPE_INTEGER:
+    case V4L2_CTRL_TYPE_BOOLEAN:
+    case V4L2_CTRL_TYPE_MENU:
+    case V4L2_CTRL_TYPE_INTEGER_MENU:
+        break;
+    default: // buttons, strings, 64-bit and compound controls are not cached
+        return 0;
+    }
+    if (dev->ctrl_num >= V4L2DEV_MAX_CTRLS) return -1;
+
+    ctrl = &dev->ctrls[dev->ctrl_num++];
+    ctrl->id    = id;
+    ctrl->flags = flags;
+    ctrl->min   = (int)min;
+    ctrl->max   = (int)max;
+    ctrl->step  = step > 0 ? (int)step : 1;
+    ctrl->def   = (int)def;
+    ctrl->cur   = ctrl->def;
+    ctrl->val   = ctrl->def;
+    return 0;
+}
+
+static void v4l2_enum_ctrls(V4L2DEV *dev)
+{
+    struct v4l2_ext_control  vals[V4L2DEV_MAX_CTRLS];
+    struct v4l2_ext_controls ext;
+    int    i;
+
+    dev->ctrl_num = 0;
+#ifdef VIDIOC_QUERY_EXT_CTRL
+    struct v4l2_query_ext_ctrl qec;
+    memset(&qec, 0, sizeof(qec));
+    qec.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    while (ioctl(dev->fd, VIDIOC_QUERY_EXT_CTRL, &qec) == 0) {
+        if (v4l2_add_ctrl(dev, qec.id, qec.type, qec.flags, qec.minimum, qec.maximum, qec.step, qec.default_value) != 0) break;
+        qec.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+    }
+#endif
+    if (dev->ctrl_num == 0) { // old kernel without VIDIOC_QUERY_EXT_CTRL
+        struct v4l2_queryctrl qc;
+        memset(&qc, 0, sizeof(qc));
+        qc.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+        while (ioctl(dev->fd, VIDIOC_QUERYCTRL, &qc) == 0) {
+            if (v4l2_add_ctrl(dev, qc.id, qc.type, qc.flags, qc.minimum, qc.maximum, qc.step, qc.default_value) != 0) break;
+            qc.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+        }
+    }
+    if (dev->ctrl_num == 0) return;
+
+    // read back all current values with one ioctl
+    memset(vals, 0, sizeof(vals));
+    memset(&ext, 0, sizeof(ext ));
+    for (i=0; i<dev->ctrl_num; i++) vals[i].id = dev->ctrls[i].id;
+    ext.ctrl_class = 0;
+    ext.count      = dev->ctrl_num;
+    ext.controls   = vals;
+    if (ioctl(dev->fd, VIDIOC_G_EXT_CTRLS, &ext) == 0) {
+        for (i=0; i<dev->ctrl_num; i++) dev->ctrls[i].cur = dev->ctrls[i].val = vals[i].value;
+    } else {
+        for (i=0; i<dev->ctrl_num; i++) {
+            struct v4l2_control vc;
+            vc.id = dev->ctrls[i].id;
+            if (ioctl(dev->fd, VIDIOC_G_CTRL, &vc) == 0) dev->ctrls[i].cur = dev->ctrls[i].val = vc.value;
+        }
+    }
+    ALOGD("%d v4l2 controls cached\n", dev->ctrl_num);
+}
+
+static struct video_ctrl* v4l2_find_ctrl(V4L2DEV *dev, uint32_t id)
+{
+    int l = 0, r = dev->ctrl_num - 1;
+    while (l <= r) {
+        int m = (l + r) / 2;
+        if      (dev->ctrls[m].id < id) l = m + 1;
+        else if (dev->ctrls[m].id > id) r = m - 1;
+        else return &dev->ctrls[m];
+    }
+    return NULL;
+}
+
 // 函数实现
 void* v4l2dev_init(const char *name, int sub, int w, int h, int frate)
 {
@@ -373,6 +598,10 @@ void* v4l2dev_init(const char *name, int sub, int w, int h, int frate)
         ALOGW("failed to set camera frame rate !\n");
     }
 
+    // query and cache all controls
+    pthread_mutex_init(&dev->ctrl_lock, NULL);
+    v4l2_enum_ctrls(dev);
+
     struct v4l2_requestbuffers req;
     req.count  = VIDEO_CAPTURE_BUFFER_COUNT;
     req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -381,16 +610,24 @@ void* v4l2dev_init(const char *name, int sub, int w, int h, int frate)
 
     for (i=0; i<VIDEO_CAPTURE_BUFFER_COUNT; i++)
     {
-        dev->buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        dev->buf.memory = V4L2_MEMORY_MMAP;
-        dev->buf.index  = i;
-        ioctl(dev->fd, VIDIOC_QUERYBUF, &dev->buf);
+        struct v4l2_buffer *buf = &dev->vbs[i].buf;
+        buf->type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf->memory = V4L2_MEMORY_MMAP;
+        buf->index  = i;
+        ioctl(dev->fd, VIDIOC_QUERYBUF, buf);
+
+        dev->vbs[i].addr= mmap(NULL, buf->length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                               dev->fd, buf->m.offset);
+        dev->vbs[i].len = buf->length;
 
-        dev->vbs[i].addr= mmap(NULL, dev->buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
-                               dev->fd, dev->buf.m.offset);
-        dev->vbs[i].len = dev->buf.length;
+        ioctl(dev->fd, VIDIOC_QBUF, buf);
+    }
 
-        ioctl(dev->fd, VIDIOC_QBUF, &dev->buf);
+    // software auto exposure & white balance for sensors without on-sensor 3a
+    char soft3a[PROPERTY_VALUE_MAX];
+    property_get("persist.sys.camera.soft3a", soft3a, "0");
+    if (atoi(soft3a)) {
+        dev->cam3a = cam3a_init(dev);
     }
 
     // set test frame rate flag
@@ -399,6 +636,14 @@ void* v4l2dev_init(const char *name, int sub, int w, int h, int frate)
     // create sem_render
     sem_init(&dev->sem_render, 0, 0);
 
+    // built-in consumers, preview goes first to keep its latency low
+    pthread_mutex_init(&dev->frame_lock, NULL);
+    pthread_mutex_init(&dev->render_lock, NULL);
+    v4l2dev_add_consumer(dev, v4l2dev_preview_consumer, dev);
+    if (dev->cam3a) {
+        v4l2dev_add_consumer(dev, v4l2dev_cam3a_consumer, dev);
+    }
+
     // create capture thread
     pthread_create(&dev->thread_id_capture, NULL, v4l2dev_capture_thread_proc, dev);
 
@@ -418,12 +663,20 @@ void v4l2dev_close(void *ctxt)
     dev->thread_state |= V4L2DEV_TS_EXIT; sem_post(&dev->sem_render);
     pthread_join(dev->thread_id_capture, NULL);
     pthread_join(dev->thread_id_render , NULL);
+    if (dev->render_frame) {
+        v4l2dev_frame_release(dev, dev->render_frame);
+    }
 
     // unmap buffers
     for (i=0; i<VIDEO_CAPTURE_BUFFER_COUNT; i++) {
         munmap(dev->vbs[i].addr, dev->vbs[i].len);
     }
 
+    cam3a_close(dev->cam3a);
+    pthread_mutex_destroy(&dev->ctrl_lock);
+    pthread_mutex_destroy(&dev->frame_lock);
+    pthread_mutex_destroy(&dev->render_lock);
+
     // close & free
     close(dev->fd);
     free (dev);
@@ -433,8 +686,10 @@ void v4l2dev_set_preview_window(void *ctxt, void *win)
 {
     V4L2DEV *dev = (V4L2DEV*)ctxt;
     if (!dev) return;
+    pthread_mutex_lock(&dev->render_lock);
     dev->window      = win;
     dev->update_flag = 1;
+    pthread_mutex_unlock(&dev->render_lock);
 }
 
 void v4l2dev_capture_start(void *ctxt)
@@ -463,6 +718,14 @@ void v4l2dev_capture_stop(void *ctxt)
     // turn off stream
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     ioctl(dev->fd, VIDIOC_STREAMOFF, &type);
+
+    // stream off returns all buffers, queue idle ones again for next stream on,
+    // buffers still held by consumers are queued when they are released
+    pthread_mutex_lock(&dev->frame_lock);
+    for (int i=0; i<VIDEO_CAPTURE_BUFFER_COUNT; i++) {
+        if (dev->vbs[i].refcnt == 0) ioctl(dev->fd, VIDIOC_QBUF, &dev->vbs[i].buf);
+    }
+    pthread_mutex_unlock(&dev->frame_lock);
 }
 
 void v4l2dev_preview_start(void *ctxt)
@@ -494,8 +757,225 @@ int v4l2dev_get_param(void *ctxt, int id)
         return dev->cam_pixfmt;
     case V4L2DEV_PARAM_VIDEO_FRATE:
         return dev->cam_frate_num / dev->cam_frate_den;
+    case V4L2DEV_PARAM_SOFT3A:
+        return dev->cam3a != NULL;
     }
     return 0;
 }
 
+int v4l2dev_ctrl_query(void *ctxt, int id, V4L2DEV_CTRL_INFO *info)
+{
+    V4L2DEV *dev = (V4L2DEV*)ctxt;
+    struct video_ctrl *ctrl;
+    if (!dev) return -1;
+
+    pthread_mutex_lock(&dev->ctrl_lock);
+    ctrl = v4l2_find_ctrl(dev, id);
+    if (ctrl && info) {
+        info->min  = ctrl->min;
+        info->max  = ctrl->max;
+        info->step = ctrl->step;
+        info->def  = ctrl->def;
+        info->cur  = ctrl->dirty ? ctrl->val : ctrl->cur;
+    }
+    pthread_mutex_unlock(&dev->ctrl_lock);
+    return ctrl ? 0 : -1;
+}
 
+int v4l2dev_ctrl_set(void *ctxt, int id, int val)
+{
+    V4L2DEV *dev = (V4L2DEV*)ctxt;
+    struct video_ctrl *ctrl;
+    if (!dev) return -1;
+
+    pthread_mutex_lock(&dev->ctrl_lock);
+    ctrl = v4l2_find_ctrl(dev, id);
+    if (ctrl) {
+        if (val < ctrl->min) val = ctrl->min;
+        if (val > ctrl->max) val = ctrl->max;
+        val = ctrl->min + (val - ctrl->min) / ctrl->step * ctrl->step;
+        ctrl->val   = val;
+        // volatile controls are changed by the device itself, cached value can not be trusted
+        ctrl->dirty = (val != ctrl->cur) || (ctrl->flags & V4L2_CTRL_FLAG_VOLATILE);
+    }
+    pthread_mutex_unlock(&dev->ctrl_lock);
+    return ctrl ? 0 : -1;
+}
+
+int v4l2dev_ctrl_flush(void *ctxt)
+{
+    V4L2DEV *dev = (V4L2DEV*)ctxt;
+    struct v4l2_ext_control  vals[V4L2DEV_MAX_CTRLS];
+    struct v4l2_ext_controls ext;
+    int    idxs[V4L2DEV_MAX_CTRLS];
+    int    n = 0, i, ret = 0;
+    if (!dev) return -1;
+
+    pthread_mutex_lock(&dev->ctrl_lock);
+    memset(&ext, 0, sizeof(ext));
+    for (i=0; i<dev->ctrl_num; i++) {
+        if (!dev->ctrls[i].dirty) continue;
+        memset(&vals[n], 0, sizeof(vals[n]));
+        vals[n].id    = dev->ctrls[i].id;
+        vals[n].value = dev->ctrls[i].val;
+        idxs[n++]     = i;
+    }
+    if (n > 0) {
+        ext.ctrl_class = 0; // controls of different classes are mixed
+        ext.count      = n;
+        ext.controls   = vals;
+        if (ioctl(dev->fd, VIDIOC_S_EXT_CTRLS, &ext) == 0) {
+            for (i=0; i<n; i++) dev->ctrls[idxs[i]].cur = dev->ctrls[idxs[i]].val;
+        } else {
+            // driver without extended controls, or one bad value rejects the whole batch
+            for (i=0; i<n; i++) {
+                struct v4l2_control vc;
+                vc.id    = vals[i].id;
+                vc.value = vals[i].value;
+                if (ioctl(dev->fd, VIDIOC_S_CTRL, &vc) == 0) {
+                    dev->ctrls[idxs[i]].cur = vc.value;
+                } else {
+                    ALOGW("failed to set control 0x%x to %d !\n", vc.id, vc.value);
+                    dev->ctrls[idxs[i]].val = dev->ctrls[idxs[i]].cur;
+                    ret = -1;
+                }
+            }
+        }
+        for (i=0; i<n; i++) dev->ctrls[idxs[i]].dirty = 0;
+    }
+    pthread_mutex_unlock(&dev->ctrl_lock);
+    return ret;
+}
+
+void v4l2dev_set_direct_render(void *ctxt, int en)
+{
+    V4L2DEV       *dev = (V4L2DEV*)ctxt;
+    V4L2DEV_FRAME *old = NULL;
+    struct sched_param param;
+    if (!dev) return;
+
+    // switching under render_lock waits for a render in progress on either thread
+    pthread_mutex_lock(&dev->render_lock);
+    if (!!(dev->thread_state & V4L2DEV_TS_DIRECT) == !!en) {
+        pthread_mutex_unlock(&dev->render_lock);
+        return;
+    }
+    memset(&param, 0, sizeof(param));
+    if (en) {
+        param.sched_priority = V4L2DEV_RT_PRIORITY;
+        dev->thread_state   |= V4L2DEV_TS_DIRECT;
+        // a frame still queued for render thread is older than the next direct one, drop it
+        pthread_mutex_lock(&dev->frame_lock);
+        old = dev->render_frame;
+        dev->render_frame = NULL;
+        pthread_mutex_unlock(&dev->frame_lock);
+    } else {
+        dev->thread_state   &=~V4L2DEV_TS_DIRECT;
+    }
+    if (pthread_setschedparam(dev->thread_id_capture, en ? SCHED_FIFO : SCHED_OTHER, &param) != 0) {
+        ALOGW("failed to change capture thread scheduling policy !\n");
+    }
+    dev->lat_num = 0;
+    pthread_mutex_unlock(&dev->render_lock);
+    if (old) v4l2dev_frame_release(dev, old);
+}
+
+void v4l2dev_dump(void *ctxt, int fd)
+{
+    V4L2DEV *dev = (V4L2DEV*)ctxt;
+    uint32_t lat[V4L2DEV_LATENCY_NUM];
+    uint32_t sum = 0;
+    int      n, i, j;
+    if (!dev) return;
+
+    dprintf(fd, "v4l2dev: %dx%d, pixfmt 0x%x, %d/%d fps, %s render, %d controls\n",
+        dev->cam_w, dev->cam_h, dev->cam_pixfmt, dev->cam_frate_num, dev->cam_frate_den,
+        (dev->thread_state & V4L2DEV_TS_DIRECT) ? "direct" : "thread", dev->ctrl_num);
+    dprintf(fd, "frames: %d consumers, %d of %d buffers held, %u dropped by backpressure\n",
+        dev->consumer_num, dev->dequeued, VIDEO_CAPTURE_BUFFER_COUNT, dev->frames_dropped);
+
+    pthread_mutex_lock(&dev->render_lock);
+    n = dev->lat_num < V4L2DEV_LATENCY_NUM ? dev->lat_num : V4L2DEV_LATENCY_NUM;
+    memcpy(lat, dev->lat_ring, n * sizeof(uint32_t));
+    pthread_mutex_unlock(&dev->render_lock);
+    if (n == 0) return;
+    for (i=1; i<n; i++) { // insertion sort, n is small
+        uint32_t v = lat[i];
+        for (j=i; j>0 && lat[j-1]>v; j--) lat[j] = lat[j-1];
+        lat[j] = v;
+    }
+    for (i=0; i<n; i++) sum += lat[i];
+    dprintf(fd, "dqbuf to enqueue latency of last %d frames: avg %u us, min %u us, p95 %u us, max %u us\n",
+        n, sum / n, lat[0], lat[n * 95 / 100], lat[n - 1]);
+}
+
+int v4l2dev_add_consumer(void *ctxt, V4L2DEV_FRAME_CALLBACK callback, void *cbctxt)
+{
+    V4L2DEV *dev = (V4L2DEV*)ctxt;
+    int      ret = -1;
+    if (!dev || !callback) return -1;
+
+    pthread_mutex_lock(&dev->frame_lock);
+    if (dev->consumer_num < V4L2DEV_MAX_CONSUMERS) {
+        dev->consumers[dev->consumer_num].callback = callback;
+        dev->consumers[dev->consumer_num].cbctxt   = cbctxt;
+        dev->consumer_num++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&dev->frame_lock);
+    return ret;
+}
+
+void v4l2dev_del_consumer(void *ctxt, V4L2DEV_FRAME_CALLBACK callback, void *cbctxt)
+{
+    V4L2DEV *dev = (V4L2DEV*)ctxt;
+    int      i;
+    if (!dev) return;
+
+    pthread_mutex_lock(&dev->frame_lock);
+    for (i=0; i<dev->consumer_num; i++) {
+        if (dev->consumers[i].callback == callback && dev->consumers[i].cbctxt == cbctxt) {
+            memmove(&dev->consumers[i], &dev->consumers[i+1], (dev->consumer_num - i - 1) * sizeof(struct video_consumer));
+            dev->consumer_num--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dev->frame_lock);
+}
+
+int v4l2dev_frame_acquire(void *ctxt, V4L2DEV_FRAME *frame)
+{
+    V4L2DEV             *dev = (V4L2DEV*)ctxt;
+    struct video_buffer *vb  = (struct video_buffer*)frame;
+    int                  ret = 0;
+    if (!dev || !frame) return -1;
+
+    pthread_mutex_lock(&dev->frame_lock);
+    if (vb->refcnt <= 0) {
+        ret = -1; // already back in driver
+    } else if (vb->refcnt == 1 && dev->dequeued > VIDEO_CAPTURE_BUFFER_COUNT - VIDEO_MIN_QUEUED_BUFFERS) {
+        // holding one more buffer would starve the driver, drop this frame for the caller
+        dev->frames_dropped++;
+        ret = -1;
+    } else {
+        vb->refcnt++;
+    }
+    pthread_mutex_unlock(&dev->frame_lock);
+    return ret;
+}
+
+void v4l2dev_frame_release(void *ctxt, V4L2DEV_FRAME *frame)
+{
+    V4L2DEV             *dev = (V4L2DEV*)ctxt;
+    struct video_buffer *vb  = (struct video_buffer*)frame;
+    if (!dev || !frame) return;
+
+    pthread_mutex_lock(&dev->frame_lock);
+    if (vb->refcnt > 0 && --vb->refcnt == 0) {
+        dev->dequeued--;
+        if (-1 == ioctl(dev->fd, VIDIOC_QBUF, &vb->buf)) {
+            ALOGD("failed to en-queue buffer !\n");
+        }
+    }
+    pthread_mutex_unlock(&dev->frame_lock);
+}
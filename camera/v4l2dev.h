@@ -1,15 +1,41 @@
 #ifndef __V4L2DEV_H__
 #define __V4L2DEV_H__
 
+#include <stdint.h>
+
 // Ͷ
-// v4l2 capture callback
-typedef int (*V4L2DEV_CAPTURE_CALLBACK)(void *v4l2, void *data[8], int linesize[8], int pts);
+// captured frame, shared by all consumers without copy
+typedef struct {
+    void    *data    [3]; // plane pointers, nv12/nv21 use 2 planes, yuyv uses 1
+    int      linesize[3]; // plane strides in bytes
+    int      planes;
+    int      pixfmt;
+    int      width;
+    int      height;
+    int      bytesused;
+    int64_t  pts;         // capture time in ns, CLOCK_MONOTONIC
+    uint32_t sequence;
+} V4L2DEV_FRAME;
+
+// frame consumer, called on capture thread. frame is only valid during the call
+// unless the consumer takes a reference with v4l2dev_frame_acquire
+typedef void (*V4L2DEV_FRAME_CALLBACK)(void *cbctxt, V4L2DEV_FRAME *frame);
+
+// cached v4l2 control range & value
+typedef struct {
+    int min;
+    int max;
+    int step;
+    int def;
+    int cur;
+} V4L2DEV_CTRL_INFO;
 
 enum {
     V4L2DEV_PARAM_VIDEO_WIDTH,
     V4L2DEV_PARAM_VIDEO_HEIGHT,
     V4L2DEV_PARAM_VIDEO_PIXFMT,
     V4L2DEV_PARAM_VIDEO_FRATE,
+    V4L2DEV_PARAM_SOFT3A, // 1 when software 3a drives exposure, gain and white balance
 };
 
 // 
@@ -21,8 +47,19 @@ void  v4l2dev_capture_start(void *ctxt);
 void  v4l2dev_capture_stop (void *ctxt);
 void  v4l2dev_preview_start(void *ctxt);
 void  v4l2dev_preview_stop (void *ctxt);
-void  v4l2dev_set_callback (void *ctxt, void *callback);
+int   v4l2dev_add_consumer (void *ctxt, V4L2DEV_FRAME_CALLBACK callback, void *cbctxt);
+void  v4l2dev_del_consumer (void *ctxt, V4L2DEV_FRAME_CALLBACK callback, void *cbctxt);
+int   v4l2dev_frame_acquire(void *ctxt, V4L2DEV_FRAME *frame); // return -1 if too many frames are held
+void  v4l2dev_frame_release(void *ctxt, V4L2DEV_FRAME *frame);
 int   v4l2dev_get_param    (void *ctxt, int id);
+void  v4l2dev_set_direct_render(void *ctxt, int en);
+void  v4l2dev_dump         (void *ctxt, int fd);
+
+// controls are queried once at init, v4l2dev_ctrl_set only stages changed values,
+// and v4l2dev_ctrl_flush applies all staged values with a single VIDIOC_S_EXT_CTRLS
+int   v4l2dev_ctrl_query   (void *ctxt, int id, V4L2DEV_CTRL_INFO *info);
+int   v4l2dev_ctrl_set     (void *ctxt, int id, int val);
+int   v4l2dev_ctrl_flush   (void *ctxt);
 
 #endif
 